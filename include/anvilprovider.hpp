@@ -0,0 +1,182 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__ANVILPROVIDER_H_
+#define _hCraft__ANVILPROVIDER_H_
+
+#include "worldprovider.hpp"
+#include <unordered_map>
+#include <mutex>
+
+
+namespace hCraft {
+	
+	struct anvil_region;
+	
+	
+	class anvil_provider_naming: public world_provider_naming
+	{
+	public:
+		virtual const char* provider_name ()
+			{ return "anvil"; }
+		
+		
+		/* 
+		 * Returns true if the format is stored within a separate directory
+		 * (like Anvil).
+		 */
+		virtual bool is_directory_format ()
+			{ return true; }
+		
+		/* 
+		 * Adds required prefixes, suffixes, etc... to the specified world name so
+		 * that the importer's claims_name () function returns true when passed to
+		 * it.
+		 */
+		virtual std::string make_name (const char *world_name);
+		
+		/* 
+		 * Checks whether the specified path name meets the format required by this
+		 * exporter (could be a name prefix, suffix, extension, etc...).
+		 */
+		virtual bool claims_name (const char *path);
+	};
+	
+	
+	/* 
+	 * World provider for Minecraft's own Anvil format: a directory holding a
+	 * level.dat file, and a "region" subdirectory with one r.<x>.<z>.mca file
+	 * for every 32x32 chunks.
+	 * 
+	 * Region files are opened on demand (only a limited number are kept open
+	 * at once) and read through a memory mapping. Chunks are always written to
+	 * unused sectors. The region's header is only pointed at them once they
+	 * have been synced to disk in close (), and the sectors they replace are
+	 * only reused once the header has been synced as well, so a crash leaves
+	 * every chunk either in its old or its new state.
+	 */
+	class anvil_provider: public world_provider
+	{
+		std::string out_path;
+		world_information inf;
+		
+		// open region files, by region coordinates.
+		std::unordered_map<unsigned long long, anvil_region *> regions;
+		std::mutex lock;
+		
+	private:
+		/* 
+		 * Returns the region file that holds the specified chunk, opening it if
+		 * necessary (and creating it if @{create} is true). Returns null if it
+		 * does not exist. Must be followed by a call to release_region ().
+		 */
+		anvil_region* acquire_region (int cx, int cz, bool create);
+		void release_region (anvil_region *reg);
+		
+		/* 
+		 * Reads the world's information from its level.dat file.
+		 */
+		void read_level ();
+		
+	public:
+		/* 
+		 * Constructs a new world provider for the Anvil format.
+		 */
+		anvil_provider (const char *path, const char *world_name);
+		
+		/* 
+		 * Class destructor.
+		 */
+		~anvil_provider ();
+		
+		
+		
+		/* 
+		 * Returns the name of this world provider.
+		 */
+		virtual const char* name ()
+			{ return "anvil"; }
+		
+		
+		
+		/* 
+		 * Creates the world's directory if it does not exist yet.
+		 */
+		virtual void open (world &wr);
+		
+		/* 
+		 * Syncs the region files written to since the last call to disk, and
+		 * updates their headers.
+		 */
+		virtual void close ();
+		
+		
+		
+		/* 
+		 * Turns the specified chunk into an NBT compound, compressed with zlib
+		 * and preceded by the five byte header it has within region files.
+		 */
+		virtual unsigned char* encode (chunk *ch, int x, int z,
+			unsigned int *out_size);
+		
+		/* 
+		 * Writes out a chunk previously encoded with encode ().
+		 */
+		virtual void write (world& wr, int x, int z, const unsigned char *data,
+			unsigned int size);
+		
+		/* 
+		 * Saves the specified world without writing out any chunks.
+		 * NOTE: If a world already exists at the destination path, an empty
+		 *       template will NOT be written out.
+		 */
+		virtual void save_empty (world &wr);
+		
+		
+		
+		/* 
+		 * Checks whether the directory at @{path} holds an Anvil world.
+		 */
+		virtual bool claims (const char *path);
+		
+		/* 
+		 * Attempts to load the chunk located at the specified coordinates into
+		 * @{ch}. Returns true on success, and false if the chunk is not present
+		 * within the world.
+		 */
+		virtual bool load (world &wr, chunk *ch, int x, int z);
+		
+		virtual bool concurrent_loads ()
+			{ return true; }
+		
+		/* 
+		 * Stores the coordinates of every chunk saved in the world in @{out}.
+		 */
+		virtual void list_chunks (std::vector<chunk_pos>& out);
+		
+		/* 
+		 * Returns a structure that contains essential information about the
+		 * underlying world.
+		 */
+		virtual const world_information& info ()
+			{ return this->inf; }
+	};
+}
+
+#endif
+
@@ -0,0 +1,51 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__BENCHMARK_H_
+#define _hCraft__BENCHMARK_H_
+
+
+namespace hCraft {
+	
+	/* 
+	 * Offline performance measurements, ran instead of the server when hCraft
+	 * is started with "--benchmark <name> [args...]".
+	 */
+	namespace benchmark {
+		
+		/* 
+		 * Runs the benchmark specified by the given command-line arguments
+		 * (those that follow "--benchmark"), and prints its results to the
+		 * standard output. Returns the process' exit code.
+		 * 
+		 * Available benchmarks:
+		 *   generator [<name>] [<chunks>]
+		 *       Generates chunks using the given world generator on one, and
+		 *       then on all available cores, and reports chunks per second per
+		 *       core.
+		 *   codecs [<world>] [<chunks>]
+		 *       Loads chunks saved in the given world (from the "worlds"
+		 *       directory), compresses them with each chunk codec, and reports
+		 *       output size and encode/decode speed.
+		 */
+		int run (int argc, char *argv[]);
+	}
+}
+
+#endif
+
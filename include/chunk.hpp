@@ -22,7 +22,11 @@
 #include "blocks.hpp"
 #include <unordered_set>
 #include <mutex>
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <vector>
+#include <cstddef>
 
 
 namespace hCraft {
@@ -61,16 +65,153 @@ namespace hCraft {
 	};
 	
 	
+	/* 
+	 * A 4096-entry array of 4-bit values (metadata, block light, sky light).
+	 * As long as all entries share the same value, no storage is allocated at
+	 * all and the value is kept in `fill' instead.
+	 */
+	struct nibble_array
+	{
+		unsigned char *data;
+		unsigned char fill;
+		
+	//----
+		
+		inline bool uniform () const { return this->data == nullptr; }
+		
+		inline unsigned char
+		get (unsigned int index) const
+		{
+			if (!this->data)
+				return this->fill;
+			return (index & 1)
+				? (this->data[index >> 1] >> 4)
+				: (this->data[index >> 1] & 0xF);
+		}
+		
+		inline void
+		set (unsigned int index, unsigned char val)
+		{
+			if (!this->data)
+				{
+					if (val == this->fill)
+						return;
+					this->expand ();
+				}
+			
+			unsigned int half = index >> 1;
+			if (index & 1)
+				{ this->data[half] &= 0x0F; this->data[half] |= (val << 4); }
+			else
+				{ this->data[half] &= 0xF0; this->data[half] |= val; }
+		}
+		
+	//----
+		
+		nibble_array (unsigned char fill);
+		nibble_array (const nibble_array& other);
+		~nibble_array ();
+		
+		/* 
+		 * Allocates the backing array and fills it with the uniform value.
+		 */
+		void expand ();
+		
+		/* 
+		 * Copies the array out in its packed form (2048 bytes) to @{out}.
+		 */
+		void export_to (unsigned char *out) const;
+		
+		/* 
+		 * Replaces the array's contents with the 2048 packed bytes in @{in}.
+		 * Storage is only allocated if the input isn't uniform.
+		 */
+		void import (const unsigned char *in);
+	};
+	
+	
+	/* 
+	 * The ways in which a subchunk can store its block IDs.
+	 */
+	enum subchunk_storage
+	{
+		/* 
+		 * Every block is an index into a small per-subchunk palette of IDs, the
+		 * indices being packed into 1, 2, 4 or 8 bits each. A palette that holds
+		 * a single ID needs no index array at all.
+		 */
+		SS_PALETTE,
+		
+		/* 
+		 * A plain 4096-byte array of the lower 8 bits of each ID, plus an "add"
+		 * array that holds the upper 4 bits (allocated when needed).
+		 */
+		SS_DENSE,
+	};
+	
+	
+	/* 
+	 * The stages a chunk goes through while being generated. Every stage past
+	 * the first can only be run once all eight surrounding chunks have
+	 * completed the stage before it.
+	 */
+	enum chunk_stage
+	{
+		CS_EMPTY = 0,   // nothing has been done yet
+		CS_TERRAIN,     // base terrain has been generated
+		CS_DECORATED,   // trees and other features have been placed
+		CS_LIT,         // heightmap and sky light are up to date
+		CS_READY,       // the chunk is complete and can be sent to players
+	};
+	
+	
+	/* 
+	 * A chunk's contents in the layout used by the 0x33 packet (block IDs,
+	 * metadata, block light, sky light, add arrays and biomes), compressed with
+	 * zlib. The same blob is sent to players and saved to disk, so a chunk is
+	 * only compressed once for every version of it.
+	 */
+	struct chunk_blob
+	{
+		unsigned int version; // version of the chunk the blob was made from
+		unsigned short primary_bitmap;
+		unsigned short add_bitmap;
+		std::vector<unsigned char> data;
+	};
+	
+	
 	/* 
 	 * Every chunk is made out of 16 subchunks, each being 16x16x16 in size.
+	 * 
+	 * Subchunks start out palette-compressed, and transparently switch to the
+	 * dense layout once more than 256 distinct IDs are in use.
+	 * 
+	 * A subchunk may be shared between several chunks (e.g. when they were all
+	 * cloned from the same generator template), in which case it is reference
+	 * counted and must be treated as immutable. Chunks copy shared subchunks
+	 * before modifying them.
 	 */
 	struct subchunk
 	{
-		unsigned char ids[4096];
-		unsigned char meta[2048];
-		unsigned char blight[2048];
-		unsigned char slight[2048];
+		std::atomic<int> refs;
+		
+		unsigned char storage; // one of subchunk_storage
+		
+		// SS_PALETTE:
+		unsigned char bits;    // bits per index (0 if the subchunk is uniform)
+		unsigned short palette_size;
+		unsigned short *palette;
+		unsigned short small_palette[16];
+		unsigned char *indices;
+		
+		// SS_DENSE:
+		unsigned char *ids;
 		unsigned char *add;
+		
+		nibble_array meta;
+		nibble_array blight;
+		nibble_array slight;
+		
 		int add_count;
 		int air_count;
 		
@@ -79,36 +220,123 @@ namespace hCraft {
 		inline bool all_air () { return this->air_count == 4096; }
 		inline bool has_add () { return this->add_count > 0; }
 		
+		inline bool shared () { return this->refs.load (std::memory_order_acquire) > 1; }
+		inline void retain () { this->refs.fetch_add (1, std::memory_order_relaxed); }
+		
+		/* 
+		 * Drops a reference to the subchunk, destroying it if it was the last.
+		 */
+		void release ();
+		
+	private:
+		inline unsigned short
+		get_id_at (unsigned int index)
+		{
+			if (this->storage == SS_PALETTE)
+				{
+					if (this->bits == 0)
+						return this->palette[0];
+					
+					unsigned int bit = index * this->bits;
+					return this->palette[(this->indices[bit >> 3] >> (bit & 7))
+						& ((1 << this->bits) - 1)];
+				}
+			
+			unsigned short id = this->ids[index];
+			if (this->add)
+				id |= ((index & 1) ? (this->add[index >> 1] >> 4)
+					: (this->add[index >> 1] & 0xF)) << 8;
+			return id;
+		}
+		
+		void set_id_at (unsigned int index, unsigned short id);
+		
+		/* 
+		 * Palette management.
+		 */
+		int  palette_find (unsigned short id);
+		int  palette_insert (unsigned short id);
+		void repack (int new_bits);
+		void repalette ();
+		void make_dense ();
+		
 	//----
 		
+	public:
 		/* 
 		 * Constructs a new empty subchunk, with all blocks set to air.
 		 */
-		subchunk (bool init = true);
+		subchunk ();
+		
+		/* 
+		 * Constructs an unshared copy of @{other}.
+		 */
+		subchunk (const subchunk& other);
 		
 		/* 
 		 * Class destructor.
 		 */
 		~subchunk ();
 		
+		/* 
+		 * Subchunks are allocated from a dedicated slab allocator.
+		 */
+		static void* operator new (std::size_t size);
+		static void operator delete (void *ptr);
+		
 		
 		/* 
 		 * Block interaction:
 		 */
 		 
 		void set_id (int x, int y, int z, unsigned short id);
-		unsigned short get_id (int x, int y, int z);
+		unsigned short get_id (int x, int y, int z)
+			{ return this->get_id_at ((y << 8) | (z << 4) | x); }
 		
-		void set_meta (int x, int y, int z, unsigned char val);
-		unsigned char get_meta (int x, int y, int z);
+		void set_meta (int x, int y, int z, unsigned char val)
+			{ this->meta.set ((y << 8) | (z << 4) | x, val); }
+		unsigned char get_meta (int x, int y, int z)
+			{ return this->meta.get ((y << 8) | (z << 4) | x); }
 		
-		void set_block_light (int x, int y, int z, unsigned char val);
-		unsigned char get_block_light (int x, int y, int z);
+		void set_block_light (int x, int y, int z, unsigned char val)
+			{ this->blight.set ((y << 8) | (z << 4) | x, val); }
+		unsigned char get_block_light (int x, int y, int z)
+			{ return this->blight.get ((y << 8) | (z << 4) | x); }
 		
-		void set_sky_light (int x, int y, int z, unsigned char val);
-		unsigned char get_sky_light (int x, int y, int z);
+		void set_sky_light (int x, int y, int z, unsigned char val)
+			{ this->slight.set ((y << 8) | (z << 4) | x, val); }
+		unsigned char get_sky_light (int x, int y, int z)
+			{ return this->slight.get ((y << 8) | (z << 4) | x); }
 		
 		void set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta);
+		
+		
+		/* 
+		 * Bulk access, used when serializing subchunks. The arrays are always
+		 * in the dense format (4096 bytes for IDs, 2048 for everything else),
+		 * regardless of how the subchunk stores them internally.
+		 */
+		
+		void export_ids (unsigned char *out);
+		void export_add (unsigned char *out);
+		void export_meta (unsigned char *out) { this->meta.export_to (out); }
+		void export_block_light (unsigned char *out) { this->blight.export_to (out); }
+		void export_sky_light (unsigned char *out) { this->slight.export_to (out); }
+		
+		/* 
+		 * Replaces the contents of the subchunk with the given dense arrays.
+		 * @{add} may be null. The most compact storage that can hold the data is
+		 * chosen automatically.
+		 */
+		void import (const unsigned char *ids, const unsigned char *add,
+			const unsigned char *meta, const unsigned char *blight,
+			const unsigned char *slight);
+		
+		
+		/* 
+		 * Returns the amount of memory (in bytes) used by the subchunk.
+		 */
+		unsigned int memory_usage ();
 	};
 	
 	
@@ -126,19 +354,121 @@ namespace hCraft {
 		std::unordered_set<entity *> entities;
 		std::mutex entity_lock;
 		
+		std::atomic<int> stage;
+		
+		// the number of threads that hold on to the chunk through a raw pointer
+		// for longer than a world's unload grace period (see world::unload_chunk ()).
+		std::atomic<int> pins;
+		
+		// incremented on every change made to the chunk.
+		std::atomic<unsigned int> version;
+		
+		std::shared_ptr<const chunk_blob> blob;
+		std::mutex blob_lock;
+		
+		// guards the subchunk array, the subchunks' storage, biomes and the
+		// heightmap. Subchunks reallocate their arrays as they grow, so readers
+		// must hold it too.
+		std::mutex data_lock;
+		
 	public:
-		bool modified;
+		// set whenever the chunk changes, and cleared by the saver right
+		// before it takes a snapshot of the chunk.
+		std::atomic<bool> modified;
+		
+		// whether the chunk is waiting in the world saver's queue. Exchanged
+		// by whoever changes the chunk, after the change, so that a chunk is
+		// queued again if the saver takes it while it is being modified.
+		std::atomic<bool> save_queued;
+		
+	private:
+		/* 
+		 * Called whenever the chunk's contents change.
+		 */
+		inline void
+		touch ()
+		{
+			this->modified = true;
+			this->version.store (this->version.load (std::memory_order_relaxed) + 1,
+				std::memory_order_release);
+		}
+		
+		/* 
+		 * Returns the subchunk at the given vertical position, copying it first
+		 * if it is shared with other chunks. The data lock must be held.
+		 */
+		subchunk* unshare_sub (int index);
+		
+		/* 
+		 * The block interaction methods below, without taking the data lock.
+		 * Used by methods that go over many blocks at once, so that they only
+		 * have to take the lock once.
+		 */
+		
+		void set_id_nolock (int x, int y, int z, unsigned short id);
+		unsigned short get_id_nolock (int x, int y, int z);
+		
+		void set_meta_nolock (int x, int y, int z, unsigned char val);
+		unsigned char get_meta_nolock (int x, int y, int z);
+		
+		void set_block_light_nolock (int x, int y, int z, unsigned char val);
+		unsigned char get_block_light_nolock (int x, int y, int z);
+		
+		void set_sky_light_nolock (int x, int y, int z, unsigned char val);
+		unsigned char get_sky_light_nolock (int x, int y, int z);
+		
+		void set_id_and_meta_nolock (int x, int y, int z, unsigned short id,
+			unsigned char meta);
+		
+		void relight_nolock (int x, int z, bool stop_at_zero);
 		
 	public:
+		/* 
+		 * Direct access to the chunk's storage, bypassing the data lock. Only to
+		 * be used on chunks that no other thread can see (ones being loaded, or
+		 * private snapshots).
+		 */
 		inline subchunk* get_sub (int index) { return this->subs[index]; }
-		
 		inline unsigned char* get_biome_array () { return this->biomes; }
-		inline void set_biome (int x, int z, unsigned char val)
-			{ this->biomes[(z << 4) | x] = val; }
-		inline unsigned char get_biome (int x, int z)
-			{ return this->biomes[(z << 4) | x]; }
 		
-		inline short get_height (int x, int z) { return this->heightmap[(z << 4) | x]; }
+		inline void
+		set_biome (int x, int z, unsigned char val)
+		{
+			std::lock_guard<std::mutex> guard {this->data_lock};
+			this->biomes[(z << 4) | x] = val;
+			this->touch ();
+		}
+		
+		inline unsigned char
+		get_biome (int x, int z)
+		{
+			std::lock_guard<std::mutex> guard {this->data_lock};
+			return this->biomes[(z << 4) | x];
+		}
+		
+		inline chunk_stage get_stage () { return (chunk_stage)this->stage.load (); }
+		inline void set_stage (chunk_stage stage) { this->stage.store (stage); }
+		
+		/* 
+		 * Keeps an unloaded chunk from being freed until unpin () is called.
+		 */
+		inline void pin () { ++ this->pins; }
+		inline void unpin () { -- this->pins; }
+		inline bool pinned () { return this->pins.load () > 0; }
+		
+		inline short
+		get_height (int x, int z)
+		{
+			std::lock_guard<std::mutex> guard {this->data_lock};
+			return this->heightmap[(z << 4) | x];
+		}
+		
+		inline void
+		set_height (int x, int z, short h)
+		{
+			std::lock_guard<std::mutex> guard {this->data_lock};
+			this->heightmap[(z << 4) | x] = h;
+		}
 		
 	public:
 		/* 
@@ -151,12 +481,34 @@ namespace hCraft {
 		 */
 		~chunk ();
 		
+		/* 
+		 * Chunks are allocated from a dedicated slab allocator, so that memory
+		 * released by evicted chunks is reused by newly loaded ones.
+		 */
+		static void* operator new (std::size_t size);
+		static void operator delete (void *ptr);
+		
 		
 		/* 
 		 * Creates (if does not already exist) and returns the sub-chunk located at
-		 * the given vertical position.
+		 * the given vertical position. The returned subchunk is never shared.
+		 */
+		subchunk* create_sub (int index);
+		
+		/* 
+		 * Replaces the contents of the sub-chunk at the given vertical position
+		 * with the given dense arrays (see subchunk::import ()), creating it if
+		 * needed.
 		 */
-		subchunk* create_sub (int index, bool init = true);
+		void import_sub (int index, const unsigned char *ids,
+			const unsigned char *add, const unsigned char *meta,
+			const unsigned char *blight, const unsigned char *slight);
+		
+		/* 
+		 * Turns this chunk into an identical copy of @{other}. Subchunks are
+		 * shared between the two rather than copied.
+		 */
+		void copy_from (chunk& other);
 		
 		
 		/* 
@@ -177,6 +529,40 @@ namespace hCraft {
 		
 		void set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta);
 		
+	//----
+		
+		/* 
+		 * Serialization:
+		 */
+		
+		inline unsigned int get_version ()
+			{ return this->version.load (std::memory_order_acquire); }
+		
+		/* 
+		 * Exports the chunk's contents, uncompressed and laid out the same way
+		 * as in chunk_blob, into a buffer allocated with new[], preceded by
+		 * @{reserve} unused bytes. The total size of the buffer is stored in
+		 * @{out_size}.
+		 */
+		unsigned char* serialize (unsigned short *primary_bitmap,
+			unsigned short *add_bitmap, unsigned int *out_size,
+			unsigned int reserve = 0);
+		
+		/* 
+		 * Returns the compressed form of the chunk's current contents, creating
+		 * it only if the chunk has changed since the last call. Can be called
+		 * from several threads at once.
+		 */
+		std::shared_ptr<const chunk_blob> get_blob ();
+		
+		/* 
+		 * Attaches an already compressed blob to the chunk, to be used until the
+		 * chunk next changes. Used by providers that store chunks in the same
+		 * form, so that loaded chunks do not have to be compressed again.
+		 */
+		void set_blob (unsigned short primary_bitmap, unsigned short add_bitmap,
+			const unsigned char *data, unsigned int len);
+		
 	//----
 		
 		/* 
@@ -186,6 +572,19 @@ namespace hCraft {
 		void relight (int x, int z, bool stop_at_zero = true);
 		void relight (bool stop_at_zero = true);
 		
+		/* 
+		 * Fills @{opacity} and @{luminance} (65536-entry arrays, indexed by
+		 * (y << 8) | (z << 4) | x) with how much light each block in the chunk
+		 * absorbs and emits.
+		 */
+		void export_light_info (unsigned char *opacity, unsigned char *luminance);
+		
+		/* 
+		 * Replaces the chunk's block and sky light with the given arrays (laid
+		 * out the same way as above).
+		 */
+		void import_light (const unsigned char *blight, const unsigned char *slight);
+		
 		void respread ();
 		void respread (int x, int y, int z);
 		void respread_around (int x, int y, int z);
@@ -212,6 +611,11 @@ namespace hCraft {
 		 * Calls the specified function on every entity in the chunk's entity list.
 		 */
 		void all_entities (std::function<void (entity *)> f);
+		
+		/* 
+		 * Checks whether the chunk's entity list is non-empty.
+		 */
+		bool has_entities ();
 	};
 }
 
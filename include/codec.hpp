@@ -0,0 +1,100 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__CODEC_H_
+#define _hCraft__CODEC_H_
+
+#include <string>
+
+
+namespace hCraft {
+	
+	/* 
+	 * Codec IDs, as stored in world files. Must never change.
+	 */
+	enum chunk_codec_id
+	{
+		CC_ZLIB = 0,
+		CC_RAW  = 1,
+		CC_LZ   = 2,
+		CC_BLOB = 3,
+	};
+	
+	
+	/* 
+	 * Compresses and decompresses serialized chunk data for storage.
+	 * 
+	 * Codecs hold no state between calls, so a single instance can be used by
+	 * several threads at once.
+	 */
+	class chunk_codec
+	{
+	public:
+		virtual ~chunk_codec () { }
+		
+		/* 
+		 * Returns the name of this codec, in the same form accepted by create ()
+		 * (e.g. "zlib:3").
+		 */
+		virtual std::string name () = 0;
+		
+		virtual chunk_codec_id id () = 0;
+		
+		
+		
+		/* 
+		 * Compresses @{len} bytes at @{data}, and returns a buffer allocated with
+		 * new[] that holds the result, preceded by @{reserve} unused bytes that
+		 * the caller may use as it sees fit. The total size of the buffer is
+		 * stored in @{out_size}.
+		 */
+		virtual unsigned char* encode (const unsigned char *data, unsigned int len,
+			unsigned int *out_size, unsigned int reserve = 0) = 0;
+		
+		/* 
+		 * Decompresses @{len} bytes at @{data} into @{out}, which can hold up to
+		 * @{out_len} bytes. Returns the size of the decompressed data, or throws
+		 * an std::runtime_error if the data is corrupt or does not fit.
+		 */
+		virtual unsigned int decode (const unsigned char *data, unsigned int len,
+			unsigned char *out, unsigned int out_len) = 0;
+		
+		
+		
+		/* 
+		 * Creates a new codec from a specification string: "blob", "raw", "lz",
+		 * "zlib" or "zlib:<level>" (1-9). Returns null if the string is invalid.
+		 */
+		static chunk_codec* create (const char *spec);
+		
+		/* 
+		 * Returns a shared instance of the codec with the given ID, suitable for
+		 * decoding, or null if there is no such codec.
+		 */
+		static chunk_codec* get (int id);
+		
+		/* 
+		 * The codec that newly opened worlds save chunks with.
+		 */
+		static void set_default (const char *spec);
+		static std::string get_default ();
+	};
+}
+
+#endif
+
@@ -97,6 +97,77 @@ namespace hCraft {
 		//----
 			void execute (player *pl, command_reader& reader);
 		};
+		
+		
+		
+		/* 
+		 * /stats -
+		 * 
+		 * Displays internal server statistics, such as how much memory is held by
+		 * the server's allocators, or how much output is queued to players.
+		 * 
+		 * Permissions:
+		 *   - command.info.stats
+		 *       Needed to execute the command.
+		 */
+		class c_stats: public command
+		{
+		public:
+			const char* get_name () { return "stats"; }
+			
+			const char*
+			get_summary ()
+				{ return "Displays internal server statistics."; }
+			
+			const char**
+			get_usage ()
+			{
+				static const char *usage[] =
+					{
+						"/stats [memory/network]",
+						"/stats [--help/--summary]",
+						nullptr,
+					};
+				return usage;
+			}
+			
+			const char**
+			get_help ()
+			{
+				static const char *help[] =
+					{
+						"Shows how many objects each of the server's slab allocators has "
+						"handed out, how many are kept around for reuse, and how much memory "
+						"they have taken from the system in total.",
+						
+						"Shows how much output is waiting to be sent to players, and how "
+						"often slow clients had movement updates or chunks held back, or "
+						"were disconnected for falling too far behind.",
+						
+						"Same as calling >/help< on >stats< (\"/help [-s] stats\")",
+						nullptr,
+					};
+				return help;
+			}
+			
+			const char**
+			get_examples ()
+			{
+				static const char *examples[] =
+					{
+						"/stats",
+						"/stats memory",
+						"/stats network",
+						nullptr,
+					};
+				return examples;
+			}
+			
+			const char* get_exec_permission () { return "command.info.stats"; }
+			
+		//----
+			void execute (player *pl, command_reader& reader);
+		};
 	}
 }
 
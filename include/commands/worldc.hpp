@@ -280,6 +280,88 @@ namespace hCraft {
 		};
 		
 		
+		/* 
+		 * /pregen -
+		 * 
+		 * Generates and saves all chunks within a given radius around a world's
+		 * spawn in the background.
+		 * 
+		 * Permissions:
+		 *   - command.world.pregen
+		 *       Needed to execute the command.
+		 */
+		class c_pregen: public command
+		{
+		public:
+			const char* get_name () { return "pregen"; }
+			
+			const char*
+			get_summary ()
+				{ return "Generates and saves all chunks within a given radius around a "
+								 "world's spawn in the background."; }
+			
+			const char**
+			get_usage ()
+			{
+				static const char *usage[] =
+					{
+						"/pregen <world> <radius>",
+						"/pregen [--cpu <percent>] [--io <percent>] <world> <radius>",
+						"/pregen <world>",
+						"/pregen [--cancel/--stop] <world>",
+						"/pregen [--help/--summary]",
+						nullptr,
+					};
+				return usage;
+			}
+			
+			const char**
+			get_help ()
+			{
+				static const char *help[] =
+					{
+						"Starts generating every chunk within <radius> chunks of world "
+						"<world>'s spawn, moving outwards in a spiral. Chunks are saved to "
+						"disk and unloaded as they are finished. If an earlier run on the "
+						"same world has been interrupted, generation continues from where "
+						"it left off.",
+						
+						"Same as above, but limits the percentage of time spent generating "
+						"chunks (--cpu) and writing them to disk (--io). Both default to "
+						">50<.",
+						
+						"Displays the progress of the world's pre-generation.",
+						
+						"--cancel stops the world's pre-generation and discards its "
+						"progress. --stop pauses it instead; it is picked up again the next "
+						"time >/pregen< is given a radius, or when the server restarts.",
+						
+						"Same as calling >/help< on >pregen< (\"/help [-s] pregen\")",
+						nullptr,
+					};
+				return help;
+			}
+			
+			const char**
+			get_examples ()
+			{
+				static const char *examples[] =
+					{
+						"/pregen main 100",
+						"/pregen --cpu 25 --io 10 survival 500",
+						"/pregen survival",
+						"/pregen --cancel survival",
+						nullptr,
+					};
+				return examples;
+			}
+			
+			const char* get_exec_permission () { return "command.world.pregen"; }
+			
+		//----
+			void execute (player *pl, command_reader& reader);
+		};		
+		
 		/* 
 		 * /world - 
 		 * 
@@ -0,0 +1,116 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__ENTITYGRID_H_
+#define _hCraft__ENTITYGRID_H_
+
+#include "position.hpp"
+#include <unordered_map>
+#include <mutex>
+#include <vector>
+#include <utility>
+
+
+namespace hCraft {
+	
+	class entity;
+	
+	
+	/* 
+	 * A spatial hash of the entities in a world.
+	 * 
+	 * Entities are bucketed by the chunk they are standing in, into square
+	 * cells of (1 << cell_shift) chunks on each side. A box query only visits
+	 * the few cells that overlap it, so its cost depends on the number of
+	 * entities nearby rather than on the number of entities in the world.
+	 * The grid is updated when an entity crosses into another chunk.
+	 */
+	class entity_grid
+	{
+		struct cell
+		{
+			std::unordered_map<entity *, chunk_pos> entities;
+		};
+		
+		std::unordered_map<unsigned long long, cell> cells;
+		std::unordered_map<entity *, chunk_pos> where;
+		std::mutex lock;
+		
+	public:
+		// cells are 16x16 chunks, so a view-distance query touches at most nine.
+		static constexpr int cell_shift () { return 4; }
+		
+	private:
+		void insert_nolock (entity *e, chunk_pos cpos);
+		void remove_nolock (entity *e, chunk_pos cpos);
+		
+	public:
+		/* 
+		 * Places the entity at the given chunk, moving it out of the chunk it
+		 * was in before (if any).
+		 */
+		void update (entity *e, chunk_pos cpos);
+		
+		/* 
+		 * Removes the specified entity from the grid.
+		 */
+		void remove (entity *e);
+		
+		/* 
+		 * Returns the number of entities in the grid.
+		 */
+		int count ();
+		
+		
+		/* 
+		 * Inserts every entity that stands in a chunk within the inclusive box
+		 * [x1, x2] x [z1, z2] (in chunk coordinates) into @{out}.
+		 */
+		void query (int x1, int z1, int x2, int z2, std::vector<entity *>& out);
+		
+		/* 
+		 * Inserts every entity standing in the given chunk into @{out}.
+		 */
+		void query (chunk_pos cpos, std::vector<entity *>& out)
+			{ this->query (cpos.x, cpos.z, cpos.x, cpos.z, out); }
+		
+		/* 
+		 * Inserts every entity within @{radius} chunks (Chebyshev distance) of
+		 * the given chunk into @{out}. With the player view distance as the
+		 * radius, these are the entities that can see, and be seen by, an
+		 * entity standing in that chunk.
+		 */
+		void query_radius (chunk_pos cpos, int radius, std::vector<entity *>& out)
+			{ this->query (cpos.x - radius, cpos.z - radius, cpos.x + radius,
+				cpos.z + radius, out); }
+		
+		/* 
+		 * Same as the above, but also stores the chunk each entity is standing
+		 * in, as far as the grid knows.
+		 */
+		void query (int x1, int z1, int x2, int z2,
+			std::vector<std::pair<entity *, chunk_pos>>& out);
+		void query_radius (chunk_pos cpos, int radius,
+			std::vector<std::pair<entity *, chunk_pos>>& out)
+			{ this->query (cpos.x - radius, cpos.z - radius, cpos.x + radius,
+				cpos.z + radius, out); }
+	};
+}
+
+#endif
+
@@ -20,7 +20,6 @@
 #define _hCraft__WORLDGENERATOR__FLATGRASS_H_
 
 #include "worldgenerator.hpp"
-#include <random>
 
 
 namespace hCraft {
@@ -30,9 +29,13 @@ namespace hCraft {
 	 */
 	class flatgrass_world_generator: public world_generator
 	{
-		std::minstd_rand rnd;
 		long gen_seed;
 		
+		// every flatgrass chunk is identical, so they are all cloned from (and
+		// share subchunks with) this one. Its heightmap and lighting are
+		// computed once, on construction.
+		chunk tmpl;
+		
 	public:
 		/* 
 		 * Constructs a new flatgrass world generator.
@@ -49,6 +52,9 @@ namespace hCraft {
 		virtual long seed ()
 			{ return this->gen_seed; }
 		
+		virtual bool prelit ()
+			{ return true; }
+		
 		
 		/* 
 		 * Generates flatgrass terrain on the specified chunk.
@@ -21,10 +21,18 @@
 
 #include "worldprovider.hpp"
 #include <fstream>
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <mutex>
 
 
 namespace hCraft {
 	
+	class chunk_codec;
+	class binary_writer;
+	
+	
 //----
 	struct hw_chunk
 	{
@@ -33,12 +41,16 @@ namespace hCraft {
 		int z;
 		unsigned int sector_table[256];
 		int size;
+		unsigned char codec; // see chunk_codec_id
+		bool loaded; // whether size and sector_table have been read in yet
 		
 		hw_chunk (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
 			this->size = 0;
+			this->codec = 0;
+			this->loaded = false;
 			for (int i = 0; i < 256; ++i)
 				sector_table[i] = 0;
 		}
@@ -49,11 +61,13 @@ namespace hCraft {
 		int offset;
 		int x, z;
 		hw_chunk* chunks[1024];
+		bool loaded; // whether the table has been read in yet
 		
 		hw_region (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
+			this->loaded = false;
 			for (int i = 0; i < 1024; ++i)
 				this->chunks[i] = nullptr;
 		}
@@ -70,11 +84,13 @@ namespace hCraft {
 		int offset;
 		int x, z;
 		hw_region* regions[1024];
+		bool loaded; // whether the table has been read in yet
 		
 		hw_block (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
+			this->loaded = false;
 			for (int i = 0; i < 1024; ++i)
 				this->regions[i] = nullptr;
 		}
@@ -91,11 +107,13 @@ namespace hCraft {
 		int offset;
 		int x, z;
 		hw_block* blocks[64];
+		bool loaded; // whether the table has been read in yet
 		
 		hw_superblock (int x, int z)
 		{
 			this->x = x;
 			this->z = z;
+			this->loaded = false;
 			for (int i = 0; i < 64; ++i)
 				this->blocks[i] = nullptr;
 		}
@@ -106,6 +124,14 @@ namespace hCraft {
 				delete this->blocks[i];
 		}
 	};
+	/* 
+	 * An in-place change to the world file, waiting in the journal.
+	 */
+	struct hw_patch
+	{
+		unsigned long long offset;
+		std::vector<unsigned char> data;
+	};
 //----
 	
 	class hw_provider_naming: public world_provider_naming
@@ -143,11 +169,118 @@ namespace hCraft {
 	class hw_provider: public world_provider
 	{
 		std::string out_path;
+		chunk_codec *codec;
 		hw_superblock *sblocks[4096];
 		std::fstream strm;
 		
+		// guards everything above and below; only the reading of chunk data in
+		// load () happens without it.
+		std::recursive_mutex lock;
+		
+		// read-only descriptor and mapping of the world file. Tables are read
+		// through the mapping, and chunk data with pread ().
+		int fd;
+		unsigned char *map;
+		unsigned long long map_size;
+		
 		world_information inf;
 		
+		// chunk coordinates -> chunk header offset, for every chunk in the file.
+		std::unordered_map<unsigned long long, unsigned int> index;
+		bool index_valid;
+		bool index_dirty;
+		
+		// unused runs of 512-byte units within the world file (start -> length).
+		std::map<unsigned int, unsigned int> free_space;
+		bool space_valid;
+		
+		// chunks yet to be visited in the current compaction pass.
+		std::vector<unsigned long long> compact_queue;
+		
+		// table and header updates made since the last commit, and the space
+		// they will free up.
+		std::vector<hw_patch> journal;
+		std::vector<std::pair<unsigned int, unsigned int>> pending_free;
+		
+		// the number of loads reading chunk data without holding the lock.
+		// Sectors freed up while there are any are held back until a later
+		// commit, as they might still be being read from.
+		int active_loads;
+		
+	private:
+		/* 
+		 * Maps the world file into memory, replacing the previous mapping if the
+		 * file has grown since. Returns false if the file does not exist (yet) or
+		 * could not be mapped.
+		 */
+		bool remap ();
+		
+		/* 
+		 * Loads the chunk index saved next to the world file. Returns false if
+		 * there is none, or if it does not match the world file.
+		 */
+		bool read_index ();
+		
+		/* 
+		 * Writes the chunk index out, reading in the rest of the world's tables
+		 * first if the index was not loaded.
+		 */
+		void write_index ();
+		
+		/* 
+		 * Walks every table in the world file, rebuilding the chunk index and
+		 * the free space map.
+		 */
+		void scan ();
+		
+		/* 
+		 * Removes the index saved next to the world file, since it is about to
+		 * stop matching it. It is written out again when the provider is
+		 * destroyed.
+		 */
+		void touch ();
+		
+		/* 
+		 * Makes the changes recorded in the journal durable: new data is synced
+		 * to disk, the journal is written out and synced, and only then are the
+		 * changes made to the world file itself.
+		 */
+		void commit ();
+		
+		/* 
+		 * Applies the changes of a journal left behind by a crash, if it was
+		 * committed completely.
+		 */
+		void replay_journal ();
+		
+		/* 
+		 * Free space management.
+		 * Chunk data is always kept in a single contiguous run of sectors, and
+		 * is never written over in place.
+		 */
+		
+		/* 
+		 * Finds a free run of at least @{units} units that starts before
+		 * @{below}, marks it as used, and returns its offset. Returns zero if
+		 * there is none.
+		 * Space released since the last commit is not handed out before the
+		 * next one.
+		 */
+		unsigned int take_free (unsigned int units, unsigned int below = 0xFFFFFFFFU);
+		
+		/* 
+		 * Returns the specified run of units to the free space map.
+		 */
+		void release (unsigned int start, unsigned int units);
+		
+		/* 
+		 * Writes the chunk's data at @{start} (reusing free space or appending to
+		 * the file as needed), updates its header and releases the sectors it
+		 * no longer uses.
+		 */
+		void write_data (hw_chunk *hch, const unsigned char *data, unsigned int size,
+			unsigned int start, binary_writer& writer);
+		
 	public:
 		/* 
 		 * Constructs a new world provider for the HWv1 format.
@@ -177,16 +310,31 @@ namespace hCraft {
 		virtual void open (world &wr);
 		
 		/* 
-		 * Closes the underlying file stream.
+		 * Commits pending changes, and closes the underlying file stream.
 		 */
 		virtual void close ();
 		
 		
 		
 		/* 
-		 * Saves only the specified chunk.
+		 * Serializes and compresses the specified chunk into the form it is
+		 * stored in within the world file, using the codec the provider was
+		 * given. The first byte of the result names the codec.
+		 */
+		virtual unsigned char* encode (chunk *ch, int x, int z,
+			unsigned int *out_size);
+		
+		/* 
+		 * Serializes the specified chunk without compressing it.
+		 */
+		static unsigned char* serialize (chunk *ch, unsigned int *out_size);
+
+		
+		/* 
+		 * Writes out a chunk previously encoded with encode ().
 		 */
-		virtual void save (world& wr, chunk *ch, int x, int z);
+		virtual void write (world& wr, int x, int z, const unsigned char *data,
+			unsigned int size);
 		
 		/* 
 		 * Saves the specified world without writing out any chunks.
@@ -195,6 +343,14 @@ namespace hCraft {
 		 */
 		virtual void save_empty (world &wr);
 		
+		/* 
+		 * Moves chunk data towards the start of the world file to fill holes
+		 * left by chunks that have shrunk or moved, and truncates the file once
+		 * its tail is unused. Looks at no more than @{max_chunks} chunks, and
+		 * returns false once there is nothing left to compact.
+		 */
+		virtual bool compact (world& wr, int max_chunks);
+		
 		
 		
 		/* 
@@ -210,6 +366,14 @@ namespace hCraft {
 		 */
 		virtual bool load (world &wr, chunk *ch, int x, int z);
 		
+		virtual bool concurrent_loads ()
+			{ return true; }
+		
+		/* 
+		 * Stores the coordinates of every chunk saved in the world in @{out}.
+		 */
+		virtual void list_chunks (std::vector<chunk_pos>& out);
+		
 		/* 
 		 * Loads world information into the specified structure.
 		 */
@@ -0,0 +1,48 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__IMPORTER_H_
+#define _hCraft__IMPORTER_H_
+
+
+namespace hCraft {
+	
+	/* 
+	 * Offline conversion of worlds between formats, ran instead of the server
+	 * when hCraft is started with "--import".
+	 */
+	namespace importer {
+		
+		/* 
+		 * Converts a world according to the given command-line arguments (those
+		 * that follow "--import"), printing progress to the standard output.
+		 * Returns the process' exit code.
+		 * 
+		 * Usage:
+		 *   <world> <format> [<directory>] [<threads>]
+		 *       Converts the world named <world> in <directory> ("worlds" by
+		 *       default) to <format> ("hw" or "anvil"), leaving the original
+		 *       in place. Chunks are converted one region (32x32 chunks) at a
+		 *       time on each thread.
+		 */
+		int run (int argc, char *argv[]);
+	}
+}
+
+#endif
+
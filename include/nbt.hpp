@@ -0,0 +1,135 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__NBT_H_
+#define _hCraft__NBT_H_
+
+#include <string>
+#include <vector>
+
+
+namespace hCraft {
+	
+	enum nbt_tag_type
+	{
+		NBT_END = 0,
+		NBT_BYTE,
+		NBT_SHORT,
+		NBT_INT,
+		NBT_LONG,
+		NBT_FLOAT,
+		NBT_DOUBLE,
+		NBT_BYTE_ARRAY,
+		NBT_STRING,
+		NBT_LIST,
+		NBT_COMPOUND,
+		NBT_INT_ARRAY,
+	};
+	
+	
+	/* 
+	 * A single tag within a tree of NBT (Named Binary Tag) data, the format
+	 * Minecraft stores its worlds in. Lists and compounds own their children.
+	 */
+	class nbt_tag
+	{
+	public:
+		nbt_tag_type type;
+		std::string name;
+		
+		long long ival;                   // byte, short, int and long
+		double dval;                      // float and double
+		std::string sval;                 // string
+		std::vector<unsigned char> bytes; // byte array
+		std::vector<int> ints;            // int array
+		
+		nbt_tag_type list_type;
+		std::vector<nbt_tag *> children;  // list and compound
+		
+	public:
+		/* 
+		 * Constructs a new empty tag.
+		 */
+		nbt_tag (nbt_tag_type type, const std::string& name = std::string ());
+		
+		/* 
+		 * Class destructor.
+		 */
+		~nbt_tag ();
+		
+		nbt_tag (const nbt_tag&) = delete;
+		nbt_tag& operator= (const nbt_tag&) = delete;
+		
+		
+		
+		/* 
+		 * Returns the compound's child tag named @{name}, or null if it has
+		 * none, or if it is of a different type than @{type} (unless @{type} is
+		 * NBT_END).
+		 */
+		nbt_tag* find (const char *name, nbt_tag_type type = NBT_END);
+		
+		/* 
+		 * Shorthands for reading values out of compounds, returning @{def} if
+		 * the value is missing. Integer types are interchangeable.
+		 */
+		long long get_int (const char *name, long long def = 0);
+		double get_double (const char *name, double def = 0.0);
+		std::string get_string (const char *name, const std::string& def = std::string ());
+		
+		
+		
+		/* 
+		 * Appends @{child} to the list or compound, and returns it.
+		 */
+		nbt_tag* add (nbt_tag *child);
+		
+		/* 
+		 * Shorthands for building compounds.
+		 */
+		nbt_tag* add_byte (const char *name, int val);
+		nbt_tag* add_short (const char *name, int val);
+		nbt_tag* add_int (const char *name, int val);
+		nbt_tag* add_long (const char *name, long long val);
+		nbt_tag* add_float (const char *name, float val);
+		nbt_tag* add_double (const char *name, double val);
+		nbt_tag* add_string (const char *name, const std::string& val);
+		nbt_tag* add_byte_array (const char *name, const unsigned char *data,
+			unsigned int len);
+		nbt_tag* add_int_array (const char *name, const int *data, unsigned int len);
+		nbt_tag* add_list (const char *name, nbt_tag_type list_type);
+		nbt_tag* add_compound (const char *name);
+		
+		
+		
+		/* 
+		 * Appends the tag (along with its name) in its binary form to @{out}.
+		 */
+		void write (std::vector<unsigned char>& out) const;
+		
+		/* 
+		 * Parses a named tag (usually a compound) out of @{len} bytes at @{data}.
+		 * Throws an std::runtime_error if the data is malformed. The returned
+		 * tree must be freed with delete.
+		 */
+		static nbt_tag* parse (const unsigned char *data, unsigned int len);
+	};
+}
+
+#endif
+
@@ -0,0 +1,71 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__NOISE_H_
+#define _hCraft__NOISE_H_
+
+
+namespace hCraft {
+	
+	/* 
+	 * Seeded two-dimensional gradient (Perlin) noise.
+	 * 
+	 * Noise is evaluated a whole row at a time, eight points per iteration with
+	 * AVX2 when the CPU supports it, or one at a time otherwise. Both paths
+	 * perform the exact same floating point operations, so terrain does not
+	 * depend on the machine it was generated on.
+	 * 
+	 * Instances are immutable after construction, and may be shared between
+	 * threads freely.
+	 */
+	class perlin_noise
+	{
+		int perm[512];
+		
+	public:
+		/* 
+		 * Constructs a new noise source from the given seed.
+		 */
+		perlin_noise (long seed);
+		
+		
+		/* 
+		 * Returns the value of the noise (roughly between -1 and 1) at the
+		 * given point.
+		 */
+		float noise (float x, float z) const;
+		
+		/* 
+		 * Evaluates the noise at @{n} points starting from (@{x}, @{z}) and
+		 * moving along the X axis by @{step} units each time.
+		 */
+		void noise_row (float *out, float x, float z, float step, int n) const;
+		
+		/* 
+		 * Fills @{out} with a @{nx} by @{nz} grid (stored row after row, X
+		 * varying fastest) of fractal noise, made out of @{octaves} layers of
+		 * noise, each twice the frequency of the previous, and @{persistence}
+		 * times its amplitude. The result is normalized back to [-1, 1].
+		 */
+		void fill (float *out, float x, float z, float step, int nx, int nz,
+			int octaves = 1, float persistence = 0.5f) const;
+	};
+}
+
+#endif
+
@@ -27,8 +27,10 @@
 #include "messages.hpp"
 
 #include <queue>
+#include <bitset>
 #include <unordered_set>
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <event2/event.h>
 #include <event2/bufferevent.h>
@@ -38,6 +40,72 @@ namespace hCraft {
 	
 	class server;
 	
+	/* 
+	 * What an observing player was last told about another player's position:
+	 * fixed-point coordinates (1/32 of a block) and packed angles, exactly as
+	 * they were sent, so that further movement can be sent as small deltas.
+	 */
+	struct player_track
+	{
+		int x, y, z;
+		unsigned char r, l;
+		int rel_moves; // relative moves sent since the last teleport
+	};
+	
+	
+	/* 
+	 * The set of chunks known to a player, as a bitmap ring buffer: chunk
+	 * (x, z) maps to bit (x mod 64, z mod 64). This is exact for as long as
+	 * every chunk in the set lies within a 64x64 square, which holds since a
+	 * player only knows about the chunks around it.
+	 */
+	class chunk_ring
+	{
+		std::bitset<64 * 64> bits;
+		
+		static inline int
+		index (int x, int z)
+			{ return ((x & 63) << 6) | (z & 63); }
+		
+	public:
+		// the largest view radius (in chunks) that keeps the old and the new
+		// view square apart in the ring when both are around at once.
+		static constexpr int max_radius () { return 31; }
+		
+		inline bool contains (int x, int z) const { return this->bits.test (index (x, z)); }
+		inline void insert (int x, int z) { this->bits.set (index (x, z)); }
+		inline void erase (int x, int z) { this->bits.reset (index (x, z)); }
+	};
+	
+	
+	/* 
+	 * Outgoing packets are queued into one of these lanes, in order of
+	 * priority. Packets within a lane are always sent in the order they were
+	 * queued in.
+	 */
+	enum player_out_lane
+	{
+		OL_CONTROL,  // keep-alives, kicks, login, own position
+		OL_UPDATES,  // block changes and entity updates
+		OL_CHAT,     // chat and the player list
+		OL_BULK,     // chunk data
+		
+		OL_COUNT,
+	};
+	
+	
+	/* 
+	 * Server-wide counters of how often output backpressure kicked in.
+	 */
+	struct player_output_stats
+	{
+		std::atomic<unsigned long long> congestions;    // times a player went over the high mark
+		std::atomic<unsigned long long> moves_deferred; // observer updates put off
+		std::atomic<unsigned long long> chunks_paused;  // chunk sends put off
+		std::atomic<unsigned long long> overflows;      // players dropped past the hard cap
+	};
+	
+	
 	/* 
 	 * Represents a player.
 	 */
@@ -54,7 +122,8 @@ namespace hCraft {
 		char ip[16];
 		bool logged_in;
 		bool handshake;
-		bool fail; // true if the player is no longer valid, and must be disposed of.
+		std::atomic<bool> fail; // true if the player is no longer valid, and must be disposed of.
+		std::atomic<int> tasks; // pool tasks that refer to the player and have yet to finish
 		
 		char username[17];
 		char colored_username[24];
@@ -73,16 +142,28 @@ namespace hCraft {
 		int ping_id;
 		int ping_time_ms;
 		
-		std::queue<packet *> out_queue;
+		std::queue<packet *> out_lanes[OL_COUNT];
+		int out_credits[OL_COUNT];    // what's left of each lane's share in this round
+		packet *out_current;          // the packet being written to the socket
+		std::unordered_map<chunk_pos, int, chunk_pos_hash> out_chunks; // chunk packets in OL_BULK
 		std::mutex out_lock;
+		unsigned long long out_bytes; // queued, but not sent yet
+		std::atomic<bool> congested;  // went over the high mark, not yet under the low one
+		std::atomic<bool> overflowed; // went over the hard cap, will be disconnected
 		
 		world *curr_world;
 		chunk_pos curr_chunk;
 		std::mutex world_lock;
 		std::mutex join_lock;
-		std::unordered_set<chunk_pos, chunk_pos_hash> known_chunks;
-		std::unordered_set<player *> visible_players;
-		std::mutex visible_player_lock;
+		chunk_ring known_chunks;
+		chunk_pos view_center; // known_chunks is a subset of the square of radius
+		int view_radius;       // view_radius around view_center (-1 if empty).
+		bool view_complete;    // whether it is the whole square
+		std::unordered_set<chunk_pos, chunk_pos_hash> pending_chunks; // known, but not sent yet
+		std::unordered_set<chunk_pos, chunk_pos_hash> paused_chunks; // ready, held back by backpressure
+		std::atomic<bool> flush_queued; // send_paused_chunks () is queued on the pool
+		std::unordered_map<player *, player_track> observers; // players we are spawned to
+		std::mutex observer_lock;
 		
 		std::ostringstream msgbuf;
 		
@@ -116,6 +197,19 @@ namespace hCraft {
 		 */
 		void handle (const unsigned char *data);
 		
+		/* 
+		 * Picks the lane that the specified outgoing packet goes into.
+		 * Must be called with the output lock held.
+		 */
+		player_out_lane out_lane (packet *pack);
+		
+		/* 
+		 * Removes and returns the next packet that should be written to the
+		 * socket, or null if there are none. Must be called with the output
+		 * lock held.
+		 */
+		packet* next_out_packet ();
+		
 	//----
 		
 		/* 
@@ -147,6 +241,34 @@ namespace hCraft {
 		void stream_common_chunks (world *wr, entity_pos dest_pos,
 			int radius = player::chunk_radius ());
 		
+		/* 
+		 * Sends the specified chunk to the player, and spawns the players in it.
+		 * The world lock must be held.
+		 */
+		void send_chunk (int cx, int cz, chunk *ch);
+		
+		/* 
+		 * Adds the chunk to the player's known chunks and sends it (or waits
+		 * for it to be generated). Returns true if it was sent right away, in
+		 * which case the players in it are left for the caller to spawn.
+		 * The world lock must be held.
+		 */
+		bool add_known_chunk (chunk_pos cpos);
+		
+		/* 
+		 * Removes the chunk from the player's known chunks and unloads it from
+		 * the client. Returns true if it had been sent, in which case the
+		 * players in it are left for the caller to despawn.
+		 * The world lock must be held.
+		 */
+		bool remove_known_chunk (chunk_pos cpos);
+		
+		/* 
+		 * Sends chunks that were held back while the player's output was
+		 * congested, nearest first, for as long as it stays uncongested.
+		 */
+		void send_paused_chunks ();
+		
 	//----
 		
 		/* 
@@ -167,11 +289,33 @@ namespace hCraft {
 		inline world* get_world () { return this->curr_world; }
 		static constexpr int chunk_radius () { return 10; }
 		
+		// output queue watermarks (in bytes). above the high mark, movement
+		// updates and chunk sends to the player are held back until the queue
+		// drains below the low mark; players that go over the hard cap are
+		// disconnected.
+		static constexpr unsigned long long out_low_mark () { return 256 * 1024; }
+		static constexpr unsigned long long out_high_mark () { return 1024 * 1024; }
+		static constexpr unsigned long long out_hard_cap () { return 8 * 1024 * 1024; }
+		
+		inline bool is_congested () { return this->congested; }
+		unsigned long long get_queued_bytes ();
+		
+		static player_output_stats& get_output_stats ();
+		
+		// the number of relative moves after which an observer is sent an
+		// absolute teleport, so that it can never drift from the real position.
+		static constexpr int teleport_interval () { return 400; }
+		
 		inline int get_ping () { return this->ping_time_ms; }
 		
 		// whether the player isn't valid anymore, and should be destroyed.
 		inline bool bad () { return this->fail; }
 		
+		// whether pool tasks that refer to the player are still pending.
+		inline bool busy () { return this->tasks.load () > 0; }
+		
+		inline struct event_base* get_event_base () { return this->evbase; }
+		
 		virtual entity_type get_type () { return ET_PLAYER; }
 		
 	public:
@@ -197,6 +341,13 @@ namespace hCraft {
 		 */
 		void disconnect (bool silent = false);
 		
+		/* 
+		 * Frees the player's bufferevent, so that no more libevent callbacks
+		 * are invoked on the player. Must be called from the thread that runs
+		 * the player's event base.
+		 */
+		void close_connection ();
+		
 		/* 
 		 * Kicks the player with the given message.
 		 */
@@ -228,11 +379,29 @@ namespace hCraft {
 		 */
 		void stream_chunks (int radius = player::chunk_radius ());
 		
+		/* 
+		 * Called by the player's world when a chunk finishes generating. Sends
+		 * the chunk if the player has been waiting for it.
+		 */
+		void chunk_ready (world *wr, int cx, int cz, chunk *ch);
+		
 		/* 
 		 * Teleports the player to the given position.
 		 */
 		void teleport_to (entity_pos dest);
 		
+		/* 
+		 * Called by the player's world once every tick.
+		 */
+		void tick (unsigned long long tick);
+		
+		/* 
+		 * Called by the player's world once every tick. Tells observers where
+		 * the player has moved since they were last told, near observers every
+		 * tick and farther ones every few ticks.
+		 */
+		void send_movement (unsigned long long tick);
+		
 		/* 
 		 * Checks whether this player can be seen by player @{pl}.
 		 */
@@ -250,6 +419,13 @@ namespace hCraft {
 		 */
 		void despawn_from (player *pl);
 		
+		/* 
+		 * Removes the specified player from the list of players we are spawned
+		 * to, without sending it anything. Used on players that are about to be
+		 * destroyed.
+		 */
+		void forget_observer (player *pl);
+		
 		
 		
 		/* 
@@ -23,6 +23,7 @@
 #include "packet.hpp"
 #include <unordered_map>
 #include <mutex>
+#include <memory>
 #include <functional>
 #include <string>
 #include <vector>
@@ -41,15 +42,46 @@ namespace hCraft {
 	};
 	
 	
+	/* 
+	 * An immutable copy of a player list's contents.
+	 */
+	struct playerlist_snapshot
+	{
+		std::vector<player *> players;
+	};
+	
+	
 	/* 
 	 * A thread-safe list of players that provides a multitude of methods to
 	 * acquire a subset of that list according to certain criteria.
+	 * 
+	 * Modifications go through the map under a lock and publish a fresh
+	 * snapshot when done; iteration (broadcasts, all (), etc...) walks the
+	 * current snapshot without taking any lock, so callbacks that block on a
+	 * player's socket never hold up joins and leaves.
+	 * 
+	 * Lists never destroy the players they hold: a player that is removed can
+	 * still be reached through older snapshots (and other lists), so players
+	 * are destroyed by the server (see server::retire_player ()).
 	 */
 	class playerlist
 	{
 		std::unordered_map<cistring, player *> players;
+		std::shared_ptr<const playerlist_snapshot> snap;
 		std::mutex lock;
 		
+	private:
+		/* 
+		 * Rebuilds the snapshot from the map and swaps it in.
+		 * Must be called with the list's lock held.
+		 */
+		void publish ();
+		
+		/* 
+		 * Returns the current snapshot.
+		 */
+		std::shared_ptr<const playerlist_snapshot> snapshot () const;
+		
 	public:
 		/* 
 		 * Constructs a new empty player list.
@@ -84,17 +116,17 @@ namespace hCraft {
 		 * Removes the player that has the specified name from this player list.
 		 * NOTE: the search is done using case-INsensitive comparison.
 		 */
-		void remove (const char *name, bool delete_player = false);
+		void remove (const char *name);
 		
 		/* 
 		 * Removes the specified player from this player list.
 		 */
-		void remove (player *pl, bool delete_player = false);
+		void remove (player *pl);
 		
 		/* 
 		 * Removes all players from this player list.
 		 */
-		void clear (bool delete_players = false);
+		void clear ();
 		
 		/* 
 		 * Searches the player list for a player that has the specified name.
@@ -110,19 +142,12 @@ namespace hCraft {
 		 */
 		void all (std::function<void (player *)> f, player* except = nullptr);
 		
-		/* 
-		 * Calls the function @{f} on all players visible to player @{target} with
-		 * exception to @{target} itself.
-		 */
-		void all_visible (std::function<void (player *)> f, player *target);
-		
 		/* 
 		 * Iterates through the list, and passes all players to the specified
 		 * predicate function. Players that produce a positive value are
-		 * removed from the list, and can be optinally destroyed as well.
+		 * removed from the list.
 		 */
-		void remove_if (std::function<bool (player *)> pred,
-			bool delete_players = false);
+		void remove_if (std::function<bool (player *)> pred);
 		
 		
 		
@@ -0,0 +1,155 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__PREGEN_H_
+#define _hCraft__PREGEN_H_
+
+#include "position.hpp"
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+namespace hCraft {
+	
+	class server;
+	class world;
+	
+	
+	/* 
+	 * Generates, lights and saves every chunk within a square radius around a
+	 * world's spawn on a background thread, so that players exploring the
+	 * area later on have their chunks loaded from disk instead of generated.
+	 * 
+	 * Chunks are visited in a spiral moving outwards from the center, a batch
+	 * at a time. Finished chunks are written to disk and unloaded again as
+	 * soon as nothing else needs them, so memory use stays proportional to the
+	 * radius rather than the area.
+	 * 
+	 * Progress is stored in the server's database after every batch, and an
+	 * interrupted run can be picked up later with resume ().
+	 */
+	class world_pregenerator
+	{
+		server& srv;
+		world *wr;
+		std::string owner; // name of the player to report progress to
+		
+		int cx, cz; // center
+		int radius;
+		int cpu;  // percent of time spent generating
+		int io;   // percent of time spent writing to disk
+		
+		long long total;
+		std::atomic<long long> done;
+		
+		std::thread th;
+		std::atomic<bool> running;
+		bool stopping;
+		std::mutex stop_lock;
+		std::condition_variable stop_cv;
+		
+	private:
+		/* 
+		 * The function ran by the pre-generator's thread.
+		 */
+		void worker ();
+		
+		/* 
+		 * Sleeps for the given amount of milliseconds, or until the
+		 * pre-generator is stopped. Returns false if it has been.
+		 */
+		bool pause (long long ms);
+		
+		/* 
+		 * Sends a message to the player that started the pre-generation (if
+		 * they are still online), and logs it.
+		 */
+		void report (const std::string& msg);
+		
+		/* 
+		 * Unloads whatever the pre-generator has left in memory once it stops.
+		 */
+		void release (std::vector<chunk_pos>& to_evict);
+		
+		void save_progress ();
+		void erase_progress ();
+		
+	public:
+		inline world* get_world () { return this->wr; }
+		inline int get_radius () const { return this->radius; }
+		inline long long get_total () const { return this->total; }
+		inline long long get_done () const { return this->done.load (); }
+		inline bool is_running () const { return this->running.load (); }
+		
+	public:
+		/* 
+		 * Constructs a new pre-generator for the chunks within @{radius} chunks
+		 * of world @{wr}'s spawn. @{cpu} and @{io} limit the percentage of time
+		 * spent generating chunks and writing them to disk respectively.
+		 */
+		world_pregenerator (server& srv, world *wr, int radius, int cpu = 50,
+			int io = 50, const char *owner = "");
+		
+		/* 
+		 * Class destructor.
+		 * Stops the pre-generator if it is still running.
+		 */
+		~world_pregenerator ();
+		
+		
+		
+		/* 
+		 * Starts generating chunks on a new thread, continuing from where
+		 * previous runs on the same world left off.
+		 */
+		void start ();
+		
+		/* 
+		 * Stops the pre-generator, keeping its progress so that it can be
+		 * resumed later.
+		 */
+		void stop ();
+		
+		/* 
+		 * Stops the pre-generator and forgets about its progress.
+		 */
+		void cancel ();
+		
+		
+		
+		/* 
+		 * Resumes pre-generation on the specified world if an earlier run has
+		 * been interrupted (e.g. by a server restart). Returns true if it was.
+		 */
+		static bool resume (server& srv, world *wr);
+		
+		/* 
+		 * Forgets about an interrupted pre-generation of the specified world, so
+		 * that it is not resumed. Returns true if there was one.
+		 */
+		static bool forget (server& srv, world *wr);
+	};
+}
+
+#endif
+
@@ -0,0 +1,142 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__SAVER_H_
+#define _hCraft__SAVER_H_
+
+#include "position.hpp"
+#include <deque>
+#include <unordered_set>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+
+namespace hCraft {
+	
+	class world;
+	
+	
+	/* 
+	 * Writes modified chunks of a world to disk in the background.
+	 * 
+	 * Chunks are queued as soon as they are first modified, and are written out
+	 * once they have stayed dirty for the autosave delay, so that chunks that
+	 * keep changing are not saved over and over again. Every tick, at most a
+	 * fixed number of due chunks is handed to world::save_chunks (), which
+	 * snapshots them, compresses them on the world's thread pool (this thread
+	 * helping out) and writes them from this thread in a single batch.
+	 * 
+	 * When there is nothing to save, the saver lets the world's provider
+	 * compact the world file, a few chunks at a time.
+	 */
+	class world_saver
+	{
+		struct entry
+		{
+			chunk_pos pos;
+			std::chrono::steady_clock::time_point since;
+			
+			entry (chunk_pos pos, std::chrono::steady_clock::time_point since)
+				: pos (pos), since (since)
+				{ }
+		};
+		
+		world& wr;
+		
+		std::deque<entry> queue;
+		std::unordered_set<chunk_pos, chunk_pos_hash> queued;
+		std::mutex lock;
+		std::condition_variable cv;
+		
+		std::thread th;
+		bool running;
+		
+		int delay;  // autosave delay, in milliseconds
+		int budget; // max chunks saved per tick
+		
+		bool compact_pending; // whether the world file might need compacting
+		int idle_ticks;
+		
+	private:
+		/* 
+		 * The function ran by the saver's thread.
+		 */
+		void worker ();
+		
+		/* 
+		 * Removes up to @{max} chunks that have been dirty since @{before} from
+		 * the queue and appends them to @{out}.
+		 */
+		void take (std::vector<chunk_pos>& out, int max,
+			std::chrono::steady_clock::time_point before);
+		
+	public:
+		static constexpr int tick_interval () { return 50; }
+		
+		// idle ticks between compaction steps, and chunks looked at in each.
+		static constexpr int compact_interval () { return 20; }
+		static constexpr int compact_budget () { return 16; }
+		
+		inline void set_delay (int ms) { this->delay = ms; }
+		inline void set_budget (int chunks) { this->budget = chunks; }
+		
+	public:
+		/* 
+		 * Constructs a new saver for the specified world.
+		 */
+		world_saver (world& wr);
+		
+		/* 
+		 * Class destructor.
+		 * Stops the saver if it is still running.
+		 */
+		~world_saver ();
+		
+		
+		
+		/* 
+		 * Starts the saver's thread.
+		 */
+		void start ();
+		
+		/* 
+		 * Writes out every chunk still in the queue, and stops the saver's
+		 * thread.
+		 */
+		void stop ();
+		
+		
+		
+		/* 
+		 * Queues the chunk at the given coordinates to be saved. Does nothing if
+		 * it is already queued.
+		 */
+		void mark_dirty (int x, int z);
+		
+		/* 
+		 * Returns the number of chunks waiting to be saved.
+		 */
+		int pending ();
+	};
+}
+
+#endif
+
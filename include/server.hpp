@@ -65,6 +65,7 @@ namespace hCraft {
 		char srv_motd[81];
 		int  max_players;
 		char main_world[33];
+		char chunk_codec[33];
 		
 		char ip[16];
 		int  port;
@@ -145,6 +146,16 @@ namespace hCraft {
 		playerlist *players;
 		std::vector<player *> connecting;
 		std::mutex connecting_lock;
+		
+		// disconnected players waiting to be destroyed. Players are moved from
+		// @{retired} to @{retired_prev} on one cleanup tick, and handed to the
+		// worker that runs their connection on the next (through @{reaped}),
+		// so that threads that got hold of them before they were removed from
+		// the server's lists are done with them by then.
+		std::vector<player *> retired;
+		std::vector<player *> retired_prev;
+		std::vector<player *> reaped;
+		std::mutex retired_lock;
 		int id_counter;
 		std::mutex id_lock;
 		
@@ -223,6 +234,13 @@ namespace hCraft {
 		 */
 		void work ();
 		
+		/* 
+		 * Destroys the reaped players whose connections are run by the specified
+		 * worker. Called by the worker's thread in between event loop iterations,
+		 * so that none of the players' callbacks can be running or pending.
+		 */
+		void destroy_reaped (worker& w);
+		
 		/* 
 		 * Returns the worker that has the least amount of events associated with
 		 * it.
@@ -240,7 +258,8 @@ namespace hCraft {
 		// scheduler callbacks:
 		
 		/* 
-		 * Removes and destroys disconnected players.
+		 * Hands players that have been retired for long enough to the workers
+		 * that run their connections, to be destroyed.
 		 */
 		static void cleanup_players (scheduler_task& task);
 		
@@ -321,6 +340,13 @@ namespace hCraft {
 		 * returns false and the player is kicked with an appropriate message.
 		 */
 		bool done_connecting (player *pl);
+		
+		/* 
+		 * Queues the specified disconnected player to be destroyed once no
+		 * other thread could be using it anymore. Called once for every player,
+		 * by player::disconnect ().
+		 */
+		void retire_player (player *pl);
 	};
 }
 
@@ -0,0 +1,125 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__SLAB_H_
+#define _hCraft__SLAB_H_
+
+#include <atomic>
+#include <functional>
+#include <cstddef>
+
+
+namespace hCraft {
+	
+	/* 
+	 * Usage figures reported by a slab allocator.
+	 */
+	struct slab_stats
+	{
+		const char *name;
+		unsigned int obj_size;
+		
+		unsigned int slabs;      // number of slabs allocated from the heap
+		unsigned int in_use;     // objects currently handed out
+		unsigned int free;       // objects sitting in free lists
+		unsigned int high_water; // highest value `in_use' has ever reached
+	};
+	
+	
+	/* 
+	 * A lock-free allocator for objects of a single, fixed size.
+	 * 
+	 * Memory is obtained from the heap in large slabs that are carved up into
+	 * objects and never handed back; freed objects are kept in per-thread
+	 * caches, which spill over into (and refill from) a shared lock-free free
+	 * list. This keeps frequently created and destroyed objects (chunks,
+	 * subchunks and their arrays) from fragmenting the heap over time.
+	 */
+	class slab_allocator
+	{
+		struct free_node
+		{
+			free_node *next;
+		};
+		
+		friend struct slab_thread_caches;
+		
+	private:
+		const char *name;
+		unsigned int obj_size;
+		unsigned int objs_per_slab;
+		int id;
+		
+		// the shared free list's head, tagged with a modification count in the
+		// upper 16 bits to protect against ABA.
+		std::atomic<unsigned long long> free_head;
+		
+		std::atomic<unsigned int> slabs;
+		std::atomic<unsigned int> in_use;
+		std::atomic<unsigned int> high_water;
+		
+	private:
+		free_node* pop_shared ();
+		void push_shared (free_node *node);
+		
+		/* 
+		 * Moves objects from the shared free list (or from a newly allocated
+		 * slab, if it's empty) into the calling thread's cache.
+		 */
+		void refill ();
+		
+		/* 
+		 * Returns @{count} objects from the calling thread's cache back to the
+		 * shared free list.
+		 */
+		void drain (int count);
+		
+	public:
+		/* 
+		 * Constructs a new allocator for objects of @{obj_size} bytes.
+		 * @{name} must point to a string with static storage duration.
+		 */
+		slab_allocator (const char *name, unsigned int obj_size);
+		slab_allocator (const slab_allocator&) = delete;
+		
+		
+		/* 
+		 * Returns a pointer to an uninitialized object.
+		 */
+		void* alloc ();
+		
+		/* 
+		 * Returns the specified object back to the allocator.
+		 */
+		void free (void *ptr);
+		
+		
+		/* 
+		 * Returns current usage figures.
+		 */
+		slab_stats stats ();
+		
+		/* 
+		 * Calls @{f} on every slab allocator that has been created so far.
+		 */
+		static void all (std::function<void (slab_allocator&)> f);
+	};
+}
+
+#endif
+
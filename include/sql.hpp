@@ -71,6 +71,8 @@ namespace hCraft {
 			
 			void bind_text (int index, const char *text, int len = -1,
 				void (*dctor)(void *) = dctor_static);
+			void bind_int (int index, int val);
+			void bind_int64 (int index, long long val);
 			
 			void execute ();
 			return_code step ();
@@ -0,0 +1,88 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hCraft__WORLDGENERATOR__TERRAIN_H_
+#define _hCraft__WORLDGENERATOR__TERRAIN_H_
+
+#include "worldgenerator.hpp"
+#include "noise.hpp"
+
+
+namespace hCraft {
+	
+	/* 
+	 * Natural-looking terrain: rolling hills, mountains, oceans and beaches,
+	 * with biomes picked from temperature and rainfall noise.
+	 * 
+	 * Chunks are generated independently of each other, and the generator
+	 * holds no mutable state, so generate () can be called for several chunks
+	 * at once from different threads.
+	 */
+	class terrain_world_generator: public world_generator
+	{
+		long gen_seed;
+		
+		perlin_noise height_noise;
+		perlin_noise hill_noise;
+		perlin_noise temp_noise;
+		perlin_noise rain_noise;
+		
+	private:
+		/* 
+		 * Computes the height and biome of the column at (@{x}, @{z}) in chunk
+		 * (@{cx}, @{cz}) from the noise alone, exactly as generate () does.
+		 */
+		void column_at (int cx, int cz, int x, int z, int *h,
+			unsigned char *biome) const;
+		
+	public:
+		/* 
+		 * Constructs a new terrain world generator.
+		 */
+		terrain_world_generator (long seed);
+		
+		
+		/* 
+		 * Returns the name of this generator.
+		 */
+		virtual const char* name ()
+			{ return "terrain"; }
+		
+		virtual long seed ()
+			{ return this->gen_seed; }
+		
+		virtual bool prelit ()
+			{ return true; }
+		
+		
+		/* 
+		 * Generates terrain on the specified chunk.
+		 */
+		virtual void generate (world& wr, chunk *out, int cx, int cz);
+		
+		/* 
+		 * Plants trees. Trees are rooted in a chunk but may hang over into its
+		 * neighbours, so every chunk also draws the parts of trees planted in
+		 * the eight chunks around it.
+		 */
+		virtual bool decorate (world& wr, chunk *out, int cx, int cz);
+	};
+}
+
+#endif
+
@@ -97,6 +97,11 @@ namespace hCraft {
 		 */
 		void stop ();
 		
+		/* 
+		 * Returns the number of worker threads in the pool.
+		 */
+		inline int size () const { return this->workers.size (); }
+		
 		
 		
 		/* 
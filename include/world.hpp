@@ -23,18 +23,28 @@
 #include "chunk.hpp"
 #include "worldgenerator.hpp"
 #include "worldprovider.hpp"
+#include "entitygrid.hpp"
 
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
 #include <queue>
+#include <deque>
 #include <memory>
 #include <thread>
+#include <vector>
+#include <string>
+#include <chrono>
 
 
 namespace hCraft {
 	
+	class logger;
 	class player;
 	class playerlist;
+	class thread_pool;
+	class world_pregenerator;
+	class world_saver;
 	
 	
 	/* 
@@ -62,6 +72,21 @@ namespace hCraft {
 	};
 	
 	
+	/* 
+	 * Generation state kept for chunks that have not reached CS_READY yet.
+	 */
+	struct chunk_gen_state
+	{
+		int  target;  // the stage the chunk has been requested to reach
+		bool busy;    // whether a stage is currently being run on the chunk
+		bool relight; // whether the lighting stage has any work to do
+		
+		chunk_gen_state ()
+			: target (CS_EMPTY), busy (false), relight (true)
+			{ }
+	};
+	
+	
 	/* 
 	 * The world provides methods to easily retreive or modify chunks, and
 	 * get/set individual blocks within those chunks. In addition to that,
@@ -71,6 +96,7 @@ namespace hCraft {
 	{
 		char name[33]; // 32 chars max
 		playerlist *players;
+		entity_grid entities;
 		
 		std::unique_ptr<std::thread> th;
 		bool th_running;
@@ -82,6 +108,23 @@ namespace hCraft {
 		std::unordered_map<unsigned long long, chunk *> chunks;
 		std::mutex chunk_lock;
 		
+		// chunks that have been unloaded, but might still be used by threads
+		// that got hold of them before. Guarded by chunk_lock.
+		std::vector<std::pair<chunk *, std::chrono::steady_clock::time_point>> retired;
+		
+		// generation pipeline:
+		std::unordered_map<unsigned long long, chunk_gen_state> gen_states;
+		std::deque<unsigned long long> gen_jobs; // chunks with a runnable stage
+		std::mutex gen_lock;
+		std::condition_variable gen_cv;
+		int gen_tasks; // pool tasks that have not finished yet
+		
+		std::mutex prov_lock;
+		
+		// held throughout save_chunks (), so that snapshots of a chunk are
+		// written out in the order they were taken.
+		std::mutex save_lock;
+		
 		int width;
 		int depth;
 		entity_pos spawn_pos;
@@ -89,10 +132,18 @@ namespace hCraft {
 		
 		world_generator *gen;
 		world_provider *prov;
+		thread_pool *pool;
+		
+		std::shared_ptr<world_pregenerator> pregen;
+		std::mutex pregen_lock;
+		
+		world_saver *saver;
+		logger *log;
 		
 	public:
 		inline const char* get_name () { return this->name; }
 		inline playerlist& get_players () { return *this->players; }
+		inline entity_grid& get_entities () { return this->entities; }
 		
 		inline world_generator* get_generator () { return this->gen; }
 		inline world_provider* get_provider () { return this->prov; }
@@ -107,12 +158,110 @@ namespace hCraft {
 		inline entity_pos get_spawn () const { return this->spawn_pos; }
 		inline void set_spawn (const entity_pos& pos) { this->spawn_pos = pos; }
 		
+		/* 
+		 * Sets the thread pool that chunk generation stages are run on. If none
+		 * is set, stages are only run by threads that wait on chunks.
+		 */
+		inline void set_thread_pool (thread_pool *pool) { this->pool = pool; }
+		
+		/* 
+		 * Sets the logger that errors met in the background (chunks that fail
+		 * to load or save) are reported to. If none is set, they are written to
+		 * the standard error stream.
+		 */
+		inline void set_logger (logger *log) { this->log = log; }
+		
 	private:
 		/* 
 		 * The function ran by the world's thread.
 		 */
 		void worker ();
 		
+		/* 
+		 * Reports an error met while running a task in the background.
+		 */
+		void report_error (const std::string& msg);
+		
+		/* 
+		 * Runs the per-tick work of every player in the world (movement
+		 * broadcasts, held back chunks, etc...).
+		 */
+		void tick_players (unsigned long long tick);
+		
+		/* 
+		 * Generation pipeline.
+		 * All of these must be called with gen_lock held.
+		 */
+		
+		/* 
+		 * Makes sure the chunk at the given coordinates exists, and that it will
+		 * eventually reach (at least) stage @{target}.
+		 */
+		chunk* gen_request (int x, int z, int target);
+		
+		/* 
+		 * Queues the chunk's next stage if all of its dependencies have been met.
+		 */
+		void gen_try_advance (int x, int z);
+		
+		/* 
+		 * Returns true if a stage is being run on the chunk at the given
+		 * coordinates, or is yet to be run on it.
+		 */
+		bool gen_pending (int x, int z);
+		
+		/* 
+		 * Loads the chunk at the given coordinates from the world's provider.
+		 * Returns false if it has never been saved, or could not be read (in
+		 * which case it is left empty, to be generated again).
+		 * Unlike the other methods here, called without gen_lock held.
+		 */
+		bool gen_load (chunk *ch, int x, int z);
+		
+		/* 
+		 * Runs stage @{next} on the given chunk. Loaded chunks skip straight to
+		 * CS_READY, in which case @{next} is updated accordingly.
+		 * Called without gen_lock held.
+		 */
+		void gen_run_stage (chunk *ch, int x, int z, int& next, bool& relight);
+		
+		/* 
+		 * Runs a single queued stage (temporarily releasing the lock while doing
+		 * so). Returns false if there was nothing to run.
+		 */
+		bool gen_run_job (std::unique_lock<std::mutex>& guard);
+		
+		/* 
+		 * Blocks until the chunk at the given coordinates is ready, running
+		 * queued stages on the calling thread in the meantime.
+		 */
+		void gen_wait (int x, int z, std::unique_lock<std::mutex>& guard);
+		
+		
+		/* 
+		 * Runs @{f} on the thread pool, keeping track of it so that the world is
+		 * not destroyed while it is still pending.
+		 */
+		void gen_enqueue (std::function<void ()>&& f);
+		
+		/* 
+		 * Lets players in this world know that a chunk they might be waiting for
+		 * has become ready.
+		 */
+		void notify_ready (int x, int z, chunk *ch);
+		
+		/* 
+		 * Queues the chunk at the given coordinates to be saved if it has
+		 * changed since version @{old_version} and is not queued already.
+		 */
+		void mark_dirty (int x, int z, chunk *ch, unsigned int old_version);
+		
+		/* 
+		 * Frees unloaded chunks that have outlived the grace period and are not
+		 * pinned.
+		 */
+		void reclaim_chunks ();
+		
 	public:
 		/* 
 		 * Constructs a new empty world.
@@ -139,17 +288,57 @@ namespace hCraft {
 		void start ();
 		
 		/* 
-		 * Stops the world's thread.
+		 * Stops the world's thread, along with any pre-generation running on
+		 * the world.
 		 */
 		void stop ();
 		
 		
 		
+		/* 
+		 * Starts running the specified pre-generator on this world, stopping the
+		 * previous one (if any).
+		 */
+		void start_pregen (std::shared_ptr<world_pregenerator> pregen);
+		
+		/* 
+		 * Stops the world's pre-generator, if there is one running.
+		 */
+		void stop_pregen ();
+		
+		/* 
+		 * Returns the world's current (or last) pre-generator, or null if none
+		 * has been started.
+		 */
+		std::shared_ptr<world_pregenerator> get_pregen ();
+		
+		
+		
 		/* 
 		 * Saves all modified chunks to disk.
 		 */
 		void save_all ();
 		
+		/* 
+		 * Writes out the modified chunks at the given positions in a single
+		 * batch. Each chunk is snapshotted under its data lock, and the
+		 * snapshots are compressed and written without holding any of the
+		 * chunks' locks, so they can still be used and modified while being
+		 * saved. Batches are saved one at a time.
+		 * Chunks that fail to compress or to be written are logged, marked
+		 * modified and queued for saving again.
+		 */
+		void save_chunks (const std::vector<chunk_pos>& positions);
+		
+		/* 
+		 * Lets the world's provider reclaim unused space in the world file,
+		 * looking at no more than @{max_chunks} chunks. Returns false once there
+		 * is nothing left to do.
+		 */
+		bool compact (int max_chunks);
+		
+		inline world_saver& get_saver () { return *this->saver; }
+		
 		
 		
 		/* 
@@ -184,10 +373,36 @@ namespace hCraft {
 		/* 
 		 * Same as get_chunk (), but if the chunk does not exist, it will be either
 		 * loaded from a file (if such a file exists), or completely generated from
-		 * scratch.
+		 * scratch. Blocks until the chunk is ready.
 		 */
 		chunk* load_chunk (int x, int z);
 		
+		/* 
+		 * Asynchronous version of load_chunk (). The returned chunk might not be
+		 * ready yet (see chunk::get_stage ()); players in the world are notified
+		 * through player::chunk_ready () once it is.
+		 */
+		chunk* request_chunk (int x, int z);
+		
+		/* 
+		 * Writes the chunk at the given coordinates to disk if it is ready and
+		 * has been modified.
+		 */
+		void save_chunk (int x, int z);
+		
+		/* 
+		 * Saves the chunk at the specified coordinates and removes it from
+		 * memory. Returns false if the chunk is still needed, i.e. it is close to
+		 * a player, or it (or a chunk around it) is still being generated.
+		 * Partially generated chunks are dropped without being saved.
+		 * Chunks whose neighbours have not been generated yet should not be
+		 * unloaded, as they would be loaded back in as soon as they are.
+		 * The chunk is not freed right away: pointers obtained through
+		 * get_chunk (), load_chunk () and the like remain valid for a few
+		 * seconds (or for as long as the chunk is pinned).
+		 */
+		bool unload_chunk (int x, int z);
+		
 		
 		
 		/* 
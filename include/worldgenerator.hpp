@@ -36,6 +36,17 @@ namespace hCraft {
 		virtual void generate (world& wr, chunk *out, int cx, int cz) = 0;
 		virtual void generate_edge (world& wr, chunk *out);
 		
+		/* 
+		 * Places features (trees, structures, etc...) on the specified chunk,
+		 * once it and the eight chunks around it have had their terrain
+		 * generated. Features may originate in neighbouring chunks (which can be
+		 * read through @{wr}), but only @{out} may be modified.
+		 * 
+		 * Returns true if any blocks were changed.
+		 */
+		virtual bool decorate (world& wr, chunk *out, int cx, int cz)
+			{ return false; }
+		
 		
 		/* 
 		 * Returns the name of this generator.
@@ -43,6 +54,15 @@ namespace hCraft {
 		virtual const char* name () = 0;
 		virtual long seed () = 0;
 		
+		/* 
+		 * Returns true if chunks produced by generate () already come with a
+		 * valid heightmap and sky light, in which case the world does not have
+		 * to recalculate them. This is usually the case for generators that
+		 * clone precomputed template chunks. Note that light is then not spread
+		 * across chunk borders either, unless decorate () changes the chunk.
+		 */
+		virtual bool prelit () { return false; }
+		
 		/* 
 		 * Finds and instantiates a new world generator from the given name.
 		 */
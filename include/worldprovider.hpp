@@ -107,8 +107,28 @@ namespace hCraft {
 		
 		/* 
 		 * Saves only the specified chunk.
+		 * Same as calling encode () and then write ().
 		 */
-		virtual void save (world& wr, chunk *ch, int x, int z) = 0;
+		virtual void save (world& wr, chunk *ch, int x, int z);
+		
+		/* 
+		 * Saving is split into two parts, so that the expensive one can be done
+		 * away from the world file:
+		 * 
+		 * encode () turns the chunk at the given coordinates into the (usually
+		 * compressed) form that it is stored in, and returns a buffer allocated
+		 * with new[] that the caller must free. It does not touch the world file,
+		 * and can be called from several threads at once, even while other
+		 * chunks are being read or written.
+		 * 
+		 * write () then stores the encoded chunk in the world file. Like save ()
+		 * and load (), it must not be called by more than one thread at a time
+		 * (though see concurrent_loads ()).
+		 */
+		virtual unsigned char* encode (chunk *ch, int x, int z,
+			unsigned int *out_size) = 0;
+		virtual void write (world& wr, int x, int z, const unsigned char *data,
+			unsigned int size) = 0;
 		
 		/* 
 		 * Saves the specified world without writing out any chunks.
@@ -117,6 +137,14 @@ namespace hCraft {
 		 */
 		virtual void save_empty (world &wr) = 0; 
 		
+		/* 
+		 * Performs a small amount of maintenance on the world file (like
+		 * reclaiming unused space), looking at no more than @{max_chunks}
+		 * chunks. Returns false once there is nothing left to do.
+		 */
+		virtual bool compact (world& wr, int max_chunks)
+			{ return false; }
+		
 		
 		
 		/* 
@@ -132,6 +160,19 @@ namespace hCraft {
 		 */
 		virtual bool load (world &wr, chunk *ch, int x, int z) = 0;
 		
+		/* 
+		 * Returns true if load () can be called by several threads at once,
+		 * including while chunks are being written, and without open () and
+		 * close () around it.
+		 */
+		virtual bool concurrent_loads ()
+			{ return false; }
+		
+		/* 
+		 * Stores the coordinates of every chunk saved in the world in @{out}.
+		 */
+		virtual void list_chunks (std::vector<chunk_pos>& out) = 0;
+		
 		/* 
 		 * Returns a structure that contains essential informatino about the
 		 * underlying world.
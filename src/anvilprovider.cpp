@@ -0,0 +1,820 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "anvilprovider.hpp"
+#include "world.hpp"
+#include "chunk.hpp"
+#include "nbt.hpp"
+#include "worldgenerator.hpp"
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+
+namespace hCraft {
+	
+	/* 
+	 * An open region file.
+	 */
+	struct anvil_region
+	{
+		int x, z;
+		int fd;
+		
+		// read-only mapping of the whole file.
+		unsigned char *map;
+		unsigned long long map_size;
+		
+		// the chunk location table (sector offset << 8 | sector count), and
+		// which of the file's 4KB sectors are in use.
+		unsigned int locations[1024];
+		std::vector<bool> used;
+		
+		// location entries changed since the last sync (which are only written
+		// to the header once the chunks they point at are on disk), and the
+		// sector runs they replace (freed only once the header is on disk too).
+		std::vector<int> pending_locs;
+		std::vector<std::pair<unsigned int, unsigned int>> pending_free;
+		
+		bool dirty; // written to since the last sync
+		int refs;
+		std::mutex lock;
+		
+		anvil_region (int x, int z)
+			: x (x), z (z)
+		{
+			this->fd = -1;
+			this->map = nullptr;
+			this->map_size = 0;
+			this->dirty = false;
+			this->refs = 0;
+		}
+		
+		~anvil_region ()
+		{
+			if (this->map)
+				munmap (this->map, this->map_size);
+			if (this->fd != -1)
+				{
+					this->sync ();
+					::close (this->fd);
+				}
+		}
+		
+		/* 
+		 * Syncs the chunks written since the last call to disk, then points the
+		 * header at them, and finally releases the sectors they replaced.
+		 * Returns false if the header could not be written.
+		 */
+		bool sync ();
+		
+		/* 
+		 * Makes sure the first @{size} bytes of the file are mapped in.
+		 */
+		bool
+		map_to (unsigned long long size)
+		{
+			if (size <= this->map_size)
+				return true;
+			
+			struct stat st;
+			if (fstat (this->fd, &st) == -1 || (unsigned long long)st.st_size < size)
+				return false;
+			
+			if (this->map)
+				munmap (this->map, this->map_size);
+			this->map_size = 0;
+			void *ptr = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+			if (ptr == MAP_FAILED)
+				{
+					this->map = nullptr;
+					return false;
+				}
+			
+			this->map = (unsigned char *)ptr;
+			this->map_size = st.st_size;
+			return true;
+		}
+	};
+	
+	// region files kept open at once, not counting those in use.
+	static const unsigned int max_open_regions = 64;
+	
+	
+	
+	static unsigned int
+	_read_be (const unsigned char *ptr)
+	{
+		return ((unsigned int)ptr[0] << 24) | ((unsigned int)ptr[1] << 16)
+			| ((unsigned int)ptr[2] << 8) | ptr[3];
+	}
+	
+	static void
+	_write_be (unsigned char *ptr, unsigned int val)
+	{
+		ptr[0] = val >> 24;
+		ptr[1] = (val >> 16) & 0xFF;
+		ptr[2] = (val >> 8) & 0xFF;
+		ptr[3] = val & 0xFF;
+	}
+	
+	static bool
+	_pwrite_all (int fd, const unsigned char *data, unsigned long long len,
+		unsigned long long off)
+	{
+		while (len > 0)
+			{
+				ssize_t ret = ::pwrite (fd, data, len, off);
+				if (ret <= 0)
+					return false;
+				data += ret;
+				len -= ret;
+				off += ret;
+			}
+		return true;
+	}
+	
+	bool
+	anvil_region::sync ()
+	{
+		if (!this->dirty)
+			return true;
+		
+		// the chunk data must be on disk before anything refers to it.
+		fdatasync (this->fd);
+		
+		bool ok = true;
+		unsigned char entry[4];
+		unsigned int now = (unsigned int)std::time (nullptr);
+		for (int index : this->pending_locs)
+			{
+				_write_be (entry, this->locations[index]);
+				ok = ok && _pwrite_all (this->fd, entry, 4, 4 * index);
+				_write_be (entry, now);
+				ok = ok && _pwrite_all (this->fd, entry, 4, 4096 + (4 * index));
+			}
+		fdatasync (this->fd);
+		if (!ok)
+			return false;
+		
+		// nothing on disk refers to the old runs anymore.
+		for (auto& run : this->pending_free)
+			for (unsigned int i = 0; i < run.second; ++i)
+				this->used[run.first + i] = false;
+		this->pending_locs.clear ();
+		this->pending_free.clear ();
+		this->dirty = false;
+		return true;
+	}
+	
+	static bool
+	_read_file (const std::string& path, std::vector<unsigned char>& out)
+	{
+		std::ifstream strm (path, std::ios_base::binary);
+		if (!strm)
+			return false;
+		out.assign (std::istreambuf_iterator<char> (strm),
+			std::istreambuf_iterator<char> ());
+		return true;
+	}
+	
+	/* 
+	 * Decompresses zlib or gzip data (the header tells which) into @{out}.
+	 */
+	static void
+	_inflate (const unsigned char *data, unsigned int len,
+		std::vector<unsigned char>& out)
+	{
+		z_stream zs;
+		std::memset (&zs, 0, sizeof zs);
+		if (inflateInit2 (&zs, 15 + 32) != Z_OK)
+			throw std::runtime_error ("failed to decompress chunk");
+		
+		out.resize (len * 4 + 1024);
+		zs.next_in = (Bytef *)data;
+		zs.avail_in = len;
+		int ret;
+		do
+			{
+				if (zs.total_out == out.size ())
+					out.resize (out.size () * 2);
+				zs.next_out = out.data () + zs.total_out;
+				zs.avail_out = out.size () - zs.total_out;
+				ret = inflate (&zs, Z_NO_FLUSH);
+			}
+		while (ret == Z_OK && out.size () < (64 << 20));
+		
+		out.resize (zs.total_out);
+		inflateEnd (&zs);
+		if (ret != Z_STREAM_END)
+			throw std::runtime_error ("failed to decompress chunk");
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Adds required prefixes, suffixes, etc... to the specified world name so
+	 * that the importer's claims_name () function returns true when passed to
+	 * it.
+	 */
+	std::string
+	anvil_provider_naming::make_name (const char *world_name)
+	{
+		// Anvil worlds are directories named after the world itself.
+		return std::string (world_name);
+	}
+	
+	/* 
+	 * Checks whether the specified path name meets the format required by this
+	 * exporter (could be a name prefix, suffix, extension, etc...).
+	 */
+	bool
+	anvil_provider_naming::claims_name (const char *path)
+	{
+		struct stat st;
+		return (stat ((std::string (path) + "/level.dat").c_str (), &st) == 0);
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Constructs a new world provider for the Anvil format.
+	 */
+	anvil_provider::anvil_provider (const char *path, const char *world_name)
+		: out_path (path), inf ()
+	{
+		if (this->out_path[this->out_path.size () - 1] != '/')
+			this->out_path.push_back ('/');
+		this->out_path.append (anvil_provider_naming ().make_name (world_name));
+		this->out_path.push_back ('/');
+		
+		this->read_level ();
+	}
+	
+	/* 
+	 * Class destructor.
+	 */
+	anvil_provider::~anvil_provider ()
+	{
+		for (auto& entry : this->regions)
+			delete entry.second;
+	}
+	
+	
+	
+	/* 
+	 * Reads the world's information from its level.dat file.
+	 */
+	void
+	anvil_provider::read_level ()
+	{
+		this->inf.width = 0;
+		this->inf.depth = 0;
+		this->inf.chunk_count = 0;
+		this->inf.generator = "terrain";
+		this->inf.seed = 0;
+		
+		std::vector<unsigned char> raw, data;
+		if (!_read_file (this->out_path + "level.dat", raw) || raw.empty ())
+			return;
+		
+		nbt_tag *root;
+		try
+			{
+				_inflate (raw.data (), raw.size (), data);
+				root = nbt_tag::parse (data.data (), data.size ());
+			}
+		catch (const std::runtime_error&)
+			{
+				return;
+			}
+		
+		nbt_tag *level = root->find ("Data", NBT_COMPOUND);
+		if (level)
+			{
+				this->inf.spawn_pos = entity_pos (level->get_int ("SpawnX"),
+					level->get_int ("SpawnY", 64), level->get_int ("SpawnZ"));
+				this->inf.seed = (int)level->get_int ("RandomSeed");
+				
+				// worlds created by Minecraft itself are given the closest match
+				// among our own generators.
+				std::string gen = level->get_string ("hCraftGenerator");
+				if (gen.empty ())
+					gen = (level->get_string ("generatorName") == "flat")
+						? "flatgrass" : "terrain";
+				this->inf.generator = gen;
+				
+				this->inf.width = (int)level->get_int ("hCraftWidth");
+				this->inf.depth = (int)level->get_int ("hCraftDepth");
+			}
+		delete root;
+		
+		std::vector<chunk_pos> chunks;
+		this->list_chunks (chunks);
+		this->inf.chunk_count = chunks.size ();
+	}
+	
+	
+	
+	/* 
+	 * Returns the region file that holds the specified chunk, opening it if
+	 * necessary (and creating it if @{create} is true). Returns null if it
+	 * does not exist. Must be followed by a call to release_region ().
+	 */
+	anvil_region*
+	anvil_provider::acquire_region (int cx, int cz, bool create)
+	{
+		int rx = cx >> 5, rz = cz >> 5;
+		unsigned long long key = ((unsigned long long)(unsigned int)rz << 32)
+			| (unsigned int)rx;
+		
+		std::lock_guard<std::mutex> guard {this->lock};
+		auto itr = this->regions.find (key);
+		if (itr != this->regions.end ())
+			{
+				++ itr->second->refs;
+				return itr->second;
+			}
+		
+		std::string path = this->out_path + "region/r." + std::to_string (rx)
+			+ "." + std::to_string (rz) + ".mca";
+		int fd = ::open (path.c_str (), O_RDWR);
+		if (fd == -1)
+			{
+				if (!create)
+					return nullptr;
+				
+				fd = ::open (path.c_str (), O_RDWR | O_CREAT | O_EXCL, 0644);
+				if (fd == -1)
+					throw std::runtime_error ("failed to create region file");
+				
+				static const unsigned char empty[8192] = { 0 };
+				if (!_pwrite_all (fd, empty, sizeof empty, 0))
+					{
+						::close (fd);
+						throw std::runtime_error ("failed to create region file");
+					}
+			}
+		
+		anvil_region *reg = new anvil_region (rx, rz);
+		reg->fd = fd;
+		
+		unsigned char header[4096];
+		struct stat st;
+		if (::pread (fd, header, 4096, 0) != 4096 || fstat (fd, &st) == -1)
+			{
+				delete reg;
+				throw std::runtime_error ("failed to read region file");
+			}
+		
+		// sectors lying past the end of the file are not counted as used, and
+		// the chunks in them are treated as missing.
+		unsigned int sectors = (st.st_size + 4095) / 4096;
+		reg->used.assign ((sectors < 2) ? 2 : sectors, false);
+		reg->used[0] = reg->used[1] = true;
+		for (int i = 0; i < 1024; ++i)
+			{
+				unsigned int loc = _read_be (header + (4 * i));
+				unsigned int off = loc >> 8, count = loc & 0xFF;
+				if (count == 0 || off < 2 || off + count > sectors)
+					{
+						reg->locations[i] = 0;
+						continue;
+					}
+				
+				reg->locations[i] = loc;
+				for (unsigned int j = 0; j < count; ++j)
+					reg->used[off + j] = true;
+			}
+		
+		// close some of the regions nobody is using.
+		if (this->regions.size () >= max_open_regions)
+			for (auto itr = this->regions.begin (); itr != this->regions.end (); )
+				{
+					if (itr->second->refs == 0)
+						{
+							delete itr->second;
+							itr = this->regions.erase (itr);
+						}
+					else
+						++ itr;
+				}
+		
+		reg->refs = 1;
+		this->regions[key] = reg;
+		return reg;
+	}
+	
+	void
+	anvil_provider::release_region (anvil_region *reg)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		-- reg->refs;
+	}
+	
+	
+	
+	/* 
+	 * Creates the world's directory if it does not exist yet.
+	 */
+	void
+	anvil_provider::open (world &wr)
+	{
+		struct stat st;
+		if (stat ((this->out_path + "level.dat").c_str (), &st) != 0)
+			this->save_empty (wr);
+	}
+	
+	/* 
+	 * Syncs the region files written to since the last call to disk, and
+	 * updates their headers.
+	 */
+	void
+	anvil_provider::close ()
+	{
+		bool ok = true;
+		std::lock_guard<std::mutex> guard {this->lock};
+		for (auto& entry : this->regions)
+			{
+				anvil_region *reg = entry.second;
+				std::lock_guard<std::mutex> reg_guard {reg->lock};
+				if (!reg->sync ())
+					ok = false;
+			}
+		
+		if (!ok)
+			throw std::runtime_error ("failed to write region file");
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Adds a byte array named @{name} of @{len} bytes to @{parent}, and
+	 * returns a pointer to its contents.
+	 */
+	static unsigned char*
+	_add_array (nbt_tag *parent, const char *name, unsigned int len)
+	{
+		nbt_tag *tag = parent->add (new nbt_tag (NBT_BYTE_ARRAY, name));
+		tag->bytes.resize (len);
+		return tag->bytes.data ();
+	}
+	
+	/* 
+	 * Turns the specified chunk into an NBT compound, compressed with zlib
+	 * and preceded by the five byte header it has within region files.
+	 */
+	unsigned char*
+	anvil_provider::encode (chunk *ch, int x, int z, unsigned int *out_size)
+	{
+		nbt_tag root (NBT_COMPOUND);
+		nbt_tag *level = root.add_compound ("Level");
+		level->add_int ("xPos", x);
+		level->add_int ("zPos", z);
+		level->add_long ("LastUpdate", 0);
+		level->add_byte ("TerrainPopulated", 1);
+		level->add_byte_array ("Biomes", ch->get_biome_array (), 256);
+		
+		int heights[256];
+		for (int i = 0; i < 256; ++i)
+			heights[i] = ch->get_height (i & 15, i >> 4);
+		level->add_int_array ("HeightMap", heights, 256);
+		
+		// section arrays are laid out the same way ours are.
+		nbt_tag *sections = level->add_list ("Sections", NBT_COMPOUND);
+		for (int i = 0; i < 16; ++i)
+			{
+				subchunk *sub = ch->get_sub (i);
+				if (!sub || sub->all_air ())
+					continue;
+				
+				nbt_tag *sec = sections->add (new nbt_tag (NBT_COMPOUND));
+				sec->add_byte ("Y", i);
+				sub->export_ids (_add_array (sec, "Blocks", 4096));
+				if (sub->has_add ())
+					sub->export_add (_add_array (sec, "Add", 2048));
+				sub->export_meta (_add_array (sec, "Data", 2048));
+				sub->export_block_light (_add_array (sec, "BlockLight", 2048));
+				sub->export_sky_light (_add_array (sec, "SkyLight", 2048));
+			}
+		
+		level->add_list ("Entities", NBT_COMPOUND);
+		level->add_list ("TileEntities", NBT_COMPOUND);
+		
+		std::vector<unsigned char> data;
+		data.reserve (65536);
+		root.write (data);
+		
+		unsigned long compressed_size = compressBound (data.size ());
+		unsigned char *out = new unsigned char[5 + compressed_size];
+		if (compress2 (out + 5, &compressed_size, data.data (), data.size (),
+			Z_DEFAULT_COMPRESSION) != Z_OK)
+			{
+				delete[] out;
+				throw std::runtime_error ("failed to compress chunk");
+			}
+		
+		_write_be (out, compressed_size + 1);
+		out[4] = 2; // zlib
+		*out_size = 5 + compressed_size;
+		return out;
+	}
+	
+	/* 
+	 * Writes out a chunk previously encoded with encode ().
+	 */
+	void
+	anvil_provider::write (world& wr, int x, int z, const unsigned char *data,
+		unsigned int size)
+	{
+		unsigned int count = (size + 4095) / 4096;
+		if (count > 255)
+			throw std::runtime_error ("chunk too large for region file");
+		
+		anvil_region *reg = this->acquire_region (x, z, true);
+		std::lock_guard<std::mutex> guard {reg->lock};
+		
+		int index = (x & 31) | ((z & 31) << 5);
+		unsigned int old_loc = reg->locations[index];
+		
+		// find a run of unused sectors, or append to the file.
+		unsigned int start = 0, run = 0;
+		for (unsigned int i = 2; i < reg->used.size () && run < count; ++i)
+			{
+				if (reg->used[i])
+					run = 0;
+				else if (run++ == 0)
+					start = i;
+			}
+		if (run < count)
+			{
+				if (run == 0)
+					start = reg->used.size ();
+				reg->used.resize (start + count, false);
+			}
+		
+		static const unsigned char zeroes[4096] = { 0 };
+		bool ok = _pwrite_all (reg->fd, data, size, start * 4096ULL)
+			&& _pwrite_all (reg->fd, zeroes, (count * 4096) - size,
+				(start * 4096ULL) + size);
+		if (!ok)
+			{
+				this->release_region (reg);
+				throw std::runtime_error ("failed to write region file");
+			}
+		
+		// the header on disk keeps pointing at the old run (which stays in use)
+		// until the region is synced.
+		for (unsigned int i = 0; i < count; ++i)
+			reg->used[start + i] = true;
+		if (old_loc != 0)
+			reg->pending_free.emplace_back (old_loc >> 8, old_loc & 0xFF);
+		if (std::find (reg->pending_locs.begin (), reg->pending_locs.end (), index)
+			== reg->pending_locs.end ())
+			reg->pending_locs.push_back (index);
+		reg->locations[index] = (start << 8) | count;
+		reg->dirty = true;
+		if (old_loc == 0)
+			++ this->inf.chunk_count;
+		
+		this->release_region (reg);
+	}
+	
+	
+	
+	/* 
+	 * Saves the specified world without writing out any chunks.
+	 */
+	void
+	anvil_provider::save_empty (world &wr)
+	{
+		std::string dir = this->out_path.substr (0, this->out_path.size () - 1);
+		::mkdir (dir.c_str (), 0755);
+		::mkdir ((this->out_path + "region").c_str (), 0755);
+		
+		std::string path = this->out_path + "level.dat";
+		struct stat st;
+		if (stat (path.c_str (), &st) == 0)
+			return;
+		
+		entity_pos spawn = wr.get_spawn ();
+		const char *gen = wr.get_generator () ? wr.get_generator ()->name () : "";
+		
+		nbt_tag root (NBT_COMPOUND);
+		nbt_tag *level = root.add_compound ("Data");
+		level->add_int ("version", 19133); // Anvil
+		level->add_byte ("initialized", 1);
+		level->add_string ("LevelName", wr.get_name ());
+		level->add_string ("generatorName",
+			(std::strcmp (gen, "flatgrass") == 0) ? "flat" : "default");
+		level->add_int ("generatorVersion", 0);
+		level->add_long ("RandomSeed",
+			wr.get_generator () ? wr.get_generator ()->seed () : 0);
+		level->add_byte ("MapFeatures", 0);
+		level->add_int ("SpawnX", (int)spawn.x);
+		level->add_int ("SpawnY", (int)spawn.y);
+		level->add_int ("SpawnZ", (int)spawn.z);
+		level->add_long ("Time", 0);
+		level->add_long ("LastPlayed", (long long)std::time (nullptr) * 1000);
+		level->add_long ("SizeOnDisk", 0);
+		level->add_int ("GameType", 0);
+		level->add_byte ("hardcore", 0);
+		level->add_byte ("raining", 0);
+		level->add_byte ("thundering", 0);
+		
+		// our own, which Minecraft ignores.
+		level->add_string ("hCraftGenerator", gen);
+		level->add_int ("hCraftWidth", wr.get_width ());
+		level->add_int ("hCraftDepth", wr.get_depth ());
+		
+		std::vector<unsigned char> data;
+		root.write (data);
+		
+		gzFile gz = gzopen (path.c_str (), "wb");
+		if (!gz)
+			throw std::runtime_error ("failed to create level.dat");
+		int written = gzwrite (gz, data.data (), data.size ());
+		gzclose (gz);
+		if (written != (int)data.size ())
+			throw std::runtime_error ("failed to write level.dat");
+		
+		this->inf.spawn_pos = spawn;
+		this->inf.generator = gen;
+		this->inf.seed = wr.get_generator () ? wr.get_generator ()->seed () : 0;
+		this->inf.width = wr.get_width ();
+		this->inf.depth = wr.get_depth ();
+	}
+	
+	
+	
+	/* 
+	 * Checks whether the directory at @{path} holds an Anvil world.
+	 */
+	bool
+	anvil_provider::claims (const char *path)
+	{
+		struct stat st;
+		std::string dir (path);
+		return (stat ((dir + "/level.dat").c_str (), &st) == 0)
+			&& (stat ((dir + "/region").c_str (), &st) == 0) && S_ISDIR (st.st_mode);
+	}
+	
+	
+	
+	/* 
+	 * Looks up a section array, returning null if it is missing or of the
+	 * wrong size.
+	 */
+	static const unsigned char*
+	_get_array (nbt_tag *sec, const char *name, unsigned int len)
+	{
+		nbt_tag *tag = sec->find (name, NBT_BYTE_ARRAY);
+		if (!tag || tag->bytes.size () != len)
+			return nullptr;
+		return tag->bytes.data ();
+	}
+	
+	/* 
+	 * Attempts to load the chunk located at the specified coordinates into
+	 * @{ch}. Returns true on success, and false if the chunk is not present
+	 * within the world.
+	 */
+	bool
+	anvil_provider::load (world &wr, chunk *ch, int x, int z)
+	{
+		anvil_region *reg = this->acquire_region (x, z, false);
+		if (!reg)
+			return false;
+		
+		// only the compressed data is copied out while the region is locked.
+		std::vector<unsigned char> compressed;
+		unsigned char type = 0;
+		{
+			std::lock_guard<std::mutex> guard {reg->lock};
+			unsigned int loc = reg->locations[(x & 31) | ((z & 31) << 5)];
+			unsigned long long off = (loc >> 8) * 4096ULL;
+			unsigned int count = loc & 0xFF;
+			if (loc != 0 && reg->map_to (off + (count * 4096ULL)))
+				{
+					unsigned int len = _read_be (reg->map + off);
+					if (len > 0 && len <= (count * 4096) - 4)
+						{
+							type = reg->map[off + 4];
+							compressed.assign (reg->map + off + 5, reg->map + off + 4 + len);
+						}
+				}
+		}
+		this->release_region (reg);
+		if (type == 0)
+			return false;
+		
+		std::vector<unsigned char> data;
+		if (type == 3)
+			data.swap (compressed); // uncompressed
+		else if (type == 1 || type == 2)
+			_inflate (compressed.data (), compressed.size (), data);
+		else
+			throw std::runtime_error ("chunk saved with an unknown compression type");
+		
+		nbt_tag *root = nbt_tag::parse (data.data (), data.size ());
+		nbt_tag *level = root->find ("Level", NBT_COMPOUND);
+		nbt_tag *sections = level ? level->find ("Sections", NBT_LIST) : nullptr;
+		if (!sections)
+			{
+				delete root;
+				throw std::runtime_error ("malformed Anvil chunk");
+			}
+		
+		static const unsigned char zeroes[2048] = { 0 };
+		static const std::vector<unsigned char> lit (2048, 0xFF);
+		
+		for (nbt_tag *sec : sections->children)
+			{
+				int y = (int)sec->get_int ("Y", -1);
+				const unsigned char *ids = _get_array (sec, "Blocks", 4096);
+				if (y < 0 || y > 15 || !ids)
+					continue;
+				
+				const unsigned char *meta = _get_array (sec, "Data", 2048);
+				const unsigned char *blight = _get_array (sec, "BlockLight", 2048);
+				const unsigned char *slight = _get_array (sec, "SkyLight", 2048);
+				ch->import_sub (y, ids, _get_array (sec, "Add", 2048),
+					meta ? meta : zeroes, blight ? blight : zeroes,
+					slight ? slight : lit.data ());
+			}
+		
+		nbt_tag *biomes = level->find ("Biomes", NBT_BYTE_ARRAY);
+		if (biomes && biomes->bytes.size () == 256)
+			std::memcpy (ch->get_biome_array (), biomes->bytes.data (), 256);
+		
+		delete root;
+		return true;
+	}
+	
+	
+	
+	/* 
+	 * Stores the coordinates of every chunk saved in the world in @{out}.
+	 */
+	void
+	anvil_provider::list_chunks (std::vector<chunk_pos>& out)
+	{
+		DIR *dir = opendir ((this->out_path + "region").c_str ());
+		if (!dir)
+			return;
+		
+		struct dirent *ent;
+		while ((ent = readdir (dir)) != nullptr)
+			{
+				int rx, rz;
+				char ext[4] = { 0 };
+				if (std::sscanf (ent->d_name, "r.%d.%d.%3s", &rx, &rz, ext) != 3
+					|| std::strcmp (ext, "mca") != 0)
+					continue;
+				
+				anvil_region *reg = this->acquire_region (rx * 32, rz * 32, false);
+				if (!reg)
+					continue;
+				{
+					std::lock_guard<std::mutex> guard {reg->lock};
+					for (int i = 0; i < 1024; ++i)
+						if (reg->locations[i])
+							out.emplace_back ((rx * 32) + (i & 31), (rz * 32) + (i >> 5));
+				}
+				this->release_region (reg);
+			}
+		closedir (dir);
+	}
+}
+
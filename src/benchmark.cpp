@@ -0,0 +1,277 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "benchmark.hpp"
+#include "world.hpp"
+#include "worldgenerator.hpp"
+#include "worldprovider.hpp"
+#include "hwprovider.hpp"
+#include "codec.hpp"
+#include "chunk.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+
+
+namespace hCraft {
+	namespace benchmark {
+		
+		/* 
+		 * Generates @{count} chunks (in a square around the origin) using
+		 * @{threads} threads, and returns the time it took in seconds.
+		 */
+		static double
+		_time_generation (world& wr, int count, int threads)
+		{
+			world_generator *gen = wr.get_generator ();
+			int side = 1;
+			while (side * side < count)
+				++ side;
+			
+			std::atomic<int> next (0);
+			auto work = [&wr, gen, &next, count, side] ()
+				{
+					int i;
+					while ((i = next.fetch_add (1)) < count)
+						{
+							chunk *ch = new chunk ();
+							gen->generate (wr, ch, (i % side) - (side / 2), (i / side) - (side / 2));
+							if (!gen->prelit ())
+								{
+									ch->recalc_heightmap ();
+									ch->relight (false);
+								}
+							delete ch;
+						}
+				};
+			
+			auto start = std::chrono::steady_clock::now ();
+			std::vector<std::thread> workers;
+			for (int i = 1; i < threads; ++i)
+				workers.emplace_back (work);
+			work ();
+			for (std::thread& th : workers)
+				th.join ();
+			auto end = std::chrono::steady_clock::now ();
+			
+			return std::chrono::duration<double> (end - start).count ();
+		}
+		
+		static int
+		_bench_generator (int argc, char *argv[])
+		{
+			const char *gen_name = (argc > 0) ? argv[0] : "terrain";
+			int count = (argc > 1) ? std::atoi (argv[1]) : 2048;
+			if (count <= 0)
+				{
+					std::cerr << "invalid chunk count" << std::endl;
+					return 1;
+				}
+			
+			world_generator *gen = world_generator::create (gen_name, 1234);
+			if (!gen)
+				{
+					std::cerr << "unknown world generator: " << gen_name << std::endl;
+					return 1;
+				}
+			world wr ("benchmark", gen, nullptr);
+			
+			int cores = std::thread::hardware_concurrency ();
+			if (cores < 1)
+				cores = 1;
+			
+			// warm up (page in the allocators, noise tables, etc...)
+			_time_generation (wr, (count < 64) ? count : 64, 1);
+			
+			std::cout << "generator \"" << gen_name << "\", " << count << " chunks:" << std::endl;
+			std::cout << std::fixed << std::setprecision (1);
+			for (int threads : { 1, cores })
+				{
+					double secs = _time_generation (wr, count, threads);
+					double rate = count / secs;
+					std::cout << "  " << std::setw (3) << threads << " thread(s): "
+						<< std::setw (10) << rate << " chunks/s, "
+						<< std::setw (10) << (rate / threads) << " chunks/s/core" << std::endl;
+					if (cores == 1)
+						break;
+				}
+			
+			return 0;
+		}
+		
+		
+		
+		/* 
+		 * Loads up to @{count} of the chunks saved in the world named
+		 * @{world_name} (in the "worlds" directory), and stores them in @{out}
+		 * in the form they are passed to chunk codecs.
+		 */
+		static void
+		_load_samples (const char *world_name, int count,
+			std::vector<std::vector<unsigned char>>& out)
+		{
+			std::string prov_name = world_provider::determine ("worlds", world_name);
+			if (prov_name.empty ())
+				throw std::runtime_error ("world does not exist");
+			
+			world_provider *prov = world_provider::create (prov_name.c_str (),
+				"worlds", world_name);
+			if (!prov)
+				throw std::runtime_error ("invalid provider: " + prov_name);
+			
+			const world_information& winf = prov->info ();
+			world_generator *gen = world_generator::create (winf.generator.c_str (), winf.seed);
+			if (!gen)
+				{
+					delete prov;
+					throw std::runtime_error ("invalid generator: " + winf.generator);
+				}
+			world wr (world_name, gen, prov);
+			
+			std::vector<chunk_pos> positions;
+			prov->list_chunks (positions);
+			
+			prov->open (wr);
+			for (chunk_pos cpos : positions)
+				{
+					if ((int)out.size () == count)
+						break;
+					
+					std::unique_ptr<chunk> ch { new chunk () };
+					if (!prov->load (wr, ch.get (), cpos.x, cpos.z))
+						continue;
+					
+					unsigned int size;
+					unsigned char *data = hw_provider::serialize (ch.get (), &size);
+					out.emplace_back (data, data + size);
+					delete[] data;
+				}
+			prov->close ();
+		}
+		
+		static int
+		_bench_codecs (int argc, char *argv[])
+		{
+			const char *world_name = (argc > 0) ? argv[0] : "main";
+			int count = (argc > 1) ? std::atoi (argv[1]) : 64;
+			if (count <= 0)
+				{
+					std::cerr << "invalid chunk count" << std::endl;
+					return 1;
+				}
+			
+			std::vector<std::vector<unsigned char>> samples;
+			try
+				{
+					_load_samples (world_name, count, samples);
+				}
+			catch (const std::exception& ex)
+				{
+					std::cerr << "failed to load world \"" << world_name << "\": "
+						<< ex.what () << std::endl;
+					return 1;
+				}
+			if (samples.empty ())
+				{
+					std::cerr << "world \"" << world_name << "\" has no chunks" << std::endl;
+					return 1;
+				}
+			
+			unsigned long long total = 0;
+			for (auto& sample : samples)
+				total += sample.size ();
+			
+			std::cout << "codecs, " << samples.size () << " chunks from \"" << world_name
+				<< "\" (" << (total / 1024) << "KB):" << std::endl;
+			std::cout << std::fixed << std::setprecision (1);
+			
+			static const char *specs[] = { "blob", "raw", "lz", "zlib:1", "zlib:3",
+				"zlib:6", "zlib:9" };
+			std::vector<unsigned char> out (524288);
+			for (const char *spec : specs)
+				{
+					std::unique_ptr<chunk_codec> codec { chunk_codec::create (spec) };
+					std::vector<std::pair<unsigned char *, unsigned int>> encoded;
+					unsigned long long encoded_total = 0;
+					
+					auto t0 = std::chrono::steady_clock::now ();
+					for (auto& sample : samples)
+						{
+							unsigned int size;
+							unsigned char *data = codec->encode (sample.data (), sample.size (),
+								&size);
+							encoded.emplace_back (data, size);
+							encoded_total += size;
+						}
+					
+					auto t1 = std::chrono::steady_clock::now ();
+					for (auto& enc : encoded)
+						codec->decode (enc.first, enc.second, out.data (), out.size ());
+					auto t2 = std::chrono::steady_clock::now ();
+					
+					for (auto& enc : encoded)
+						delete[] enc.first;
+					
+					double enc_secs = std::chrono::duration<double> (t1 - t0).count ();
+					double dec_secs = std::chrono::duration<double> (t2 - t1).count ();
+					double mb = total / 1048576.0;
+					std::cout << "  " << std::setw (7) << spec << ": "
+						<< std::setw (6) << (100.0 * encoded_total / total) << "% size, "
+						<< std::setw (8) << (enc_secs > 0 ? mb / enc_secs : 0.0) << " MB/s encode, "
+						<< std::setw (8) << (dec_secs > 0 ? mb / dec_secs : 0.0) << " MB/s decode"
+						<< std::endl;
+				}
+			
+			return 0;
+		}
+		
+		
+		
+		/* 
+		 * Runs the benchmark specified by the given command-line arguments
+		 * (those that follow "--benchmark"), and prints its results to the
+		 * standard output. Returns the process' exit code.
+		 */
+		int
+		run (int argc, char *argv[])
+		{
+			if (argc < 1)
+				{
+					std::cerr << "usage: hCraft --benchmark <generator/codecs> [args...]" << std::endl;
+					return 1;
+				}
+			
+			if (std::strcmp (argv[0], "generator") == 0)
+				return _bench_generator (argc - 1, argv + 1);
+			else if (std::strcmp (argv[0], "codecs") == 0)
+				return _bench_codecs (argc - 1, argv + 1);
+			
+			std::cerr << "unknown benchmark: " << argv[0] << std::endl;
+			return 1;
+		}
+	}
+}
+
@@ -17,28 +17,207 @@
  */
 
 #include "chunk.hpp"
+#include "slab.hpp"
 #include <cstring>
+#include <stdexcept>
+#include <zlib.h>
 
 #include <iostream> // DEBUG
 
 
 namespace hCraft {
 	
+	namespace {
+		
+		/* 
+		 * Block, nibble and index arrays all come in one of four sizes (512, 1024,
+		 * 2048 or 4096 bytes), each of which gets its own slab allocator.
+		 */
+		slab_allocator&
+		array_allocator (unsigned int size)
+		{
+			static slab_allocator *allocs[4] = {
+				new slab_allocator ("array-512", 512),
+				new slab_allocator ("array-1024", 1024),
+				new slab_allocator ("array-2048", 2048),
+				new slab_allocator ("array-4096", 4096),
+			};
+			
+			switch (size)
+				{
+					case 512: return *allocs[0];
+					case 1024: return *allocs[1];
+					case 2048: return *allocs[2];
+					default: return *allocs[3];
+				}
+		}
+		
+		inline unsigned char*
+		alloc_array (unsigned int size)
+			{ return static_cast<unsigned char *> (array_allocator (size).alloc ()); }
+		
+		inline void
+		free_array (void *ptr, unsigned int size)
+		{
+			if (ptr)
+				array_allocator (size).free (ptr);
+		}
+		
+		slab_allocator&
+		subchunk_allocator ()
+		{
+			static slab_allocator *alloc = new slab_allocator ("subchunk",
+				sizeof (subchunk));
+			return *alloc;
+		}
+		
+		slab_allocator&
+		chunk_allocator ()
+		{
+			static slab_allocator *alloc = new slab_allocator ("chunk",
+				sizeof (chunk));
+			return *alloc;
+		}
+	}
+	
+	
+	
+	nibble_array::nibble_array (unsigned char fill)
+	{
+		this->data = nullptr;
+		this->fill = fill;
+	}
+	
+	nibble_array::nibble_array (const nibble_array& other)
+	{
+		this->fill = other.fill;
+		this->data = nullptr;
+		if (other.data)
+			{
+				this->data = alloc_array (2048);
+				std::memcpy (this->data, other.data, 2048);
+			}
+	}
+	
+	nibble_array::~nibble_array ()
+	{
+		free_array (this->data, 2048);
+	}
+	
+	
+	
+	/* 
+	 * Allocates the backing array and fills it with the uniform value.
+	 */
+	void
+	nibble_array::expand ()
+	{
+		if (this->data)
+			return;
+		
+		this->data = alloc_array (2048);
+		std::memset (this->data, this->fill | (this->fill << 4), 2048);
+	}
+	
+	/* 
+	 * Copies the array out in its packed form (2048 bytes) to @{out}.
+	 */
+	void
+	nibble_array::export_to (unsigned char *out) const
+	{
+		if (this->data)
+			std::memcpy (out, this->data, 2048);
+		else
+			std::memset (out, this->fill | (this->fill << 4), 2048);
+	}
+	
+	/* 
+	 * Replaces the array's contents with the 2048 packed bytes in @{in}.
+	 * Storage is only allocated if the input isn't uniform.
+	 */
+	void
+	nibble_array::import (const unsigned char *in)
+	{
+		unsigned char first = in[0];
+		bool uniform = ((first >> 4) == (first & 0xF));
+		for (int i = 1; uniform && i < 2048; ++i)
+			if (in[i] != first)
+				uniform = false;
+		
+		if (uniform)
+			{
+				free_array (this->data, 2048);
+				this->data = nullptr;
+				this->fill = first & 0xF;
+				return;
+			}
+		
+		if (!this->data)
+			this->data = alloc_array (2048);
+		std::memcpy (this->data, in, 2048);
+	}
+	
+	
+	
+//----
+	
 	/* 
 	 * Constructs a new empty subchunk, with all blocks set to air.
 	 */
-	subchunk::subchunk (bool init)
+	subchunk::subchunk ()
+		: refs (1), meta (0), blight (0), slight (0xF)
 	{
-		if (init)
+		this->storage = SS_PALETTE;
+		this->bits = 0;
+		this->palette = this->small_palette;
+		this->palette[0] = BT_AIR;
+		this->palette_size = 1;
+		this->indices = nullptr;
+		
+		this->ids = nullptr;
+		this->add = nullptr;
+		
+		this->add_count = 0;
+		this->air_count = 4096;
+	}
+	
+	/* 
+	 * Constructs an unshared copy of @{other}.
+	 */
+	subchunk::subchunk (const subchunk& other)
+		: refs (1), meta (other.meta), blight (other.blight), slight (other.slight)
+	{
+		this->storage = other.storage;
+		this->bits = other.bits;
+		this->palette_size = other.palette_size;
+		this->add_count = other.add_count;
+		this->air_count = other.air_count;
+		
+		this->palette = this->small_palette;
+		if (other.palette != other.small_palette)
+			this->palette = reinterpret_cast<unsigned short *> (alloc_array (512));
+		std::memcpy (this->palette, other.palette,
+			this->palette_size * sizeof (unsigned short));
+		
+		this->indices = nullptr;
+		if (other.indices)
 			{
-				std::memset (this->ids, 0x00, 4096);
-				std::memset (this->meta, 0x00, 2048);
-				std::memset (this->blight, 0x00, 2048);
-				std::memset (this->slight, 0xFF, 2048);
-				this->add = nullptr;
+				this->indices = alloc_array (512 * this->bits);
+				std::memcpy (this->indices, other.indices, 512 * this->bits);
+			}
 		
-				this->add_count = 0;
-				this->air_count = 4096;
+		this->ids = nullptr;
+		if (other.ids)
+			{
+				this->ids = alloc_array (4096);
+				std::memcpy (this->ids, other.ids, 4096);
+			}
+		
+		this->add = nullptr;
+		if (other.add)
+			{
+				this->add = alloc_array (2048);
+				std::memcpy (this->add, other.add, 2048);
 			}
 	}
 	
@@ -47,189 +226,440 @@ namespace hCraft {
 	 */
 	subchunk::~subchunk ()
 	{
-		if (this->add)
-			delete[] this->add;
+		if (this->palette != this->small_palette)
+			free_array (this->palette, 512);
+		free_array (this->indices, 512 * this->bits);
+		free_array (this->ids, 4096);
+		free_array (this->add, 2048);
+	}
+	
+	
+	
+	/* 
+	 * Drops a reference to the subchunk, destroying it if it was the last.
+	 */
+	void
+	subchunk::release ()
+	{
+		if (this->refs.fetch_sub (1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+	
+	
+	
+	void*
+	subchunk::operator new (std::size_t size)
+	{
+		return subchunk_allocator ().alloc ();
+	}
+	
+	void
+	subchunk::operator delete (void *ptr)
+	{
+		subchunk_allocator ().free (ptr);
 	}
 	
 	
 	
 //----
 	
+	/* 
+	 * Returns the position of @{id} within the subchunk's palette, or -1 if it
+	 * is not present.
+	 */
+	int
+	subchunk::palette_find (unsigned short id)
+	{
+		for (int i = 0; i < this->palette_size; ++i)
+			if (this->palette[i] == id)
+				return i;
+		return -1;
+	}
+	
+	/* 
+	 * Re-encodes the index array using @{new_bits} bits per block.
+	 */
 	void
-	subchunk::set_id (int x, int y, int z, unsigned short id)
+	subchunk::repack (int new_bits)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		unsigned short lo = id & 0xFF; // the lower 8 bits of the ID.
-		unsigned short hi = id >> 8;   // the upper 4 bits of the ID (the "add").
-		unsigned short prev_lo = this->ids[index];
-		unsigned short prev_hi =
-			(this->add_count > 0)
-				? ((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-				: 0;
-		unsigned short prev_id = (prev_hi << 8) | prev_lo;
-		
-		this->ids[index] = lo;
-		if (hi != 0)
+		unsigned char *new_indices = nullptr;
+		if (new_bits > 0)
 			{
-				if (this->add_count == 0)
+				new_indices = alloc_array (512 * new_bits);
+				std::memset (new_indices, 0, 512 * new_bits);
+				
+				if (this->bits > 0)
 					{
-						this->add = new unsigned char[2048];
-						std::memset (this->add, 0x00, 2048);
+						unsigned int old_mask = (1 << this->bits) - 1;
+						for (unsigned int i = 0; i < 4096; ++i)
+							{
+								unsigned int obit = i * this->bits;
+								unsigned int nbit = i * new_bits;
+								unsigned int val = (this->indices[obit >> 3] >> (obit & 7)) & old_mask;
+								new_indices[nbit >> 3] |= val << (nbit & 7);
+							}
 					}
-				
-				if (index & 1)
-					{ this->add[half] &= 0x0F; this->add[half] |= (hi << 4); }
-				else
-					{ this->add[half] &= 0xF0; this->add[half] |= hi; }
 			}
 		
-		if (prev_id && !id)
-			++ this->air_count;
-		else if (!prev_id && id)
-			-- this->air_count;
+		free_array (this->indices, 512 * this->bits);
+		this->indices = new_indices;
+		this->bits = new_bits;
 		
-		if (prev_hi && !hi)
-			-- this->add_count;
-		else if (!prev_hi && hi)
-			++ this->add_count;
+		// make sure the palette can hold as many entries as the indices can
+		// address.
+		if (new_bits > 4 && this->palette == this->small_palette)
+			{
+				this->palette = reinterpret_cast<unsigned short *> (alloc_array (512));
+				std::memcpy (this->palette, this->small_palette,
+					this->palette_size * sizeof (unsigned short));
+			}
 	}
 	
-	unsigned short
-	subchunk::get_id (int x, int y, int z)
+	/* 
+	 * Drops palette entries that are no longer referenced by any block, and
+	 * shrinks the index array accordingly.
+	 */
+	void
+	subchunk::repalette ()
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
+		if (this->bits == 0)
+			return;
 		
-		unsigned short id = this->ids[index];
-		if (this->add_count > 0)
+		bool used[256] = { false };
+		unsigned int mask = (1 << this->bits) - 1;
+		for (unsigned int i = 0; i < 4096; ++i)
+			{
+				unsigned int bit = i * this->bits;
+				used[(this->indices[bit >> 3] >> (bit & 7)) & mask] = true;
+			}
+		
+		unsigned char remap[256];
+		int count = 0;
+		for (int i = 0; i < this->palette_size; ++i)
+			if (used[i])
+				{
+					remap[i] = count;
+					this->palette[count++] = this->palette[i];
+				}
+		if (count == this->palette_size)
+			return;
+		
+		int new_bits = 0;
+		while ((1 << new_bits) < count)
+			new_bits = new_bits ? (new_bits << 1) : 1;
+		
+		unsigned char *new_indices = nullptr;
+		if (new_bits > 0)
 			{
-				unsigned int half = index >> 1;
-				id |=
-					((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-					<< 8;
+				new_indices = alloc_array (512 * new_bits);
+				std::memset (new_indices, 0, 512 * new_bits);
+				for (unsigned int i = 0; i < 4096; ++i)
+					{
+						unsigned int obit = i * this->bits;
+						unsigned int nbit = i * new_bits;
+						unsigned int val = remap[(this->indices[obit >> 3] >> (obit & 7)) & mask];
+						new_indices[nbit >> 3] |= val << (nbit & 7);
+					}
 			}
 		
-		return id;
+		free_array (this->indices, 512 * this->bits);
+		this->indices = new_indices;
+		this->bits = new_bits;
+		this->palette_size = count;
 	}
 	
-	
-	void
-	subchunk::set_meta (int x, int y, int z, unsigned char val)
+	/* 
+	 * Inserts @{id} into the palette, widening the index array if necessary.
+	 * Returns the entry's position, or -1 if the palette could not hold any
+	 * more entries, and the subchunk has been converted to the dense layout.
+	 */
+	int
+	subchunk::palette_insert (unsigned short id)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		if (this->palette_size == (1 << this->bits))
+			{
+				// the palette is full, try to get rid of stale entries first.
+				this->repalette ();
+				if (this->palette_size == (1 << this->bits))
+					{
+						if (this->bits == 8)
+							{
+								this->make_dense ();
+								return -1;
+							}
+						
+						this->repack (this->bits ? (this->bits << 1) : 1);
+					}
+			}
 		
-		if (index & 1)
-			{ this->meta[half] &= 0x0F; this->meta[half] |= (val << 4); }
-		else
-			{ this->meta[half] &= 0xF0; this->meta[half] |= val; }
+		this->palette[this->palette_size] = id;
+		return this->palette_size++;
 	}
 	
-	unsigned char
-	subchunk::get_meta (int x, int y, int z)
+	/* 
+	 * Switches the subchunk over to the dense layout.
+	 */
+	void
+	subchunk::make_dense ()
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		if (this->storage == SS_DENSE)
+			return;
 		
-		return (index & 1)
-			? (this->meta[half] >> 4)
-			: (this->meta[half] & 0xF);
+		unsigned char *ids = alloc_array (4096);
+		unsigned char *add = nullptr;
+		if (this->add_count > 0)
+			{
+				add = alloc_array (2048);
+				std::memset (add, 0, 2048);
+			}
+		
+		for (unsigned int i = 0; i < 4096; ++i)
+			{
+				unsigned short id = this->get_id_at (i);
+				ids[i] = id & 0xFF;
+				if (add && (id >> 8))
+					add[i >> 1] |= (id >> 8) << ((i & 1) << 2);
+			}
+		
+		if (this->palette != this->small_palette)
+			free_array (this->palette, 512);
+		free_array (this->indices, 512 * this->bits);
+		this->palette = this->small_palette;
+		this->palette_size = 0;
+		this->indices = nullptr;
+		this->bits = 0;
+		
+		this->ids = ids;
+		this->add = add;
+		this->storage = SS_DENSE;
 	}
 	
 	
+	
 	void
-	subchunk::set_block_light (int x, int y, int z, unsigned char val)
+	subchunk::set_id_at (unsigned int index, unsigned short id)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		unsigned short prev_id = this->get_id_at (index);
+		if (prev_id == id)
+			return;
 		
-		if (index & 1)
-			{ this->blight[half] &= 0x0F; this->blight[half] |= (val << 4); }
-		else
-			{ this->blight[half] &= 0xF0; this->blight[half] |= val; }
+		if (this->storage == SS_PALETTE)
+			{
+				int pi = this->palette_find (id);
+				if (pi == -1)
+					pi = this->palette_insert (id);
+				
+				if (pi != -1)
+					{
+						unsigned int bit = index * this->bits;
+						unsigned char mask = ((1 << this->bits) - 1) << (bit & 7);
+						this->indices[bit >> 3] = (this->indices[bit >> 3] & ~mask)
+							| ((pi << (bit & 7)) & mask);
+					}
+			}
+		
+		if (this->storage == SS_DENSE)
+			{
+				unsigned short hi = id >> 8; // the upper 4 bits of the ID (the "add").
+				this->ids[index] = id & 0xFF;
+				if (hi && !this->add)
+					{
+						this->add = alloc_array (2048);
+						std::memset (this->add, 0x00, 2048);
+					}
+				
+				if (this->add)
+					{
+						unsigned int half = index >> 1;
+						if (index & 1)
+							{ this->add[half] &= 0x0F; this->add[half] |= (hi << 4); }
+						else
+							{ this->add[half] &= 0xF0; this->add[half] |= hi; }
+					}
+			}
+		
+		if (prev_id && !id)
+			++ this->air_count;
+		else if (!prev_id && id)
+			-- this->air_count;
+		
+		if ((prev_id >> 8) && !(id >> 8))
+			-- this->add_count;
+		else if (!(prev_id >> 8) && (id >> 8))
+			++ this->add_count;
 	}
 	
-	unsigned char
-	subchunk::get_block_light (int x, int y, int z)
+	void
+	subchunk::set_id (int x, int y, int z, unsigned short id)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
-		
-		return (index & 1)
-			? (this->blight[half] >> 4)
-			: (this->blight[half] & 0xF);
+		this->set_id_at ((y << 8) | (z << 4) | x, id);
 	}
 	
+	void
+	subchunk::set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta)
+	{
+		unsigned int index = (y << 8) | (z << 4) | x;
+		this->meta.set (index, meta);
+		this->set_id_at (index, id);
+	}
+	
+	
+	
+//----
 	
 	void
-	subchunk::set_sky_light (int x, int y, int z, unsigned char val)
+	subchunk::export_ids (unsigned char *out)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		if (this->storage == SS_DENSE)
+			{
+				std::memcpy (out, this->ids, 4096);
+				return;
+			}
 		
-		if (index & 1)
-			{ this->slight[half] &= 0x0F; this->slight[half] |= (val << 4); }
-		else
-			{ this->slight[half] &= 0xF0; this->slight[half] |= val; }
+		if (this->bits == 0)
+			{
+				std::memset (out, this->palette[0] & 0xFF, 4096);
+				return;
+			}
+		
+		unsigned int mask = (1 << this->bits) - 1;
+		for (unsigned int i = 0; i < 4096; ++i)
+			{
+				unsigned int bit = i * this->bits;
+				out[i] = this->palette[(this->indices[bit >> 3] >> (bit & 7)) & mask] & 0xFF;
+			}
 	}
 	
-	unsigned char
-	subchunk::get_sky_light (int x, int y, int z)
+	void
+	subchunk::export_add (unsigned char *out)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		if (this->storage == SS_DENSE)
+			{
+				if (this->add)
+					std::memcpy (out, this->add, 2048);
+				else
+					std::memset (out, 0, 2048);
+				return;
+			}
 		
-		return (index & 1)
-			? (this->slight[half] >> 4)
-			: (this->slight[half] & 0xF);
+		for (unsigned int i = 0; i < 4096; i += 2)
+			out[i >> 1] = (this->get_id_at (i) >> 8)
+				| ((this->get_id_at (i + 1) >> 8) << 4);
 	}
 	
-	
+	/* 
+	 * Replaces the contents of the subchunk with the given dense arrays.
+	 * @{add} may be null. The most compact storage that can hold the data is
+	 * chosen automatically.
+	 */
 	void
-	subchunk::set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta)
+	subchunk::import (const unsigned char *ids, const unsigned char *add,
+		const unsigned char *meta, const unsigned char *blight,
+		const unsigned char *slight)
 	{
-		unsigned int index = (y << 8) | (z << 4) | x; 
-		unsigned int half = index >> 1;
+		this->meta.import (meta);
+		this->blight.import (blight);
+		this->slight.import (slight);
 		
-		if (index & 1)
-			{ this->meta[half] &= 0x0F; this->meta[half] |= (meta << 4); }
-		else
-			{ this->meta[half] &= 0xF0; this->meta[half] |= meta; }
-		
-		unsigned short lo = id & 0xFF; // the lower 8 bits of the ID.
-		unsigned short hi = id >> 8;   // the upper 4 bits of the ID (the "add").
-		unsigned short prev_lo = this->ids[index];
-		unsigned short prev_hi =
-			(this->add_count > 0)
-				? ((index & 1) ? (this->add[half] >> 4) : (this->add[half] & 0xF))
-				: 0;
-		unsigned short prev_id = (prev_hi << 8) | prev_lo;
-
-		this->ids[index] = lo;
-		if (hi != 0)
+		// release current block storage.
+		if (this->palette != this->small_palette)
+			free_array (this->palette, 512);
+		free_array (this->indices, 512 * this->bits);
+		free_array (this->ids, 4096);
+		free_array (this->add, 2048);
+		this->palette = this->small_palette;
+		this->indices = nullptr;
+		this->ids = nullptr;
+		this->add = nullptr;
+		
+		// build the palette, and count air/add blocks while we're at it.
+		short lookup[4096];
+		unsigned short palette[256];
+		int palette_size = 0;
+		std::memset (lookup, 0xFF, sizeof lookup);
+		
+		this->air_count = 0;
+		this->add_count = 0;
+		for (unsigned int i = 0; i < 4096; ++i)
 			{
-				if (this->add_count == 0)
+				unsigned short id = ids[i];
+				if (add)
+					id |= ((i & 1) ? (add[i >> 1] >> 4) : (add[i >> 1] & 0xF)) << 8;
+				
+				if (id == 0)
+					++ this->air_count;
+				if (id >> 8)
+					++ this->add_count;
+				
+				if (lookup[id] == -1 && palette_size <= 256)
 					{
-						this->add = new unsigned char[2048];
-						std::memset (this->add, 0x00, 2048);
+						if (palette_size < 256)
+							palette[palette_size] = id;
+						lookup[id] = palette_size++;
 					}
+			}
 		
-				if (index & 1)
-					{ this->add[half] &= 0x0F; this->add[half] |= (hi << 4); }
-				else
-					{ this->add[half] &= 0xF0; this->add[half] |= hi; }
+		if (palette_size > 256)
+			{
+				// too many distinct IDs, go dense.
+				this->storage = SS_DENSE;
+				this->palette_size = 0;
+				this->bits = 0;
+				this->ids = alloc_array (4096);
+				std::memcpy (this->ids, ids, 4096);
+				if (this->add_count > 0)
+					{
+						this->add = alloc_array (2048);
+						std::memcpy (this->add, add, 2048);
+					}
+				return;
+			}
+		
+		int bits = 0;
+		while ((1 << bits) < palette_size)
+			bits = bits ? (bits << 1) : 1;
+		
+		this->storage = SS_PALETTE;
+		this->bits = bits;
+		if (bits > 4)
+			this->palette = reinterpret_cast<unsigned short *> (alloc_array (512));
+		std::memcpy (this->palette, palette, palette_size * sizeof (unsigned short));
+		this->palette_size = palette_size;
+		
+		if (bits > 0)
+			{
+				this->indices = alloc_array (512 * bits);
+				std::memset (this->indices, 0, 512 * bits);
+				for (unsigned int i = 0; i < 4096; ++i)
+					{
+						unsigned short id = ids[i];
+						if (add)
+							id |= ((i & 1) ? (add[i >> 1] >> 4) : (add[i >> 1] & 0xF)) << 8;
+						
+						unsigned int bit = i * bits;
+						this->indices[bit >> 3] |= lookup[id] << (bit & 7);
+					}
 			}
-
-		if (prev_id && !id)
-			++ this->air_count;
-		else if (!prev_id && id)
-			-- this->air_count;
-
-		if (prev_hi && !hi)
-			-- this->add_count;
-		else if (!prev_hi && hi)
-			++ this->add_count;
+	}
+	
+	
+	
+	/* 
+	 * Returns the amount of memory (in bytes) used by the subchunk.
+	 */
+	unsigned int
+	subchunk::memory_usage ()
+	{
+		unsigned int total = sizeof (subchunk);
+		if (this->palette != this->small_palette)
+			total += 256 * sizeof (unsigned short);
+		if (this->indices) total += 512 * this->bits;
+		if (this->ids) total += 4096;
+		if (this->add) total += 2048;
+		if (this->meta.data) total += 2048;
+		if (this->blight.data) total += 2048;
+		if (this->slight.data) total += 2048;
+		return total;
 	}
 	
 	
@@ -249,6 +679,10 @@ namespace hCraft {
 		std::memset (this->heightmap, 0, 256 * sizeof (short));
 		std::memset (this->biomes, BI_PLAINS, 256);
 		this->modified = true;
+		this->save_queued = false;
+		this->stage = CS_EMPTY;
+		this->version = 0;
+		this->pins = 0;
 	}
 	
 	/* 
@@ -259,31 +693,124 @@ namespace hCraft {
 		for (int i = 0; i < 16; ++i)
 			{
 				if (this->subs[i])
-					delete this->subs[i];
+					this->subs[i]->release ();
 			}
 	}
 	
 	
 	
+	void*
+	chunk::operator new (std::size_t size)
+	{
+		return chunk_allocator ().alloc ();
+	}
+	
+	void
+	chunk::operator delete (void *ptr)
+	{
+		chunk_allocator ().free (ptr);
+	}
+	
+	
+	
 	/* 
 	 * Creates (if does not already exist) and returns the sub-chunk located at
 	 * the given vertical position.
 	 */
 	subchunk*
-	chunk::create_sub (int index, bool init)
+	chunk::create_sub (int index)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		subchunk *sub = this->unshare_sub (index);
+		if (!sub)
+			sub = this->subs[index] = new subchunk ();
+		
+		this->touch ();
+		return sub;
+	}
+	
+	/* 
+	 * Replaces the contents of the sub-chunk at the given vertical position
+	 * with the given dense arrays, creating it if needed.
+	 */
+	void
+	chunk::import_sub (int index, const unsigned char *ids,
+		const unsigned char *add, const unsigned char *meta,
+		const unsigned char *blight, const unsigned char *slight)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		subchunk *sub = this->unshare_sub (index);
+		if (!sub)
+			sub = this->subs[index] = new subchunk ();
+		
+		sub->import (ids, add, meta, blight, slight);
+		this->touch ();
+	}
+	
+	/* 
+	 * Returns the subchunk at the given vertical position, copying it first
+	 * if it is shared with other chunks.
+	 */
+	subchunk*
+	chunk::unshare_sub (int index)
 	{
-		subchunk *sub = this->get_sub (index);
-		if (sub) return sub;
+		subchunk *sub = this->subs[index];
+		if (sub && sub->shared ())
+			{
+				subchunk *copy = new subchunk (*sub);
+				sub->release ();
+				sub = this->subs[index] = copy;
+			}
+		
+		return sub;
+	}
+	
+	/* 
+	 * Turns this chunk into an identical copy of @{other}. Subchunks are
+	 * shared between the two rather than copied.
+	 */
+	void
+	chunk::copy_from (chunk& other)
+	{
+		std::unique_lock<std::mutex> this_guard {this->data_lock, std::defer_lock};
+		std::unique_lock<std::mutex> other_guard {other.data_lock, std::defer_lock};
+		std::lock (this_guard, other_guard);
+		
+		for (int i = 0; i < 16; ++i)
+			{
+				subchunk *sub = other.subs[i];
+				if (sub)
+					sub->retain ();
+				if (this->subs[i])
+					this->subs[i]->release ();
+				this->subs[i] = sub;
+			}
+		
+		std::memcpy (this->biomes, other.biomes, 256);
+		std::memcpy (this->heightmap, other.heightmap, 256 * sizeof (short));
+		this->modified = true;
 		
-		return (this->subs[index] = new subchunk (init));
+		// the copy starts off at the same version, and so can use the original's
+		// blob for as long as it is not changed.
+		{
+			std::lock_guard<std::mutex> guard {other.blob_lock};
+			this->version.store (other.version.load ());
+			std::lock_guard<std::mutex> blob_guard {this->blob_lock};
+			this->blob = other.blob;
+		}
 	}
 	
 	
 	
 //----
 	
+	/* 
+	 * Block interaction, without taking the data lock (which the caller
+	 * must hold).
+	 */
+	
 	void
-	chunk::set_id (int x, int y, int z, unsigned short id)
+	chunk::set_id_nolock (int x, int y, int z, unsigned short id)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -294,14 +821,20 @@ namespace hCraft {
 				else
 					sub = this->subs[sy] = new subchunk ();
 			}
+		else if (sub->shared ())
+			{
+				// shared subchunks are only copied if the write changes something.
+				if (sub->get_id (x, y & 0xF, z) == id)
+					return;
+				sub = this->unshare_sub (sy);
+			}
 		
-		//if (sub->get_id (x, y & 0xF, z) != id)
-			this->modified = true;
 		sub->set_id (x, y & 0xF, z, id);
+		this->touch ();
 	}
 	
 	unsigned short
-	chunk::get_id (int x, int y, int z)
+	chunk::get_id_nolock (int x, int y, int z)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -313,7 +846,7 @@ namespace hCraft {
 	
 	
 	void
-	chunk::set_meta (int x, int y, int z, unsigned char val)
+	chunk::set_meta_nolock (int x, int y, int z, unsigned char val)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -324,14 +857,19 @@ namespace hCraft {
 				else
 					sub = this->subs[sy] = new subchunk ();
 			}
+		else if (sub->shared ())
+			{
+				if (sub->get_meta (x, y & 0xF, z) == val)
+					return;
+				sub = this->unshare_sub (sy);
+			}
 		
-		//if (sub->get_meta (x, y & 0xF, z) != val)
-			this->modified = true;
 		sub->set_meta (x, y & 0xF, z, val);
+		this->touch ();
 	}
 	
 	unsigned char
-	chunk::get_meta (int x, int y, int z)
+	chunk::get_meta_nolock (int x, int y, int z)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -343,7 +881,7 @@ namespace hCraft {
 	
 	
 	void
-	chunk::set_block_light (int x, int y, int z, unsigned char val)
+	chunk::set_block_light_nolock (int x, int y, int z, unsigned char val)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -354,14 +892,19 @@ namespace hCraft {
 				else
 					sub = this->subs[sy] = new subchunk ();
 			}
+		else if (sub->shared ())
+			{
+				if (sub->get_block_light (x, y & 0xF, z) == val)
+					return;
+				sub = this->unshare_sub (sy);
+			}
 		
-		//if (sub->get_block_light (x, y & 0xF, z) != val)
-			this->modified = true;
 		sub->set_block_light (x, y & 0xF, z, val);
+		this->touch ();
 	}
 	
 	unsigned char
-	chunk::get_block_light (int x, int y, int z)
+	chunk::get_block_light_nolock (int x, int y, int z)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -373,7 +916,7 @@ namespace hCraft {
 	
 	
 	void
-	chunk::set_sky_light (int x, int y, int z, unsigned char val)
+	chunk::set_sky_light_nolock (int x, int y, int z, unsigned char val)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -384,14 +927,19 @@ namespace hCraft {
 				else
 					sub = this->subs[sy] = new subchunk ();
 			}
+		else if (sub->shared ())
+			{
+				if (sub->get_sky_light (x, y & 0xF, z) == val)
+					return;
+				sub = this->unshare_sub (sy);
+			}
 		
-		//if (sub->get_sky_light (x, y & 0xF, z) != val)
-			this->modified = true;
 		sub->set_sky_light (x, y & 0xF, z, val);
+		this->touch ();
 	}
 	
 	unsigned char
-	chunk::get_sky_light (int x, int y, int z)
+	chunk::get_sky_light_nolock (int x, int y, int z)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -403,7 +951,7 @@ namespace hCraft {
 	
 	
 	void
-	chunk::set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta)
+	chunk::set_id_and_meta_nolock (int x, int y, int z, unsigned short id, unsigned char meta)
 	{
 		int sy = y >> 4;
 		subchunk *sub = this->subs[sy];
@@ -414,9 +962,209 @@ namespace hCraft {
 				else
 					sub = this->subs[sy] = new subchunk ();
 			}
+		else if (sub->shared ())
+			{
+				if (sub->get_id (x, y & 0xF, z) == id
+					&& sub->get_meta (x, y & 0xF, z) == meta)
+					return;
+				sub = this->unshare_sub (sy);
+			}
 		
-		this->modified = true;
 		sub->set_id_and_meta (x, y & 0xF, z, id, meta);
+		this->touch ();
+	}
+	
+	
+	
+	/* 
+	 * Block interaction:
+	 */
+	
+	void
+	chunk::set_id (int x, int y, int z, unsigned short id)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		this->set_id_nolock (x, y, z, id);
+	}
+	
+	unsigned short
+	chunk::get_id (int x, int y, int z)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		return this->get_id_nolock (x, y, z);
+	}
+	
+	
+	void
+	chunk::set_meta (int x, int y, int z, unsigned char val)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		this->set_meta_nolock (x, y, z, val);
+	}
+	
+	unsigned char
+	chunk::get_meta (int x, int y, int z)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		return this->get_meta_nolock (x, y, z);
+	}
+	
+	
+	void
+	chunk::set_block_light (int x, int y, int z, unsigned char val)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		this->set_block_light_nolock (x, y, z, val);
+	}
+	
+	unsigned char
+	chunk::get_block_light (int x, int y, int z)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		return this->get_block_light_nolock (x, y, z);
+	}
+	
+	
+	void
+	chunk::set_sky_light (int x, int y, int z, unsigned char val)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		this->set_sky_light_nolock (x, y, z, val);
+	}
+	
+	unsigned char
+	chunk::get_sky_light (int x, int y, int z)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		return this->get_sky_light_nolock (x, y, z);
+	}
+	
+	
+	void
+	chunk::set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		this->set_id_and_meta_nolock (x, y, z, id, meta);
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Exports the chunk's contents, uncompressed and laid out the same way
+	 * as in chunk_blob, into a buffer allocated with new[], preceded by
+	 * @{reserve} unused bytes. The total size of the buffer is stored in
+	 * @{out_size}.
+	 */
+	unsigned char*
+	chunk::serialize (unsigned short *primary_bitmap, unsigned short *add_bitmap,
+		unsigned int *out_size, unsigned int reserve)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		unsigned int data_size = reserve + 256; // biome array
+		int i;
+		
+		// create bitmaps and calculate the size of the array.
+		*primary_bitmap = *add_bitmap = 0;
+		for (i = 0; i < 16; ++i)
+			{
+				subchunk *sub = this->subs[i];
+				if (sub && !sub->all_air ())
+					{
+						*primary_bitmap |= (1 << i);
+						data_size += 10240;
+						
+						if (sub->has_add ())
+							{ *add_bitmap |= (1 << i); data_size += 2048; }
+					}
+			}
+		
+		unsigned char *data = new unsigned char[data_size];
+		unsigned int n = reserve;
+		
+		for (i = 0; i < 16; ++i)
+			if (*primary_bitmap & (1 << i))
+				{ this->subs[i]->export_ids (data + n); n += 4096; }
+		
+		for (i = 0; i < 16; ++i)
+			if (*primary_bitmap & (1 << i))
+				{ this->subs[i]->export_meta (data + n); n += 2048; }
+		
+		for (i = 0; i < 16; ++i)
+			if (*primary_bitmap & (1 << i))
+				{ this->subs[i]->export_block_light (data + n); n += 2048; }
+		
+		for (i = 0; i < 16; ++i)
+			if (*primary_bitmap & (1 << i))
+				{ this->subs[i]->export_sky_light (data + n); n += 2048; }
+		
+		for (i = 0; i < 16; ++i)
+			if (*add_bitmap & (1 << i))
+				{ this->subs[i]->export_add (data + n); n += 2048; }
+		
+		std::memcpy (data + n, this->biomes, 256);
+		n += 256;
+		
+		*out_size = n;
+		return data;
+	}
+	
+	/* 
+	 * Returns the compressed form of the chunk's current contents, creating
+	 * it only if the chunk has changed since the last call. Can be called
+	 * from several threads at once.
+	 */
+	std::shared_ptr<const chunk_blob>
+	chunk::get_blob ()
+	{
+		unsigned int version = this->get_version ();
+		{
+			std::lock_guard<std::mutex> guard {this->blob_lock};
+			if (this->blob && this->blob->version == version)
+				return this->blob;
+		}
+		
+		// if the chunk changes while being compressed, the blob is simply not
+		// used again, since its version will be out of date.
+		std::shared_ptr<chunk_blob> fresh { new chunk_blob () };
+		fresh->version = version;
+		
+		unsigned int data_size;
+		unsigned char *data = this->serialize (&fresh->primary_bitmap,
+			&fresh->add_bitmap, &data_size);
+		
+		unsigned long compressed_size = compressBound (data_size);
+		fresh->data.resize (compressed_size);
+		int err = compress2 (fresh->data.data (), &compressed_size, data,
+			data_size, Z_DEFAULT_COMPRESSION);
+		delete[] data;
+		if (err != Z_OK)
+			throw std::runtime_error ("failed to compress chunk");
+		fresh->data.resize (compressed_size);
+		
+		std::lock_guard<std::mutex> guard {this->blob_lock};
+		if (!this->blob || this->blob->version != this->get_version ())
+			this->blob = fresh;
+		return fresh;
+	}
+	
+	/* 
+	 * Attaches an already compressed blob to the chunk, to be used until the
+	 * chunk next changes.
+	 */
+	void
+	chunk::set_blob (unsigned short primary_bitmap, unsigned short add_bitmap,
+		const unsigned char *data, unsigned int len)
+	{
+		std::shared_ptr<chunk_blob> fresh { new chunk_blob () };
+		fresh->version = this->get_version ();
+		fresh->primary_bitmap = primary_bitmap;
+		fresh->add_bitmap = add_bitmap;
+		fresh->data.assign (data, data + len);
+		
+		std::lock_guard<std::mutex> guard {this->blob_lock};
+		this->blob = fresh;
 	}
 	
 	
@@ -429,30 +1177,80 @@ namespace hCraft {
 	
 	void
 	chunk::relight (int x, int z, bool stop_at_zero)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		this->relight_nolock (x, z, stop_at_zero);
+	}
+	
+	void
+	chunk::relight (bool stop_at_zero)
+	{
+		// the lock is taken once for the whole chunk, rather than once for each
+		// of the blocks looked at.
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		for (int x = 0; x < 16; ++x)
+			for (int z = 0; z < 16; ++z)
+				{
+					this->relight_nolock (x, z, stop_at_zero);
+				}
+	}
+	
+	void
+	chunk::relight_nolock (int x, int z, bool stop_at_zero)
 	{
 		// the top-most layer is always lit.
-		this->set_sky_light (x, 255, z, 15);
+		this->set_sky_light_nolock (x, 255, z, 15);
 		
 		char curr_opacity = 15;
 		for (int y = 254; y >= 0; --y)
 			{
 				if (curr_opacity > 0)
-					curr_opacity -= block_info::from_id (this->get_id (x, y, z))->opacity;
+					curr_opacity -= block_info::from_id (this->get_id_nolock (x, y, z))->opacity;
 				else if (stop_at_zero)
 					break;
 				
-				this->set_sky_light (x, y, z, (curr_opacity > 0) ? curr_opacity : 0);
+				this->set_sky_light_nolock (x, y, z, (curr_opacity > 0) ? curr_opacity : 0);
 			}
 	}
 	
+	
 	void
-	chunk::relight (bool stop_at_zero)
+	chunk::export_light_info (unsigned char *opacity, unsigned char *luminance)
 	{
-		for (int x = 0; x < 16; ++x)
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		for (int sy = 0; sy < 16; ++sy)
+			{
+				subchunk *sub = this->subs[sy];
+				if (!sub)
+					{
+						// missing subchunks are all air.
+						std::memset (opacity + (sy << 12), 0, 4096);
+						std::memset (luminance + (sy << 12), 0, 4096);
+						continue;
+					}
+				
+				for (int i = 0; i < 4096; ++i)
+					{
+						block_info *inf = block_info::from_id (
+							sub->get_id (i & 0xF, i >> 8, (i >> 4) & 0xF));
+						opacity[(sy << 12) | i] = inf ? inf->opacity : 15;
+						luminance[(sy << 12) | i] = inf ? inf->luminance : 0;
+					}
+			}
+	}
+	
+	void
+	chunk::import_light (const unsigned char *blight, const unsigned char *slight)
+	{
+		std::lock_guard<std::mutex> guard {this->data_lock};
+		for (int y = 0; y < 256; ++y)
 			for (int z = 0; z < 16; ++z)
-				{
-					this->relight (x, z, stop_at_zero);
-				}
+				for (int x = 0; x < 16; ++x)
+					{
+						int i = (y << 8) | (z << 4) | x;
+						this->set_block_light_nolock (x, y, z, blight[i]);
+						this->set_sky_light_nolock (x, y, z, slight[i]);
+					}
 	}
 	
 	
@@ -551,14 +1349,15 @@ namespace hCraft {
 	{
 		int y;
 		short h;
-
+		
+		std::lock_guard<std::mutex> guard {this->data_lock};
 		for (int x = 0; x < 16; ++x)
 			for (int z = 0; z < 16; ++z)
 				{
 					h = 0;
 					for (y = 255; y >= 0; --y)
 						{
-							if (this->get_id (x, y, z) != 0)
+							if (this->get_id_nolock (x, y, z) != 0)
 								{ h = y + 1; break; }
 						}
 					this->heightmap[(z << 4) | x] = h;
@@ -599,5 +1398,15 @@ namespace hCraft {
 		for (entity* e : this->entities)
 			f (e);
 	}
+	
+	/* 
+	 * Checks whether the chunk's entity list is non-empty.
+	 */
+	bool
+	chunk::has_entities ()
+	{
+		std::lock_guard<std::mutex> guard {this->entity_lock};
+		return !this->entities.empty ();
+	}
 }
 
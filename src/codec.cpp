@@ -0,0 +1,407 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "codec.hpp"
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <zlib.h>
+
+
+namespace hCraft {
+	
+	/* 
+	 * zlib, at a configurable compression level.
+	 */
+	class zlib_codec: public chunk_codec
+	{
+		int level;
+		
+	public:
+		zlib_codec (int level)
+			: level (level)
+			{ }
+		
+		virtual std::string
+		name ()
+		{
+			if (this->level == Z_DEFAULT_COMPRESSION)
+				return "zlib";
+			return "zlib:" + std::to_string (this->level);
+		}
+		
+		virtual chunk_codec_id id ()
+			{ return CC_ZLIB; }
+		
+		
+		virtual unsigned char*
+		encode (const unsigned char *data, unsigned int len,
+			unsigned int *out_size, unsigned int reserve)
+		{
+			unsigned long compressed_size = compressBound (len);
+			unsigned char *out = new unsigned char[reserve + compressed_size];
+			if (compress2 (out + reserve, &compressed_size, data, len,
+				this->level) != Z_OK)
+				{
+					delete[] out;
+					throw std::runtime_error ("failed to compress chunk");
+				}
+			
+			*out_size = reserve + compressed_size;
+			return out;
+		}
+		
+		virtual unsigned int
+		decode (const unsigned char *data, unsigned int len,
+			unsigned char *out, unsigned int out_len)
+		{
+			unsigned long size = out_len;
+			if (uncompress (out, &size, data, len) != Z_OK)
+				throw std::runtime_error ("failed to decompress chunk");
+			return size;
+		}
+	};
+	
+	
+	
+	/* 
+	 * No compression at all.
+	 */
+	class raw_codec: public chunk_codec
+	{
+	public:
+		virtual std::string name ()
+			{ return "raw"; }
+		
+		virtual chunk_codec_id id ()
+			{ return CC_RAW; }
+		
+		
+		virtual unsigned char*
+		encode (const unsigned char *data, unsigned int len,
+			unsigned int *out_size, unsigned int reserve)
+		{
+			unsigned char *out = new unsigned char[reserve + len];
+			std::memcpy (out + reserve, data, len);
+			*out_size = reserve + len;
+			return out;
+		}
+		
+		virtual unsigned int
+		decode (const unsigned char *data, unsigned int len,
+			unsigned char *out, unsigned int out_len)
+		{
+			if (len > out_len)
+				throw std::runtime_error ("chunk data too large");
+			std::memcpy (out, data, len);
+			return len;
+		}
+	};
+	
+	
+	
+	/* 
+	 * The two bitmaps at the start of the data as they are, followed by the
+	 * rest compressed with zlib, the same way chunks are sent to players (see
+	 * chunk_blob). Providers can then save and load a chunk's blob as is.
+	 */
+	class blob_codec: public chunk_codec
+	{
+	public:
+		virtual std::string name ()
+			{ return "blob"; }
+		
+		virtual chunk_codec_id id ()
+			{ return CC_BLOB; }
+		
+		
+		virtual unsigned char*
+		encode (const unsigned char *data, unsigned int len,
+			unsigned int *out_size, unsigned int reserve)
+		{
+			if (len < 4)
+				throw std::runtime_error ("chunk data too small");
+			
+			unsigned long compressed_size = compressBound (len - 4);
+			unsigned char *out = new unsigned char[reserve + 4 + compressed_size];
+			std::memcpy (out + reserve, data, 4);
+			if (compress2 (out + reserve + 4, &compressed_size, data + 4, len - 4,
+				Z_DEFAULT_COMPRESSION) != Z_OK)
+				{
+					delete[] out;
+					throw std::runtime_error ("failed to compress chunk");
+				}
+			
+			*out_size = reserve + 4 + compressed_size;
+			return out;
+		}
+		
+		virtual unsigned int
+		decode (const unsigned char *data, unsigned int len,
+			unsigned char *out, unsigned int out_len)
+		{
+			if (len < 4 || out_len < 4)
+				throw std::runtime_error ("failed to decompress chunk");
+			
+			std::memcpy (out, data, 4);
+			unsigned long size = out_len - 4;
+			if (uncompress (out + 4, &size, data + 4, len - 4) != Z_OK)
+				throw std::runtime_error ("failed to decompress chunk");
+			return size + 4;
+		}
+	};
+	
+	
+	
+	/* 
+	 * A simple byte-oriented LZ77 codec, much faster than zlib at the cost of
+	 * a somewhat larger output. Chunk data, being mostly runs of air and
+	 * repeated layers, still compresses well.
+	 * 
+	 * The data is a series of sequences, each made up of a token byte (literal
+	 * count in the high nibble, match length minus 4 in the low one), extra
+	 * length bytes for counts of 15 and above (255 while more follow), the
+	 * literals themselves, and a 16-bit offset back to the match. The last
+	 * sequence has literals only.
+	 */
+	class lz_codec: public chunk_codec
+	{
+		static inline unsigned int
+		read32 (const unsigned char *ptr)
+			{ unsigned int val; std::memcpy (&val, ptr, 4); return val; }
+		
+		static inline unsigned char*
+		put_length (unsigned char *op, unsigned int len)
+		{
+			for (; len >= 255; len -= 255)
+				*op++ = 255;
+			*op++ = len;
+			return op;
+		}
+		
+		static unsigned char*
+		put_sequence (unsigned char *op, const unsigned char *lit,
+			unsigned int lit_len, unsigned int offset, unsigned int match_len)
+		{
+			unsigned int ml = match_len ? (match_len - 4) : 0;
+			*op++ = ((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15);
+			if (lit_len >= 15)
+				op = put_length (op, lit_len - 15);
+			std::memcpy (op, lit, lit_len);
+			op += lit_len;
+			
+			if (match_len)
+				{
+					*op++ = offset & 0xFF;
+					*op++ = offset >> 8;
+					if (ml >= 15)
+						op = put_length (op, ml - 15);
+				}
+			return op;
+		}
+		
+		static unsigned int
+		get_length (const unsigned char *& ip, const unsigned char *end)
+		{
+			unsigned int len = 0, b;
+			do
+				{
+					if (ip >= end)
+						throw std::runtime_error ("corrupt chunk data");
+					b = *ip++;
+					len += b;
+				}
+			while (b == 255);
+			return len;
+		}
+		
+	public:
+		virtual std::string name ()
+			{ return "lz"; }
+		
+		virtual chunk_codec_id id ()
+			{ return CC_LZ; }
+		
+		
+		virtual unsigned char*
+		encode (const unsigned char *data, unsigned int len,
+			unsigned int *out_size, unsigned int reserve)
+		{
+			unsigned char *out = new unsigned char[reserve + len + (len / 255) + 16];
+			unsigned char *op = out + reserve;
+			
+			// positions (plus one) of recently seen 4-byte sequences.
+			std::vector<unsigned int> table (1 << 13);
+			
+			unsigned int ip = 0, anchor = 0;
+			while (ip + 4 <= len)
+				{
+					unsigned int seq = read32 (data + ip);
+					unsigned int h = (seq * 2654435761U) >> 19;
+					unsigned int ref = table[h];
+					table[h] = ip + 1;
+					
+					if (ref == 0 || (ip - (ref - 1)) > 0xFFFF
+						|| read32 (data + ref - 1) != seq)
+						{
+							++ ip;
+							continue;
+						}
+					
+					-- ref;
+					unsigned int match_len = 4;
+					while (ip + match_len < len && data[ref + match_len] == data[ip + match_len])
+						++ match_len;
+					
+					op = put_sequence (op, data + anchor, ip - anchor, ip - ref, match_len);
+					ip += match_len;
+					anchor = ip;
+				}
+			
+			op = put_sequence (op, data + anchor, len - anchor, 0, 0);
+			*out_size = op - out;
+			return out;
+		}
+		
+		virtual unsigned int
+		decode (const unsigned char *data, unsigned int len,
+			unsigned char *out, unsigned int out_len)
+		{
+			const unsigned char *ip = data, *end = data + len;
+			unsigned char *op = out, *op_end = out + out_len;
+			
+			while (ip < end)
+				{
+					unsigned int token = *ip++;
+					
+					unsigned int lit_len = token >> 4;
+					if (lit_len == 15)
+						lit_len += get_length (ip, end);
+					if (lit_len > (unsigned int)(end - ip)
+						|| lit_len > (unsigned int)(op_end - op))
+						throw std::runtime_error ("corrupt chunk data");
+					std::memcpy (op, ip, lit_len);
+					op += lit_len;
+					ip += lit_len;
+					
+					if (ip == end)
+						break; // last sequence
+					
+					if (end - ip < 2)
+						throw std::runtime_error ("corrupt chunk data");
+					unsigned int offset = ip[0] | (ip[1] << 8);
+					ip += 2;
+					
+					unsigned int match_len = (token & 0xF) + 4;
+					if ((token & 0xF) == 15)
+						match_len += get_length (ip, end);
+					if (offset == 0 || offset > (unsigned int)(op - out)
+						|| match_len > (unsigned int)(op_end - op))
+						throw std::runtime_error ("corrupt chunk data");
+					
+					// matches may overlap with their own output.
+					const unsigned char *src = op - offset;
+					if (offset >= match_len)
+						std::memcpy (op, src, match_len);
+					else if (offset == 1)
+						std::memset (op, *src, match_len);
+					else
+						for (unsigned int i = 0; i < match_len; ++i)
+							op[i] = src[i];
+					op += match_len;
+				}
+			
+			return op - out;
+		}
+	};
+	
+	
+	
+//----
+	
+	/* 
+	 * Creates a new codec from a specification string: "blob", "raw", "lz",
+	 * "zlib" or "zlib:<level>" (1-9). Returns null if the string is invalid.
+	 */
+	chunk_codec*
+	chunk_codec::create (const char *spec)
+	{
+		if (std::strcmp (spec, "blob") == 0)
+			return new blob_codec ();
+		else if (std::strcmp (spec, "raw") == 0)
+			return new raw_codec ();
+		else if (std::strcmp (spec, "lz") == 0)
+			return new lz_codec ();
+		else if (std::strcmp (spec, "zlib") == 0)
+			return new zlib_codec (Z_DEFAULT_COMPRESSION);
+		else if (std::strncmp (spec, "zlib:", 5) == 0)
+			{
+				char *end;
+				long level = std::strtol (spec + 5, &end, 10);
+				if (*end || end == spec + 5 || level < 1 || level > 9)
+					return nullptr;
+				return new zlib_codec (level);
+			}
+		
+		return nullptr;
+	}
+	
+	/* 
+	 * Returns a shared instance of the codec with the given ID, suitable for
+	 * decoding, or null if there is no such codec.
+	 */
+	chunk_codec*
+	chunk_codec::get (int id)
+	{
+		static zlib_codec zlib { Z_DEFAULT_COMPRESSION };
+		static raw_codec raw;
+		static lz_codec lz;
+		static blob_codec blob;
+		
+		switch (id)
+			{
+			case CC_ZLIB: return &zlib;
+			case CC_RAW: return &raw;
+			case CC_LZ: return &lz;
+			case CC_BLOB: return &blob;
+			default: return nullptr;
+			}
+	}
+	
+	
+	
+	static std::string&
+	_default_spec ()
+	{
+		static std::string spec {"blob"};
+		return spec;
+	}
+	
+	/* 
+	 * The codec that newly opened worlds save chunks with.
+	 */
+	void
+	chunk_codec::set_default (const char *spec)
+		{ _default_spec () = spec; }
+	
+	std::string
+	chunk_codec::get_default ()
+		{ return _default_spec (); }
+}
+
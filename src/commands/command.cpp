@@ -37,6 +37,7 @@ namespace hCraft {
 	
 	// info commands:
 	static command* create_c_help () { return new commands::c_help (); }
+	static command* create_c_stats () { return new commands::c_stats (); }
 	
 	// chat commands:
 	static command* create_c_me () { return new commands::c_me (); }
@@ -50,6 +51,7 @@ namespace hCraft {
 	static command* create_c_wload () { return new commands::c_wload (); }
 	static command* create_c_wunload () { return new commands::c_wunload (); }
 	static command* create_c_world () { return new commands::c_world (); }
+	static command* create_c_pregen () { return new commands::c_pregen (); }
 	static command* create_c_tp () { return new commands::c_tp (); }
 	
 	/* 
@@ -68,6 +70,8 @@ namespace hCraft {
 			{ "tp", create_c_tp },
 			{ "nick", create_c_nick },
 			{ "wunload", create_c_wunload },
+			{ "stats", create_c_stats },
+			{ "pregen", create_c_pregen },
 			};
 		
 		auto itr = creators.find (name);
@@ -0,0 +1,155 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "worldc.hpp"
+#include "../server.hpp"
+#include "../player.hpp"
+#include "../world.hpp"
+#include "../pregen.hpp"
+
+
+namespace hCraft {
+	namespace commands {
+		
+		/* 
+		 * /pregen -
+		 * 
+		 * Generates and saves all chunks within a given radius around a world's
+		 * spawn in the background.
+		 * 
+		 * Permissions:
+		 *   - command.world.pregen
+		 *       Needed to execute the command.
+		 */
+		void
+		c_pregen::execute (player *pl, command_reader& reader)
+		{
+			if (!pl->perm ("command.world.pregen"))
+				return;
+			
+			reader.add_option ("cpu", "c", true, true);
+			reader.add_option ("io", "i", true, true);
+			reader.add_option ("cancel");
+			reader.add_option ("stop");
+			if (!reader.parse_args (this, pl))
+				return;
+			
+			if (reader.no_args () || reader.arg_count () > 2)
+				{ this->show_usage (pl); return; }
+			
+			std::string& world_name = reader.arg (0);
+			world *wr = pl->get_server ().find_world (world_name.c_str ());
+			if (!wr)
+				{
+					pl->message ("§c * §eWorld §b" + world_name + " §eis not loaded§f.");
+					return;
+				}
+			
+			auto pregen = wr->get_pregen ();
+			if (reader.opt ("cancel")->found ())
+				{
+					// paused runs can be cancelled too, as their progress is still stored
+					// (and would be resumed on the next restart).
+					bool pending = pregen && (pregen->get_done () < pregen->get_total ());
+					if (pregen)
+						pregen->cancel ();
+					if (world_pregenerator::forget (pl->get_server (), wr))
+						pending = true;
+					
+					if (!pending)
+						pl->message ("§c * §eWorld §b" + world_name + " §eis not being "
+							"pre-generated§f.");
+					else
+						pl->message ("§eCancelled pre-generation of world §b" + world_name + "§f.");
+					return;
+				}
+			else if (reader.opt ("stop")->found ())
+				{
+					if (!pregen || !pregen->is_running ())
+						{
+							pl->message ("§c * §eWorld §b" + world_name + " §eis not being "
+								"pre-generated§f.");
+							return;
+						}
+					
+					pregen->stop ();
+					pl->message ("§ePaused pre-generation of world §b" + world_name + "§f.");
+					return;
+				}
+			
+			// progress
+			if (reader.arg_count () == 1)
+				{
+					if (!pregen)
+						pl->message ("§c * §eWorld §b" + world_name + " §ehas not been "
+							"pre-generated since it was loaded§f.");
+					else
+						pl->message ("§eWorld §b" + world_name + "§f: §a"
+							+ std::to_string (pregen->get_done ()) + "§f/§a"
+							+ std::to_string (pregen->get_total ()) + " §echunks §f("
+							+ std::to_string (pregen->get_done () * 100 / pregen->get_total ())
+							+ "%) - " + (pregen->is_running () ? "§arunning" : "§cstopped"));
+					return;
+				}
+			
+			if (!reader.arg_is_int (1) || reader.arg_as_int (1) < 0)
+				{
+					pl->message ("§c * §eRadius must be a non-negative integer§f.");
+					return;
+				}
+			int radius = reader.arg_as_int (1);
+			
+			int cpu = 50, io = 50;
+			auto opt_cpu = reader.opt ("cpu");
+			if (opt_cpu->found ())
+				{
+					if (!opt_cpu->is_int ())
+						{
+							pl->message_nowrap ("§c * §eArgument to flag §c--cpu §emust be an integer§f.");
+							return;
+						}
+					cpu = opt_cpu->as_int ();
+				}
+			auto opt_io = reader.opt ("io");
+			if (opt_io->found ())
+				{
+					if (!opt_io->is_int ())
+						{
+							pl->message_nowrap ("§c * §eArgument to flag §c--io §emust be an integer§f.");
+							return;
+						}
+					io = opt_io->as_int ();
+				}
+			
+			if (pregen && pregen->is_running ())
+				{
+					pl->message ("§c * §eWorld §b" + world_name + " §eis already being "
+						"pre-generated§f. §eStop it first using §a/pregen --stop " + world_name);
+					return;
+				}
+			
+			pregen = std::make_shared<world_pregenerator> (pl->get_server (), wr,
+				radius, cpu, io, pl->get_username ());
+			wr->start_pregen (pregen);
+			pl->message ("§eStarted pre-generating §a" + std::to_string (pregen->get_total ())
+				+ " §echunks in world §b" + world_name + " §f(§e"
+				+ std::to_string (pregen->get_done ()) + " §ealready done§f).");
+		}
+	}
+}
+
@@ -0,0 +1,141 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "infoc.hpp"
+#include "../server.hpp"
+#include "../player.hpp"
+#include "../slab.hpp"
+#include <sstream>
+
+
+namespace hCraft {
+	namespace commands {
+		
+		static void
+		_show_memory_stats (player *pl)
+		{
+			unsigned long long total = 0;
+			
+			pl->message ("§6Slab allocators§f:");
+			slab_allocator::all (
+				[pl, &total] (slab_allocator& alloc)
+					{
+						slab_stats st = alloc.stats ();
+						unsigned long long bytes = (unsigned long long)(st.in_use + st.free)
+							* st.obj_size;
+						total += bytes;
+						
+						std::ostringstream ss;
+						ss << "§e  " << st.name << "§f: §c" << st.in_use << " §eused§f, §c"
+							 << st.free << " §efree§f, §c" << st.high_water << " §epeak§f, §c"
+							 << (bytes / 1024) << "§eKB in §c" << st.slabs << " §eslabs§f.";
+						pl->message_nowrap (ss.str ());
+					});
+			
+			std::ostringstream ss;
+			ss << "§eTotal§f: §c" << (total / 1024) << "§eKB§f.";
+			pl->message_nowrap (ss.str ());
+		}
+		
+		
+		
+		/* 
+		 * Shows how much output is queued to players, and how often slow clients
+		 * had updates held back or were dropped.
+		 */
+		static void
+		_show_network_stats (player *pl)
+		{
+			int players = 0, congested = 0;
+			unsigned long long queued = 0, worst = 0;
+			pl->get_server ().get_players ().all (
+				[&] (player *other)
+					{
+						unsigned long long bytes = other->get_queued_bytes ();
+						++ players;
+						queued += bytes;
+						if (bytes > worst)
+							worst = bytes;
+						if (other->is_congested ())
+							++ congested;
+					});
+			
+			player_output_stats& st = player::get_output_stats ();
+			
+			pl->message ("§6Player output§f:");
+			std::ostringstream ss;
+			ss << "§e  Queued§f: §c" << (queued / 1024) << "§eKB for §c" << players
+				 << " §eplayers§f, §c" << (worst / 1024) << "§eKB at most§f.";
+			pl->message_nowrap (ss.str ());
+			
+			ss.clear (); ss.str ("");
+			ss << "§e  Watermarks§f: §c" << (player::out_low_mark () / 1024) << "§eKB low§f, §c"
+				 << (player::out_high_mark () / 1024) << "§eKB high§f, §c"
+				 << (player::out_hard_cap () / 1024) << "§eKB cap§f.";
+			pl->message_nowrap (ss.str ());
+			
+			ss.clear (); ss.str ("");
+			ss << "§e  Congested§f: §c" << congested << " §enow§f, §c" << st.congestions
+				 << " §etimes in total§f.";
+			pl->message_nowrap (ss.str ());
+			
+			ss.clear (); ss.str ("");
+			ss << "§e  Held back§f: §c" << st.moves_deferred << " §emovement updates§f, §c"
+				 << st.chunks_paused << " §echunks§f.";
+			pl->message_nowrap (ss.str ());
+			
+			ss.clear (); ss.str ("");
+			ss << "§e  Dropped§f: §c" << st.overflows << " §eplayers over the cap§f.";
+			pl->message_nowrap (ss.str ());
+		}
+		
+		
+		
+		/* 
+		 * /stats -
+		 * 
+		 * Displays internal server statistics, such as how much memory is held by
+		 * the server's allocators, or how much output is queued to players.
+		 * 
+		 * Permissions:
+		 *   - command.info.stats
+		 *       Needed to execute the command.
+		 */
+		void
+		c_stats::execute (player *pl, command_reader& reader)
+		{
+			if (!pl->perm ("command.info.stats"))
+				return;
+			
+			if (!reader.parse_args (this, pl))
+				return;
+			
+			if (reader.arg_count () > 1)
+				{ this->show_usage (pl); return; }
+			
+			std::string section = reader.has_args () ? reader.arg (0) : "memory";
+			if (section == "memory")
+				_show_memory_stats (pl);
+			else if (section == "network")
+				_show_network_stats (pl);
+			else
+				pl->message ("§c * §eUnknown statistics section§f: §c" + section);
+		}
+	}
+}
+
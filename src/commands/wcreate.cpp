@@ -162,6 +162,8 @@ namespace hCraft {
 			world *wr = new world (world_name.c_str (), gen, prov);
 			wr->set_width (world_width);
 			wr->set_depth (world_depth);
+			wr->set_thread_pool (&pl->get_server ().get_thread_pool ());
+			wr->set_logger (&pl->get_server ().get_logger ());
 			wr->prepare_spawn (10);
 			
 			pl->message_nowrap ("§f - §aSaving§f...");
@@ -22,6 +22,7 @@
 #include "../world.hpp"
 #include "../worldprovider.hpp"
 #include "../worldgenerator.hpp"
+#include "../pregen.hpp"
 
 
 namespace hCraft {
@@ -108,6 +109,8 @@ namespace hCraft {
 			pl->get_logger () () << "Loading world \"" << world_name << "\"" << std::endl;
 			world *wr = new world (world_name.c_str (), gen, prov);
 			wr->set_size (winf.width, winf.depth);
+			wr->set_thread_pool (&pl->get_server ().get_thread_pool ());
+			wr->set_logger (&pl->get_server ().get_logger ());
 			wr->prepare_spawn (10);
 			wr->start ();
 			if (!pl->get_server ().add_world (wr))
@@ -128,6 +131,7 @@ namespace hCraft {
 				}
 			
 			wr->start ();
+			world_pregenerator::resume (pl->get_server (), wr);
 			pl->get_server ().get_players ().message (
 				"§a * §6World §a" + world_name + " §6has been loaded§f.");
 		}
@@ -0,0 +1,164 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "entitygrid.hpp"
+
+
+namespace hCraft {
+	
+	static inline unsigned long long
+	cell_key (int cx, int cz)
+		{ return ((unsigned long long)((unsigned int)cz) << 32)
+			| (unsigned int)cx; }
+	
+	
+	
+	void
+	entity_grid::insert_nolock (entity *e, chunk_pos cpos)
+	{
+		int s = entity_grid::cell_shift ();
+		this->cells[cell_key (cpos.x >> s, cpos.z >> s)].entities[e] = cpos;
+		this->where[e] = cpos;
+	}
+	
+	void
+	entity_grid::remove_nolock (entity *e, chunk_pos cpos)
+	{
+		int s = entity_grid::cell_shift ();
+		auto itr = this->cells.find (cell_key (cpos.x >> s, cpos.z >> s));
+		if (itr != this->cells.end ())
+			{
+				itr->second.entities.erase (e);
+				if (itr->second.entities.empty ())
+					this->cells.erase (itr);
+			}
+		this->where.erase (e);
+	}
+	
+	
+	
+	/* 
+	 * Places the entity at the given chunk, moving it out of the chunk it
+	 * was in before (if any).
+	 */
+	void
+	entity_grid::update (entity *e, chunk_pos cpos)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		
+		auto itr = this->where.find (e);
+		if (itr != this->where.end ())
+			{
+				chunk_pos prev = itr->second;
+				if (prev.x == cpos.x && prev.z == cpos.z)
+					return;
+				
+				int s = entity_grid::cell_shift ();
+				if ((prev.x >> s) == (cpos.x >> s) && (prev.z >> s) == (cpos.z >> s))
+					{
+						// same cell, only the chunk changed.
+						this->cells[cell_key (cpos.x >> s, cpos.z >> s)].entities[e] = cpos;
+						itr->second = cpos;
+						return;
+					}
+				
+				this->remove_nolock (e, prev);
+			}
+		
+		this->insert_nolock (e, cpos);
+	}
+	
+	/* 
+	 * Removes the specified entity from the grid.
+	 */
+	void
+	entity_grid::remove (entity *e)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		
+		auto itr = this->where.find (e);
+		if (itr != this->where.end ())
+			this->remove_nolock (e, itr->second);
+	}
+	
+	/* 
+	 * Returns the number of entities in the grid.
+	 */
+	int
+	entity_grid::count ()
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		return this->where.size ();
+	}
+	
+	
+	
+	/* 
+	 * Inserts every entity that stands in a chunk within the inclusive box
+	 * [x1, x2] x [z1, z2] (in chunk coordinates) into @{out}.
+	 */
+	void
+	entity_grid::query (int x1, int z1, int x2, int z2, std::vector<entity *>& out)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		
+		int s = entity_grid::cell_shift ();
+		for (int gx = (x1 >> s); gx <= (x2 >> s); ++gx)
+			for (int gz = (z1 >> s); gz <= (z2 >> s); ++gz)
+				{
+					auto itr = this->cells.find (cell_key (gx, gz));
+					if (itr == this->cells.end ())
+						continue;
+					
+					for (auto& ent : itr->second.entities)
+						{
+							chunk_pos cpos = ent.second;
+							if (cpos.x >= x1 && cpos.x <= x2 && cpos.z >= z1 && cpos.z <= z2)
+								out.push_back (ent.first);
+						}
+				}
+	}
+	
+	/* 
+	 * Same as the above, but also stores the chunk each entity is standing
+	 * in, as far as the grid knows.
+	 */
+	void
+	entity_grid::query (int x1, int z1, int x2, int z2,
+		std::vector<std::pair<entity *, chunk_pos>>& out)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		
+		int s = entity_grid::cell_shift ();
+		for (int gx = (x1 >> s); gx <= (x2 >> s); ++gx)
+			for (int gz = (z1 >> s); gz <= (z2 >> s); ++gz)
+				{
+					auto itr = this->cells.find (cell_key (gx, gz));
+					if (itr == this->cells.end ())
+						continue;
+					
+					for (auto& ent : itr->second.entities)
+						{
+							chunk_pos cpos = ent.second;
+							if (cpos.x >= x1 && cpos.x <= x2 && cpos.z >= z1 && cpos.z <= z2)
+								out.emplace_back (ent.first, cpos);
+						}
+				}
+	}
+}
+
@@ -17,7 +17,6 @@
  */
 
 #include "flatgrass.hpp"
-#include <functional>
 
 
 namespace hCraft {
@@ -28,22 +27,9 @@ namespace hCraft {
 	flatgrass_world_generator::flatgrass_world_generator (long seed)
 	{
 		this->gen_seed = seed;
-	}
-	
-	
-	
-	/* 
-	 * Generates flatgrass terrain on the specified chunk.
-	 */
-	void
-	flatgrass_world_generator::generate (world& wr, chunk *out, int cx, int cz)
-	{
-		int x, y, z;
-		unsigned int xz_hash = std::hash<long> () (((long)cz << 32) | cx) & 0xFFFFFFFF;
-		
-		this->rnd.seed (this->gen_seed + xz_hash);
-		std::uniform_int_distribution<> dist (1, 20);
 		
+		chunk *out = &this->tmpl;
+		int x, y, z;
 		int height = 64;
 		for (x = 0; x < 16; ++x)
 			for (z = 0; z < 16; ++z)
@@ -55,11 +41,22 @@ namespace hCraft {
 						out->set_id (x, y, z, BT_DIRT);
 					out->set_id (x, y, z, BT_GRASS);
 					
-					//if (dist (this->rnd) > 15)
-					//	out->set_id_and_meta (x, y + 1, z, BT_TALL_GRASS, 1);
-					
 					out->set_biome (x, z, BI_FOREST);
 				}
+		
+		out->recalc_heightmap ();
+		out->relight (false);
+	}
+	
+	
+	
+	/* 
+	 * Generates flatgrass terrain on the specified chunk.
+	 */
+	void
+	flatgrass_world_generator::generate (world& wr, chunk *out, int cx, int cz)
+	{
+		out->copy_from (this->tmpl);
 	}
 }
 
@@ -19,13 +19,21 @@
 #include "hwprovider.hpp"
 #include "world.hpp"
 #include "chunk.hpp"
+#include "codec.hpp"
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
 #include <cstring>
 #include <cctype>
 #include <zlib.h>
-#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
 
 
 namespace hCraft {
@@ -54,6 +62,11 @@ namespace hCraft {
 		return hash;
 	}
 	
+	static unsigned long long
+	chunk_key (int x, int z)
+		{ return ((unsigned long long)((unsigned int)z) << 32)
+			| (unsigned long long)((unsigned int)x); }
+	
 	static unsigned int
 	hash_coords (int x, int z)
 	{
@@ -75,53 +88,104 @@ namespace hCraft {
 	
 //----
 	
+	static int
+	_write_short (unsigned char *ptr, unsigned short val)
+	{
+		ptr[0] = val & 0xFF;
+		ptr[1] = (val >> 8) & 0xFF;
+		return 2;
+	}
+	
+	static int
+	_write_int (unsigned char *ptr, unsigned int val)
+	{
+		ptr[0] = val & 0xFF;
+		ptr[1] = (val >> 8) & 0xFF;
+		ptr[2] = (val >> 16) & 0xFF;
+		ptr[3] = (val >> 24) & 0xFF;
+		return 4;
+	}
+	
+	
+	static unsigned short
+	_read_short (const unsigned char *ptr)
+	{
+		return ((unsigned short)ptr[0])
+				 | ((unsigned short)ptr[1] << 8);
+	}
+	
+	static unsigned int
+	_read_int (const unsigned char *ptr)
+	{
+		return ((unsigned int)ptr[0])
+				 | ((unsigned int)ptr[1] << 8)
+				 | ((unsigned int)ptr[2] << 16)
+				 | ((unsigned int)ptr[3] << 24);
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Reads little-endian values out of a block of memory (usually the mapped
+	 * world file).
+	 */
 	class binary_reader
 	{
-		std::istream& strm;
+		const unsigned char *data;
+		unsigned long long size;
+		unsigned long long pos;
+		
+	private:
+		inline const unsigned char*
+		take (unsigned long long len)
+		{
+			if (len > this->size || this->pos > (this->size - len))
+				throw std::runtime_error ("unexpected end of world file");
+			
+			const unsigned char *ptr = this->data + this->pos;
+			this->pos += len;
+			return ptr;
+		}
 		
 	public:
-		binary_reader (std::istream& strm)
-			: strm (strm)
+		binary_reader (const unsigned char *data, unsigned long long size)
+			: data (data), size (size), pos (0)
 			{ }
 		
 		//---
 		inline void
-		seek (std::ostream::off_type off, std::ios_base::seekdir dir = std::ios_base::beg)
-			{
-				this->strm.seekg (off, dir);
-			}
+		seek (unsigned long long off)
+			{ this->pos = off; }
 		
-		inline std::ostream::pos_type
+		inline unsigned long long
 		tell ()
-			{ return this->strm.tellg (); }
+			{ return this->pos; }
 		
 		//---
 		inline unsigned char
 		read_byte ()
-			{ return strm.get (); }
+			{ return *take (1); }
 		
 		inline unsigned short
 		read_short ()
-			{ return ((unsigned short)read_byte ())
-						 | ((unsigned short)read_byte () << 8); }
+			{ const unsigned char *ptr = take (2);
+				return ((unsigned short)ptr[0])
+						 | ((unsigned short)ptr[1] << 8); }
 		
 		inline unsigned int
 		read_int ()
-			{ return ((unsigned int)read_byte ())
-						 | ((unsigned int)read_byte () << 8)
-						 | ((unsigned int)read_byte () << 16)
-						 | ((unsigned int)read_byte () << 24); }
+			{ const unsigned char *ptr = take (4);
+				return ((unsigned int)ptr[0])
+						 | ((unsigned int)ptr[1] << 8)
+						 | ((unsigned int)ptr[2] << 16)
+						 | ((unsigned int)ptr[3] << 24); }
 		
 		inline unsigned long long
 		read_long ()
-			{ return ((unsigned long long)read_byte ())
-						 | ((unsigned long long)read_byte () << 8)
-						 | ((unsigned long long)read_byte () << 16)
-						 | ((unsigned long long)read_byte () << 24)
-						 | ((unsigned long long)read_byte () << 32)
-						 | ((unsigned long long)read_byte () << 40)
-						 | ((unsigned long long)read_byte () << 48)
-						 | ((unsigned long long)read_byte () << 56); }
+			{ unsigned long long lo = read_int ();
+				return lo | ((unsigned long long)read_int () << 32); }
 		
 		inline float
 		read_float ()
@@ -134,84 +198,130 @@ namespace hCraft {
 		inline std::string
 		read_string ()
 		{
-			short len = this->read_short ();
-			std::string str;
-			str.reserve (len + 1);
-			
-			for (int i = 0; i < len; ++i)
-				{
-					str.push_back (this->read_byte ());
-				}
-			
-			return str;
+			unsigned short len = this->read_short ();
+			return std::string ((const char *)take (len), len);
 		}
 		
 		inline void
 		read_bytes (unsigned char *data, unsigned int len)
 		{
-			this->strm.read ((char *)data, len);
+			std::memcpy (data, take (len), len);
 		}
+		
+		/* 
+		 * Returns a pointer to the next @{len} bytes, for reading them in bulk.
+		 */
+		inline const unsigned char*
+		read_raw (unsigned int len)
+			{ return take (len); }
 	};
 	
 	
 	
 //----
 	
+	/* 
+	 * Writes little-endian values into an in-memory buffer, which is written
+	 * to the underlying stream in one go when the writer seeks elsewhere, is
+	 * flushed or is destroyed.
+	 */
 	class binary_writer
 	{
 		std::ostream& strm;
 		int written;
+		std::vector<hw_patch> *journal;
+		
+		std::vector<unsigned char> buf;
+		unsigned long long buf_start; // where in the stream the buffer goes
+		bool positioned;              // false until the first seek
+		
+	private:
+		inline void
+		flush_buffer ()
+		{
+			if (this->buf.empty ())
+				return;
+			
+			if (this->positioned)
+				this->strm.seekp (this->buf_start);
+			this->strm.write ((const char *)this->buf.data (), this->buf.size ());
+			this->buf_start += this->buf.size ();
+			this->buf.clear ();
+		}
+		
+		inline unsigned char*
+		grow (unsigned int len)
+		{
+			this->written += len;
+			this->buf.resize (this->buf.size () + len);
+			return this->buf.data () + this->buf.size () - len;
+		}
 		
 	public:
-		binary_writer () : strm (std::cout) { }
-		binary_writer (std::ostream& strm)
-			: strm (strm), written (0)
+		binary_writer ()
+			: strm (std::cout), written (0), journal (nullptr), buf_start (0),
+				positioned (false)
+			{ }
+		
+		binary_writer (std::ostream& strm, std::vector<hw_patch> *journal = nullptr)
+			: strm (strm), written (0), journal (journal), buf_start (0),
+				positioned (false)
 			{ }
 		
+		binary_writer (const binary_writer&) = delete;
+		
+		~binary_writer ()
+			{ this->flush_buffer (); }
+		
 		//---
 		inline void
 		seek (std::ostream::off_type off, std::ios_base::seekdir dir = std::ios_base::beg)
 			{
-				this->strm.seekp (off, dir);
+				this->flush_buffer ();
 				if (dir == std::ios_base::end)
-					this->written = this->tell ();
+					{
+						this->strm.seekp (off, dir);
+						this->buf_start = this->strm.tellp ();
+						this->written = this->buf_start;
+					}
+				else
+					this->buf_start = off;
+				this->positioned = true;
 			}
 		
-		inline std::ostream::pos_type
+		inline unsigned long long
 		tell ()
-			{ return this->strm.tellp (); }
+		{
+			if (!this->positioned)
+				{
+					this->buf_start = this->strm.tellp ();
+					this->positioned = true;
+				}
+			return this->buf_start + this->buf.size ();
+		}
 		
 		inline void
 		flush ()
-			{ this->strm.flush (); }
+			{ this->flush_buffer (); this->strm.flush (); }
 		
 		//---
 		inline void
 		write_byte (unsigned char val)
-			{ this->strm.put (val); ++ written; }
+			{ *grow (1) = val; }
 		
 		inline void
 		write_short (unsigned short val)
-			{ write_byte (val & 0xFF);
-				write_byte ((val >> 8) & 0xFF); }
+			{ _write_short (grow (2), val); }
 		
 		inline void
 		write_int (unsigned int val)
-			{ write_byte (val & 0xFF);
-				write_byte ((val >> 8) & 0xFF);
-				write_byte ((val >> 16) & 0xFF);
-				write_byte ((val >> 24) & 0xFF); }
+			{ _write_int (grow (4), val); }
 		
 		inline void
 		write_long (unsigned long long val)
-			{ write_byte (val & 0xFF);
-				write_byte ((val >> 8) & 0xFF);
-				write_byte ((val >> 16) & 0xFF);
-				write_byte ((val >> 24) & 0xFF);
-				write_byte ((val >> 32) & 0xFF);
-				write_byte ((val >> 40) & 0xFF);
-				write_byte ((val >> 48) & 0xFF);
-				write_byte ((val >> 56) & 0xFF);}
+			{ unsigned char *ptr = grow (8);
+				_write_int (ptr, val & 0xFFFFFFFFU);
+				_write_int (ptr + 4, val >> 32); }
 		
 		inline void
 		write_float (float val)
@@ -225,16 +335,30 @@ namespace hCraft {
 		write_string (const char *str)
 			{
 				int len = std::strlen (str);
-				write_short (std::strlen (str));
-				for (int i = 0; i < len; ++i)
-					write_byte (str[i]);
+				write_short (len);
+				write_bytes ((const unsigned char *)str, len);
 			}
 		
 		inline void
 		write_bytes (const unsigned char *data, unsigned int len)
+			{ std::memcpy (grow (len), data, len); }
+		
+		/* 
+		 * Overwrites existing data at the given offset. With a journal, the
+		 * change is only recorded, and is made once the journal is committed.
+		 */
+		inline void
+		patch (unsigned long long off, const unsigned char *data, unsigned int len)
 		{
-			this->strm.write ((const char *)data, len);
-			this->written += len;
+			if (this->journal)
+				this->journal->push_back ({ off,
+					std::vector<unsigned char> (data, data + len) });
+			else
+				{
+					this->flush_buffer ();
+					this->strm.seekp (off);
+					this->strm.write ((const char *)data, len);
+				}
 		}
 			
 	//----
@@ -246,17 +370,42 @@ namespace hCraft {
 			
 			int next = (this->written / mul + 1) * mul;
 			int need = next - this->written;
-			for (next = 0; next < need; ++next)
-				this->write_byte (0);
+			std::memset (grow (need), 0, need);
 			return need;
 		}
 	};
 	
 	
 	
+	static std::vector<unsigned char>
+	make_empty_table ()
+	{
+		std::vector<unsigned char> table (12 * 1024);
+		for (int i = 0; i < 1024; ++i)
+			{
+				_write_int (&table[12 * i], 0); // x
+				_write_int (&table[12 * i] + 4, 0); // z
+				_write_int (&table[12 * i] + 8, 0xFFFFFFFFU); // offset
+			}
+		return table;
+	}
+	
+	/* 
+	 * Writes out a table of @{count} empty entries.
+	 */
+	static void
+	write_empty_table (binary_writer& writer, int count)
+	{
+		static const std::vector<unsigned char> table = make_empty_table ();
+		for (; count > 0; count -= 1024)
+			writer.write_bytes (table.data (), 12 * std::min (count, 1024));
+	}
+	
+	
+	
 //----
 		
-	static void read_file (world_information&, hw_superblock **, binary_reader); // forward def
+	static void read_file (world_information&, hw_superblock **, binary_reader&); // forward def
 	
 	/* 
 	 * Constructs a new world provider for the HWv1 format.
@@ -268,17 +417,30 @@ namespace hCraft {
 			this->out_path.push_back ('/');
 		this->out_path.append (hw_provider_naming ().make_name (world_name));
 		
+		this->codec = chunk_codec::create (chunk_codec::get_default ().c_str ());
+		if (!this->codec)
+			this->codec = chunk_codec::create ("zlib");
+		
+		for (int i = 0; i < 4096; ++i)
+			this->sblocks[i] = nullptr;
+		
+		this->fd = -1;
+		this->map = nullptr;
+		this->map_size = 0;
+		this->active_loads = 0;
+		
+		this->replay_journal ();
+		
 		// read tables if the world file already exists
-		{
-			std::fstream strm (this->out_path, std::ios_base::in
-				| std::ios_base::binary);
-			if (strm.is_open ())
-				{
-					binary_reader reader {strm};
-					read_file (this->inf, this->sblocks, reader);
-					strm.close ();
-				}
-		}
+		if (this->remap ())
+			{
+				binary_reader reader {this->map, this->map_size};
+				read_file (this->inf, this->sblocks, reader);
+			}
+		
+		this->index_valid = this->read_index ();
+		this->index_dirty = false;
+		this->space_valid = this->index_valid;
 	}
 	
 	/* 
@@ -286,9 +448,271 @@ namespace hCraft {
 	 */
 	hw_provider::~hw_provider ()
 	{
+		this->close ();
+		if (this->index_dirty || !this->index_valid)
+			this->write_index ();
+		
+		// everything in the journal has been applied, and only needs to reach
+		// the disk before the journal can go.
+		if (this->fd != -1)
+			fdatasync (this->fd);
+		std::remove ((this->out_path + ".jnl").c_str ());
+		
 		for (int i = 0; i < 4096; ++i)
 			delete this->sblocks[i];
-		this->close ();
+		delete this->codec;
+		
+		if (this->map)
+			munmap (this->map, this->map_size);
+		if (this->fd != -1)
+			::close (this->fd);
+	}
+	
+	
+	
+	/* 
+	 * Maps the world file into memory, replacing the previous mapping if the
+	 * file has grown since. Returns false if the file does not exist (yet) or
+	 * could not be mapped.
+	 */
+	bool
+	hw_provider::remap ()
+	{
+		if (this->fd == -1)
+			{
+				this->fd = ::open (this->out_path.c_str (), O_RDONLY);
+				if (this->fd == -1)
+					return false;
+			}
+		
+		struct stat st;
+		if (fstat (this->fd, &st) == -1)
+			return false;
+		if (this->map && (unsigned long long)st.st_size == this->map_size)
+			return true;
+		
+		if (this->map)
+			{
+				munmap (this->map, this->map_size);
+				this->map = nullptr;
+				this->map_size = 0;
+			}
+		if (st.st_size == 0)
+			return false;
+		
+		// shared, so that writes made through the stream show up in the mapping.
+		void *ptr = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+		if (ptr == MAP_FAILED)
+			return false;
+		
+		this->map = (unsigned char *)ptr;
+		this->map_size = st.st_size;
+		return true;
+	}
+	
+	
+	
+	/* 
+	 * The chunk index is kept in a separate file (<world>.hw.idx), and maps
+	 * chunk coordinates directly to chunk header offsets. It also holds the
+	 * world file's free space map. It is stamped with the size of the world
+	 * file it was written for, and is removed as soon as the world file is
+	 * modified (see touch ()), so an index that is still around after a crash
+	 * can be trusted.
+	 */
+	
+	static void load_superblock (hw_superblock *, binary_reader&);
+	static void load_block (hw_block *, binary_reader&);
+	static void load_region (hw_region *, binary_reader&);
+	static void load_chunk_header (hw_chunk *, binary_reader&);
+	
+	/* 
+	 * Loads the chunk index saved next to the world file. Returns false if
+	 * there is none, or if it does not match the world file.
+	 */
+	bool
+	hw_provider::read_index ()
+	{
+		this->index.clear ();
+		if (!this->map)
+			return true; // no world file, no chunks
+		
+		std::ifstream strm (this->out_path + ".idx", std::ios_base::binary);
+		if (!strm)
+			return false;
+		std::vector<unsigned char> buf ((std::istreambuf_iterator<char> (strm)),
+			std::istreambuf_iterator<char> ());
+		
+		try
+			{
+				binary_reader reader (buf.data (), buf.size ());
+				if (reader.read_int () != 0x32695748) // "HWi2"
+					return false;
+				if (reader.read_long () != this->map_size)
+					return false;
+				
+				unsigned int count = reader.read_int ();
+				this->index.reserve (count);
+				for (unsigned int i = 0; i < count; ++i)
+					{
+						int cx = reader.read_int ();
+						int cz = reader.read_int ();
+						this->index[chunk_key (cx, cz)] = reader.read_int ();
+					}
+				
+				this->free_space.clear ();
+				count = reader.read_int ();
+				for (unsigned int i = 0; i < count; ++i)
+					{
+						unsigned int start = reader.read_int ();
+						this->free_space[start] = reader.read_int ();
+					}
+			}
+		catch (const std::runtime_error&)
+			{
+				this->index.clear ();
+				this->free_space.clear ();
+				return false;
+			}
+		
+		return true;
+	}
+	
+	/* 
+	 * Writes the chunk index out, reading in the rest of the world's tables
+	 * first if the index was not loaded.
+	 */
+	void
+	hw_provider::write_index ()
+	{
+		if (!this->index_valid || !this->space_valid)
+			this->scan ();
+		if (!this->remap ())
+			return;
+		
+		std::vector<unsigned char> buf (20 + (12 * this->index.size ())
+			+ (8 * this->free_space.size ()));
+		unsigned char *ptr = buf.data ();
+		ptr += _write_int (ptr, 0x32695748);
+		ptr += _write_int (ptr, this->map_size & 0xFFFFFFFFU);
+		ptr += _write_int (ptr, this->map_size >> 32);
+		ptr += _write_int (ptr, this->index.size ());
+		for (auto& entry : this->index)
+			{
+				ptr += _write_int (ptr, entry.first & 0xFFFFFFFFU);
+				ptr += _write_int (ptr, entry.first >> 32);
+				ptr += _write_int (ptr, entry.second);
+			}
+		ptr += _write_int (ptr, this->free_space.size ());
+		for (auto& run : this->free_space)
+			{
+				ptr += _write_int (ptr, run.first);
+				ptr += _write_int (ptr, run.second);
+			}
+		
+		std::ofstream strm (this->out_path + ".idx", std::ios_base::binary
+			| std::ios_base::trunc);
+		strm.write ((const char *)buf.data (), buf.size ());
+		this->index_dirty = false;
+	}
+	
+	/* 
+	 * Walks every table in the world file, rebuilding the chunk index and
+	 * the free space map.
+	 */
+	void
+	hw_provider::scan ()
+	{
+		this->commit ();
+		if (this->strm.is_open ())
+			this->strm.flush ();
+		
+		this->index.clear ();
+		this->free_space.clear ();
+		this->index_valid = this->space_valid = true;
+		if (!this->remap ())
+			return;
+		
+		/* 
+		 * Sizes, in 512-byte units: the header and superblock table take up 97,
+		 * superblocks 2, blocks and regions 24, chunk headers 3 and every data
+		 * sector 8.
+		 */
+		std::vector<std::pair<unsigned int, unsigned int>> used;
+		used.emplace_back (0, 97);
+		
+		binary_reader reader {this->map, this->map_size};
+		for (int i = 0; i < 4096; ++i)
+			{
+				hw_superblock *sblock = this->sblocks[i];
+				if (!sblock) continue;
+				if (!sblock->loaded)
+					load_superblock (sblock, reader);
+				used.emplace_back (sblock->offset, 2);
+				
+				for (hw_block *block : sblock->blocks)
+					{
+						if (!block) continue;
+						if (!block->loaded)
+							load_block (block, reader);
+						used.emplace_back (block->offset, 24);
+						
+						for (hw_region *region : block->regions)
+							{
+								if (!region) continue;
+								if (!region->loaded)
+									load_region (region, reader);
+								used.emplace_back (region->offset, 24);
+								
+								for (hw_chunk *ch : region->chunks)
+									{
+										if (!ch) continue;
+										this->index[chunk_key (ch->x, ch->z)] = ch->offset;
+										used.emplace_back (ch->offset, 3);
+										
+										// headers are not kept around, as there can be a lot of them.
+										hw_chunk header (ch->x, ch->z);
+										header.offset = ch->offset;
+										if (!ch->loaded)
+											load_chunk_header (&header, reader);
+										hw_chunk *hch = ch->loaded ? ch : &header;
+										
+										unsigned int sector_count = (hch->size + 4095) / 4096;
+										for (unsigned int j = 0; j < sector_count; ++j)
+											used.emplace_back (hch->sector_table[j], 8);
+									}
+							}
+					}
+			}
+		
+		// everything in between is free.
+		std::sort (used.begin (), used.end ());
+		unsigned int pos = 0;
+		for (auto& run : used)
+			{
+				if (run.first > pos)
+					this->release (pos, run.first - pos);
+				if (run.first + run.second > pos)
+					pos = run.first + run.second;
+			}
+		unsigned int end = this->map_size / 512;
+		if (end > pos)
+			this->release (pos, end - pos);
+	}
+	
+	/* 
+	 * Removes the index saved next to the world file, since it is about to
+	 * stop matching it. It is written out again when the provider is
+	 * destroyed.
+	 */
+	void
+	hw_provider::touch ()
+	{
+		if (this->index_dirty)
+			return;
+		
+		std::remove ((this->out_path + ".idx").c_str ());
+		this->index_dirty = true;
 	}
 	
 	
@@ -301,6 +725,7 @@ namespace hCraft {
  	void
  	hw_provider::open (world &wr)
  	{
+ 		std::lock_guard<std::recursive_mutex> guard {this->lock};
  		if (this->strm.is_open ())
  			return;
  		
@@ -315,13 +740,15 @@ namespace hCraft {
  	}
 	
 	/* 
-	 * Closes the underlying file stream.
+	 * Commits pending changes, and closes the underlying file stream.
 	 */
 	void
 	hw_provider::close ()
 	{
+		std::lock_guard<std::recursive_mutex> guard {this->lock};
 		if (this->strm.is_open ())
 			{
+				this->commit ();
 				this->strm.flush ();
 				this->strm.close ();
 			}
@@ -330,67 +757,318 @@ namespace hCraft {
 	
 	
 	/* 
-	 * Adds required prefixes, suffixes, etc... to the specified world name so
-	 * that the importer's claims_name () function returns true when passed to
-	 * it.
+	 * The journal (<world>.hw.jnl) holds in-place changes to the world file:
+	 * table entries and chunk headers. Everything else (chunk data, new
+	 * tables and headers) is written to unused space, and only becomes
+	 * reachable once the changes in the journal are made, so the world file is
+	 * left consistent no matter where a crash happens.
+	 * 
+	 * Each batch of changes (everything between open () and close ()) is
+	 * committed as a whole, with one sync of the world file and one of the
+	 * journal.
 	 */
-	std::string
-	hw_provider_naming::make_name (const char *world_name)
+	
+	static void
+	append_bytes (std::vector<unsigned char>& buf, const unsigned char *data,
+		unsigned int len)
 	{
-		std::string out;
-		out.reserve (std::strlen (world_name) + 4);
-		
-		int c;
-		while (c = *world_name++)
-			{
-				if (c == ' ')
-					out.push_back ('_');
-				else
-					out.push_back (std::tolower (c));
-			}
-		
-		out.append (".hw"); // extension
-		
-		return out;
+		buf.insert (buf.end (), data, data + len);
 	}
 	
-	/* 
-	 * Checks whether the specified path name meets the format required by this
-	 * exporter (could be a name prefix, suffix, extension, etc...).
-	 */
-	bool
-	hw_provider_naming::claims_name (const char *path)
+	static void
+	append_int (std::vector<unsigned char>& buf, unsigned int val)
 	{
-		int len = std::strlen (path);
-		return ((len > 4) && ((path[len - 3] == '.') && (path[len - 2] == 'h')
-			&& (path[len - 1] == 'w')));
+		unsigned char tmp[4];
+		_write_int (tmp, val);
+		append_bytes (buf, tmp, 4);
 	}
 	
 	/* 
-	 * Opens the file located at path @{path} and performs a check to see if it
-	 * is of the same format created by this exporter.
+	 * Makes the changes recorded in the journal durable: new data is synced
+	 * to disk, the journal is written out and synced, and only then are the
+	 * changes made to the world file itself.
 	 */
-	bool
-	hw_provider::claims (const char *path)
+	void
+	hw_provider::commit ()
 	{
-		std::ifstream strm (path);
-		if (!strm)
-			return false;
+		if (!this->journal.empty ())
+			{
+				// this also syncs the changes made by the previous commit, whose
+				// journal is about to be overwritten.
+				this->strm.flush ();
+				this->remap ();
+				if (this->fd != -1)
+					fdatasync (this->fd);
+				
+				std::vector<unsigned char> buf;
+				append_int (buf, 0x316A5748); // "HWj1"
+				append_int (buf, this->journal.size ());
+				for (hw_patch& patch : this->journal)
+					{
+						append_int (buf, patch.offset & 0xFFFFFFFFU);
+						append_int (buf, patch.offset >> 32);
+						append_int (buf, patch.data.size ());
+						append_bytes (buf, patch.data.data (), patch.data.size ());
+					}
+				append_int (buf, crc32 (0, buf.data (), buf.size ()));
+				
+				int jfd = ::open ((this->out_path + ".jnl").c_str (),
+					O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if (jfd == -1)
+					throw std::runtime_error ("failed to open world journal");
+				for (unsigned int n = 0; n < buf.size (); )
+					{
+						ssize_t ret = ::write (jfd, buf.data () + n, buf.size () - n);
+						if (ret <= 0)
+							{
+								::close (jfd);
+								throw std::runtime_error ("failed to write world journal");
+							}
+						n += ret;
+					}
+				fdatasync (jfd);
+				::close (jfd);
+				
+				// committed.
+				for (hw_patch& patch : this->journal)
+					{
+						this->strm.seekp (patch.offset);
+						this->strm.write ((const char *)patch.data.data (),
+							patch.data.size ());
+					}
+				this->strm.flush ();
+				this->journal.clear ();
+			}
+		
+		if (this->active_loads == 0)
+			{
+				for (auto& run : this->pending_free)
+					this->release (run.first, run.second);
+				this->pending_free.clear ();
+			}
+	}
+	
+	/* 
+	 * Applies the changes of a journal left behind by a crash, if it was
+	 * committed completely.
+	 */
+	void
+	hw_provider::replay_journal ()
+	{
+		std::string path = this->out_path + ".jnl";
+		std::vector<unsigned char> buf;
+		{
+			std::ifstream strm (path, std::ios_base::binary);
+			if (!strm)
+				return;
+			buf.assign (std::istreambuf_iterator<char> (strm),
+				std::istreambuf_iterator<char> ());
+		}
 		
-		binary_reader reader (strm);
-		bool cl = (reader.read_int () == 0x31765748);
+		// a journal that was cut short was never committed, and is ignored.
+		if (buf.size () >= 12 && crc32 (0, buf.data (), buf.size () - 4)
+			== _read_int (buf.data () + buf.size () - 4))
+			{
+				std::fstream strm (this->out_path, std::ios_base::binary
+					| std::ios_base::in | std::ios_base::out);
+				try
+					{
+						binary_reader reader (buf.data (), buf.size () - 4);
+						if (strm && reader.read_int () == 0x316A5748)
+							{
+								std::vector<unsigned char> data;
+								unsigned int count = reader.read_int ();
+								for (unsigned int i = 0; i < count; ++i)
+									{
+										unsigned long long offset = reader.read_long ();
+										data.resize (reader.read_int ());
+										reader.read_bytes (data.data (), data.size ());
+										
+										strm.seekp (offset);
+										strm.write ((const char *)data.data (), data.size ());
+									}
+								strm.close ();
+								
+								int wfd = ::open (this->out_path.c_str (), O_RDONLY);
+								if (wfd != -1)
+									{
+										fdatasync (wfd);
+										::close (wfd);
+									}
+							}
+					}
+				catch (const std::runtime_error&)
+					{ }
+			}
 		
-		strm.close ();
-		return cl;
+		std::remove (path.c_str ());
+	}
+	
+	
+	
+	/* 
+	 * Adds required prefixes, suffixes, etc... to the specified world name so
+	 * that the importer's claims_name () function returns true when passed to
+	 * it.
+	 */
+	std::string
+	hw_provider_naming::make_name (const char *world_name)
+	{
+		std::string out;
+		out.reserve (std::strlen (world_name) + 4);
+		
+		int c;
+		while (c = *world_name++)
+			{
+				if (c == ' ')
+					out.push_back ('_');
+				else
+					out.push_back (std::tolower (c));
+			}
+		
+		out.append (".hw"); // extension
+		
+		return out;
+	}
+	
+	/* 
+	 * Checks whether the specified path name meets the format required by this
+	 * exporter (could be a name prefix, suffix, extension, etc...).
+	 */
+	bool
+	hw_provider_naming::claims_name (const char *path)
+	{
+		int len = std::strlen (path);
+		return ((len > 4) && ((path[len - 3] == '.') && (path[len - 2] == 'h')
+			&& (path[len - 1] == 'w')));
+	}
+	
+	/* 
+	 * Opens the file located at path @{path} and performs a check to see if it
+	 * is of the same format created by this exporter.
+	 */
+	bool
+	hw_provider::claims (const char *path)
+	{
+		std::ifstream strm (path, std::ios_base::binary);
+		if (!strm)
+			return false;
+		
+		unsigned char magic[4];
+		strm.read ((char *)magic, 4);
+		if (strm.gcount () != 4)
+			return false;
+		
+		binary_reader reader (magic, 4);
+		return (reader.read_int () == 0x31765748);
 	}
 	
 	
 	
 //----
 	
+	/* 
+	 * Tables are read in lazily: the superblock table is loaded along with the
+	 * world file, but block, region and chunk tables are only read the first
+	 * time a lookup passes through them.
+	 */
+	
+	static void
+	load_superblock (hw_superblock *sblock, binary_reader& reader)
+	{
+		reader.seek (sblock->offset * 512ULL);
+		const unsigned char *ptr = reader.read_raw (12 * 64);
+		for (int i = 0; i < 64; ++i, ptr += 12)
+			{
+				int b_x = _read_int (ptr);
+				int b_z = _read_int (ptr + 4);
+				unsigned int b_offset = _read_int (ptr + 8);
+				if (b_offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_block *block = new hw_block (b_x, b_z);
+				block->offset = b_offset;
+				sblock->blocks[i] = block;
+			}
+		sblock->loaded = true;
+	}
+	
+	static void
+	load_block (hw_block *block, binary_reader& reader)
+	{
+		reader.seek (block->offset * 512ULL);
+		const unsigned char *ptr = reader.read_raw (12 * 1024);
+		for (int i = 0; i < 1024; ++i, ptr += 12)
+			{
+				int r_x = _read_int (ptr);
+				int r_z = _read_int (ptr + 4);
+				unsigned int r_offset = _read_int (ptr + 8);
+				if (r_offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_region *region = new hw_region (r_x, r_z);
+				region->offset = r_offset;
+				block->regions[i] = region;
+			}
+		block->loaded = true;
+	}
+	
+	static void
+	load_region (hw_region *region, binary_reader& reader)
+	{
+		reader.seek (region->offset * 512ULL);
+		const unsigned char *ptr = reader.read_raw (12 * 1024);
+		for (int i = 0; i < 1024; ++i, ptr += 12)
+			{
+				int c_x = _read_int (ptr);
+				int c_z = _read_int (ptr + 4);
+				unsigned int c_offset = _read_int (ptr + 8);
+				if (c_offset == 0xFFFFFFFFU)
+					continue;
+				
+				hw_chunk *ch = new hw_chunk (c_x, c_z);
+				ch->offset = c_offset;
+				region->chunks[i] = ch;
+			}
+		region->loaded = true;
+	}
+	
+	static void
+	decode_chunk_header (hw_chunk *ch, const unsigned char *ptr)
+	{
+		ch->size = _read_int (ptr);
+		for (int i = 0; i < 256; ++i)
+			ch->sector_table[i] = _read_int (ptr + 4 + (4 * i));
+		ch->codec = ptr[1028]; // zero (zlib) in older files
+		ch->loaded = true;
+	}
+	
+	static void
+	load_chunk_header (hw_chunk *ch, binary_reader& reader)
+	{
+		reader.seek (ch->offset * 512ULL);
+		decode_chunk_header (ch, reader.read_raw (1029));
+	}
+	
+	
+	
+	/* 
+	 * Points a table entry at a newly created table (or chunk header).
+	 */
+	static void
+	patch_entry (binary_writer& writer, unsigned long long off, int x, int z,
+		unsigned int offset)
+	{
+		unsigned char buf[12];
+		_write_int (buf, x);
+		_write_int (buf + 4, z);
+		_write_int (buf + 8, offset);
+		writer.patch (off, buf, 12);
+	}
+	
 	static hw_superblock*
 	find_or_create_superblock (int x, int z, hw_superblock **sblocks,
-		binary_writer writer, bool create = true)
+		binary_reader& reader, binary_writer& writer, bool create = true)
 	{
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0xFFF;
@@ -420,23 +1098,16 @@ namespace hCraft {
 			{
 				sblocks[hash_m] = new hw_superblock (x, z);
 				sblock = sblocks[hash_m];
+				sblock->loaded = true;
 		
 				// create the superblock
 				writer.seek (0, std::ios_base::end);
 				sblock->offset = writer.tell () / 512;
-				for (int i = 0; i < 64; ++i)
-					{
-						writer.write_int (0); // x
-						writer.write_int (0); // z
-						writer.write_int (0xFFFFFFFFU); // offset
-					}
+				write_empty_table (writer, 64);
 				writer.pad_to (512);
 		
 				// update file
-				writer.seek (512 + (12 * hash_m));
-				writer.write_int (x);
-				writer.write_int (z);
-				writer.write_int (sblock->offset);
+				patch_entry (writer, 512 + (12 * hash_m), x, z, sblock->offset);
 			}
 		
 		return sblock;
@@ -444,11 +1115,13 @@ namespace hCraft {
 	
 	static hw_block*
 	find_or_create_block (int x, int z, hw_superblock **sblocks,
-		binary_writer writer, bool create = true)
+		binary_reader& reader, binary_writer& writer, bool create = true)
 	{
 		hw_superblock *sblock = find_or_create_superblock (
-			fast_floor (x / 8.0), fast_floor (z / 8.0), sblocks,writer, create);
+			fast_floor (x / 8.0), fast_floor (z / 8.0), sblocks, reader, writer, create);
 		if (!sblock) return nullptr;
+		if (!sblock->loaded)
+			load_superblock (sblock, reader);
 		
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0x3F;
@@ -478,23 +1151,17 @@ namespace hCraft {
 			{
 				sblock->blocks[hash_m] = new hw_block (x, z);
 				block = sblock->blocks[hash_m];
+				block->loaded = true;
 		
 				// create the block
 				writer.seek (0, std::ios_base::end);
 				block->offset = writer.tell () / 512;
-				for (int i = 0; i < 1024; ++i)
-					{
-						writer.write_int (0); // x
-						writer.write_int (0); // z
-						writer.write_int (0xFFFFFFFFU); // offset
-					}
+				write_empty_table (writer, 1024);
 				writer.pad_to (512);
 		
 				// update file
-				writer.seek ((sblock->offset * 512) + (12 * hash_m));
-				writer.write_int (x);
-				writer.write_int (z);
-				writer.write_int (block->offset);
+				patch_entry (writer, (sblock->offset * 512ULL) + (12 * hash_m), x, z,
+					block->offset);
 			}
 		
 		return block;
@@ -502,11 +1169,14 @@ namespace hCraft {
 	
 	static hw_region*
 	find_or_create_region (int x, int z, hw_superblock **sblocks,
-		binary_writer writer, bool create = true)
+		binary_reader& reader, binary_writer& writer, bool create = true)
 	{
 		hw_block *block = find_or_create_block (
-			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, writer, create);
+			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, reader, writer,
+			create);
 		if (!block) return nullptr;
+		if (!block->loaded)
+			load_block (block, reader);
 		
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0x3FF;
@@ -536,23 +1206,17 @@ namespace hCraft {
 			{
 				block->regions[hash_m] = new hw_region (x, z);
 				region = block->regions[hash_m];
+				region->loaded = true;
 		
 				// create the region
 				writer.seek (0, std::ios_base::end);
 				region->offset = writer.tell () / 512;
-				for (int i = 0; i < 1024; ++i)
-					{
-						writer.write_int (0); // x
-						writer.write_int (0); // z
-						writer.write_int (0xFFFFFFFFU); // offset
-					}
+				write_empty_table (writer, 1024);
 				writer.pad_to (512);
 		
 				// update file
-				writer.seek ((block->offset * 512) + (12 * hash_m));
-				writer.write_int (x);
-				writer.write_int (z);
-				writer.write_int (region->offset);
+				patch_entry (writer, (block->offset * 512ULL) + (12 * hash_m), x, z,
+					region->offset);
 			}
 		
 		return region;
@@ -560,12 +1224,16 @@ namespace hCraft {
 	
 	static hw_chunk*
 	find_or_create_chunk (int x, int z, hw_superblock **sblocks,
-		binary_writer writer, bool create = true, bool* got_created = nullptr)
+		binary_reader& reader, binary_writer& writer, bool create = true,
+		bool* got_created = nullptr)
 	{
 		if (got_created) *got_created = false;
 		hw_region *region = find_or_create_region (
-			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, writer, create);
+			fast_floor (x / 32.0), fast_floor (z / 32.0), sblocks, reader, writer,
+			create);
 		if (!region) return nullptr;
+		if (!region->loaded)
+			load_region (region, reader);
 		
 		unsigned int hash = hash_coords (x, z);
 		unsigned int hash_m = hash & 0x3FF;
@@ -574,7 +1242,11 @@ namespace hCraft {
 		if (ch != nullptr)
 			{
 				if (ch->x == x && ch->z == z)
-					return ch;
+					{
+						if (!ch->loaded)
+							load_chunk_header (ch, reader);
+						return ch;
+					}
 				
 				// linear probe
 				int i;
@@ -589,13 +1261,19 @@ namespace hCraft {
 					return nullptr;
 				hash_m = (hash_m + i) & 0x3FF;
 			}
-		if (ch) return ch;
+		if (ch)
+			{
+				if (!ch->loaded)
+					load_chunk_header (ch, reader);
+				return ch;
+			}
 		
 		if (create)
 			{
 				if (got_created) *got_created = true;
 				region->chunks[hash_m] = new hw_chunk (x, z);
 				ch = region->chunks[hash_m];
+				ch->loaded = true;
 		
 				// create the chunk
 				writer.seek (0, std::ios_base::end);
@@ -608,10 +1286,8 @@ namespace hCraft {
 				writer.pad_to (512);
 		
 				// update file
-				writer.seek ((region->offset * 512) + (12 * hash_m));
-				writer.write_int (x);
-				writer.write_int (z);
-				writer.write_int (ch->offset);
+				patch_entry (writer, (region->offset * 512ULL) + (12 * hash_m), x, z,
+					ch->offset);
 			}
 		
 		return ch;
@@ -621,238 +1297,363 @@ namespace hCraft {
 	
 //----
 	
-	static int
-	_write_short (unsigned char *ptr, unsigned short val)
-	{
-		ptr[0] = val & 0xFF;
-		ptr[1] = (val >> 8) & 0xFF;
-		return 2;
-	}
+//----
 	
-	static int
-	_write_int (unsigned char *ptr, unsigned int val)
+	/* 
+	 * Serializes the specified chunk without compressing it.
+	 */
+	unsigned char*
+	hw_provider::serialize (chunk *ch, unsigned int *out_size)
 	{
-		ptr[0] = val & 0xFF;
-		ptr[1] = (val >> 8) & 0xFF;
-		ptr[2] = (val >> 16) & 0xFF;
-		ptr[3] = (val >> 24) & 0xFF;
-		return 4;
+		// the same layout chunks are sent in, preceded by the two bitmaps.
+		unsigned short primary_bitmap, add_bitmap;
+		unsigned char *data = ch->serialize (&primary_bitmap, &add_bitmap,
+			out_size, 4);
+		_write_short (data, primary_bitmap);
+		_write_short (data + 2, add_bitmap);
+		return data;
 	}
 	
 	
-	static unsigned short
-	_read_short (const unsigned char *ptr)
+	
+	/* 
+	 * Serializes the chunk's header (size, sector table and codec), padded to
+	 * three 512-byte units.
+	 */
+	static void
+	make_chunk_header (hw_chunk *hch, unsigned char *out)
 	{
-		return ((unsigned short)ptr[0])
-				 | ((unsigned short)ptr[1] << 8);
+		std::memset (out, 0, 1536);
+		unsigned char *ptr = out;
+		ptr += _write_int (ptr, hch->size);
+		for (unsigned int i = 0; i < 256; ++i)
+			ptr += _write_int (ptr, hch->sector_table[i]);
+		*ptr = hch->codec;
 	}
 	
-	static unsigned int
-	_read_int (const unsigned char *ptr)
+	/* 
+	 * Finds a free run of at least @{units} units that starts before
+	 * @{below}, marks it as used, and returns its offset. Returns zero if
+	 * there is none.
+	 */
+	unsigned int
+	hw_provider::take_free (unsigned int units, unsigned int below)
 	{
-		return ((unsigned int)ptr[0])
-				 | ((unsigned int)ptr[1] << 8)
-				 | ((unsigned int)ptr[2] << 16)
-				 | ((unsigned int)ptr[3] << 24);
+		// first fit, so that data gathers towards the start of the file.
+		for (auto itr = this->free_space.begin (); itr != this->free_space.end ()
+			&& itr->first < below; ++itr)
+			if (itr->second >= units)
+				{
+					unsigned int start = itr->first;
+					unsigned int rem = itr->second - units;
+					this->free_space.erase (itr);
+					if (rem > 0)
+						this->free_space[start + units] = rem;
+					return start;
+				}
+		
+		return 0;
 	}
 	
-	
-	
-//----
-	
-	static unsigned char*
-	make_chunk_data (chunk *ch, unsigned int *out_size)
+	/* 
+	 * Returns the specified run of units to the free space map.
+	 */
+	void
+	hw_provider::release (unsigned int start, unsigned int units)
 	{
-		unsigned short primary_bitmap = 0, add_bitmap = 0;
-		unsigned int   data_size = 0;
-		int i;
-		
-		// calculate size needed for array and create bitmaps
-		for (i = 0; i < 16; ++i)
+		// merge with the runs around it.
+		auto next = this->free_space.lower_bound (start);
+		if (next != this->free_space.end () && next->first == start + units)
+			{
+				units += next->second;
+				next = this->free_space.erase (next);
+			}
+		if (next != this->free_space.begin ())
 			{
-				subchunk *sub = ch->get_sub (i);
-				if (sub && !sub->all_air ())
+				auto prev = std::prev (next);
+				if (prev->first + prev->second == start)
 					{
-						data_size += 10240;
-						primary_bitmap |= (1 << i);
-						
-						if (sub->has_add ())
-							{
-								add_bitmap |= (1 << i);
-								data_size += 2048;
-							}
+						prev->second += units;
+						return;
 					}
 			}
-		data_size += 256; // biome array
-		data_size += 4; // bitmaps
-		
-		/* 
-		 * Create and fill the array:
-		 */
-		unsigned char *data = new unsigned char[data_size];
-		unsigned int n = 0;
-		
-		n += _write_short (data + n, primary_bitmap);
-		n += _write_short (data + n, add_bitmap);
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->ids, 4096); n += 4096; }
 		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->meta, 2048); n += 2048; }
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->blight, 2048); n += 2048; }
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->slight, 2048); n += 2048; }
-		
-		for (i = 0; i < 16; ++i)
-			if (add_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->add, 2048); n += 2048; }
-		
-		std::memcpy (data + n, ch->get_biome_array (), 256);
-		n += 256;
-		
-		*out_size = n;
-		return data;
+		this->free_space[start] = units;
 	}
 	
-	
-	
-	static void
-	write_to_sector (hw_chunk *hch, unsigned int index, unsigned char *data,
-		unsigned int len, binary_writer writer)
+	/* 
+	 * Writes the chunk's data at @{start} (reusing free space or appending to
+	 * the file as needed), updates its header and releases the sectors it
+	 * no longer uses.
+	 */
+	void
+	hw_provider::write_data (hw_chunk *hch, const unsigned char *data,
+		unsigned int size, unsigned int start, binary_writer& writer)
 	{
-		unsigned int sectors_used = hch->size / 4096;
-		if (hch->size % 4096 != 0)
-			++ sectors_used;
-		
-		if (index >= sectors_used)
-			{
-				int sector_offset;
-				
-				// create the sector
-				writer.seek (0, std::ios_base::end);
-				sector_offset = writer.tell () / 512;
-				writer.write_bytes (data, len);
-				if (len < 4096)
-					{
-						int rem = 4096 - len;
-						while (rem-- > 0)
-							writer.write_byte (0);
-					}
-				
-				hch->sector_table[index] = sector_offset;
-				
-				// update file
-				writer.seek ((hch->offset * 512) + 4 + (index * 4));
-				writer.write_int (sector_offset);
-			}
-		else
-			{
-				// overwrite existing sector
-				writer.seek (hch->sector_table[index] * 512);
-				writer.write_bytes (data, len);
-			}
+		static const unsigned char zeroes[4096] = { 0 };
+		
+		unsigned int sector_count = (size + 4095) / 4096;
+		writer.seek (start * 512ULL);
+		writer.write_bytes (data, size);
+		writer.write_bytes (zeroes, (sector_count * 4096) - size);
+		
+		// the header is only updated once the data is in place.
+		unsigned int old_count = (hch->size + 4095) / 4096;
+		unsigned int old_table[256];
+		std::memcpy (old_table, hch->sector_table, sizeof old_table);
+		
+		hch->size = size;
+		for (unsigned int i = 0; i < 256; ++i)
+			hch->sector_table[i] = (i < sector_count) ? (start + (8 * i)) : 0;
+		
+		unsigned char header[1536];
+		make_chunk_header (hch, header);
+		writer.patch (hch->offset * 512ULL, header, 1029);
+		
+		// the old sectors are still in use until the journal is committed.
+		for (unsigned int i = 0; i < old_count; ++i)
+			if (old_table[i] < start || old_table[i] >= start + (8 * sector_count))
+				this->pending_free.emplace_back (old_table[i], 8);
 	}
 	
-	static void
-	write_in_sectors (hw_chunk *hch, unsigned char *data, unsigned int data_size,
-		binary_writer writer)
+	/* 
+	 * Serializes and compresses the specified chunk into the form it is
+	 * stored in within the world file, using the codec the provider was
+	 * given. The first byte of the result names the codec.
+	 */
+	unsigned char*
+	hw_provider::encode (chunk *ch, int x, int z, unsigned int *out_size)
 	{
-		unsigned int sectors_needed = data_size / 4096;
-		if (data_size % 4096 != 0)
-			++ sectors_needed;
+		if (this->codec->id () == CC_BLOB)
+			{
+				// store the chunk's blob as it is, which might not have to be
+				// compressed at all if it was already sent to a player.
+				std::shared_ptr<const chunk_blob> blob = ch->get_blob ();
+				*out_size = 5 + blob->data.size ();
+				unsigned char *encoded = new unsigned char[*out_size];
+				encoded[0] = CC_BLOB;
+				_write_short (encoded + 1, blob->primary_bitmap);
+				_write_short (encoded + 3, blob->add_bitmap);
+				std::memcpy (encoded + 5, blob->data.data (), blob->data.size ());
+				return encoded;
+			}
 		
-		int i, sector_size;
+		unsigned int data_size = 0;
+		unsigned char *data = hw_provider::serialize (ch, &data_size);
 		
-		for (i = 0; i < sectors_needed; ++i)
+		unsigned char *encoded;
+		try
 			{
-				if (i == (sectors_needed - 1))
-					{
-						sector_size = data_size % 4096;
-						if (sector_size == 0)
-							sector_size = 4096;
-					}
-				else
-					sector_size = 4096;
-				
-				write_to_sector (hch, i, data + (4096 * i), sector_size, writer);
+				encoded = this->codec->encode (data, data_size, out_size, 1);
 			}
-		
-		if (hch->size != data_size)
+		catch (...)
 			{
-				hch->size = data_size;
-				writer.seek (hch->offset * 512);
-				writer.write_int (data_size);
+				delete[] data;
+				throw;
 			}
+		delete[] data;
+		
+		encoded[0] = this->codec->id ();
+		return encoded;
 	}
 	
-	static void
-	save_chunk (chunk *ch, int x, int z, hw_superblock **sblocks,
-		world_information& inf, binary_writer writer)
+	/* 
+	 * Writes out a chunk previously encoded with encode ().
+	 */
+	void
+	hw_provider::write (world& wr, int x, int z, const unsigned char *data,
+		unsigned int size)
 	{
-		unsigned char *compressed;
-		unsigned long compressed_size;
-		
-		unsigned int data_size = 0;
-		unsigned char *data = make_chunk_data (ch, &data_size);
-		
-		compressed_size = compressBound (data_size);
-		compressed = new unsigned char[compressed_size];
-		if (compress2 (compressed, &compressed_size, data, data_size,
-			Z_BEST_COMPRESSION) != Z_OK)
+		std::lock_guard<std::recursive_mutex> guard {this->lock};
+		bool close_when_done = false;
+		if (!this->strm.is_open ())
 			{
-				delete[] data;
-				delete[] compressed;
-				throw std::runtime_error ("failed to compress chunk");
+				this->open (wr);
+				if (!this->strm)
+					return;
+				close_when_done = true;
 			}
-		delete[] data;
 		
+		if (!this->space_valid)
+			this->scan ();
+		this->touch ();
+		
+		binary_reader reader {this->map, this->map_size};
+		binary_writer writer {this->strm, &this->journal};
 		bool created;
-		hw_chunk *hch = find_or_create_chunk (x, z, sblocks, writer, &created);
+		hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, reader, writer,
+			true, &created);
 		if (hch)
-			write_in_sectors (hch, compressed, compressed_size, writer);
+			{
+				hch->codec = data[0];
+				++ data;
+				-- size;
+				
+				// never overwrite the chunk's current data, so that it is still
+				// intact if the journal does not make it to disk.
+				unsigned int sector_count = (size + 4095) / 4096;
+				unsigned int start = this->take_free (8 * sector_count);
+				if (!start)
+					{
+						writer.seek (0, std::ios_base::end);
+						start = writer.tell () / 512;
+					}
+				
+				this->write_data (hch, data, size, start, writer);
+			}
 		
 		if (created)
 			{
 				// update chunk count
-				writer.seek (44);
-				writer.write_int (++ (inf.chunk_count));
+				unsigned char buf[4];
+				_write_int (buf, ++ (this->inf.chunk_count));
+				writer.patch (44, buf, 4);
+				
+				this->index[chunk_key (x, z)] = hch->offset;
+				this->index_dirty = true;
 			}
 		
-		delete[] compressed;
+		writer.flush ();
+		if (close_when_done)
+			{
+				this->close ();
+			}
 	}
 	
 	
 	
 	/* 
-	 * Saves only the specified chunk.
+	 * Moves chunk data towards the start of the world file to fill holes
+	 * left by chunks that have shrunk or moved, and truncates the file once
+	 * its tail is unused. Looks at no more than @{max_chunks} chunks, and
+	 * returns false once there is nothing left to compact.
 	 */
-	void
-	hw_provider::save (world& wr, chunk *ch, int x, int z)
+	bool
+	hw_provider::compact (world& wr, int max_chunks)
 	{
+		std::lock_guard<std::recursive_mutex> guard {this->lock};
 		bool close_when_done = false;
 		if (!this->strm.is_open ())
 			{
 				this->open (wr);
 				if (!this->strm)
-					return;
+					return false;
 				close_when_done = true;
 			}
 		
-		binary_writer writer {this->strm};
-		save_chunk (ch, x, z, this->sblocks, this->inf, writer);
+		if (!this->index_valid || !this->space_valid)
+			this->scan ();
 		
-		if (close_when_done)
+		if (this->compact_queue.empty () && !this->free_space.empty ())
 			{
-				this->close ();
+				// start a new pass (only if there are holes to fill), beginning with
+				// the chunks furthest down the file.
+				std::vector<std::pair<unsigned int, unsigned long long>> order;
+				for (auto& entry : this->index)
+					order.emplace_back (entry.second, entry.first);
+				std::sort (order.begin (), order.end ());
+				for (auto& entry : order)
+					this->compact_queue.push_back (entry.second);
+			}
+		
+		if (!this->compact_queue.empty ())
+			{
+				this->touch ();
+				this->strm.flush ();
+				this->remap ();
+			}
+		
+		binary_reader reader {this->map, this->map_size};
+		binary_writer writer {this->strm, &this->journal};
+		std::vector<unsigned char> buf;
+		for (int n = 0; n < max_chunks && !this->compact_queue.empty (); ++n)
+			{
+				unsigned long long key = this->compact_queue.back ();
+				this->compact_queue.pop_back ();
+				
+				int x = (int)(key & 0xFFFFFFFFU), z = (int)(key >> 32);
+				hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, reader,
+					writer, false);
+				if (!hch)
+					continue;
+				
+				// move the chunk's header as well.
+				unsigned int hstart = this->take_free (3, hch->offset);
+				if (hstart)
+					{
+						hw_region *region = find_or_create_region (
+							fast_floor (x / 32.0), fast_floor (z / 32.0), this->sblocks, reader,
+							writer, false);
+						int slot = std::find (region->chunks, region->chunks + 1024, hch)
+							- region->chunks;
+						
+						unsigned char header[1536];
+						make_chunk_header (hch, header);
+						writer.seek (hstart * 512ULL);
+						writer.write_bytes (header, sizeof header);
+						patch_entry (writer, (region->offset * 512ULL) + (12 * slot), x, z,
+							hstart);
+						
+						this->pending_free.emplace_back (hch->offset, 3);
+						hch->offset = hstart;
+						this->index[key] = hstart;
+					}
+				if (hch->size == 0)
+					continue;
+				
+				unsigned int sector_count = (hch->size + 4095) / 4096;
+				unsigned int first = hch->sector_table[0];
+				bool contiguous = true;
+				for (unsigned int i = 1; i < sector_count && contiguous; ++i)
+					if (hch->sector_table[i] != first + (8 * i))
+						contiguous = false;
+				
+				// fragmented chunks are moved anywhere, others only if that brings
+				// them closer to the start of the file.
+				unsigned int start = this->take_free (8 * sector_count,
+					contiguous ? first : 0xFFFFFFFFU);
+				if (!start)
+					{
+						if (contiguous)
+							continue;
+						writer.seek (0, std::ios_base::end);
+						start = writer.tell () / 512;
+					}
+				
+				buf.resize (hch->size);
+				for (unsigned int i = 0; i < sector_count; ++i)
+					{
+						unsigned int len = (i == sector_count - 1)
+							? (hch->size - (4096 * i)) : 4096;
+						reader.seek (hch->sector_table[i] * 512ULL);
+						reader.read_bytes (buf.data () + (4096 * i), len);
+					}
+				this->write_data (hch, buf.data (), hch->size, start, writer);
 			}
+		
+		// cut off unused space at the end of the file.
+		writer.seek (0, std::ios_base::end);
+		unsigned int end = writer.tell () / 512;
+		if (!this->free_space.empty ())
+			{
+				auto last = std::prev (this->free_space.end ());
+				if (last->first + last->second == end)
+					{
+						this->touch ();
+						this->strm.flush ();
+						if (::truncate (this->out_path.c_str (), last->first * 512ULL) == 0)
+							{
+								this->free_space.erase (last);
+								this->remap ();
+							}
+					}
+			}
+		
+		writer.flush ();
+		bool more = !this->compact_queue.empty ();
+		if (close_when_done)
+			this->close ();
+		return more;
 	}
 	
 	
@@ -891,12 +1692,7 @@ namespace hCraft {
 		writer.pad_to (512);
 		
 		// super-block table
-		for (int i = 0; i < 4096; ++i)
-			{
-				writer.write_int (0); // x
-				writer.write_int (0); // z
-				writer.write_int (0xFFFFFFFFU); // offset
-			}
+		write_empty_table (writer, 4096);
 		
 		writer.flush ();
 		
@@ -910,6 +1706,7 @@ namespace hCraft {
 	void
 	hw_provider::save_empty (world &wr)
 	{
+		std::lock_guard<std::recursive_mutex> guard {this->lock};
 		{
 			// check if the file exists
 			std::ifstream strm (this->out_path);
@@ -934,16 +1731,17 @@ namespace hCraft {
 //----
 	
 	static void
-	read_tables (hw_superblock **sblocks, binary_reader reader)
+	read_tables (hw_superblock **sblocks, binary_reader& reader)
 	{
 		reader.seek (512);
 		
-		int sb_x, sb_z, sb_offset;
-		for (int i = 0; i < 4096; ++i)
+		// the tables further down are read in on demand.
+		const unsigned char *ptr = reader.read_raw (12 * 4096);
+		for (int i = 0; i < 4096; ++i, ptr += 12)
 			{
-				sb_x = reader.read_int ();
-				sb_z = reader.read_int ();
-				sb_offset = reader.read_int ();
+				int sb_x = _read_int (ptr);
+				int sb_z = _read_int (ptr + 4);
+				unsigned int sb_offset = _read_int (ptr + 8);
 				if (sb_offset == 0xFFFFFFFFU)
 					{
 						sblocks[i] = nullptr;
@@ -953,80 +1751,11 @@ namespace hCraft {
 				hw_superblock *sblock = new hw_superblock (sb_x, sb_z);
 				sblocks[i] = sblock;
 				sblock->offset = sb_offset;
-				
-				int saved_pos = reader.tell ();
-				int b_x, b_z, b_offset;
-				reader.seek (sblock->offset * 512);
-				for (int i = 0; i < 64; ++i)
-					{
-						b_x = reader.read_int ();
-						b_z = reader.read_int ();
-						b_offset = reader.read_int ();
-						if (b_offset == 0xFFFFFFFFU)
-							{
-								sblock->blocks[i] = nullptr;
-								continue;
-							}
-						
-						hw_block *block = new hw_block (b_x, b_z);
-						sblock->blocks[i] = block;
-						block->offset = b_offset;
-						
-						int saved_pos = reader.tell ();
-						int r_x, r_z, r_offset;
-						reader.seek (block->offset * 512);
-						for (int i = 0; i < 1024; ++i)
-							{
-								r_x = reader.read_int ();
-								r_z = reader.read_int ();
-								r_offset = reader.read_int ();
-								if (r_offset == 0xFFFFFFFFU)
-									{
-										block->regions[i] = nullptr;
-										continue;
-									}
-								
-								hw_region *region = new hw_region (r_x, r_z);
-								block->regions[i] = region;
-								region->offset = r_offset;
-								
-								int saved_pos = reader.tell ();
-								int c_x, c_z, c_offset;
-								reader.seek (region->offset * 512);
-								for (int i = 0; i < 1024; ++i)
-									{
-										c_x = reader.read_int ();
-										c_z = reader.read_int ();
-										c_offset = reader.read_int ();
-										if (c_offset == 0xFFFFFFFFU)
-											{
-												region->chunks[i] = nullptr;
-												continue;
-											}
-										
-										hw_chunk *ch = new hw_chunk (c_x, c_z);
-										region->chunks[i] = ch;
-										ch->offset = c_offset;
-										
-										int saved_pos = reader.tell ();
-										reader.seek (c_offset * 512);
-										
-										ch->size = reader.read_int ();
-										for (int i = 0; i < 256; ++i)
-											ch->sector_table[i] = reader.read_int ();
-										
-										reader.seek (saved_pos);
-									}
-								reader.seek (saved_pos);
-							}
-						reader.seek (saved_pos);
-					}
-				reader.seek (saved_pos);
 			}
 	}
 	
 	static void
-	read_header (world_information& inf, binary_reader reader)
+	read_header (world_information& inf, binary_reader& reader)
 	{
 		reader.seek (4);
 		
@@ -1057,7 +1786,7 @@ namespace hCraft {
 	}
 	
 	static void
-	read_file (world_information& inf, hw_superblock **sblocks, binary_reader reader)
+	read_file (world_information& inf, hw_superblock **sblocks, binary_reader& reader)
 	{
 		read_header (inf, reader);
 		read_tables (sblocks, reader);
@@ -1065,95 +1794,75 @@ namespace hCraft {
 	
 	
 	
-	static unsigned char*
-	combine_sectors (hw_chunk *hch, binary_reader reader, unsigned int *out_size)
+	/* 
+	 * Reads exactly @{len} bytes at offset @{off} from the specified file.
+	 */
+	static bool
+	read_at (int fd, unsigned char *buf, unsigned int len, unsigned long long off)
 	{
-		unsigned int compressed_size = hch->size;
-		*out_size = compressed_size;
-		
-		unsigned char *compressed = new unsigned char[compressed_size];
-		unsigned int n = 0;
-		
-		int sector_index = 0;
-		while (compressed_size > 0)
+		while (len > 0)
 			{
-				int need = (compressed_size >= 4096) ? 4096 : compressed_size;
-				reader.seek (hch->sector_table[sector_index] * 512);
-				reader.read_bytes (compressed + n, need);
-				
-				n += need;
-				compressed_size -= need;
+				ssize_t ret = ::pread (fd, buf, len, off);
+				if (ret <= 0)
+					return false;
+				buf += ret;
+				len -= ret;
+				off += ret;
 			}
-		
-		return compressed;
+		return true;
 	}
 	
 	static void
 	fill_chunk (chunk *ch, const unsigned char *data)
 	{
-		unsigned int n = 0, i;
+		unsigned int i, count = 0, add_count = 0;
 		unsigned short primary_bitmap, add_bitmap;
 		
 		primary_bitmap = _read_short (data + 0);
 		add_bitmap = _read_short (data + 2);
-		n += 4;
 		
-		// create sub-chunks
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{
-					subchunk *sub = ch->create_sub (i, false);
-					sub->air_count = 4096;
-					sub->add_count = 0;
-					sub->add = nullptr;
-				}
+				++ count;
+		
+		const unsigned char *ids = data + 4;
+		const unsigned char *meta = ids + (4096 * count);
+		const unsigned char *blight = meta + (2048 * count);
+		const unsigned char *slight = blight + (2048 * count);
+		const unsigned char *add = slight + (2048 * count);
 		
 		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->ids, data + n, 4096); n += 4096; }
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->meta, data + n, 2048); n += 2048; }
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->blight, data + n, 2048); n += 2048; }
+			if (add_bitmap & (1 << i))
+				++ add_count;
+		
+		unsigned int n = 0;
+		unsigned int a = 0;
 		for (i = 0; i < 16; ++i)
 			if (primary_bitmap & (1 << i))
-				{ std::memcpy (ch->get_sub (i)->slight, data + n, 2048); n += 2048; }
-		for (i = 0; i < 16; ++i)
-			{
-				subchunk *sub = ch->get_sub (i);
-				if (add_bitmap & (1 << i))
-					{
-						sub->add = new unsigned char[2048];
-						std::memcpy (ch->get_sub (i)->add, data + n, 2048); n += 2048;
-					}
-			}
+				{
+					ch->import_sub (i, ids + (4096 * n),
+						(add_bitmap & (1 << i)) ? (add + (2048 * a++)) : nullptr,
+						meta + (2048 * n), blight + (2048 * n), slight + (2048 * n));
+					++ n;
+				}
 		
 		// biomes
-		std::memcpy (ch->get_biome_array (), data + n, 256);
-		n += 256;
+		std::memcpy (ch->get_biome_array (), add + (2048 * add_count), 256);
+	}
+	
+	/* 
+	 * Stores the coordinates of every chunk saved in the world in @{out}.
+	 */
+	void
+	hw_provider::list_chunks (std::vector<chunk_pos>& out)
+	{
+		std::lock_guard<std::recursive_mutex> guard {this->lock};
+		if (!this->index_valid)
+			this->scan ();
 		
-		// calculate add\air count
-		for (i = 0; i < 16; ++i)
-			{
-				subchunk *sub = ch->get_sub (i);
-				if (sub)
-					{
-						for (int j = 0; j < 4096; ++j)
-							{
-								if (sub->ids[j] != 0)
-									-- sub->air_count;
-								if (sub->add && sub->add[j >> 1] != 0)
-									{
-										if (sub->add[j >> 1] >> 4)
-											++ sub->add_count;
-										if (sub->add[j >> 1] & 0xF)
-											++ sub->add_count;
-									}
-							}
-					}
-			}
+		out.reserve (out.size () + this->index.size ());
+		for (auto& entry : this->index)
+			out.emplace_back ((int)(entry.first & 0xFFFFFFFFU), (int)(entry.first >> 32));
 	}
 	
 	/* 
@@ -1164,30 +1873,105 @@ namespace hCraft {
 	bool
 	hw_provider::load (world &wr, chunk *ch, int x, int z)
 	{
-		if (!this->strm.is_open ())
-			return false;
+		hw_chunk header (x, z);
+		{
+			std::lock_guard<std::recursive_mutex> guard {this->lock};
+			
+			// data written through the stream has to reach the file before it can
+			// be read.
+			if (this->strm.is_open ())
+				this->strm.flush ();
+			if (this->fd == -1 && !this->remap ())
+				return false;
+			
+			if (this->index_valid)
+				{
+					// go straight to the chunk's header, skipping the tables.
+					auto itr = this->index.find (chunk_key (x, z));
+					if (itr == this->index.end ())
+						return false;
+					
+					header.offset = itr->second;
+					if ((header.offset * 512ULL + 1029) > this->map_size)
+						this->remap ();
+					binary_reader reader {this->map, this->map_size};
+					load_chunk_header (&header, reader);
+					
+					// the header in the file might not have been updated yet.
+					for (hw_patch& patch : this->journal)
+						if (patch.offset == header.offset * 512ULL && patch.data.size () >= 1029)
+							decode_chunk_header (&header, patch.data.data ());
+				}
+			else
+				{
+					binary_reader reader {this->map, this->map_size};
+					binary_writer writer; // not actually used
+					hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, reader,
+						writer, false);
+					if (!hch) return false;
+					header = *hch;
+				}
+			
+			unsigned int sector_count = (header.size + 4095) / 4096;
+			for (unsigned int i = 0; i < sector_count; ++i)
+				{
+					unsigned long long end = (header.sector_table[i] * 512ULL)
+						+ ((i == sector_count - 1) ? (header.size - (4096 * i)) : 4096);
+					if (end > this->map_size && (!this->remap () || end > this->map_size))
+						throw std::runtime_error ("chunk data lies outside of world file");
+				}
+			
+			++ this->active_loads;
+		}
 		
-		binary_writer writer; // not actually used
-		hw_chunk *hch = find_or_create_chunk (x, z, this->sblocks, writer, false);
-		if (!hch) return false;
+		// the chunk's sectors are left alone until the load is over (see
+		// commit ()), so they can be read without holding the lock.
+		std::vector<unsigned char> src (header.size);
+		bool read_ok = true;
+		unsigned int sector_count = (header.size + 4095) / 4096;
+		for (unsigned int i = 0; i < sector_count && read_ok; )
+			{
+				// read runs of consecutive sectors at once (which is all of them,
+				// except in older files).
+				unsigned int n = 1;
+				while ((i + n) < sector_count &&
+						header.sector_table[i + n] == header.sector_table[i] + (8 * n))
+					++ n;
+				unsigned int len = std::min (4096 * n, header.size - (4096 * i));
+				read_ok = read_at (this->fd, src.data () + (4096 * i), len,
+					header.sector_table[i] * 512ULL);
+				i += n;
+			}
 		
-		binary_reader reader {this->strm};
+		{
+			std::lock_guard<std::recursive_mutex> guard {this->lock};
+			-- this->active_loads;
+		}
+		if (!read_ok)
+			throw std::runtime_error ("failed to read chunk data");
 		
-		unsigned int compressed_size = 0;
-		unsigned char *compressed = combine_sectors (hch, reader, &compressed_size);
+		chunk_codec *dec = chunk_codec::get (header.codec);
+		if (!dec)
+			throw std::runtime_error ("chunk saved with an unknown codec");
 		
-		unsigned long data_size = 524288;
-		unsigned char *data = new unsigned char[data_size];
-		if (uncompress (data, &data_size, compressed, compressed_size) != Z_OK)
+		unsigned char *data = new unsigned char[524288];
+		try
+			{
+				dec->decode (src.data (), header.size, data, 524288);
+			}
+		catch (...)
 			{
-				delete[] compressed;
 				delete[] data;
-				throw std::runtime_error ("failed to decompress chunk");
+				throw;
 			}
-		delete[] compressed;
 		
 		fill_chunk (ch, data);
 		delete[] data;
+		
+		// the chunk can be sent to players as it was loaded.
+		if (header.codec == CC_BLOB && header.size >= 4)
+			ch->set_blob (_read_short (src.data ()), _read_short (src.data () + 2),
+				src.data () + 4, header.size - 4);
 		return true;
 	}
 }
@@ -0,0 +1,262 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "importer.hpp"
+#include "world.hpp"
+#include "worldprovider.hpp"
+#include "worldgenerator.hpp"
+#include "chunk.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <cstdlib>
+
+
+namespace hCraft {
+	namespace importer {
+		
+		/* 
+		 * State shared between the threads converting a world.
+		 */
+		struct import_job
+		{
+			world& wr;
+			world_provider *src;
+			world_provider *dst;
+			
+			// chunks to convert, grouped by region.
+			std::vector<std::vector<chunk_pos>> regions;
+			std::atomic<unsigned int> next;
+			
+			std::mutex load_lock;  // only used if the source can't load concurrently
+			std::mutex write_lock;
+			
+			unsigned int regions_done;
+			unsigned long long chunks_done;
+			unsigned long long chunks_failed;
+			
+			import_job (world& wr, world_provider *src, world_provider *dst)
+				: wr (wr), src (src), dst (dst), next (0)
+			{
+				this->regions_done = 0;
+				this->chunks_done = this->chunks_failed = 0;
+			}
+		};
+		
+		
+		/* 
+		 * Loads and encodes the chunks of one region, then writes them out to
+		 * the destination world in a single batch. Returns false once there are
+		 * no regions left.
+		 */
+		static bool
+		_convert_next (import_job& job)
+		{
+			unsigned int index = job.next.fetch_add (1);
+			if (index >= job.regions.size ())
+				return false;
+			
+			struct encoded { chunk_pos pos; unsigned char *data; unsigned int size; };
+			std::vector<encoded> batch;
+			unsigned long long failed = 0;
+			for (const chunk_pos& pos : job.regions[index])
+				{
+					std::unique_ptr<chunk> ch { new chunk () };
+					try
+						{
+							bool loaded;
+							if (job.src->concurrent_loads ())
+								loaded = job.src->load (job.wr, ch.get (), pos.x, pos.z);
+							else
+								{
+									std::lock_guard<std::mutex> guard {job.load_lock};
+									loaded = job.src->load (job.wr, ch.get (), pos.x, pos.z);
+								}
+							if (!loaded)
+								continue;
+							
+							ch->recalc_heightmap ();
+							unsigned int size;
+							unsigned char *data = job.dst->encode (ch.get (), pos.x, pos.z, &size);
+							batch.push_back ({ pos, data, size });
+						}
+					catch (const std::exception& ex)
+						{
+							std::cerr << "chunk (" << pos.x << ", " << pos.z << "): "
+								<< ex.what () << std::endl;
+							++ failed;
+						}
+				}
+			
+			std::lock_guard<std::mutex> guard {job.write_lock};
+			unsigned long long written = 0;
+			job.dst->open (job.wr);
+			for (encoded& enc : batch)
+				{
+					try
+						{
+							job.dst->write (job.wr, enc.pos.x, enc.pos.z, enc.data, enc.size);
+							++ written;
+						}
+					catch (const std::exception& ex)
+						{
+							std::cerr << "chunk (" << enc.pos.x << ", " << enc.pos.z << "): "
+								<< ex.what () << std::endl;
+							++ failed;
+						}
+					delete[] enc.data;
+				}
+			
+			try
+				{
+					job.dst->close ();
+				}
+			catch (const std::exception& ex)
+				{
+					// none of the batch's chunks can be relied upon.
+					std::cerr << "failed to save " << written << " chunks: " << ex.what ()
+						<< std::endl;
+					failed += written;
+					written = 0;
+				}
+			
+			job.chunks_done += written;
+			job.chunks_failed += failed;
+			++ job.regions_done;
+			std::cout << "\r  " << job.regions_done << "/" << job.regions.size ()
+				<< " regions, " << job.chunks_done << " chunks" << std::flush;
+			return true;
+		}
+		
+		
+		
+		/* 
+		 * Converts a world according to the given command-line arguments (those
+		 * that follow "--import"), printing progress to the standard output.
+		 * Returns the process' exit code.
+		 */
+		int
+		run (int argc, char *argv[])
+		{
+			if (argc < 2)
+				{
+					std::cerr << "usage: hCraft --import <world> <format> [<directory>] [<threads>]" << std::endl;
+					return 1;
+				}
+			
+			const char *world_name = argv[0];
+			const char *dst_format = argv[1];
+			const char *dir = (argc > 2) ? argv[2] : "worlds";
+			int threads = (argc > 3) ? std::atoi (argv[3]) : std::thread::hardware_concurrency ();
+			if (threads < 1)
+				threads = 1;
+			
+			std::string src_format = world_provider::determine (dir, world_name);
+			if (src_format.empty ())
+				{
+					std::cerr << "world \"" << world_name << "\" does not exist in " << dir << std::endl;
+					return 1;
+				}
+			if (src_format == dst_format)
+				{
+					std::cerr << "world \"" << world_name << "\" is already in the "
+						<< dst_format << " format" << std::endl;
+					return 1;
+				}
+			
+			std::unique_ptr<world_provider> src { world_provider::create (
+				src_format.c_str (), dir, world_name) };
+			std::unique_ptr<world_provider> dst { world_provider::create (
+				dst_format, dir, world_name) };
+			if (!dst)
+				{
+					std::cerr << "unknown world format: " << dst_format << std::endl;
+					return 1;
+				}
+			
+			std::vector<chunk_pos> existing;
+			dst->list_chunks (existing);
+			if (!existing.empty ())
+				{
+					std::cerr << "a " << dst_format << " world named \"" << world_name
+						<< "\" already exists in " << dir << std::endl;
+					return 1;
+				}
+			
+			const world_information& winf = src->info ();
+			world_generator *gen = world_generator::create (winf.generator.c_str (), winf.seed);
+			if (!gen)
+				gen = world_generator::create ("flatgrass", winf.seed);
+			world wr (world_name, gen, nullptr);
+			wr.set_size (winf.width, winf.depth);
+			wr.set_spawn (winf.spawn_pos);
+			
+			// group chunks by region, so that every batch written out touches as
+			// few tables and files as possible.
+			std::vector<chunk_pos> chunks;
+			src->list_chunks (chunks);
+			std::map<std::pair<int, int>, std::vector<chunk_pos>> by_region;
+			for (const chunk_pos& pos : chunks)
+				by_region[std::make_pair (pos.x >> 5, pos.z >> 5)].push_back (pos);
+			
+			import_job job { wr, src.get (), dst.get () };
+			job.regions.reserve (by_region.size ());
+			for (auto& entry : by_region)
+				job.regions.push_back (std::move (entry.second));
+			
+			std::cout << "Converting \"" << world_name << "\" from " << src_format
+				<< " to " << dst_format << ": " << chunks.size () << " chunks in "
+				<< job.regions.size () << " regions, " << threads << " thread(s)." << std::endl;
+			
+			auto start = std::chrono::steady_clock::now ();
+			dst->save_empty (wr);
+			
+			auto work = [&job] ()
+				{
+					while (_convert_next (job))
+						;
+				};
+			std::vector<std::thread> workers;
+			for (int i = 1; i < threads; ++i)
+				workers.emplace_back (work);
+			work ();
+			for (std::thread& th : workers)
+				th.join ();
+			
+			dst.reset (); // flushes out anything the provider still holds on to
+			auto end = std::chrono::steady_clock::now ();
+			double secs = std::chrono::duration<double> (end - start).count ();
+			
+			std::cout << std::endl << std::fixed << std::setprecision (1)
+				<< "Done: " << job.chunks_done << " chunks in " << secs << "s ("
+				<< ((secs > 0.0) ? (job.chunks_done / secs) : 0.0) << " chunks/s)";
+			if (job.chunks_failed > 0)
+				std::cout << ", " << job.chunks_failed << " failed";
+			std::cout << "." << std::endl;
+			return (job.chunks_failed > 0) ? 1 : 0;
+		}
+	}
+}
+
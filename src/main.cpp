@@ -18,6 +18,8 @@
 
 #include "logger.hpp"
 #include "server.hpp"
+#include "benchmark.hpp"
+#include "importer.hpp"
 #include <iostream>
 #include <cstring>
 #include <exception>
@@ -26,6 +28,11 @@
 int
 main (int argc, char *argv[])
 {
+	if (argc > 1 && std::strcmp (argv[1], "--benchmark") == 0)
+		return hCraft::benchmark::run (argc - 2, argv + 2);
+	if (argc > 1 && std::strcmp (argv[1], "--import") == 0)
+		return hCraft::importer::run (argc - 2, argv + 2);
+	
 	hCraft::logger log;
 	hCraft::server srv (log);
 	
@@ -0,0 +1,466 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nbt.hpp"
+#include <stdexcept>
+#include <cstring>
+
+
+namespace hCraft {
+	
+	/* 
+	 * Constructs a new empty tag.
+	 */
+	nbt_tag::nbt_tag (nbt_tag_type type, const std::string& name)
+		: type (type), name (name)
+	{
+		this->ival = 0;
+		this->dval = 0.0;
+		this->list_type = NBT_END;
+	}
+	
+	/* 
+	 * Class destructor.
+	 */
+	nbt_tag::~nbt_tag ()
+	{
+		for (nbt_tag *child : this->children)
+			delete child;
+	}
+	
+	
+	
+	/* 
+	 * Returns the compound's child tag named @{name}, or null if it has
+	 * none, or if it is of a different type than @{type} (unless @{type} is
+	 * NBT_END).
+	 */
+	nbt_tag*
+	nbt_tag::find (const char *name, nbt_tag_type type)
+	{
+		if (this->type != NBT_COMPOUND)
+			return nullptr;
+		
+		for (nbt_tag *child : this->children)
+			if (child->name == name)
+				return (type == NBT_END || child->type == type) ? child : nullptr;
+		return nullptr;
+	}
+	
+	/* 
+	 * Shorthands for reading values out of compounds, returning @{def} if
+	 * the value is missing. Integer types are interchangeable.
+	 */
+	
+	long long
+	nbt_tag::get_int (const char *name, long long def)
+	{
+		nbt_tag *tag = this->find (name);
+		if (!tag || tag->type < NBT_BYTE || tag->type > NBT_LONG)
+			return def;
+		return tag->ival;
+	}
+	
+	double
+	nbt_tag::get_double (const char *name, double def)
+	{
+		nbt_tag *tag = this->find (name);
+		if (!tag)
+			return def;
+		if (tag->type == NBT_FLOAT || tag->type == NBT_DOUBLE)
+			return tag->dval;
+		if (tag->type >= NBT_BYTE && tag->type <= NBT_LONG)
+			return (double)tag->ival;
+		return def;
+	}
+	
+	std::string
+	nbt_tag::get_string (const char *name, const std::string& def)
+	{
+		nbt_tag *tag = this->find (name, NBT_STRING);
+		return tag ? tag->sval : def;
+	}
+	
+	
+	
+	/* 
+	 * Appends @{child} to the list or compound, and returns it.
+	 */
+	nbt_tag*
+	nbt_tag::add (nbt_tag *child)
+	{
+		this->children.push_back (child);
+		return child;
+	}
+	
+	/* 
+	 * Shorthands for building compounds.
+	 */
+	
+	nbt_tag*
+	nbt_tag::add_byte (const char *name, int val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_BYTE, name));
+		tag->ival = (signed char)val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_short (const char *name, int val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_SHORT, name));
+		tag->ival = (short)val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_int (const char *name, int val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_INT, name));
+		tag->ival = val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_long (const char *name, long long val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_LONG, name));
+		tag->ival = val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_float (const char *name, float val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_FLOAT, name));
+		tag->dval = val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_double (const char *name, double val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_DOUBLE, name));
+		tag->dval = val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_string (const char *name, const std::string& val)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_STRING, name));
+		tag->sval = val;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_byte_array (const char *name, const unsigned char *data,
+		unsigned int len)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_BYTE_ARRAY, name));
+		tag->bytes.assign (data, data + len);
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_int_array (const char *name, const int *data, unsigned int len)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_INT_ARRAY, name));
+		tag->ints.assign (data, data + len);
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_list (const char *name, nbt_tag_type list_type)
+	{
+		nbt_tag *tag = this->add (new nbt_tag (NBT_LIST, name));
+		tag->list_type = list_type;
+		return tag;
+	}
+	
+	nbt_tag*
+	nbt_tag::add_compound (const char *name)
+	{
+		return this->add (new nbt_tag (NBT_COMPOUND, name));
+	}
+	
+	
+	
+//----
+	
+	/* 
+	 * Everything in NBT is big-endian.
+	 */
+	
+	static void
+	_put (std::vector<unsigned char>& out, unsigned long long val, int size)
+	{
+		for (int i = size - 1; i >= 0; --i)
+			out.push_back ((val >> (i * 8)) & 0xFF);
+	}
+	
+	static void
+	_put_string (std::vector<unsigned char>& out, const std::string& str)
+	{
+		_put (out, str.size (), 2);
+		out.insert (out.end (), str.begin (), str.end ());
+	}
+	
+	static void
+	_write_payload (const nbt_tag *tag, std::vector<unsigned char>& out)
+	{
+		switch (tag->type)
+			{
+			case NBT_BYTE: _put (out, tag->ival, 1); break;
+			case NBT_SHORT: _put (out, tag->ival, 2); break;
+			case NBT_INT: _put (out, tag->ival, 4); break;
+			case NBT_LONG: _put (out, tag->ival, 8); break;
+			
+			case NBT_FLOAT:
+				{
+					float f = tag->dval;
+					unsigned int bits;
+					std::memcpy (&bits, &f, 4);
+					_put (out, bits, 4);
+				}
+				break;
+			
+			case NBT_DOUBLE:
+				{
+					unsigned long long bits;
+					std::memcpy (&bits, &tag->dval, 8);
+					_put (out, bits, 8);
+				}
+				break;
+			
+			case NBT_BYTE_ARRAY:
+				_put (out, tag->bytes.size (), 4);
+				out.insert (out.end (), tag->bytes.begin (), tag->bytes.end ());
+				break;
+			
+			case NBT_STRING:
+				_put_string (out, tag->sval);
+				break;
+			
+			case NBT_LIST:
+				_put (out, tag->children.empty () ? tag->list_type
+					: tag->children[0]->type, 1);
+				_put (out, tag->children.size (), 4);
+				for (const nbt_tag *child : tag->children)
+					_write_payload (child, out);
+				break;
+			
+			case NBT_COMPOUND:
+				for (const nbt_tag *child : tag->children)
+					child->write (out);
+				out.push_back (NBT_END);
+				break;
+			
+			case NBT_INT_ARRAY:
+				_put (out, tag->ints.size (), 4);
+				for (int val : tag->ints)
+					_put (out, (unsigned int)val, 4);
+				break;
+			
+			default: break;
+			}
+	}
+	
+	/* 
+	 * Appends the tag (along with its name) in its binary form to @{out}.
+	 */
+	void
+	nbt_tag::write (std::vector<unsigned char>& out) const
+	{
+		out.push_back (this->type);
+		_put_string (out, this->name);
+		_write_payload (this, out);
+	}
+	
+	
+	
+	namespace {
+		
+		class nbt_parser
+		{
+			const unsigned char *data;
+			unsigned int len;
+			unsigned int pos;
+			
+		public:
+			nbt_parser (const unsigned char *data, unsigned int len)
+				: data (data), len (len), pos (0)
+				{ }
+			
+			const unsigned char*
+			take (unsigned int count)
+			{
+				if (count > this->len - this->pos)
+					throw std::runtime_error ("unexpected end of NBT data");
+				const unsigned char *ptr = this->data + this->pos;
+				this->pos += count;
+				return ptr;
+			}
+			
+			unsigned long long
+			get (int size)
+			{
+				const unsigned char *ptr = this->take (size);
+				unsigned long long val = 0;
+				for (int i = 0; i < size; ++i)
+					val = (val << 8) | ptr[i];
+				return val;
+			}
+			
+			std::string
+			get_string ()
+			{
+				unsigned int size = this->get (2);
+				const char *ptr = (const char *)this->take (size);
+				return std::string (ptr, size);
+			}
+			
+			unsigned int
+			get_count (unsigned int elem_size)
+			{
+				int count = (int)this->get (4);
+				if (count < 0 || (unsigned int)count > (this->len - this->pos) / elem_size)
+					throw std::runtime_error ("invalid NBT array length");
+				return count;
+			}
+			
+			void
+			read_payload (nbt_tag *tag, int depth)
+			{
+				if (depth > 512)
+					throw std::runtime_error ("NBT data nested too deeply");
+				
+				switch (tag->type)
+					{
+					case NBT_BYTE: tag->ival = (signed char)this->get (1); break;
+					case NBT_SHORT: tag->ival = (short)this->get (2); break;
+					case NBT_INT: tag->ival = (int)this->get (4); break;
+					case NBT_LONG: tag->ival = (long long)this->get (8); break;
+					
+					case NBT_FLOAT:
+						{
+							unsigned int bits = this->get (4);
+							float f;
+							std::memcpy (&f, &bits, 4);
+							tag->dval = f;
+						}
+						break;
+					
+					case NBT_DOUBLE:
+						{
+							unsigned long long bits = this->get (8);
+							std::memcpy (&tag->dval, &bits, 8);
+						}
+						break;
+					
+					case NBT_BYTE_ARRAY:
+						{
+							unsigned int count = this->get_count (1);
+							const unsigned char *ptr = this->take (count);
+							tag->bytes.assign (ptr, ptr + count);
+						}
+						break;
+					
+					case NBT_STRING:
+						tag->sval = this->get_string ();
+						break;
+					
+					case NBT_LIST:
+						{
+							tag->list_type = (nbt_tag_type)this->get (1);
+							if (tag->list_type > NBT_INT_ARRAY)
+								throw std::runtime_error ("invalid NBT tag type");
+							unsigned int count = this->get_count (1);
+							if (tag->list_type == NBT_END)
+								break;
+							for (unsigned int i = 0; i < count; ++i)
+								this->read_payload (tag->add (new nbt_tag (tag->list_type)),
+									depth + 1);
+						}
+						break;
+					
+					case NBT_COMPOUND:
+						{
+							nbt_tag *child;
+							while ((child = this->read_named (depth + 1)) != nullptr)
+								tag->add (child);
+						}
+						break;
+					
+					case NBT_INT_ARRAY:
+						{
+							unsigned int count = this->get_count (4);
+							tag->ints.resize (count);
+							for (unsigned int i = 0; i < count; ++i)
+								tag->ints[i] = (int)this->get (4);
+						}
+						break;
+					
+					default: break;
+					}
+			}
+			
+			/* 
+			 * Reads a named tag, returning null on a TAG_End.
+			 */
+			nbt_tag*
+			read_named (int depth)
+			{
+				nbt_tag_type type = (nbt_tag_type)this->get (1);
+				if (type == NBT_END)
+					return nullptr;
+				if (type > NBT_INT_ARRAY)
+					throw std::runtime_error ("invalid NBT tag type");
+				
+				nbt_tag *tag = new nbt_tag (type);
+				try
+					{
+						tag->name = this->get_string ();
+						this->read_payload (tag, depth);
+					}
+				catch (...)
+					{
+						delete tag;
+						throw;
+					}
+				return tag;
+			}
+		};
+	}
+	
+	/* 
+	 * Parses a named tag (usually a compound) out of @{len} bytes at @{data}.
+	 * Throws an std::runtime_error if the data is malformed. The returned
+	 * tree must be freed with delete.
+	 */
+	nbt_tag*
+	nbt_tag::parse (const unsigned char *data, unsigned int len)
+	{
+		nbt_parser parser (data, len);
+		nbt_tag *tag = parser.read_named (0);
+		if (!tag)
+			throw std::runtime_error ("empty NBT data");
+		return tag;
+	}
+}
+
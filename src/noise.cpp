@@ -0,0 +1,247 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "noise.hpp"
+#include <random>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define HCRAFT_NOISE_AVX2
+#	include <immintrin.h>
+#endif
+
+
+namespace hCraft {
+	
+	/* 
+	 * Constructs a new noise source from the given seed.
+	 */
+	perlin_noise::perlin_noise (long seed)
+	{
+		// std::shuffle's output is implementation-defined, so the permutation
+		// is shuffled by hand to keep worlds identical across platforms.
+		std::minstd_rand rnd (seed & 0x7FFFFFFF);
+		for (int i = 0; i < 256; ++i)
+			this->perm[i] = i;
+		for (int i = 255; i > 0; --i)
+			{
+				int j = rnd () % (i + 1);
+				int t = this->perm[i];
+				this->perm[i] = this->perm[j];
+				this->perm[j] = t;
+			}
+		for (int i = 0; i < 256; ++i)
+			this->perm[256 + i] = this->perm[i];
+	}
+	
+	
+	
+//----
+	
+	static inline float
+	_fade (float t)
+	{
+		float t3 = (t * t) * t;
+		return t3 * ((t * ((t * 6.0f) - 15.0f)) + 10.0f);
+	}
+	
+	static inline float
+	_lerp (float t, float a, float b)
+		{ return a + (t * (b - a)); }
+	
+	static inline float
+	_grad (int h, float x, float z)
+		{ return ((h & 1) ? -x : x) + ((h & 2) ? -z : z); }
+	
+	
+	/* 
+	 * Returns the value of the noise (roughly between -1 and 1) at the
+	 * given point.
+	 */
+	float
+	perlin_noise::noise (float x, float z) const
+	{
+		float fx = std::floor (x), fz = std::floor (z);
+		int ix = (int)fx & 255, iz = (int)fz & 255;
+		x -= fx;
+		z -= fz;
+		
+		float u = _fade (x);
+		float v = _fade (z);
+		
+		const int *p = this->perm;
+		int a = p[ix] + iz, b = p[ix + 1] + iz;
+		return _lerp (v,
+			_lerp (u, _grad (p[a], x, z), _grad (p[b], x - 1.0f, z)),
+			_lerp (u, _grad (p[a + 1], x, z - 1.0f), _grad (p[b + 1], x - 1.0f, z - 1.0f)));
+	}
+	
+	
+	
+#ifdef HCRAFT_NOISE_AVX2
+	
+	__attribute__ ((target ("avx2"))) static inline __m256
+	_fade_avx2 (__m256 t)
+	{
+		__m256 t3 = _mm256_mul_ps (_mm256_mul_ps (t, t), t);
+		__m256 r = _mm256_sub_ps (_mm256_mul_ps (t, _mm256_set1_ps (6.0f)),
+			_mm256_set1_ps (15.0f));
+		r = _mm256_add_ps (_mm256_mul_ps (t, r), _mm256_set1_ps (10.0f));
+		return _mm256_mul_ps (t3, r);
+	}
+	
+	__attribute__ ((target ("avx2"))) static inline __m256
+	_lerp_avx2 (__m256 t, __m256 a, __m256 b)
+		{ return _mm256_add_ps (a, _mm256_mul_ps (t, _mm256_sub_ps (b, a))); }
+	
+	/* 
+	 * Flips the sign of x and z according to bits 0 and 1 of the hash.
+	 */
+	__attribute__ ((target ("avx2"))) static inline __m256
+	_grad_avx2 (__m256i h, __m256 x, __m256 z)
+	{
+		__m256i one = _mm256_set1_epi32 (1);
+		__m256 xs = _mm256_castsi256_ps (_mm256_slli_epi32 (
+			_mm256_and_si256 (h, one), 31));
+		__m256 zs = _mm256_castsi256_ps (_mm256_slli_epi32 (
+			_mm256_and_si256 (_mm256_srli_epi32 (h, 1), one), 31));
+		return _mm256_add_ps (_mm256_xor_ps (x, xs), _mm256_xor_ps (z, zs));
+	}
+	
+	__attribute__ ((target ("avx2"))) static int
+	_noise_row_avx2 (const int *p, float *out, float x0, float z, float step,
+		int n)
+	{
+		float fz = std::floor (z);
+		int iz = (int)fz & 255;
+		z -= fz;
+		
+		__m256 vz = _mm256_set1_ps (z);
+		__m256 vz1 = _mm256_set1_ps (z - 1.0f);
+		__m256 v = _mm256_set1_ps (_fade (z));
+		__m256i viz = _mm256_set1_epi32 (iz);
+		__m256i one = _mm256_set1_epi32 (1);
+		__m256i mask = _mm256_set1_epi32 (255);
+		__m256i lanes = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7);
+		__m256 vx0 = _mm256_set1_ps (x0);
+		__m256 vstep = _mm256_set1_ps (step);
+		__m256 fone = _mm256_set1_ps (1.0f);
+		
+		int i;
+		for (i = 0; (i + 8) <= n; i += 8)
+			{
+				__m256 idx = _mm256_cvtepi32_ps (_mm256_add_epi32 (
+					_mm256_set1_epi32 (i), lanes));
+				__m256 x = _mm256_add_ps (vx0, _mm256_mul_ps (idx, vstep));
+				__m256 fx = _mm256_floor_ps (x);
+				__m256i ix = _mm256_and_si256 (_mm256_cvttps_epi32 (fx), mask);
+				x = _mm256_sub_ps (x, fx);
+				__m256 x1 = _mm256_sub_ps (x, fone);
+				
+				__m256 u = _fade_avx2 (x);
+				
+				__m256i a = _mm256_add_epi32 (_mm256_i32gather_epi32 (p, ix, 4), viz);
+				__m256i b = _mm256_add_epi32 (_mm256_i32gather_epi32 (p,
+					_mm256_add_epi32 (ix, one), 4), viz);
+				
+				__m256 r = _lerp_avx2 (v,
+					_lerp_avx2 (u,
+						_grad_avx2 (_mm256_i32gather_epi32 (p, a, 4), x, vz),
+						_grad_avx2 (_mm256_i32gather_epi32 (p, b, 4), x1, vz)),
+					_lerp_avx2 (u,
+						_grad_avx2 (_mm256_i32gather_epi32 (p, _mm256_add_epi32 (a, one), 4), x, vz1),
+						_grad_avx2 (_mm256_i32gather_epi32 (p, _mm256_add_epi32 (b, one), 4), x1, vz1)));
+				_mm256_storeu_ps (out + i, r);
+			}
+		
+		return i;
+	}
+	
+	static bool
+	_have_avx2 ()
+	{
+		static bool result = __builtin_cpu_supports ("avx2");
+		return result;
+	}
+	
+#endif
+	
+	
+	/* 
+	 * Evaluates the noise at @{n} points starting from (@{x}, @{z}) and
+	 * moving along the X axis by @{step} units each time.
+	 */
+	void
+	perlin_noise::noise_row (float *out, float x, float z, float step, int n) const
+	{
+		int i = 0;
+#ifdef HCRAFT_NOISE_AVX2
+		if (_have_avx2 ())
+			i = _noise_row_avx2 (this->perm, out, x, z, step, n);
+#endif
+		
+		for (; i < n; ++i)
+			out[i] = this->noise (x + ((float)i * step), z);
+	}
+	
+	/* 
+	 * Fills @{out} with a @{nx} by @{nz} grid (stored row after row, X
+	 * varying fastest) of fractal noise, made out of @{octaves} layers of
+	 * noise, each twice the frequency of the previous, and @{persistence}
+	 * times its amplitude. The result is normalized back to [-1, 1].
+	 */
+	void
+	perlin_noise::fill (float *out, float x, float z, float step, int nx,
+		int nz, int octaves, float persistence) const
+	{
+		float row[64];
+		
+		float total_amp = 0.0f;
+		float amp = 1.0f;
+		for (int o = 0; o < octaves; ++o)
+			{ total_amp += amp; amp *= persistence; }
+		
+		for (int j = 0; j < nz; ++j)
+			{
+				float *dest = out + (j * nx);
+				for (int i = 0; i < nx; ++i)
+					dest[i] = 0.0f;
+				
+				float freq = 1.0f;
+				amp = 1.0f / total_amp;
+				for (int o = 0; o < octaves; ++o)
+					{
+						for (int k = 0; k < nx; k += 64)
+							{
+								int count = ((nx - k) < 64) ? (nx - k) : 64;
+								// shift every octave a bit, so that they don't all
+								// line up (and vanish) at the lattice points.
+								float shift = o * 37.3f;
+								this->noise_row (row, ((x + (k * step)) * freq) + shift,
+									((z + (j * step)) * freq) + shift, step * freq, count);
+								for (int i = 0; i < count; ++i)
+									dest[k + i] += row[i] * amp;
+							}
+						
+						freq *= 2.0f;
+						amp *= persistence;
+					}
+			}
+	}
+}
+
@@ -725,81 +725,20 @@ namespace hCraft {
 	packet*
 	packet::make_chunk (int x, int z, chunk *ch)
 	{
-		int data_size = 0, n = 0, i;
-		unsigned short primary_bitmap = 0, add_bitmap = 0;
+		// chunks are only compressed again if they have changed since the last
+		// time they were sent (or saved).
+		std::shared_ptr<const chunk_blob> blob = ch->get_blob ();
 		
-		// create bitmaps and calculate the size of the uncompressed data array.
-		data_size += 256; // biome array
-		for (i = 0; i < 16; ++i)
-			{
-				subchunk *sub = ch->get_sub (i);
-				if (sub && !sub->all_air ())
-					{
-						primary_bitmap |= (1 << i);
-						data_size += 10240;
-						
-						if (sub->has_add ())
-							{ add_bitmap |= (1 << i); data_size += 2048; }
-					}
-			}
-		
-		unsigned char *data = new unsigned char[data_size];
-		
-		// fill the array.
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->ids, 4096);
-					n += 4096; }
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->meta, 2048);
-					n += 2048; }
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->blight, 2048);
-					n += 2048; }
-		
-		for (i = 0; i < 16; ++i)
-			if (primary_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->slight, 2048);
-					n += 2048; }
-		
-		for (i = 0; i < 16; ++i)
-			if (add_bitmap & (1 << i))
-				{ std::memcpy (data + n, ch->get_sub (i)->add, 2048);
-					n += 2048; }
-		
-		std::memcpy (data + n, ch->get_biome_array (), 256);
-		n += 256;
-		
-		// compress.
-		unsigned long compressed_size = compressBound (data_size);
-		unsigned char *compressed = new unsigned char[compressed_size];
-		if (compress2 (compressed, &compressed_size, data, data_size,
-			Z_BEST_COMPRESSION) != Z_OK)
-			{
-				delete[] compressed;
-				delete[] data;
-				return nullptr;
-			}
-		
-		delete[] data;
-		
-		// and finally, create the packet.
-		packet* pack = new packet (18 + compressed_size);
+		packet* pack = new packet (18 + blob->data.size ());
 		
 		pack->put_byte (0x33);
 		pack->put_int (x);
 		pack->put_int (z);
 		pack->put_bool (true); // ground-up continuous
-		pack->put_short (primary_bitmap);
-		pack->put_short (add_bitmap);
-		pack->put_int (compressed_size);
-		pack->put_bytes (compressed, compressed_size);
-		delete[] compressed;
+		pack->put_short (blob->primary_bitmap);
+		pack->put_short (blob->add_bitmap);
+		pack->put_int (blob->data.size ());
+		pack->put_bytes (blob->data.data (), blob->data.size ());
 		
 		return pack;
 	}
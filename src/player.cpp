@@ -58,7 +58,15 @@ namespace hCraft {
 		
 		this->logged_in = false;
 		this->fail = false;
+		this->tasks = 0;
 		this->kicked = false;
+		this->out_bytes = 0;
+		this->out_current = nullptr;
+		for (int i = 0; i < OL_COUNT; ++i)
+			this->out_credits[i] = 0;
+		this->congested = false;
+		this->overflowed = false;
+		this->flush_queued = false;
 		this->handshake = false;
 		
 		this->total_read = 0;
@@ -66,12 +74,18 @@ namespace hCraft {
 		
 		this->curr_world = nullptr;
 		this->curr_chunk = chunk_pos (0, 0);
+		this->view_radius = -1;
+		this->view_complete = false;
 		this->ping_waiting = false;
 		
 		this->last_ping = std::chrono::system_clock::now ();
 		
 		this->evbase = evbase;
-		this->bufev  = bufferevent_socket_new (evbase, sock, 0);
+		
+		// callbacks are run without the bufferevent's lock held, since they take
+		// out_lock, which send () holds while writing to the bufferevent.
+		this->bufev  = bufferevent_socket_new (evbase, sock, BEV_OPT_THREADSAFE
+			| BEV_OPT_DEFER_CALLBACKS | BEV_OPT_UNLOCK_CALLBACKS);
 		if (!this->bufev)
 			{ this->fail = true; return; }
 		
@@ -102,12 +116,14 @@ namespace hCraft {
 		
 		{
 			std::lock_guard<std::mutex> guard {this->out_lock};
-			while (!this->out_queue.empty ())
-				{
-					packet *top = this->out_queue.front ();
-					delete top;
-					this->out_queue.pop ();
-				}
+			for (auto& lane : this->out_lanes)
+				while (!lane.empty ())
+					{
+						packet *top = lane.front ();
+						delete top;
+						lane.pop ();
+					}
+			delete this->out_current;
 		}
 	}
 	
@@ -161,6 +177,7 @@ namespace hCraft {
 						/* finished reading packet */
 						unsigned char *data = new unsigned char [pl->total_read];
 						std::memcpy (data, pl->rdbuf, pl->total_read);
+						++ pl->tasks;
 						pl->get_server ().get_thread_pool ().enqueue (
 							[pl] (void *ctx)
 								{
@@ -175,6 +192,7 @@ namespace hCraft {
 											pl->log (LT_ERROR) << "Exception: " << ex.what () << std::endl;
 											pl->disconnect ();
 										}
+									-- pl->tasks;
 								}, data);
 						
 						pl->total_read = 0;
@@ -192,14 +210,18 @@ namespace hCraft {
 		int opcode;
 		
 		std::lock_guard<std::mutex> guard {pl->out_lock};
-		if (!pl->out_queue.empty ())
+		if (pl->out_current)
 			{
 				// dispose of the packet that we just completed sending.
-				packet *pack = pl->out_queue.front ();
-				pl->out_queue.pop ();
+				packet *pack = pl->out_current;
+				pl->out_current = nullptr;
 				opcode = pack->data[0];
+				pl->out_bytes -= pack->size;
 				delete pack;
 				
+				if (pl->congested && (pl->out_bytes < player::out_low_mark ()))
+					pl->congested = false;
+				
 				if (pl->kicked && (opcode == 0xFF))
 					{
 						if (pl->kick_msg[0] == '\0')
@@ -211,12 +233,10 @@ namespace hCraft {
 						return;
 					}
 				
-				// if the queue has more packets, send the next one.
-				if (!pl->out_queue.empty ())
-					{
-						packet *pack = pl->out_queue.front ();
-						bufferevent_write (bufev, pack->data, pack->size);
-					}
+				// if there are more packets queued, send the next one.
+				pl->out_current = pl->next_out_packet ();
+				if (pl->out_current)
+					bufferevent_write (bufev, pl->out_current->data, pl->out_current->size);
 			}
 	}
 	
@@ -245,8 +265,7 @@ namespace hCraft {
 	void
 	player::disconnect (bool silent)
 	{
-		if (this->bad ()) return;
-		this->fail = true;
+		if (this->fail.exchange (true)) return;
 		
 		if (!silent)
 			log () << this->get_username () << " has disconnected." << std::endl;
@@ -263,18 +282,40 @@ namespace hCraft {
 						this->get_server ().get_players ().message_nowrap (ss.str ());
 					}
 				
-				chunk *curr_chunk = this->curr_world->get_chunk (
-					this->curr_chunk.x, this->curr_chunk.z);
-				if (curr_chunk)
-					curr_chunk->remove_entity (this);
+				this->curr_world->get_entities ().remove (this);
+				
+				// despawn from other players (and them from us, so that they stop
+				// sending us their movement).
+				std::vector<player *> others;
+				{
+					std::lock_guard<std::mutex> guard {this->observer_lock};
+					for (auto& ent : this->observers)
+						others.push_back (ent.first);
+				}
 				
-				// despawn from other players.
-				std::lock_guard<std::mutex> guard {this->visible_player_lock};
-				for (player *pl : this->visible_players)
+				for (player *pl : others)
 					{
 						this->despawn_from (pl);
+						pl->despawn_from (this);
 					}
 			}
+		
+		this->get_server ().retire_player (this);
+	}
+	
+	/* 
+	 * Frees the player's bufferevent, so that no more libevent callbacks
+	 * are invoked on the player. Must be called from the thread that runs
+	 * the player's event base.
+	 */
+	void
+	player::close_connection ()
+	{
+		if (this->bufev)
+			{
+				bufferevent_free (this->bufev);
+				this->bufev = nullptr;
+			}
 	}
 	
 	/* 
@@ -294,24 +335,228 @@ namespace hCraft {
 	
 	
 	
+	static inline int
+	read_int (const unsigned char *data)
+	{
+		return (int)(((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16)
+			| ((unsigned int)data[2] << 8) | (unsigned int)data[3]);
+	}
+	
+	/* 
+	 * Picks the lane that the specified outgoing packet goes into.
+	 * Must be called with the output lock held.
+	 */
+	player_out_lane
+	player::out_lane (packet *pack)
+	{
+		switch (pack->data[0])
+			{
+				case 0x00: // keep alive
+				case 0x01: // login
+				case 0x02: // handshake
+				case 0x06: // spawn position
+				case 0x08: // update health
+				case 0x09: // respawn
+				case 0x0D: // player position and look
+				case 0x46: // change game state
+				case 0xFF: // kick
+					return OL_CONTROL;
+				
+				case 0x03: // chat message
+				case 0xC9: // player list item
+					return OL_CHAT;
+				
+				case 0x33: // chunk data
+				case 0x38: // map chunk bulk
+					return OL_BULK;
+				
+				/* 
+				 * A block change must not overtake the chunk it modifies: the chunk
+				 * was encoded when it was queued, so the client would end up with
+				 * the old block.
+				 */
+				case 0x34: // multi block change
+				case 0x35: // block change
+					{
+						int cx, cz;
+						if (pack->data[0] == 0x34)
+							{
+								cx = read_int (pack->data + 1);
+								cz = read_int (pack->data + 5);
+							}
+						else
+							{
+								cx = utils::div (read_int (pack->data + 1), 16);
+								cz = utils::div (read_int (pack->data + 6), 16);
+							}
+						
+						if (this->out_chunks.count (chunk_pos (cx, cz)) > 0)
+							return OL_BULK;
+						return OL_UPDATES;
+					}
+				
+				default:
+					return OL_UPDATES;
+			}
+	}
+	
+	/* 
+	 * Removes and returns the next packet that should be written to the
+	 * socket, or null if there are none. Must be called with the output
+	 * lock held.
+	 * 
+	 * Control packets always go first. The other lanes share the socket in a
+	 * weighted round-robin, where each round a lane may send up to its weight
+	 * in packets, so that bulk data is never starved completely.
+	 */
+	packet*
+	player::next_out_packet ()
+	{
+		static const int weights[OL_COUNT] = { 0, 8, 4, 1 };
+		
+		packet *pack = nullptr;
+		if (!this->out_lanes[OL_CONTROL].empty ())
+			{
+				pack = this->out_lanes[OL_CONTROL].front ();
+				this->out_lanes[OL_CONTROL].pop ();
+				return pack;
+			}
+		
+		for (int round = 0; round < 2 && !pack; ++round)
+			{
+				for (int i = OL_CONTROL + 1; i < OL_COUNT; ++i)
+					if (!this->out_lanes[i].empty () && this->out_credits[i] > 0)
+						{
+							-- this->out_credits[i];
+							pack = this->out_lanes[i].front ();
+							this->out_lanes[i].pop ();
+							break;
+						}
+				
+				// all lanes with packets in them have used up their share.
+				if (!pack)
+					for (int i = 0; i < OL_COUNT; ++i)
+						this->out_credits[i] = weights[i];
+			}
+		
+		if (pack && (pack->data[0] == 0x33))
+			{
+				auto itr = this->out_chunks.find (chunk_pos (read_int (pack->data + 1),
+					read_int (pack->data + 5)));
+				if (itr != this->out_chunks.end () && (-- itr->second) == 0)
+					this->out_chunks.erase (itr);
+			}
+		
+		return pack;
+	}
+	
+	
+	
 	/* 
 	 * Inserts the specified packet into the player's queue of outgoing packets.
 	 */
 	void
 	player::send (packet *pack)
 	{
-		if (this->bad ())
+		if (this->bad () || this->overflowed)
 			{ delete pack; return; }
 		
 		std::lock_guard<std::mutex> guard {this->out_lock};
-		this->out_queue.push (pack);
-		if (this->out_queue.size () == 1)
+		player_out_lane lane = this->out_lane (pack);
+		this->out_lanes[lane].push (pack);
+		if (lane == OL_BULK && pack->data[0] == 0x33)
+			++ this->out_chunks[chunk_pos (read_int (pack->data + 1), read_int (pack->data + 5))];
+		this->out_bytes += pack->size;
+		if (!this->congested && (this->out_bytes > player::out_high_mark ()))
+			{
+				this->congested = true;
+				++ player::get_output_stats ().congestions;
+			}
+		
+		// the player is disconnected on its next tick, this might be called
+		// with locks held that disconnect () needs.
+		if (this->out_bytes > player::out_hard_cap ())
+			this->overflowed = true;
+		
+		if (!this->out_current)
 			{
 				// initiate write
-				bufferevent_write (this->bufev, pack->data, pack->size);
+				this->out_current = this->next_out_packet ();
+				bufferevent_write (this->bufev, this->out_current->data,
+					this->out_current->size);
 			}
 	}
 	
+	/* 
+	 * Returns the number of bytes queued to the player but not sent yet.
+	 */
+	unsigned long long
+	player::get_queued_bytes ()
+	{
+		std::lock_guard<std::mutex> guard {this->out_lock};
+		return this->out_bytes;
+	}
+	
+	/* 
+	 * Returns the server-wide output backpressure counters.
+	 */
+	player_output_stats&
+	player::get_output_stats ()
+	{
+		static player_output_stats stats {};
+		return stats;
+	}
+	
+	
+	
+	/* 
+	 * Calls @{f} on every player in world @{wr}, other than @{except}, that is
+	 * standing within @{radius} chunks of @{center}, along with the chunk
+	 * they are standing in. Takes a single grid query.
+	 */
+	static void
+	players_near (world *wr, chunk_pos center, int radius, player *except,
+		std::function<void (player *, chunk_pos)> f)
+	{
+		std::vector<std::pair<entity *, chunk_pos>> ents;
+		wr->get_entities ().query_radius (center, radius, ents);
+		for (auto& ent : ents)
+			if (ent.first->get_type () == ET_PLAYER)
+				{
+					player *pl = dynamic_cast<player *> (ent.first);
+					if (pl != except)
+						f (pl, ent.second);
+				}
+	}
+	
+	/* 
+	 * Spawns @{me} to every player standing in one of the chunks in
+	 * @{chunks} and vice-versa (or despawns them, if @{spawn} is false). The
+	 * chunks must all lie within @{radius} chunks of @{center}.
+	 */
+	static void
+	exchange_spawns (player *me, world *wr, chunk_pos center, int radius,
+		const chunk_ring& chunks, bool spawn)
+	{
+		players_near (wr, center, radius, me,
+			[me, &chunks, spawn] (player *pl, chunk_pos cpos)
+				{
+					if (!chunks.contains (cpos.x, cpos.z))
+						return;
+					
+					if (spawn)
+						{
+							me->spawn_to (pl);
+							pl->spawn_to (me);
+						}
+					else
+						{
+							me->despawn_from (pl);
+							pl->despawn_from (me);
+						}
+				});
+	}
+	
 	
 	
 	/* 
@@ -347,15 +592,14 @@ namespace hCraft {
 				
 				// despawn self from other players (and vice-versa).
 				player *me = this;
+				chunk_pos cpos = curr_pos;
+				int r = player::chunk_radius ();
 				this->curr_world->get_players ().remove (this);
-				this->curr_world->get_players ().all (
-					[me] (player *pl)
+				players_near (this->curr_world, cpos, r, me,
+					[me] (player *pl, chunk_pos)
 						{
-							if (me->visible_to (pl))
-								{
-									me->despawn_from (pl);
-									pl->despawn_from (me);
-								}
+							me->despawn_from (pl);
+							pl->despawn_from (me);
 						});
 				
 				// this ensures smooth transitions between worlds:
@@ -381,112 +625,300 @@ namespace hCraft {
 	
 	
 //--
-	class chunk_pos_less
+	/* 
+	 * Every offset within chunk_ring::max_radius () of a chunk, sorted by
+	 * distance, so that walking it visits a square outwards in a spiral.
+	 * rank () gives the position of an offset in that order.
+	 */
+	struct spiral_table
 	{
-		chunk_pos origin;
+		static constexpr int span = 2 * chunk_ring::max_radius () + 1;
 		
-	private:
-		double
-		distance (const chunk_pos c1, const chunk_pos c2) const
+		std::vector<chunk_pos> order;
+		int ranks[span][span];
+		
+		spiral_table ()
 		{
-			double xd = (double)c1.x - (double)c2.x;
-			double zd = (double)c1.z - (double)c2.z;
-			return std::sqrt (xd * xd + zd * zd);
+			const int r = chunk_ring::max_radius ();
+			for (int dx = -r; dx <= r; ++dx)
+				for (int dz = -r; dz <= r; ++dz)
+					this->order.push_back (chunk_pos (dx, dz));
+			std::stable_sort (this->order.begin (), this->order.end (),
+				[] (const chunk_pos& a, const chunk_pos& b)
+					{ return (a.x * a.x + a.z * a.z) < (b.x * b.x + b.z * b.z); });
+			
+			for (int i = 0; i < (int)this->order.size (); ++i)
+				this->ranks[this->order[i].x + r][this->order[i].z + r] = i;
 		}
 		
-	public:
-		chunk_pos_less (chunk_pos origin)
-			: origin (origin)
-			{ }
-		
-		// checks whether lhs < rhs.
-		bool
-		operator() (const chunk_pos lhs, const chunk_pos rhs) const
+		inline int
+		rank (int dx, int dz) const
 		{
-			return distance (lhs, origin) < distance (rhs, origin);
+			const int r = chunk_ring::max_radius ();
+			if (utils::iabs (dx) > r || utils::iabs (dz) > r)
+				return span * span + utils::iabs (dx) + utils::iabs (dz);
+			return this->ranks[dx + r][dz + r];
 		}
 	};
 	
+	static const spiral_table&
+	get_spiral ()
+	{
+		static const spiral_table table;
+		return table;
+	}
+	
+	/* 
+	 * Sorts the given chunks by distance from @{center}, nearest first.
+	 */
+	static void
+	sort_spiral (std::vector<chunk_pos>& chunks, chunk_pos center)
+	{
+		const spiral_table& spiral = get_spiral ();
+		std::sort (chunks.begin (), chunks.end (),
+			[&spiral, center] (const chunk_pos& a, const chunk_pos& b)
+				{
+					return spiral.rank (a.x - center.x, a.z - center.z)
+						< spiral.rank (b.x - center.x, b.z - center.z);
+				});
+	}
+	
+	/* 
+	 * Inserts the chunks in the square of radius @{r} around @{c}, that are not
+	 * in the square of radius @{r} around @{other}, into @{out}. Only the strips
+	 * along the edges that moved are visited.
+	 */
+	static void
+	square_difference (chunk_pos c, chunk_pos other, int r,
+		std::vector<chunk_pos>& out)
+	{
+		int dx = c.x - other.x, dz = c.z - other.z;
+		if (utils::iabs (dx) > 2 * r || utils::iabs (dz) > 2 * r)
+			{
+				// the squares don't overlap.
+				for (int x = c.x - r; x <= c.x + r; ++x)
+					for (int z = c.z - r; z <= c.z + r; ++z)
+						out.push_back (chunk_pos (x, z));
+				return;
+			}
+		
+		// columns that only @{c}'s square has, full height.
+		int x1 = (dx > 0) ? (other.x + r + 1) : (c.x - r);
+		int x2 = (dx > 0) ? (c.x + r) : (other.x - r - 1);
+		for (int x = x1; x <= x2; ++x)
+			for (int z = c.z - r; z <= c.z + r; ++z)
+				out.push_back (chunk_pos (x, z));
+		
+		// rows that only @{c}'s square has, skipping the columns above.
+		int z1 = (dz > 0) ? (other.z + r + 1) : (c.z - r);
+		int z2 = (dz > 0) ? (c.z + r) : (other.z - r - 1);
+		for (int z = z1; z <= z2; ++z)
+			for (int x = c.x - r; x <= c.x + r; ++x)
+				if (x < x1 || x > x2)
+					out.push_back (chunk_pos (x, z));
+	}
+	
+	
+	/* 
+	 * Adds the chunk to the player's known chunks and sends it (or waits
+	 * for it to be generated). Returns true if it was sent right away, in
+	 * which case the players in it are left for the caller to spawn.
+	 * The world lock must be held.
+	 */
+	bool
+	player::add_known_chunk (chunk_pos cpos)
+	{
+		this->known_chunks.insert (cpos.x, cpos.z);
+		
+		// chunks that are still being generated are sent by chunk_ready ()
+		// later on.
+		chunk *ch = this->get_world ()->request_chunk (cpos.x, cpos.z);
+		if (ch->get_stage () != CS_READY)
+			{
+				this->pending_chunks.insert (cpos);
+				return false;
+			}
+		else if (this->congested)
+			{
+				this->paused_chunks.insert (cpos);
+				++ player::get_output_stats ().chunks_paused;
+				return false;
+			}
+		
+		this->send (packet::make_chunk (cpos.x, cpos.z, ch));
+		return true;
+	}
+	
+	/* 
+	 * Removes the chunk from the player's known chunks and unloads it from
+	 * the client. Returns true if it had been sent, in which case the
+	 * players in it are left for the caller to despawn.
+	 * The world lock must be held.
+	 */
+	bool
+	player::remove_known_chunk (chunk_pos cpos)
+	{
+		this->known_chunks.erase (cpos.x, cpos.z);
+		if ((this->pending_chunks.erase (cpos) > 0) ||
+				(this->paused_chunks.erase (cpos) > 0))
+			return false; // never sent in the first place
+		
+		this->send (packet::make_empty_chunk (cpos.x, cpos.z));
+		return true;
+	}
+	
 	/* 
 	 * Loads new close chunks to the player and unloads those that are too
 	 * far away.
+	 * 
+	 * When the player simply walks into another chunk, only the strips of
+	 * the view square that were entered or left are looked at. A full scan
+	 * is only needed when the view square isn't complete (after changing
+	 * worlds) or the radius changes.
 	 */
 	void
 	player::stream_chunks (int radius)
 	{
 		std::lock_guard<std::mutex> wguard {this->world_lock};
-		std::multiset<chunk_pos, chunk_pos_less> to_load {chunk_pos_less (this->get_pos ())};
-		auto prev_chunks = this->known_chunks;
 		
 		chunk_pos center = this->get_pos ();
-		int r_half = radius / 2;
-		for (int cx = (center.x - r_half); cx <= (center.x + r_half); ++cx)
-			for (int cz = (center.z - r_half); cz <= (center.z + r_half); ++cz)
-				{
-					chunk_pos cpos = chunk_pos (cx, cz);
-					if (this->known_chunks.count (cpos) == 0)
-						{
-							to_load.insert (cpos);
-						}
-					prev_chunks.erase (cpos);
-				}
+		int r = std::min (radius / 2, chunk_ring::max_radius ());
+		chunk_pos prev = this->view_center;
+		int prev_r = this->view_radius;
 		
-		for (auto cpos : to_load)
+		// the players standing in the chunks sent or unloaded are (de)spawned
+		// at the end, with one grid query for each square.
+		chunk_ring spawn_in, despawn_in;
+		bool spawn = false, despawn = false;
+		
+		std::vector<chunk_pos> to_load, to_unload;
+		if (this->view_complete && (r == prev_r))
 			{
-				this->known_chunks.insert (cpos);
-				chunk *ch = this->get_world ()->load_chunk (cpos.x, cpos.z);
-				this->send (packet::make_chunk (cpos.x, cpos.z, ch));
+				if (center.x == prev.x && center.z == prev.z)
+					{
+						this->get_world ()->get_entities ().update (this, center);
+						this->curr_chunk.set (center.x, center.z);
+						return;
+					}
 				
-				// spawn self to other players and vice-versa.
-				player *me = this;
-				ch->all_entities (
-					[me] (entity *e)
-						{
-							if (e->get_type () == ET_PLAYER)
-								{
-									player* pl = dynamic_cast<player *> (e);
-									if (pl == me) return;
-									
-									me->spawn_to (pl);
-									pl->spawn_to (me);
-								}
-						});
+				square_difference (prev, center, r, to_unload);
+				for (auto cpos : to_unload)
+					if (this->remove_known_chunk (cpos))
+						{ despawn_in.insert (cpos.x, cpos.z); despawn = true; }
+				
+				square_difference (center, prev, r, to_load);
+				sort_spiral (to_load, center);
+				for (auto cpos : to_load)
+					if (this->add_known_chunk (cpos))
+						{ spawn_in.insert (cpos.x, cpos.z); spawn = true; }
 			}
-		to_load.clear ();
-		
-		for (auto cpos : prev_chunks)
+		else
 			{
-				this->known_chunks.erase (cpos);
-				this->send (packet::make_empty_chunk (cpos.x, cpos.z));
-				
-				// despawn self from other players and vice-versa.
-				chunk *ch = this->get_world ()->load_chunk (cpos.x, cpos.z);
+				// unloading first keeps the ring free of chunks from outside the new
+				// view square.
+				if (prev_r >= 0)
+					for (int x = prev.x - prev_r; x <= prev.x + prev_r; ++x)
+						for (int z = prev.z - prev_r; z <= prev.z + prev_r; ++z)
+							if ((utils::iabs (x - center.x) > r || utils::iabs (z - center.z) > r)
+								&& this->known_chunks.contains (x, z)
+								&& this->remove_known_chunk (chunk_pos (x, z)))
+								{ despawn_in.insert (x, z); despawn = true; }
 				
-				player *me = this;
-				ch->all_entities (
-					[me] (entity *e)
-						{
-							if (e->get_type () == ET_PLAYER)
-								{
-									player *pl = dynamic_cast<player *> (e);
-									if (pl == me) return;
-									
-									me->despawn_from (pl);
-									pl->despawn_from (me);
-								}
-						});
+				for (auto off : get_spiral ().order)
+					{
+						if (utils::iabs (off.x) > r || utils::iabs (off.z) > r)
+							continue;
+						
+						chunk_pos cpos (center.x + off.x, center.z + off.z);
+						if (!this->known_chunks.contains (cpos.x, cpos.z)
+							&& this->add_known_chunk (cpos))
+							{ spawn_in.insert (cpos.x, cpos.z); spawn = true; }
+					}
 			}
-		prev_chunks.clear ();
 		
-		chunk *prev_chunk = this->get_world ()->get_chunk (this->curr_chunk.x, this->curr_chunk.z);
-		if (prev_chunk)
-			prev_chunk->remove_entity (this);
+		if (despawn)
+			exchange_spawns (this, this->get_world (), prev, prev_r, despawn_in, false);
+		if (spawn)
+			exchange_spawns (this, this->get_world (), center, r, spawn_in, true);
 		
-		chunk *new_chunk = this->get_world ()->load_chunk (center.x, center.z);
-		new_chunk->add_entity (this);
+		this->view_center = center;
+		this->view_radius = r;
+		this->view_complete = true;
+		
+		this->get_world ()->get_entities ().update (this, center);
 		this->curr_chunk.set (center.x, center.z);
 	}
 	
+	/* 
+	 * Sends the specified chunk to the player, and spawns the players in it.
+	 * The world lock must be held.
+	 */
+	void
+	player::send_chunk (int cx, int cz, chunk *ch)
+	{
+		this->send (packet::make_chunk (cx, cz, ch));
+		
+		// spawn self to other players and vice-versa.
+		player *me = this;
+		players_near (this->get_world (), chunk_pos (cx, cz), 0, me,
+			[me] (player *pl, chunk_pos)
+				{
+					me->spawn_to (pl);
+					pl->spawn_to (me);
+				});
+	}
+	
+	/* 
+	 * Called by the player's world when a chunk finishes generating. Sends
+	 * the chunk if the player has been waiting for it.
+	 */
+	void
+	player::chunk_ready (world *wr, int cx, int cz, chunk *ch)
+	{
+		std::lock_guard<std::mutex> wguard {this->world_lock};
+		if (wr != this->curr_world)
+			return;
+		
+		if (this->pending_chunks.erase (chunk_pos (cx, cz)) > 0)
+			{
+				if (this->congested)
+					{
+						this->paused_chunks.insert (chunk_pos (cx, cz));
+						++ player::get_output_stats ().chunks_paused;
+					}
+				else
+					this->send_chunk (cx, cz, ch);
+			}
+	}
+	
+	/* 
+	 * Sends chunks that were held back while the player's output was
+	 * congested, nearest first, for as long as it stays uncongested.
+	 */
+	void
+	player::send_paused_chunks ()
+	{
+		std::lock_guard<std::mutex> wguard {this->world_lock};
+		if (this->paused_chunks.empty () || this->congested || !this->curr_world)
+			return;
+		
+		std::vector<chunk_pos> to_send (this->paused_chunks.begin (),
+			this->paused_chunks.end ());
+		sort_spiral (to_send, this->get_pos ());
+		for (auto cpos : to_send)
+			{
+				if (this->congested)
+					break;
+				
+				this->paused_chunks.erase (cpos);
+				chunk *ch = this->get_world ()->request_chunk (cpos.x, cpos.z);
+				if (ch->get_stage () == CS_READY)
+					this->send_chunk (cpos.x, cpos.z, ch);
+				else
+					this->pending_chunks.insert (cpos);
+			}
+	}
+	
 	/* 
 	 * Used when transitioning players between worlds or teleporting.
 	 * This sends common chunks (shared by two worlds in their position) without
@@ -497,34 +929,29 @@ namespace hCraft {
 	{
 		std::lock_guard<std::mutex> wguard {this->world_lock};
 		
-		auto spawn_pos = dest_pos;
-		chunk_pos center = spawn_pos;
+		// chunks from the previous world that haven't been sent yet won't be.
+		this->pending_chunks.clear ();
+		this->paused_chunks.clear ();
 		
-		chunk *prev_chunk = this->get_world ()->get_chunk (this->curr_chunk.x, this->curr_chunk.z);
-		if (prev_chunk)
-			prev_chunk->remove_entity (this);
+		chunk_pos center = dest_pos;
+		int r = std::min (radius / 2, chunk_ring::max_radius ());
+		chunk_pos prev = this->view_center;
+		int prev_r = this->view_radius;
 		
-		std::multiset<chunk_pos, chunk_pos_less> to_load {chunk_pos_less (spawn_pos)};
-		int r_half = radius / 2;
-		for (int cx = (center.x - r_half); cx <= (center.x + r_half); ++cx)
-			for (int cz = (center.z - r_half); cz <= (center.z + r_half); ++cz)
-				{
-					chunk_pos cpos = chunk_pos (cx, cz);
-					to_load.insert (cpos);
-				}
+		this->get_world ()->get_entities ().remove (this);
 		
-		// keep chunks that are shared between both worlds, remove others.
-		for (auto itr = to_load.begin (); itr != to_load.end (); )
+		// keep chunks that are shared between both worlds, nearest first.
+		std::vector<chunk_pos> to_load;
+		for (auto off : get_spiral ().order)
 			{
-				chunk_pos cpos = *itr;
-				if (std::find (this->known_chunks.begin (), this->known_chunks.end (),
-					cpos) == this->known_chunks.end ())
-					{
-						// not contained by both worlds, remove.
-						itr = to_load.erase (itr);
-					}
-				else
-					++ itr;
+				if (utils::iabs (off.x) > r || utils::iabs (off.z) > r)
+					continue;
+				
+				chunk_pos cpos (center.x + off.x, center.z + off.z);
+				if (utils::iabs (cpos.x - prev.x) <= prev_r &&
+					utils::iabs (cpos.z - prev.z) <= prev_r &&
+					this->known_chunks.contains (cpos.x, cpos.z))
+					to_load.push_back (cpos);
 			}
 		
 		for (auto cpos : to_load)
@@ -539,47 +966,45 @@ namespace hCraft {
 		this->set_pos (dest_pos);
 		
 		// spawn self to other players and vice-versa.
-		for (auto cpos : to_load)
+		if (!to_load.empty ())
 			{
-				player *me = this;
-				chunk *ch = wr->get_chunk (cpos.x, cpos.z);
-				if (ch)
-					{
-						ch->all_entities (
-							[me] (entity *e)
-								{
-									if (e->get_type () == ET_PLAYER)
-										{
-											player* pl = dynamic_cast<player *> (e);
-											if (pl == me) return;
-									
-											me->spawn_to (pl);
-											pl->spawn_to (me);
-										}
-								});
-					}
+				chunk_ring spawn_in;
+				for (auto cpos : to_load)
+					spawn_in.insert (cpos.x, cpos.z);
+				exchange_spawns (this, wr, center, r, spawn_in, true);
 			}
 		
 		// unload all other chunks
-		for (auto itr = this->known_chunks.begin (); itr != this->known_chunks.end (); )
-			{
-				chunk_pos cpos = *itr;
-				if (std::find (to_load.begin (), to_load.end (), cpos) == to_load.end ())
-					{
-						this->send (packet::make_empty_chunk (cpos.x, cpos.z));
-						itr = this->known_chunks.erase (itr);
-					}
-				else
-					++ itr;
-			}
+		if (prev_r >= 0)
+			for (int x = prev.x - prev_r; x <= prev.x + prev_r; ++x)
+				for (int z = prev.z - prev_r; z <= prev.z + prev_r; ++z)
+					if ((utils::iabs (x - center.x) > r || utils::iabs (z - center.z) > r)
+						&& this->known_chunks.contains (x, z))
+						{
+							this->send (packet::make_empty_chunk (x, z));
+							this->known_chunks.erase (x, z);
+						}
 		
-		to_load.clear ();
+		// only some of the chunks around the destination are known now, the
+		// next call to stream_chunks () fills in the rest.
+		this->view_center = center;
+		this->view_radius = r;
+		this->view_complete = false;
 	}
 	
 //--
 	
 	
 	
+	/* 
+	 * Packs an angle (in degrees) into a byte, the way packets carry them.
+	 */
+	static inline unsigned char
+	packed_angle (float a)
+	{
+		return (unsigned char)(std::fmod (std::floor (a), 360.0f) / 360.0 * 256.0);
+	}
+	
 	/* 
 	 * Moves the player to the specified position.
 	 */
@@ -618,60 +1043,151 @@ namespace hCraft {
 				this->stream_chunks ();
 			}
 		
-		if (prev_pos == dest)
-			return;
-		
-		double x_delta = dest.x - prev_pos.x;
-		double y_delta = dest.y - prev_pos.y;
-		double z_delta = dest.z - prev_pos.z;
-		float r_delta = dest.r - prev_pos.r;
-		float l_delta = dest.l - prev_pos.l;
-		
-		if (x_delta == 0.0 && y_delta == 0.0 && z_delta == 0.0)
+		// observers are told about the move by send_movement () on the next
+		// world tick.
+	}
+	
+	/* 
+	 * Teleports the player to the given position.
+	 */
+	void
+	player::teleport_to (entity_pos dest)
+	{
+		block_pos b_dest = dest;
+		this->move_to (dest);
+		this->send (packet::make_player_pos_and_look (
+			dest.x, dest.y, dest.z, dest.y + 1.65, dest.r, dest.l, dest.on_ground));
+	}
+	
+	/* 
+	 * Called by the player's world once every tick.
+	 */
+	void
+	player::tick (unsigned long long tick)
+	{
+		if (this->overflowed && !this->bad ())
 			{
-				// position hasn't changed.
-				
-				if (r_delta == 0.0f && l_delta == 0.0f)
-					{
-						// the player hasn't moved at all.
-						
-					}
-				else
-					{
-						// only orientation changed.
-						std::lock_guard<std::mutex> guard {this->visible_player_lock};
-						for (player *pl : this->visible_players)
-							{
-								pl->send (packet::make_entity_look (this->get_eid (), dest.r, dest.l));
-								pl->send (packet::make_entity_head_look (this->get_eid (), dest.r));
-							}
-					}
+				log () << this->get_username () << " has too much unsent output ("
+					<< (this->get_queued_bytes () / 1024) << "KB), disconnecting." << std::endl;
+				++ player::get_output_stats ().overflows;
+				this->disconnect ();
+				return;
 			}
-		else
+		
+		this->send_movement (tick);
+		
+		// held back chunks are compressed and sent on the pool, so as not to
+		// stall the world's thread.
+		if (!this->congested && !this->flush_queued)
 			{
-				// position has changed.
+				bool paused;
+				{
+					std::unique_lock<std::mutex> wguard {this->world_lock, std::try_to_lock};
+					paused = wguard.owns_lock () && !this->paused_chunks.empty ();
+				}
 				
-				std::lock_guard<std::mutex> guard {this->visible_player_lock};
-				for (player *pl : this->visible_players)
+				if (paused && !this->flush_queued.exchange (true))
 					{
-						pl->send (packet::make_entity_teleport (this->get_eid (),
-							std::round (dest.x * 32.0), std::round (dest.y * 32.0),
-							std::round (dest.z * 32.0), dest.r, dest.l));
-						pl->send (packet::make_entity_head_look (this->get_eid (), dest.r));
+						++ this->tasks;
+						this->get_server ().get_thread_pool ().enqueue (
+							[this] (void *ctx)
+								{
+									try
+										{
+											this->send_paused_chunks ();
+										}
+									catch (const std::exception& ex)
+										{
+											this->log (LT_ERROR) << "Exception: " << ex.what () << std::endl;
+											this->disconnect ();
+										}
+									this->flush_queued = false;
+									-- this->tasks;
+								});
 					}
 			}
 	}
 	
 	/* 
-	 * Teleports the player to the given position.
+	 * Called by the player's world once every tick. Tells observers where
+	 * the player has moved since they were last told, near observers every
+	 * tick and farther ones every few ticks.
 	 */
 	void
-	player::teleport_to (entity_pos dest)
+	player::send_movement (unsigned long long tick)
 	{
-		block_pos b_dest = dest;
-		this->move_to (dest);
-		this->send (packet::make_player_pos_and_look (
-			dest.x, dest.y, dest.z, dest.y + 1.65, dest.r, dest.l, dest.on_ground));
+		entity_pos dest = this->get_pos ();
+		chunk_pos me_pos = dest;
+		
+		int fx = (int)std::round (dest.x * 32.0);
+		int fy = (int)std::round (dest.y * 32.0);
+		int fz = (int)std::round (dest.z * 32.0);
+		unsigned char fr = packed_angle (dest.r);
+		unsigned char fl = packed_angle (dest.l);
+		
+		// every observer that is due gets the smallest packet that takes it from
+		// what it was last told to the current position.
+		std::lock_guard<std::mutex> guard {this->observer_lock};
+		for (auto& ent : this->observers)
+			{
+				player *pl = ent.first;
+				player_track& t = ent.second;
+				
+				// farther observers are updated less often. staggered by entity ID,
+				// so that they don't all get their updates on the same tick.
+				chunk_pos pl_pos = pl->get_pos ();
+				int dist = std::max (utils::iabs (pl_pos.x - me_pos.x),
+					utils::iabs (pl_pos.z - me_pos.z));
+				int interval = (dist <= 2) ? 1 : ((dist <= 5) ? 2 : 4);
+				if (((tick + pl->get_eid ()) % interval) != 0)
+					continue;
+				
+				// let a slow client catch up; the changes accumulate into the next
+				// update it gets.
+				if (pl->is_congested ())
+					{
+						++ player::get_output_stats ().moves_deferred;
+						continue;
+					}
+				
+				int dx = fx - t.x, dy = fy - t.y, dz = fz - t.z;
+				bool moved = (dx != 0) || (dy != 0) || (dz != 0);
+				bool looked = (fr != t.r) || (fl != t.l);
+				bool turned = (fr != t.r);
+				
+				if (moved)
+					{
+						bool fits = (dx >= -128 && dx <= 127) && (dy >= -128 && dy <= 127)
+							&& (dz >= -128 && dz <= 127);
+						if (fits && t.rel_moves < player::teleport_interval ())
+							{
+								if (looked)
+									pl->send (packet::make_entity_look_and_move (this->get_eid (),
+										dx, dy, dz, dest.r, dest.l));
+								else
+									pl->send (packet::make_entity_relative_move (this->get_eid (),
+										dx, dy, dz));
+								++ t.rel_moves;
+							}
+						else
+							{
+								pl->send (packet::make_entity_teleport (this->get_eid (),
+									fx, fy, fz, dest.r, dest.l));
+								t.rel_moves = 0;
+							}
+						
+						t.x = fx;
+						t.y = fy;
+						t.z = fz;
+					}
+				else if (looked)
+					pl->send (packet::make_entity_look (this->get_eid (), dest.r, dest.l));
+				
+				if (turned)
+					pl->send (packet::make_entity_head_look (this->get_eid (), dest.r));
+				t.r = fr;
+				t.l = fl;
+			}
 	}
 	
 	/* 
@@ -773,9 +1289,17 @@ namespace hCraft {
 		pl->send (packet::make_entity_head_look (this->get_eid (), me_pos.r));
 		pl->send (packet::make_player_list_item (ping_name, true, this->ping_time_ms));
 		
+		player_track t;
+		t.x = (int)(me_pos.x * 32.0);
+		t.y = (int)(me_pos.y * 32.0);
+		t.z = (int)(me_pos.z * 32.0);
+		t.r = packed_angle (me_pos.r);
+		t.l = packed_angle (me_pos.l);
+		t.rel_moves = 0;
+		
 		{
-			std::lock_guard<std::mutex> guard {pl->visible_player_lock};
-			pl->visible_players.insert (this);
+			std::lock_guard<std::mutex> guard {this->observer_lock};
+			this->observers[pl] = t;
 		}
 	}
 	
@@ -794,8 +1318,20 @@ namespace hCraft {
 		
 		pl->send (packet::make_destroy_entity (this->get_eid ()));
 		pl->send (packet::make_player_list_item (ping_name, false, 0));
-		std::lock_guard<std::mutex> guard {pl->visible_player_lock};
-		pl->visible_players.erase (this);
+		std::lock_guard<std::mutex> guard {this->observer_lock};
+		this->observers.erase (pl);
+	}
+	
+	/* 
+	 * Removes the specified player from the list of players we are spawned
+	 * to, without sending it anything. Used on players that are about to be
+	 * destroyed.
+	 */
+	void
+	player::forget_observer (player *pl)
+	{
+		std::lock_guard<std::mutex> guard {this->observer_lock};
+		this->observers.erase (pl);
 	}
 	
 	
@@ -27,6 +27,7 @@ namespace hCraft {
 	 * Constructs a new empty player list.
 	 */
 	playerlist::playerlist ()
+		: snap (std::make_shared<playerlist_snapshot> ())
 		{ }
 	
 	/* 
@@ -34,7 +35,9 @@ namespace hCraft {
 	 */
 	playerlist::playerlist (const playerlist& other)
 		: players (other.players), lock ()
-		{ }
+	{
+		this->publish ();
+	}
 	
 	/* 
 	 * Class destructor.
@@ -44,14 +47,39 @@ namespace hCraft {
 	
 	
 	
+	/* 
+	 * Rebuilds the snapshot from the map and swaps it in.
+	 * Must be called with the list's lock held.
+	 */
+	void
+	playerlist::publish ()
+	{
+		std::shared_ptr<playerlist_snapshot> next = std::make_shared<playerlist_snapshot> ();
+		next->players.reserve (this->players.size ());
+		for (auto itr = this->players.begin (); itr != this->players.end (); ++itr)
+			next->players.push_back (itr->second);
+		
+		std::atomic_store (&this->snap, std::shared_ptr<const playerlist_snapshot> (next));
+	}
+	
+	/* 
+	 * Returns the current snapshot.
+	 */
+	std::shared_ptr<const playerlist_snapshot>
+	playerlist::snapshot () const
+	{
+		return std::atomic_load (&this->snap);
+	}
+	
+	
+	
 	/* 
 	 * Returns the number of players contained in this list.
 	 */
 	int
 	playerlist::count ()
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		return this->players.size ();
+		return this->snapshot ()->players.size ();
 	}
 	
 	
@@ -65,12 +93,13 @@ namespace hCraft {
 	playerlist::add (player *pl)
 	{
 		const char *username = pl->get_username ();
-		player *other = this->find (username, player_find_method::case_insensitive);
-		if (other)
-			return false;
-			
+		
 		std::lock_guard<std::mutex> guard {this->lock};
+		if (this->players.find (username) != this->players.end ())
+			return false;
+		
 		this->players[username] = pl;
+		this->publish ();
 		return true;
 	}
 	
@@ -79,16 +108,15 @@ namespace hCraft {
 	 * NOTE: the search is done using case-INsensitive comparison.
 	 */
 	void
-	playerlist::remove (const char *name, bool delete_player)
+	playerlist::remove (const char *name)
 	{
 		std::lock_guard<std::mutex> guard {this->lock};
 		
 		auto itr = this->players.find (name);
 		if (itr != this->players.end ())
 			{
-				if (delete_player)
-					delete itr->second;
 				this->players.erase (itr);
+				this->publish ();
 			}
 	}
 	
@@ -96,7 +124,7 @@ namespace hCraft {
 	 * Removes the specified player from this player list.
 	 */
 	void
-	playerlist::remove (player *pl, bool delete_player)
+	playerlist::remove (player *pl)
 	{
 		std::lock_guard<std::mutex> guard {this->lock};
 		
@@ -105,9 +133,8 @@ namespace hCraft {
 				player *other = itr->second;
 				if (other == pl)
 					{
-						if (delete_player)
-							delete other;
 						this->players.erase (itr);
+						this->publish ();
 						break;
 					}
 			}
@@ -117,20 +144,12 @@ namespace hCraft {
 	 * Removes all players from this player list.
 	 */
 	void
-	playerlist::clear (bool delete_players)
+	playerlist::clear ()
 	{
 		std::lock_guard<std::mutex> guard {this->lock};
 		
-		if (delete_players)
-			{
-				for (auto itr = this->players.begin (); itr != this->players.end (); ++itr)
-					{
-						player *pl = itr->second;
-						delete pl;
-					}
-			}
-		
 		this->players.clear ();
+		this->publish ();
 	}
 	
 	/* 
@@ -184,51 +203,37 @@ namespace hCraft {
 	void
 	playerlist::all (std::function<void (player *)> f, player* except)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		
-		for (auto itr = this->players.begin (); itr != this->players.end (); ++itr)
-			{
-				player *pl = itr->second;
-				if (pl != except)
-					f (pl);
-			}
-	}
-	
-	/* 
-	 * Calls the function @{f} on all players visible to player @{target} with
-	 * exception to @{target} itself.
-	 */
-	void
-	playerlist::all_visible (std::function<void (player *)> f, player *target)
-	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		
-		for (auto itr = this->players.begin (); itr != this->players.end (); ++itr)
-			{
-				player *pl = itr->second;
-				if (pl != target && pl->visible_to (target))
-					f (pl);
-			}
+		std::shared_ptr<const playerlist_snapshot> s = this->snapshot ();
+		for (player *pl : s->players)
+			if (pl != except)
+				f (pl);
 	}
 	
 	/* 
 	 * Iterates through the list, and passes all players to the specified
 	 * predicate function. Players that produce a positive value are
-	 * removed from the list, and can be optinally destroyed as well.
+	 * removed from the list.
 	 */
 	void
-	playerlist::remove_if (std::function<bool (player *)> pred, bool delete_players)
+	playerlist::remove_if (std::function<bool (player *)> pred)
 	{
 		std::lock_guard<std::mutex> guard {this->lock};
 		
+		bool changed = false;
 		for (auto itr = this->players.begin (); itr != this->players.end (); )
 			{
 				player *pl = itr->second;
 				if (pred (pl) == true)
-					itr = this->players.erase (itr);
+					{
+						itr = this->players.erase (itr);
+						changed = true;
+					}
 				else
 					++ itr;
 			}
+		
+		if (changed)
+			this->publish ();
 	}
 	
 	
@@ -239,14 +244,10 @@ namespace hCraft {
 	void
 	playerlist::populate (std::vector<player *>& vec, player *except)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		
-		for (auto itr = this->players.begin (); itr != this->players.end (); ++itr)
-			{
-				player *pl = itr->second;
-				if (pl != except)
-					vec.push_back (pl);
-			}
+		std::shared_ptr<const playerlist_snapshot> s = this->snapshot ();
+		for (player *pl : s->players)
+			if (pl != except)
+				vec.push_back (pl);
 	}
 	
 	
@@ -295,16 +296,10 @@ namespace hCraft {
 	void
 	playerlist::send_to_all (packet *pack, player *except)
 	{
-		std::lock_guard<std::mutex> guard {this->lock};
-		
-		for (auto itr = this->players.begin (); itr != this->players.end (); ++itr)
-			{
-				player *pl = itr->second;
-				if (pl != except)
-					{
-						pl->send (new packet (*pack));
-					}
-			}
+		std::shared_ptr<const playerlist_snapshot> s = this->snapshot ();
+		for (player *pl : s->players)
+			if (pl != except)
+				pl->send (new packet (*pack));
 		delete pack;
 	}
 }
@@ -0,0 +1,437 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pregen.hpp"
+#include "server.hpp"
+#include "world.hpp"
+#include "player.hpp"
+#include "playerlist.hpp"
+#include "threadpool.hpp"
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+
+namespace hCraft {
+	
+	/* 
+	 * Returns the offset of the @{i}th position of a square spiral going
+	 * outwards from (0, 0). Every ring of the spiral is a prefix of the next,
+	 * so runs with different radii visit chunks in the same order.
+	 */
+	static void
+	spiral_at (long long i, int *dx, int *dz)
+	{
+		if (i == 0)
+			{ *dx = *dz = 0; return; }
+		
+		// ring k holds positions [(2k - 1)^2, (2k + 1)^2)
+		long long k = (long long)((std::sqrt ((double)i) + 1.0) / 2.0);
+		while ((2*k + 1) * (2*k + 1) <= i) ++ k;
+		while (k > 1 && (2*k - 1) * (2*k - 1) > i) -- k;
+		
+		long long j = i - (2*k - 1) * (2*k - 1);
+		long long t = j % (2*k);
+		switch (j / (2*k))
+			{
+			case 0: *dx = k;         *dz = -k + 1 + t; break;
+			case 1: *dx = k - 1 - t; *dz = k;          break;
+			case 2: *dx = -k;        *dz = k - 1 - t;  break;
+			default: *dx = -k + 1 + t; *dz = -k;       break;
+			}
+	}
+	
+	/* 
+	 * The inverse of spiral_at (): returns the position in the spiral of the
+	 * given offset.
+	 */
+	static long long
+	spiral_index (int dx, int dz)
+	{
+		long long k = std::max (std::abs (dx), std::abs (dz));
+		if (k == 0)
+			return 0;
+		
+		long long base = (2*k - 1) * (2*k - 1);
+		if (dx == k && dz > -k)
+			return base + (dz + k - 1);
+		else if (dz == k && dx < k)
+			return base + 2*k + (k - 1 - dx);
+		else if (dx == -k && dz < k)
+			return base + 4*k + (k - 1 - dz);
+		return base + 6*k + (dx + k - 1);
+	}
+	
+	
+	
+	/* 
+	 * Constructs a new pre-generator for the chunks within @{radius} chunks
+	 * of world @{wr}'s spawn. @{cpu} and @{io} limit the percentage of time
+	 * spent generating chunks and writing them to disk respectively.
+	 */
+	world_pregenerator::world_pregenerator (server& srv, world *wr, int radius,
+		int cpu, int io, const char *owner)
+		: srv (srv), owner (owner)
+	{
+		this->wr = wr;
+		this->radius = radius;
+		this->cpu = std::min (std::max (cpu, 1), 100);
+		this->io = std::min (std::max (io, 1), 100);
+		
+		chunk_pos center = wr->get_spawn ();
+		this->cx = center.x;
+		this->cz = center.z;
+		
+		this->total = (2LL*radius + 1) * (2LL*radius + 1);
+		this->done = 0;
+		this->running = false;
+		this->stopping = false;
+	}
+	
+	/* 
+	 * Class destructor.
+	 * Stops the pre-generator if it is still running.
+	 */
+	world_pregenerator::~world_pregenerator ()
+	{
+		this->stop ();
+	}
+	
+	
+	
+	/* 
+	 * Starts generating chunks on a new thread, continuing from where
+	 * previous runs on the same world left off.
+	 */
+	void
+	world_pregenerator::start ()
+	{
+		if (this->running)
+			return;
+		
+		std::string wname = this->wr->get_name ();
+		{
+			sql::statement stmt = this->srv.sql ().create (
+				"SELECT `cx`, `cz`, `progress` FROM `pregen` WHERE `world`=?;");
+			stmt.bind_text (1, wname.c_str ());
+			if (stmt.step () == sql::row)
+				{
+					// the spiral only lines up if the center stayed the same.
+					if (stmt.column_int (0) == this->cx && stmt.column_int (1) == this->cz)
+						this->done = std::min (stmt.column_int64 (2), this->total);
+				}
+		}
+		this->save_progress ();
+		
+		this->stopping = false;
+		this->running = true;
+		this->th = std::thread (std::bind (
+			std::mem_fn (&hCraft::world_pregenerator::worker), this));
+	}
+	
+	/* 
+	 * Stops the pre-generator, keeping its progress so that it can be
+	 * resumed later.
+	 */
+	void
+	world_pregenerator::stop ()
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->stop_lock};
+			this->stopping = true;
+		}
+		this->stop_cv.notify_all ();
+		
+		if (this->th.joinable ())
+			this->th.join ();
+	}
+	
+	/* 
+	 * Stops the pre-generator and forgets about its progress.
+	 */
+	void
+	world_pregenerator::cancel ()
+	{
+		this->stop ();
+		this->erase_progress ();
+	}
+	
+	
+	
+	/* 
+	 * Resumes pre-generation on the specified world if an earlier run has
+	 * been interrupted (e.g. by a server restart). Returns true if it was.
+	 */
+	bool
+	world_pregenerator::resume (server& srv, world *wr)
+	{
+		int radius, cpu, io;
+		{
+			sql::statement stmt = srv.sql ().create (
+				"SELECT `radius`, `cpu`, `io` FROM `pregen` WHERE `world`=?;");
+			stmt.bind_text (1, wr->get_name ());
+			if (stmt.step () != sql::row)
+				return false;
+			
+			radius = stmt.column_int (0);
+			cpu = stmt.column_int (1);
+			io = stmt.column_int (2);
+		}
+		
+		srv.get_logger () () << "Resuming pre-generation of world \""
+			<< wr->get_name () << "\"" << std::endl;
+		wr->start_pregen (std::make_shared<world_pregenerator> (srv, wr, radius,
+			cpu, io));
+		return true;
+	}
+	
+	/* 
+	 * Forgets about an interrupted pre-generation of the specified world, so
+	 * that it is not resumed. Returns true if there was one.
+	 */
+	bool
+	world_pregenerator::forget (server& srv, world *wr)
+	{
+		{
+			sql::statement stmt = srv.sql ().create (
+				"SELECT 1 FROM `pregen` WHERE `world`=?;");
+			stmt.bind_text (1, wr->get_name ());
+			if (stmt.step () != sql::row)
+				return false;
+		}
+		
+		sql::statement stmt = srv.sql ().create (
+			"DELETE FROM `pregen` WHERE `world`=?;");
+		stmt.bind_text (1, wr->get_name ());
+		stmt.execute ();
+		return true;
+	}
+	
+	
+	
+	void
+	world_pregenerator::save_progress ()
+	{
+		this->erase_progress ();
+		
+		sql::statement stmt = this->srv.sql ().create (
+			"INSERT INTO `pregen` (`world`, `radius`, `cx`, `cz`, `cpu`, `io`, "
+			"`progress`) VALUES (?, ?, ?, ?, ?, ?, ?);");
+		stmt.bind_text (1, this->wr->get_name ());
+		stmt.bind_int (2, this->radius);
+		stmt.bind_int (3, this->cx);
+		stmt.bind_int (4, this->cz);
+		stmt.bind_int (5, this->cpu);
+		stmt.bind_int (6, this->io);
+		stmt.bind_int64 (7, this->done.load ());
+		stmt.execute ();
+	}
+	
+	void
+	world_pregenerator::erase_progress ()
+	{
+		sql::statement stmt = this->srv.sql ().create (
+			"DELETE FROM `pregen` WHERE `world`=?;");
+		stmt.bind_text (1, this->wr->get_name ());
+		stmt.execute ();
+	}
+	
+	
+	
+	/* 
+	 * Sleeps for the given amount of milliseconds, or until the
+	 * pre-generator is stopped. Returns false if it has been.
+	 */
+	bool
+	world_pregenerator::pause (long long ms)
+	{
+		std::unique_lock<std::mutex> guard {this->stop_lock};
+		if (ms > 0)
+			this->stop_cv.wait_for (guard, std::chrono::milliseconds (ms),
+				[this] { return this->stopping; });
+		return !this->stopping;
+	}
+	
+	/* 
+	 * Sends a message to the player that started the pre-generation (if
+	 * they are still online), and logs it.
+	 */
+	void
+	world_pregenerator::report (const std::string& msg)
+	{
+		std::ostringstream ss;
+		ss << "Pre-generation of world \"" << this->wr->get_name () << "\": "
+			<< msg << " (" << this->done.load () << "/" << this->total << " chunks)";
+		this->srv.get_logger () () << ss.str () << std::endl;
+		
+		if (this->owner.empty ())
+			return;
+		player *pl = this->srv.get_players ().find (this->owner.c_str ());
+		if (pl)
+			pl->message ("§7 | §ePregen §b" + std::string (this->wr->get_name ())
+				+ "§f: §e" + msg + " §7(" + std::to_string (this->done.load ())
+				+ "/" + std::to_string (this->total) + ")");
+	}
+	
+	
+	
+	/* 
+	 * Unloads whatever the pre-generator has left in memory once it stops:
+	 * the chunks that were kept around for their neighbours' sake, and the
+	 * partially generated chunks just outside the area covered so far, which
+	 * nothing needs anymore.
+	 */
+	void
+	world_pregenerator::release (std::vector<chunk_pos>& to_evict)
+	{
+		for (chunk_pos& cpos : to_evict)
+			this->wr->unload_chunk (cpos.x, cpos.z);
+		to_evict.clear ();
+		
+		// every stage needs the one before it done on the chunks around it, so
+		// partially generated chunks reach up to three rings past the last one
+		// worked on.
+		int dx, dz;
+		spiral_at (std::max (this->done.load () - 1, 0LL), &dx, &dz);
+		long long last = std::max (std::abs (dx), std::abs (dz));
+		long long first = (last == 0) ? 0 : ((2*last - 1) * (2*last - 1));
+		long long end = (2*last + 7) * (2*last + 7);
+		for (long long i = first; i < end; ++i)
+			{
+				spiral_at (i, &dx, &dz);
+				int x = this->cx + dx, z = this->cz + dz;
+				
+				chunk *ch = this->wr->get_chunk (x, z);
+				if (ch && ch->get_stage () != CS_READY)
+					this->wr->unload_chunk (x, z);
+			}
+	}
+	
+	
+	
+	/* 
+	 * The function ran by the pre-generator's thread.
+	 */
+	void
+	world_pregenerator::worker ()
+	{
+		typedef std::chrono::steady_clock clock;
+		
+		// enough chunks per batch to keep every pool thread busy.
+		int threads = std::max (this->srv.get_thread_pool ().size (), 1);
+		int batch_size = 8 * threads;
+		
+		std::vector<chunk_pos> to_evict;
+		std::vector<chunk_pos> batch;
+		
+		int width = this->wr->get_width ();
+		int depth = this->wr->get_depth ();
+		int last_tenth = (int)(this->done * 10 / this->total);
+		if (this->done > 0)
+			this->report ("resuming");
+		
+		while (this->done < this->total && this->pause (0))
+			{
+				long long next = std::min (this->done.load () + batch_size, this->total);
+				batch.clear ();
+				for (long long i = this->done; i < next; ++i)
+					{
+						int dx, dz;
+						spiral_at (i, &dx, &dz);
+						int x = this->cx + dx, z = this->cz + dz;
+						
+						// finite worlds
+						if (((width > 0) && ((x < 0) || ((x * 16) >= width))) ||
+								((depth > 0) && ((z < 0) || ((z * 16) >= depth))))
+							continue;
+						batch.emplace_back (x, z);
+					}
+				
+				/* 
+				 * Generation.
+				 */
+				auto t0 = clock::now ();
+				for (chunk_pos& cpos : batch)
+					this->wr->request_chunk (cpos.x, cpos.z);
+				for (chunk_pos& cpos : batch)
+					this->wr->load_chunk (cpos.x, cpos.z);
+				
+				/* 
+				 * Saving and eviction.
+				 * A chunk is only unloaded once all chunks around it have been
+				 * generated as well, since they would otherwise load it back in
+				 * when they need it. Eviction thus lags about a ring behind.
+				 */
+				auto t1 = clock::now ();
+				for (chunk_pos& cpos : batch)
+					this->wr->save_chunk (cpos.x, cpos.z);
+				to_evict.insert (to_evict.end (), batch.begin (), batch.end ());
+				to_evict.erase (std::remove_if (to_evict.begin (), to_evict.end (),
+					[this, next] (const chunk_pos& cpos)
+						{
+							for (int nx = cpos.x - 1; nx <= cpos.x + 1; ++nx)
+								for (int nz = cpos.z - 1; nz <= cpos.z + 1; ++nz)
+									{
+										int dx = nx - this->cx, dz = nz - this->cz;
+										if (std::abs (dx) <= this->radius && std::abs (dz) <= this->radius
+												&& spiral_index (dx, dz) >= next)
+											return false;
+									}
+							
+							// chunks close to players are kept around (and retried).
+							return this->wr->unload_chunk (cpos.x, cpos.z);
+						}), to_evict.end ());
+				auto t2 = clock::now ();
+				
+				this->done = next;
+				this->save_progress ();
+				
+				int tenth = (int)(this->done * 10 / this->total);
+				if (tenth != last_tenth && this->done < this->total)
+					{
+						last_tenth = tenth;
+						this->report (std::to_string (tenth * 10) + "% done");
+					}
+				
+				/* 
+				 * Throttling: idle long enough for generation and disk writes to
+				 * take up no more than their share of time.
+				 */
+				long long gen_ms = std::chrono::duration_cast<std::chrono::milliseconds> (
+					t1 - t0).count ();
+				long long io_ms = std::chrono::duration_cast<std::chrono::milliseconds> (
+					t2 - t1).count ();
+				this->pause (gen_ms * (100 - this->cpu) / this->cpu
+					+ io_ms * (100 - this->io) / this->io);
+			}
+		
+		this->release (to_evict);
+		if (this->done >= this->total)
+			{
+				this->erase_progress ();
+				this->report ("finished");
+			}
+		else
+			this->report ("stopped");
+		this->running = false;
+	}
+}
+
@@ -0,0 +1,178 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "saver.hpp"
+#include "world.hpp"
+
+
+namespace hCraft {
+	
+	/* 
+	 * Constructs a new saver for the specified world.
+	 */
+	world_saver::world_saver (world& wr)
+		: wr (wr)
+	{
+		this->running = false;
+		this->delay = 30000;
+		this->budget = 64;
+		this->compact_pending = false;
+		this->idle_ticks = 0;
+	}
+	
+	/* 
+	 * Class destructor.
+	 * Stops the saver if it is still running.
+	 */
+	world_saver::~world_saver ()
+	{
+		this->stop ();
+	}
+	
+	
+	
+	/* 
+	 * Starts the saver's thread.
+	 */
+	void
+	world_saver::start ()
+	{
+		if (this->running)
+			return;
+		
+		this->running = true;
+		this->th = std::thread (std::bind (
+			std::mem_fn (&hCraft::world_saver::worker), this));
+	}
+	
+	/* 
+	 * Writes out every chunk still in the queue, and stops the saver's
+	 * thread.
+	 */
+	void
+	world_saver::stop ()
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->lock};
+			if (!this->running)
+				return;
+			this->running = false;
+		}
+		this->cv.notify_all ();
+		
+		if (this->th.joinable ())
+			this->th.join ();
+	}
+	
+	
+	
+	/* 
+	 * Queues the chunk at the given coordinates to be saved. Does nothing if
+	 * it is already queued.
+	 */
+	void
+	world_saver::mark_dirty (int x, int z)
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		if (this->queued.insert (chunk_pos (x, z)).second)
+			this->queue.emplace_back (chunk_pos (x, z),
+				std::chrono::steady_clock::now ());
+	}
+	
+	/* 
+	 * Returns the number of chunks waiting to be saved.
+	 */
+	int
+	world_saver::pending ()
+	{
+		std::lock_guard<std::mutex> guard {this->lock};
+		return this->queue.size ();
+	}
+	
+	
+	
+	/* 
+	 * Removes up to @{max} chunks that have been dirty since @{before} from
+	 * the queue and appends them to @{out}.
+	 */
+	void
+	world_saver::take (std::vector<chunk_pos>& out, int max,
+		std::chrono::steady_clock::time_point before)
+	{
+		// entries are queued in order, so the oldest ones are always in front.
+		while (!this->queue.empty () && max-- > 0)
+			{
+				entry& ent = this->queue.front ();
+				if (ent.since > before)
+					break;
+				
+				out.push_back (ent.pos);
+				this->queued.erase (ent.pos);
+				this->queue.pop_front ();
+			}
+	}
+	
+	/* 
+	 * The function ran by the saver's thread.
+	 */
+	void
+	world_saver::worker ()
+	{
+		std::vector<chunk_pos> batch;
+		bool stopping = false;
+		
+		while (!stopping)
+			{
+				batch.clear ();
+				{
+					std::unique_lock<std::mutex> guard {this->lock};
+					this->cv.wait_for (guard,
+						std::chrono::milliseconds (world_saver::tick_interval ()),
+						[this] { return !this->running; });
+					
+					if (!this->running)
+						{
+							// write out everything that is left.
+							stopping = true;
+							this->take (batch, this->queue.size (),
+								std::chrono::steady_clock::time_point::max ());
+						}
+					else
+						this->take (batch, this->budget, std::chrono::steady_clock::now ()
+							- std::chrono::milliseconds (this->delay));
+				}
+				
+				// chunks are snapshotted, so they can be changed (and queued again)
+				// while they are being saved.
+				if (!batch.empty ())
+					{
+						this->wr.save_chunks (batch);
+						this->compact_pending = true;
+						this->idle_ticks = 0;
+					}
+				else if (!stopping && this->compact_pending
+					&& ++ this->idle_ticks >= world_saver::compact_interval ())
+					{
+						this->compact_pending = this->wr.compact (
+							world_saver::compact_budget ());
+						this->idle_ticks = 0;
+					}
+			}
+	}
+}
+
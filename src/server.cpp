@@ -17,12 +17,15 @@
  */
 
 #include "server.hpp"
+#include "pregen.hpp"
+#include "codec.hpp"
 #include <memory>
 #include <fstream>
 #include <cstring>
 #include <yaml-cpp/yaml.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <event2/thread.h>
 #include <algorithm>
 
 
@@ -142,10 +145,38 @@ namespace hCraft {
 		while (!this->workers_stop)
 			{
 				event_base_loop (w->evbase, EVLOOP_NONBLOCK);
+				this->destroy_reaped (*w);
 				std::this_thread::sleep_for (std::chrono::milliseconds (1));
 			}
 	}
 	
+	/* 
+	 * Destroys the reaped players whose connections are run by the specified
+	 * worker. Called by the worker's thread in between event loop iterations,
+	 * so that none of the players' callbacks can be running or pending.
+	 */
+	void
+	server::destroy_reaped (worker& w)
+	{
+		std::vector<player *> dead;
+		{
+			std::lock_guard<std::mutex> guard {this->retired_lock};
+			if (this->reaped.empty ())
+				return;
+			
+			auto itr = std::partition (this->reaped.begin (), this->reaped.end (),
+				[&w] (player *pl) { return pl->get_event_base () != w.evbase; });
+			dead.assign (itr, this->reaped.end ());
+			this->reaped.erase (itr, this->reaped.end ());
+		}
+		
+		for (player *pl : dead)
+			{
+				pl->close_connection ();
+				delete pl;
+			}
+	}
+	
 	/* 
 	 * Returns the worker that has the least amount of events associated with
 	 * it.
@@ -185,6 +216,12 @@ namespace hCraft {
 		
 		worker &w = srv.get_min_worker ();
 		player *pl = new player (srv, w.evbase, sock, ip);
+		if (pl->bad ())
+			{
+				// no other thread has seen the player yet.
+				delete pl;
+				return;
+			}
 		
 		{
 			std::lock_guard<std::mutex> guard {srv.connecting_lock};
@@ -195,38 +232,63 @@ namespace hCraft {
 	
 	
 	/* 
-	 * Removes and destroys disconnected players.
+	 * Hands players that have been retired for long enough to the workers
+	 * that run their connections, to be destroyed.
 	 */
 	void
 	server::cleanup_players (scheduler_task& task)
 	{
 		server &srv = *(static_cast<server *> (task.get_context ()));
 		
-		// check list of logged-in players.
+		// a player that disconnects while done_connecting () adds it to the
+		// list is left in it.
 		srv.get_players ().remove_if (
 			[] (player *pl) -> bool
 				{
-					if (pl->bad ())		
-						return true;
-					
-					return false;
-				}, true);
+					return pl->bad ();
+				});
 		
-		// and the list of players that haven't fully logged-in yet.
+		// players retired before the last tick have been out of every list for
+		// at least a full tick. those that still have packets being handled are
+		// given another one.
+		std::vector<player *> dead;
 		{
-			std::lock_guard<std::mutex> guard {srv.connecting_lock};
-			for (auto itr = srv.connecting.begin (); itr != srv.connecting.end (); )
+			std::lock_guard<std::mutex> guard {srv.retired_lock};
+			for (player *pl : srv.retired_prev)
+				{
+					if (pl->busy ())
+						srv.retired.push_back (pl);
+					else
+						dead.push_back (pl);
+				}
+			srv.retired_prev.clear ();
+			srv.retired_prev.swap (srv.retired);
+		}
+		if (dead.empty ())
+			return;
+		
+		// make sure that nothing can reach the players anymore.
+		srv.get_players ().all (
+			[&dead] (player *pl)
 				{
-					player *pl = *itr;
-					if (pl->bad ())
+					for (player *d : dead)
+						pl->forget_observer (d);
+				});
+		{
+			std::lock_guard<std::mutex> guard {srv.world_lock};
+			for (auto itr = srv.worlds.begin (); itr != srv.worlds.end (); ++itr)
+				{
+					world *wr = itr->second;
+					for (player *pl : dead)
 						{
-							itr = srv.connecting.erase (itr);
-							delete pl;
+							wr->get_players ().remove (pl);
+							wr->get_entities ().remove (pl);
 						}
-					else
-						++ itr;
 				}
 		}
+		
+		std::lock_guard<std::mutex> guard {srv.retired_lock};
+		srv.reaped.insert (srv.reaped.end (), dead.begin (), dead.end ());
 	}
 	
 	
@@ -404,6 +466,28 @@ namespace hCraft {
 		return can_stay;
 	}
 	
+	/* 
+	 * Queues the specified disconnected player to be destroyed once no
+	 * other thread could be using it anymore. Called once for every player,
+	 * by player::disconnect ().
+	 */
+	void
+	server::retire_player (player *pl)
+	{
+		{
+			std::lock_guard<std::mutex> guard {this->connecting_lock};
+			for (auto itr = this->connecting.begin (); itr != this->connecting.end (); ++itr)
+				if (*itr == pl)
+					{
+						this->connecting.erase (itr);
+						break;
+					}
+		}
+		
+		std::lock_guard<std::mutex> guard {this->retired_lock};
+		this->retired.push_back (pl);
+	}
+	
 	
 	
 /*******************************************************************************
@@ -427,6 +511,7 @@ namespace hCraft {
 		std::strcpy (out.srv_motd, "Welcome to my server!");
 		out.max_players = 12;
 		std::strcpy (out.main_world, "main");
+		std::strcpy (out.chunk_codec, "blob");
 		
 		std::strcpy (out.ip, "0.0.0.0");
 		out.port = 25565;
@@ -447,6 +532,7 @@ namespace hCraft {
 		out << YAML::Key << "server-motd" << YAML::Value << in.srv_motd;
 		out << YAML::Key << "max-players" << YAML::Value << in.max_players;
 		out << YAML::Key << "main-world" << YAML::Value << in.main_world;
+		out << YAML::Key << "chunk-codec" << YAML::Value << in.chunk_codec;
 		out << YAML::EndMap;
 		
 		out << YAML::Key << "network" << YAML::Value << YAML::BeginMap;
@@ -534,6 +620,27 @@ namespace hCraft {
 						error = true;
 					}
 			}
+		
+		// chunk codec
+		node = general_map->FindValue ("chunk-codec");
+		if (node && node->Type () == YAML::NodeType::Scalar)
+			{
+				*node >> str;
+				chunk_codec *codec = (str.size () <= 32)
+					? chunk_codec::create (str.c_str ()) : nullptr;
+				if (codec)
+					{
+						std::strcpy (out.chunk_codec, str.c_str ());
+						delete codec;
+					}
+				else
+					{
+						if (!error)
+							log (LT_ERROR) << "Config: at map \"server.general\":" << std::endl;
+						log (LT_INFO) << " - Scalar \"chunk-codec\" must be one of: blob, raw, lz, zlib, zlib:<1-9>." << std::endl;
+						error = true;
+					}
+			}
 	}
 	
 	static void
@@ -623,6 +730,7 @@ namespace hCraft {
 			{
 				read_config (this->log, strm, this->cfg);
 				strm.close ();
+				chunk_codec::set_default (this->cfg.chunk_codec);
 				return;
 			}
 		
@@ -665,6 +773,10 @@ namespace hCraft {
 			"AUTOINCREMENT, `name` TEXT, `groups` TEXT, `nick` TEXT);"
 			
 			"CREATE TABLE IF NOT EXISTS `autoloaded-worlds` (`name` TEXT);"
+			
+			"CREATE TABLE IF NOT EXISTS `pregen` (`world` TEXT, `radius` INTEGER, "
+			"`cx` INTEGER, `cz` INTEGER, `cpu` INTEGER, `io` INTEGER, "
+			"`progress` INTEGER);"
 			);
 	}
 	
@@ -701,17 +813,30 @@ namespace hCraft {
 		this->tpool.stop ();
 		this->sched.stop ();
 		
+		std::vector<player *> all;
+		this->players->populate (all);
+		this->players->clear ();
 		{
 			std::lock_guard<std::mutex> guard {this->connecting_lock};
-			for (auto itr = this->connecting.begin (); itr != this->connecting.end (); ++itr)
-				{
-					player *pl = *itr;
-					delete pl;
-				}
+			all.insert (all.end (), this->connecting.begin (), this->connecting.end ());
 			this->connecting.clear ();
 		}
+		{
+			std::lock_guard<std::mutex> guard {this->retired_lock};
+			all.insert (all.end (), this->retired.begin (), this->retired.end ());
+			all.insert (all.end (), this->retired_prev.begin (), this->retired_prev.end ());
+			all.insert (all.end (), this->reaped.begin (), this->reaped.end ());
+			this->retired.clear ();
+			this->retired_prev.clear ();
+			this->reaped.clear ();
+		}
 		
-		this->players->clear (true);
+		// a player that disconnected while being added to the list might be in
+		// two of them.
+		std::sort (all.begin (), all.end ());
+		all.erase (std::unique (all.begin (), all.end ()), all.end ());
+		for (player *pl : all)
+			delete pl;
 		delete this->players;
 	}
 	
@@ -752,6 +877,8 @@ namespace hCraft {
 		_add_command (this->perms, this->commands, "tp");
 		_add_command (this->perms, this->commands, "nick");
 		_add_command (this->perms, this->commands, "wunload");
+		_add_command (this->perms, this->commands, "stats");
+		_add_command (this->perms, this->commands, "pregen");
 	}
 	
 	void
@@ -799,6 +926,7 @@ namespace hCraft {
 		grp_moderator->set_color ('c');
 		grp_moderator->inherit (grp_designer);
 		grp_moderator->add ("command.misc.ping");
+		grp_moderator->add ("command.info.stats");
 		
 		group* grp_admin = groups.add (7, "admin");
 		grp_admin->set_color ('4');
@@ -812,6 +940,7 @@ namespace hCraft {
 		grp_executive->add ("command.world.wcreate");
 		grp_executive->add ("command.world.wload");
 		grp_executive->add ("command.world.wunload");
+		grp_executive->add ("command.world.pregen");
 		grp_executive->add ("command.chat.nick");
 		
 		group* grp_owner = groups.add (9, "owner");
@@ -1155,10 +1284,13 @@ namespace hCraft {
 				main_world = new world (this->get_config ().main_world, gen, prov);
 				main_world->set_size (winf.width, winf.depth);
 			}
+		main_world->set_thread_pool (&this->tpool);
+		main_world->set_logger (&this->log);
 		main_world->prepare_spawn (10);
 		main_world->start ();
 		this->add_world (main_world);
 		this->main_world = main_world;
+		world_pregenerator::resume (*this, main_world);
 		
 		// load worlds from the autoload list.
 		{
@@ -1201,6 +1333,8 @@ namespace hCraft {
 				log () << " - Loading \"" << wname << std::endl;
 				world *wr = new world (wname.c_str (), gen, prov);
 				wr->set_size (winf.width, winf.depth);
+				wr->set_thread_pool (&this->tpool);
+				wr->set_logger (&this->log);
 				wr->prepare_spawn (10);
 				wr->start ();
 				if (!this->add_world (wr))
@@ -1209,6 +1343,8 @@ namespace hCraft {
 						delete wr;
 						continue;
 					}
+				
+				world_pregenerator::resume (*this, wr);
 			}
 	}
 	
@@ -1250,6 +1386,11 @@ namespace hCraft {
 		this->workers.reserve (this->worker_count);
 		log () << "Creating " << this->worker_count << " server workers." << std::endl;
 		
+		// output is written to players' bufferevents from other threads too
+		// (packet handlers, worlds, etc...), so libevent has to lock them.
+		if (evthread_use_pthreads () != 0)
+			throw server_error ("failed to enable libevent threading");
+		
 		this->workers_stop = false;
 		this->workers_ready = false;
 		for (int i = 0; i < this->worker_count; ++i)
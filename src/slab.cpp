@@ -0,0 +1,281 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "slab.hpp"
+#include <stdexcept>
+#include <cstdint>
+
+
+namespace hCraft {
+	
+	namespace {
+		
+		const int max_allocators = 16;
+		const int cache_limit = 64; // max objects kept by a single thread
+		const unsigned int slab_bytes = 65536;
+		
+		slab_allocator *registry[max_allocators];
+		std::atomic<int> registry_count (0);
+		
+		
+		
+		inline unsigned long long
+		tag_ptr (void *ptr, unsigned long long tag)
+		{
+			return ((unsigned long long)(std::uintptr_t)ptr & 0xFFFFFFFFFFFFULL)
+				| (tag << 48);
+		}
+		
+		template<typename T> inline T*
+		untag_ptr (unsigned long long val)
+			{ return (T *)(std::uintptr_t)(val & 0xFFFFFFFFFFFFULL); }
+		
+		inline unsigned long long
+		next_tag (unsigned long long val)
+			{ return ((val >> 48) + 1) & 0xFFFF; }
+	}
+	
+	
+	
+	/* 
+	 * Every thread keeps a small list of free objects for each allocator, so
+	 * that most allocations don't have to touch shared state at all. When the
+	 * thread exits, the objects are returned to their allocators.
+	 */
+	struct slab_thread_caches
+	{
+		struct cache
+		{
+			slab_allocator::free_node *head;
+			int count;
+		};
+		
+		cache caches[max_allocators];
+		
+		slab_thread_caches ()
+		{
+			for (int i = 0; i < max_allocators; ++i)
+				{
+					this->caches[i].head = nullptr;
+					this->caches[i].count = 0;
+				}
+		}
+		
+		~slab_thread_caches ()
+		{
+			for (int i = 0; i < registry_count.load (); ++i)
+				if (this->caches[i].count > 0)
+					registry[i]->drain (this->caches[i].count);
+		}
+	};
+	
+	static thread_local slab_thread_caches tls_caches;
+	
+	
+	
+	/* 
+	 * Constructs a new allocator for objects of @{obj_size} bytes.
+	 * @{name} must point to a string with static storage duration.
+	 */
+	slab_allocator::slab_allocator (const char *name, unsigned int obj_size)
+		: free_head (0), slabs (0), in_use (0), high_water (0)
+	{
+		this->name = name;
+		
+		// keep objects 16-byte aligned.
+		if (obj_size < sizeof (free_node))
+			obj_size = sizeof (free_node);
+		this->obj_size = (obj_size + 15) & ~15U;
+		
+		this->objs_per_slab = slab_bytes / this->obj_size;
+		if (this->objs_per_slab < 16)
+			this->objs_per_slab = 16;
+		
+		this->id = registry_count.fetch_add (1);
+		if (this->id >= max_allocators)
+			throw std::runtime_error ("too many slab allocators");
+		registry[this->id] = this;
+	}
+	
+	
+	
+	slab_allocator::free_node*
+	slab_allocator::pop_shared ()
+	{
+		unsigned long long head = this->free_head.load (std::memory_order_acquire);
+		for (;;)
+			{
+				free_node *node = untag_ptr<free_node> (head);
+				if (!node)
+					return nullptr;
+				
+				// slabs are never freed, so reading `next' is safe even if another
+				// thread pops the node first (the tag makes our CAS fail then).
+				unsigned long long next = tag_ptr (node->next, next_tag (head));
+				if (this->free_head.compare_exchange_weak (head, next,
+					std::memory_order_acq_rel, std::memory_order_acquire))
+					return node;
+			}
+	}
+	
+	void
+	slab_allocator::push_shared (free_node *node)
+	{
+		unsigned long long head = this->free_head.load (std::memory_order_relaxed);
+		for (;;)
+			{
+				node->next = untag_ptr<free_node> (head);
+				if (this->free_head.compare_exchange_weak (head,
+					tag_ptr (node, next_tag (head)),
+					std::memory_order_release, std::memory_order_relaxed))
+					return;
+			}
+	}
+	
+	
+	
+	/* 
+	 * Moves objects from the shared free list (or from a newly allocated
+	 * slab, if it's empty) into the calling thread's cache.
+	 */
+	void
+	slab_allocator::refill ()
+	{
+		auto& cache = tls_caches.caches[this->id];
+		
+		free_node *node;
+		while ((cache.count < (cache_limit / 2)) && (node = this->pop_shared ()))
+			{
+				node->next = cache.head;
+				cache.head = node;
+				++ cache.count;
+			}
+		if (cache.count > 0)
+			return;
+		
+		// nothing in the shared list either, carve up a new slab.
+		unsigned char *slab = new unsigned char[this->obj_size * this->objs_per_slab];
+		this->slabs.fetch_add (1, std::memory_order_relaxed);
+		
+		unsigned int i = 0;
+		for (; i < this->objs_per_slab && i < (unsigned int)cache_limit; ++i)
+			{
+				node = reinterpret_cast<free_node *> (slab + (i * this->obj_size));
+				node->next = cache.head;
+				cache.head = node;
+				++ cache.count;
+			}
+		for (; i < this->objs_per_slab; ++i)
+			this->push_shared (reinterpret_cast<free_node *> (
+				slab + (i * this->obj_size)));
+	}
+	
+	/* 
+	 * Returns @{count} objects from the calling thread's cache back to the
+	 * shared free list.
+	 */
+	void
+	slab_allocator::drain (int count)
+	{
+		auto& cache = tls_caches.caches[this->id];
+		while (count-- > 0 && cache.head)
+			{
+				free_node *node = cache.head;
+				cache.head = node->next;
+				-- cache.count;
+				this->push_shared (node);
+			}
+	}
+	
+	
+	
+	/* 
+	 * Returns a pointer to an uninitialized object.
+	 */
+	void*
+	slab_allocator::alloc ()
+	{
+		auto& cache = tls_caches.caches[this->id];
+		if (!cache.head)
+			this->refill ();
+		
+		free_node *node = cache.head;
+		cache.head = node->next;
+		-- cache.count;
+		
+		unsigned int used = this->in_use.fetch_add (1, std::memory_order_relaxed) + 1;
+		unsigned int hw = this->high_water.load (std::memory_order_relaxed);
+		while (used > hw && !this->high_water.compare_exchange_weak (hw, used,
+			std::memory_order_relaxed))
+			;
+		
+		return node;
+	}
+	
+	/* 
+	 * Returns the specified object back to the allocator.
+	 */
+	void
+	slab_allocator::free (void *ptr)
+	{
+		if (!ptr)
+			return;
+		
+		auto& cache = tls_caches.caches[this->id];
+		free_node *node = static_cast<free_node *> (ptr);
+		node->next = cache.head;
+		cache.head = node;
+		++ cache.count;
+		
+		this->in_use.fetch_sub (1, std::memory_order_relaxed);
+		if (cache.count > cache_limit)
+			this->drain (cache_limit / 2);
+	}
+	
+	
+	
+	/* 
+	 * Returns current usage figures.
+	 */
+	slab_stats
+	slab_allocator::stats ()
+	{
+		slab_stats st;
+		st.name = this->name;
+		st.obj_size = this->obj_size;
+		st.slabs = this->slabs.load ();
+		st.in_use = this->in_use.load ();
+		st.free = (st.slabs * this->objs_per_slab) - st.in_use;
+		st.high_water = this->high_water.load ();
+		return st;
+	}
+	
+	/* 
+	 * Calls @{f} on every slab allocator that has been created so far.
+	 */
+	void
+	slab_allocator::all (std::function<void (slab_allocator&)> f)
+	{
+		int count = registry_count.load ();
+		if (count > max_allocators)
+			count = max_allocators;
+		for (int i = 0; i < count; ++i)
+			f (*registry[i]);
+	}
+}
+
@@ -144,6 +144,24 @@ namespace hCraft {
 				throw sql_error (sqlite3_errmsg (this->db.db));
 		}
 		
+		void
+		statement::bind_int (int index, int val)
+		{
+			if (!this->stmt)
+				return;
+			if (sqlite3_bind_int (this->stmt, index, val) != SQLITE_OK)
+				throw sql_error (sqlite3_errmsg (this->db.db));
+		}
+		
+		void
+		statement::bind_int64 (int index, long long val)
+		{
+			if (!this->stmt)
+				return;
+			if (sqlite3_bind_int64 (this->stmt, index, val) != SQLITE_OK)
+				throw sql_error (sqlite3_errmsg (this->db.db));
+		}
+		
 		
 		
 		void
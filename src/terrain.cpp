@@ -0,0 +1,342 @@
+/* 
+ * hCraft - A custom Minecraft server.
+ * Copyright (C) 2012	Jacob Zhitomirsky
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "terrain.hpp"
+#include "world.hpp"
+#include <cstring>
+#include <random>
+
+
+namespace hCraft {
+	
+	static const int sea_level = 62;
+	
+	
+	/* 
+	 * Constructs a new terrain world generator.
+	 */
+	terrain_world_generator::terrain_world_generator (long seed)
+		: height_noise (seed), hill_noise (seed + 1), temp_noise (seed + 2),
+			rain_noise (seed + 3)
+	{
+		this->gen_seed = seed;
+	}
+	
+	
+	
+	static unsigned char
+	_pick_biome (int h, float temp, float rain)
+	{
+		if (h < (sea_level - 1))
+			return (temp < -0.45f) ? BI_FROZEN_OCEAN : BI_OCEAN;
+		if (h <= (sea_level + 1))
+			return (temp < -0.45f) ? BI_ICE_PLAINS : BI_BEACH;
+		if (h > 96)
+			return (temp < -0.3f) ? BI_ICE_MOUNTAINS : BI_EXTREME_HILLS;
+		
+		if (temp > 0.35f && rain < 0.0f)
+			return BI_DESERT;
+		if (temp < -0.45f)
+			return (rain < 0.0f) ? BI_ICE_PLAINS : BI_TAIGA;
+		if (temp > 0.35f && rain > 0.45f)
+			return BI_JUNGLE;
+		if (rain > 0.5f && h < (sea_level + 5))
+			return BI_SWAMPLAND;
+		if (rain > 0.1f)
+			return BI_FOREST;
+		return BI_PLAINS;
+	}
+	
+	static int
+	_column_height (float base, float hills)
+	{
+		int h = 64 + (int)(base * 36.0f);
+		if (hills > 0.2f)
+			h += (int)((hills - 0.2f) * 80.0f);
+		if (h < 4) h = 4;
+		else if (h > 240) h = 240;
+		return h;
+	}
+	
+	static void
+	_pick_blocks (unsigned char biome, int h, unsigned short *surface,
+		unsigned short *filler)
+	{
+		*surface = BT_GRASS;
+		*filler = BT_DIRT;
+		switch (biome)
+			{
+			case BI_OCEAN:
+			case BI_FROZEN_OCEAN:
+				*surface = *filler = (h > (sea_level - 8)) ? BT_SAND : BT_GRAVEL;
+				break;
+			
+			case BI_BEACH:
+				*surface = *filler = BT_SAND;
+				break;
+			
+			case BI_DESERT:
+				*surface = BT_SAND;
+				*filler = BT_SANDSTONE;
+				break;
+			
+			case BI_EXTREME_HILLS:
+			case BI_ICE_MOUNTAINS:
+				if (h > 110)
+					*surface = *filler = BT_STONE;
+				break;
+			}
+	}
+	
+	static inline unsigned int
+	_index (int x, int y, int z)
+		{ return (y << 8) | (z << 4) | x; }
+	
+	static inline void
+	_set_nibble (unsigned char *arr, unsigned int index, unsigned char val)
+	{
+		if (index & 1)
+			arr[index >> 1] = (arr[index >> 1] & 0x0F) | (val << 4);
+		else
+			arr[index >> 1] = (arr[index >> 1] & 0xF0) | val;
+	}
+	
+	
+	/* 
+	 * Generates terrain on the specified chunk.
+	 */
+	void
+	terrain_world_generator::generate (world& wr, chunk *out, int cx, int cz)
+	{
+		static const unsigned char zeroes[2048] = { 0 };
+		
+		float base[256], hills[256], temp[256], rain[256];
+		float bx = cx * 16.0f, bz = cz * 16.0f;
+		this->height_noise.fill (base, bx / 256.0f, bz / 256.0f, 1.0f / 256.0f,
+			16, 16, 6, 0.5f);
+		this->hill_noise.fill (hills, bx / 128.0f, bz / 128.0f, 1.0f / 128.0f,
+			16, 16, 2, 0.5f);
+		this->temp_noise.fill (temp, bx / 512.0f, bz / 512.0f, 1.0f / 512.0f,
+			16, 16, 2, 0.5f);
+		this->rain_noise.fill (rain, bx / 512.0f, bz / 512.0f, 1.0f / 512.0f,
+			16, 16, 2, 0.5f);
+		
+		// the whole chunk is built in dense form first, and then handed to the
+		// subchunks in one go.
+		unsigned char ids[65536];
+		unsigned char slight[32768];
+		std::memset (ids, 0, sizeof ids);
+		std::memset (slight, 0, sizeof slight);
+		
+		short tops[256];
+		int top = 0;
+		for (int z = 0; z < 16; ++z)
+			for (int x = 0; x < 16; ++x)
+				{
+					int i = (z << 4) | x;
+					float t = temp[i] * 1.5f, r = rain[i] * 1.5f;
+					
+					int h = _column_height (base[i], hills[i]);
+					unsigned char biome = _pick_biome (h, t, r);
+					out->set_biome (x, z, biome);
+					
+					unsigned short surface, filler;
+					_pick_blocks (biome, h, &surface, &filler);
+					
+					int y;
+					ids[_index (x, 0, z)] = BT_BEDROCK;
+					for (y = 1; y < (h - 3); ++y)
+						ids[_index (x, y, z)] = BT_STONE;
+					for (; y < h; ++y)
+						ids[_index (x, y, z)] = filler;
+					ids[_index (x, h, z)] = surface;
+					
+					int ctop = h;
+					if (h < sea_level)
+						{
+							for (y = h + 1; y <= sea_level; ++y)
+								ids[_index (x, y, z)] = BT_STILL_WATER;
+							ctop = sea_level;
+						}
+					
+					tops[i] = ctop;
+					out->set_height (x, z, ctop + 1);
+					if (ctop > top)
+						top = ctop;
+				}
+		
+		// sky light, the same way chunk::relight () would have done it.
+		int top_sub = top >> 4;
+		for (int z = 0; z < 16; ++z)
+			for (int x = 0; x < 16; ++x)
+				{
+					int y = tops[(z << 4) | x];
+					for (int ly = (top_sub << 4) + 15; ly > y; --ly)
+						_set_nibble (slight, _index (x, ly, z), 15);
+					
+					char light = 15;
+					for (; y >= 0 && light > 0; --y)
+						{
+							light -= block_info::from_id (ids[_index (x, y, z)])->opacity;
+							if (light > 0)
+								_set_nibble (slight, _index (x, y, z), light);
+						}
+				}
+		
+		for (int sy = 0; sy <= top_sub; ++sy)
+			out->import_sub (sy, ids + (sy * 4096), nullptr, zeroes,
+				zeroes, slight + (sy * 2048));
+	}
+	
+	
+	
+	/* 
+	 * Computes the height and biome of the column at (@{x}, @{z}) in chunk
+	 * (@{cx}, @{cz}) from the noise alone. The noise is sampled at the exact
+	 * same points generate () uses, so the results match it bit for bit.
+	 */
+	void
+	terrain_world_generator::column_at (int cx, int cz, int x, int z, int *h,
+		unsigned char *biome) const
+	{
+		float base[16], hills[16], temp[16], rain[16];
+		float bx = cx * 16.0f, bz = cz * 16.0f;
+		this->height_noise.fill (base, bx / 256.0f,
+			(bz / 256.0f) + (z * (1.0f / 256.0f)), 1.0f / 256.0f, 16, 1, 6, 0.5f);
+		this->hill_noise.fill (hills, bx / 128.0f,
+			(bz / 128.0f) + (z * (1.0f / 128.0f)), 1.0f / 128.0f, 16, 1, 2, 0.5f);
+		this->temp_noise.fill (temp, bx / 512.0f,
+			(bz / 512.0f) + (z * (1.0f / 512.0f)), 1.0f / 512.0f, 16, 1, 2, 0.5f);
+		this->rain_noise.fill (rain, bx / 512.0f,
+			(bz / 512.0f) + (z * (1.0f / 512.0f)), 1.0f / 512.0f, 16, 1, 2, 0.5f);
+		
+		*h = _column_height (base[x], hills[x]);
+		*biome = _pick_biome (*h, temp[x] * 1.5f, rain[x] * 1.5f);
+	}
+	
+	
+	
+	/* 
+	 * Chance (out of 100) that a tree will be attempted at one of the eight
+	 * random spots picked in every chunk.
+	 */
+	static int
+	_tree_density (unsigned char biome)
+	{
+		switch (biome)
+			{
+			case BI_FOREST: return 60;
+			case BI_JUNGLE: return 90;
+			case BI_TAIGA: return 50;
+			case BI_SWAMPLAND: return 25;
+			case BI_EXTREME_HILLS: return 10;
+			case BI_PLAINS: return 3;
+			default: return 0;
+			}
+	}
+	
+	/* 
+	 * Draws the part of a tree whose trunk starts at (@{x}, @{y}, @{z})
+	 * (relative to @{out}) that falls inside the chunk.
+	 */
+	static bool
+	_draw_tree (chunk *out, int x, int y, int z, int height)
+	{
+		bool changed = false;
+		
+		// leaves
+		for (int ly = y + height - 3; ly <= y + height; ++ly)
+			{
+				int r = (ly >= (y + height - 1)) ? 1 : 2;
+				for (int lx = x - r; lx <= x + r; ++lx)
+					for (int lz = z - r; lz <= z + r; ++lz)
+						{
+							if (lx < 0 || lx > 15 || lz < 0 || lz > 15)
+								continue;
+							if ((lx - x == r || x - lx == r) && (lz - z == r || z - lz == r)
+								&& ly == (y + height))
+								continue; // round off the top
+							
+							if (out->get_id (lx, ly, lz) == BT_AIR)
+								{
+									out->set_id (lx, ly, lz, BT_LEAVES);
+									changed = true;
+								}
+						}
+			}
+		
+		// trunk
+		if (x >= 0 && x <= 15 && z >= 0 && z <= 15)
+			{
+				for (int ty = y; ty < (y + height); ++ty)
+					out->set_id (x, ty, z, BT_TRUNK);
+				changed = true;
+			}
+		
+		return changed;
+	}
+	
+	/* 
+	 * Plants trees. Trees are rooted in a chunk but may hang over into its
+	 * neighbours, so every chunk also draws the parts of trees planted in
+	 * the eight chunks around it.
+	 */
+	bool
+	terrain_world_generator::decorate (world& wr, chunk *out, int cx, int cz)
+	{
+		bool changed = false;
+		for (int nx = cx - 1; nx <= cx + 1; ++nx)
+			for (int nz = cz - 1; nz <= cz + 1; ++nz)
+				{
+					// where trees go depends only on the seed and the chunk they are
+					// rooted in, and never on the neighbour's blocks, which may have
+					// been loaded from disk or edited since.
+					std::minstd_rand rnd ((this->gen_seed ^ (nx * 341873128712LL)
+						^ (nz * 132897987541LL)) & 0x7FFFFFFF);
+					for (int i = 0; i < 8; ++i)
+						{
+							int tx = rnd () % 16;
+							int tz = rnd () % 16;
+							int height = 4 + (rnd () % 3);
+							int roll = rnd () % 100;
+							
+							// leaves reach at most two blocks out of the trunk.
+							int x = ((nx - cx) * 16) + tx, z = ((nz - cz) * 16) + tz;
+							if (x < -2 || x > 17 || z < -2 || z > 17)
+								continue;
+							
+							int h;
+							unsigned char biome;
+							this->column_at (nx, nz, tx, tz, &h, &biome);
+							if (roll >= _tree_density (biome))
+								continue;
+							
+							unsigned short surface, filler;
+							_pick_blocks (biome, h, &surface, &filler);
+							if (surface != BT_GRASS || (h + 1 + height) > 254)
+								continue;
+							
+							if (_draw_tree (out, x, h + 1, z, height))
+								changed = true;
+						}
+				}
+		
+		return changed;
+	}
+}
+
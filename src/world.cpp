@@ -21,10 +21,17 @@
 #include "playerlist.hpp"
 #include "player.hpp"
 #include "packet.hpp"
+#include "threadpool.hpp"
+#include "pregen.hpp"
+#include "saver.hpp"
+#include "logger.hpp"
 #include <stdexcept>
 #include <cassert>
 #include <cstring>
 #include <cctype>
+#include <condition_variable>
+#include <algorithm>
+#include <sstream>
 
 #include <iostream> // DEBUG
 
@@ -55,10 +62,15 @@ namespace hCraft {
 		this->depth = 0;
 		
 		this->prov = provider;
+		this->pool = nullptr;
+		this->log = nullptr;
 		this->edge_chunk = nullptr;
 		
 		this->players = new playerlist ();
 		this->th_running = false;
+		this->gen_tasks = 0;
+		
+		this->saver = new world_saver (*this);
 	}
 	
 	/* 
@@ -67,6 +79,14 @@ namespace hCraft {
 	world::~world ()
 	{
 		this->stop ();
+		
+		// wait for pending generation tasks to finish.
+		{
+			std::unique_lock<std::mutex> guard {this->gen_lock};
+			this->gen_cv.wait (guard, [this] { return this->gen_tasks == 0; });
+		}
+		
+		delete this->saver;
 		delete this->players;
 		
 		delete this->gen;
@@ -84,6 +104,10 @@ namespace hCraft {
 					delete ch;
 				}
 			this->chunks.clear ();
+			
+			for (auto& r : this->retired)
+				delete r.first;
+			this->retired.clear ();
 		}
 	}
 	
@@ -123,6 +147,7 @@ namespace hCraft {
 		this->th_running = true;
 		this->th.reset (new std::thread (
 			std::bind (std::mem_fn (&hCraft::world::worker), this)));
+		this->saver->start ();
 	}
 	
 	/* 
@@ -131,6 +156,8 @@ namespace hCraft {
 	void
 	world::stop ()
 	{
+		this->stop_pregen ();
+		
 		if (!this->th_running)
 			return;
 		
@@ -138,6 +165,61 @@ namespace hCraft {
 		if (this->th->joinable ())
 			this->th->join ();
 		this->th.reset ();
+		
+		// flushes chunks that are still waiting to be saved.
+		this->saver->stop ();
+	}
+	
+	
+	
+	/* 
+	 * Starts running the specified pre-generator on this world, stopping the
+	 * previous one (if any).
+	 */
+	void
+	world::start_pregen (std::shared_ptr<world_pregenerator> pregen)
+	{
+		std::lock_guard<std::mutex> guard {this->pregen_lock};
+		if (this->pregen)
+			this->pregen->stop ();
+		this->pregen = pregen;
+		this->pregen->start ();
+	}
+	
+	/* 
+	 * Stops the world's pre-generator, if there is one running.
+	 */
+	void
+	world::stop_pregen ()
+	{
+		std::lock_guard<std::mutex> guard {this->pregen_lock};
+		if (this->pregen)
+			this->pregen->stop ();
+	}
+	
+	/* 
+	 * Returns the world's current (or last) pre-generator, or null if none
+	 * has been started.
+	 */
+	std::shared_ptr<world_pregenerator>
+	world::get_pregen ()
+	{
+		std::lock_guard<std::mutex> guard {this->pregen_lock};
+		return this->pregen;
+	}
+	
+	
+	
+	/* 
+	 * Reports an error met while running a task in the background.
+	 */
+	void
+	world::report_error (const std::string& msg)
+	{
+		if (this->log)
+			(*this->log) (LT_ERROR) << "World \"" << this->name << "\": " << msg << std::endl;
+		else
+			std::cerr << "World \"" << this->name << "\": " << msg << std::endl;
 	}
 	
 	
@@ -200,6 +282,10 @@ namespace hCraft {
 		bool nolight_msg = false;
 		int total_update_count = 0;
 		
+		const static std::chrono::milliseconds tick_length (50);
+		auto next_tick = std::chrono::steady_clock::now ();
+		unsigned long long tick = 0;
+		
 		while (this->th_running)
 			{
 				{
@@ -366,12 +452,39 @@ namespace hCraft {
 						}
 				}
 				
+				auto now = std::chrono::steady_clock::now ();
+				if (now >= next_tick)
+					{
+						this->tick_players (tick);
+						if (tick++ % 20 == 0)
+							this->reclaim_chunks ();
+						next_tick += tick_length;
+						if (next_tick < now)
+							next_tick = now + tick_length; // don't try to catch up
+					}
+				
 				std::this_thread::sleep_for (std::chrono::milliseconds (1));
 			}
 	}
 	
 	
 	
+	/* 
+	 * Runs the per-tick work of every player in the world (movement
+	 * broadcasts, held back chunks, etc...).
+	 */
+	void
+	world::tick_players (unsigned long long tick)
+	{
+		this->get_players ().all (
+			[tick] (player *pl)
+				{
+					pl->tick (tick);
+				});
+	}
+	
+	
+	
 	void
 	world::set_width (int width)
 	{
@@ -385,6 +498,7 @@ namespace hCraft {
 				this->gen->generate_edge (*this, this->edge_chunk);
 				this->edge_chunk->recalc_heightmap ();
 				this->edge_chunk->relight ();
+				this->edge_chunk->set_stage (CS_READY);
 			}
 	}
 	
@@ -401,6 +515,7 @@ namespace hCraft {
 				this->gen->generate_edge (*this, this->edge_chunk);
 				this->edge_chunk->recalc_heightmap ();
 				this->edge_chunk->relight ();
+				this->edge_chunk->set_stage (CS_READY);
 			}
 	}
 	
@@ -415,27 +530,281 @@ namespace hCraft {
 		if (this->prov == nullptr)
 			return;
 		
-		std::lock_guard<std::mutex> guard {this->chunk_lock};
+		std::vector<chunk_pos> positions;
+		{
+			std::lock_guard<std::mutex> guard {this->chunk_lock};
+			if (this->chunks.empty ())
+				{
+					std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+					this->prov->save_empty (*this);
+					return;
+				}
+			
+			for (auto itr = this->chunks.begin (); itr != this->chunks.end (); ++itr)
+				{
+					chunk *ch = itr->second;
+					if (ch->modified && ch->get_stage () == CS_READY)
+						{
+							int x, z;
+							chunk_coords (itr->first, &x, &z);
+							positions.emplace_back (x, z);
+						}
+				}
+		}
+		
+		this->save_chunks (positions);
+	}
+	
+	/* 
+	 * State shared between a thread saving a batch of chunks and the pooled
+	 * threads helping it compress them. Kept in a shared pointer, since tasks
+	 * that start after every chunk has been claimed may outlive the call.
+	 */
+	struct save_batch
+	{
+		struct entry
+		{
+			chunk_pos pos;
+			chunk *snap;
+			unsigned char *data; // null if the chunk could not be compressed
+			unsigned int size;
+			std::string error;
+		};
 		
-		if (this->chunks.empty ())
+		std::vector<entry> chunks;
+		unsigned int next;         // next chunk to compress
+		std::vector<int> done;     // compressed, but not written yet
+		std::mutex lock;
+		std::condition_variable cv;
+		
+		save_batch ()
+			: next (0)
+			{ }
+		
+		/* 
+		 * Claims and compresses the next chunk in the batch. Returns false if
+		 * there are none left.
+		 */
+		bool
+		encode_next (world_provider *prov)
+		{
+			unsigned int index;
 			{
-				this->prov->save_empty (*this);
-				return;
+				std::lock_guard<std::mutex> guard {this->lock};
+				if (this->next >= this->chunks.size ())
+					return false;
+				index = this->next++;
+			}
+			
+			entry& ent = this->chunks[index];
+			try
+				{
+					ent.data = prov->encode (ent.snap, ent.pos.x, ent.pos.z, &ent.size);
+				}
+			catch (const std::exception& ex)
+				{
+					ent.data = nullptr;
+					ent.error = ex.what ();
+				}
+			delete ent.snap;
+			
+			{
+				std::lock_guard<std::mutex> guard {this->lock};
+				this->done.push_back (index);
+			}
+			this->cv.notify_all ();
+			return true;
+		}
+	};
+	
+	/* 
+	 * Writes out the modified chunks at the given positions in a single
+	 * batch. Each chunk is snapshotted under its data lock, and the
+	 * snapshots are compressed and written without holding any of the
+	 * chunks' locks, so they can still be used and modified while being
+	 * saved. Batches are saved one at a time.
+	 * Chunks that fail to compress or to be written are logged, marked
+	 * modified and queued for saving again.
+	 * 
+	 * Compression is spread across the thread pool, while this thread writes
+	 * chunks out in the order they finish. It also compresses chunks itself
+	 * whenever there is nothing to write, so the batch is saved even if the
+	 * pool is busy (or this is a pooled thread).
+	 */
+	void
+	world::save_chunks (const std::vector<chunk_pos>& positions)
+	{
+		if (this->prov == nullptr || positions.empty ())
+			return;
+		
+		// without this, a batch could snapshot a chunk, and have its write land
+		// after that of a later snapshot taken by another thread (e.g. the
+		// saver's and unload_chunk ()'s), leaving the older one on disk.
+		std::lock_guard<std::mutex> save_guard {this->save_lock};
+		
+		std::shared_ptr<save_batch> batch { new save_batch () };
+		{
+			std::lock_guard<std::mutex> guard {this->chunk_lock};
+			for (const chunk_pos& pos : positions)
+				{
+					auto itr = this->chunks.find (chunk_key (pos.x, pos.z));
+					if (itr == this->chunks.end ())
+						continue;
+					
+					chunk *ch = itr->second;
+					if (ch == this->edge_chunk)
+						continue;
+					
+					// both flags are cleared before taking the snapshot, so that
+					// changes made in the meantime are neither lost nor left unqueued.
+					ch->save_queued = false;
+					if (ch->get_stage () != CS_READY || !ch->modified.exchange (false))
+						continue;
+					
+					// subchunks are shared, so this is cheap: they are only copied once
+					// the original chunk writes to them. copy_from () takes the chunk's
+					// data lock, so the snapshot never sees a write half-done.
+					chunk *snap = new chunk ();
+					snap->copy_from (*ch);
+					batch->chunks.push_back ({ pos, snap, nullptr, 0, std::string () });
+				}
+		}
+		
+		unsigned int count = batch->chunks.size ();
+		if (count == 0)
+			return;
+		
+		if (this->pool)
+			{
+				world_provider *prov = this->prov;
+				int helpers = std::min (this->pool->size (), (int)count - 1);
+				for (int i = 0; i < helpers; ++i)
+					this->pool->enqueue (
+						[batch, prov] (void *)
+							{
+								while (batch->encode_next (prov))
+									;
+							});
 			}
 		
-		this->prov->open (*this);
-		for (auto itr = this->chunks.begin (); itr != this->chunks.end (); ++itr)
+		std::vector<int> ready;
+		std::vector<chunk_pos> failed;
+		for (unsigned int written = 0; written < count; )
 			{
-				chunk *ch = itr->second;
-				if (ch->modified)
+				ready.clear ();
+				{
+					std::unique_lock<std::mutex> guard {batch->lock};
+					while (batch->done.empty ())
+						{
+							if (batch->next < count)
+								{
+									guard.unlock ();
+									batch->encode_next (this->prov);
+									guard.lock ();
+								}
+							else
+								batch->cv.wait (guard);
+						}
+					ready.swap (batch->done);
+				}
+				
+				for (int index : ready)
 					{
-						int x, z;
-						chunk_coords (itr->first, &x, &z);
-						this->prov->save (*this, ch, x, z);
-						ch->modified = false;
+						save_batch::entry& ent = batch->chunks[index];
+						if (!ent.data)
+							{
+								std::ostringstream ss;
+								ss << "failed to compress chunk (" << ent.pos.x << ", "
+									 << ent.pos.z << "): " << ent.error;
+								this->report_error (ss.str ());
+								failed.push_back (ent.pos);
+							}
 					}
+				
+				{
+					// chunks are only known to be on disk once close () returns, so if
+					// anything fails, the whole group is saved again later.
+					std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+					try
+						{
+							this->prov->open (*this);
+							for (int index : ready)
+								{
+									save_batch::entry& ent = batch->chunks[index];
+									if (ent.data)
+										this->prov->write (*this, ent.pos.x, ent.pos.z, ent.data, ent.size);
+								}
+							this->prov->close ();
+						}
+					catch (const std::exception& ex)
+						{
+							std::ostringstream ss;
+							ss << "failed to save " << ready.size () << " chunk(s): " << ex.what ();
+							this->report_error (ss.str ());
+							for (int index : ready)
+								if (batch->chunks[index].data)
+									failed.push_back (batch->chunks[index].pos);
+						}
+				}
+				
+				for (int index : ready)
+					delete[] batch->chunks[index].data;
+				written += ready.size ();
+			}
+		
+		// chunks that did not make it to disk are marked modified again, and
+		// put back in the saver's queue (they are only dropped when unloaded if
+		// they are not modified).
+		if (!failed.empty ())
+			{
+				std::vector<chunk_pos> requeue;
+				{
+					std::lock_guard<std::mutex> guard {this->chunk_lock};
+					for (const chunk_pos& pos : failed)
+						{
+							auto itr = this->chunks.find (chunk_key (pos.x, pos.z));
+							if (itr == this->chunks.end ())
+								continue;
+							
+							chunk *ch = itr->second;
+							ch->modified = true;
+							if (!ch->save_queued.exchange (true))
+								requeue.push_back (pos);
+						}
+				}
+				
+				for (const chunk_pos& pos : requeue)
+					this->saver->mark_dirty (pos.x, pos.z);
+			}
+	}
+	
+	
+	
+	/* 
+	 * Lets the world's provider reclaim unused space in the world file,
+	 * looking at no more than @{max_chunks} chunks. Returns false once there
+	 * is nothing left to do.
+	 */
+	bool
+	world::compact (int max_chunks)
+	{
+		if (this->prov == nullptr)
+			return false;
+		
+		std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+		try
+			{
+				this->prov->open (*this);
+				bool more = this->prov->compact (*this, max_chunks);
+				this->prov->close ();
+				return more;
+			}
+		catch (const std::exception& ex)
+			{
+				this->report_error (std::string ("failed to compact world file: ")
+					+ ex.what ());
+				return false;
 			}
-		this->prov->close ();
 	}
 	
 	
@@ -450,11 +819,14 @@ namespace hCraft {
 		int r_half = radius >> 1;
 		int cx, cz;
 		
+		std::unique_lock<std::mutex> guard {this->gen_lock};
 		for (cx = (cpos.x - r_half); cx <= (cpos.x + r_half); ++cx)
 			for (cz = (cpos.z - r_half); cz <= (cpos.z + r_half); ++cz)
-				{
-					this->load_chunk (cx, cz);
-				}
+				this->gen_request (cx, cz, CS_READY);
+		
+		for (cx = (cpos.x - r_half); cx <= (cpos.x + r_half); ++cx)
+			for (cz = (cpos.z - r_half); cz <= (cpos.z + r_half); ++cz)
+				this->gen_wait (cx, cz, guard);
 	}
 	
 	/* 
@@ -542,37 +914,620 @@ namespace hCraft {
 	 * Same as get_chunk (), but if the chunk does not exist, it will be either
 	 * loaded from a file (if such a file exists), or completely generated from
 	 * scratch.
+	 * Threads asking for the same chunk at the same time wait on a single
+	 * load (see gen_request ()).
 	 */
 	chunk*
 	world::load_chunk (int x, int z)
 	{
 		chunk *ch = this->get_chunk (x, z);
-		if (ch) return ch;
+		if (ch && ch->get_stage () == CS_READY)
+			return ch;
+		
+		std::unique_lock<std::mutex> guard {this->gen_lock};
+		ch = this->gen_request (x, z, CS_READY);
+		this->gen_wait (x, z, guard);
+		return ch;
+	}
+	
+	/* 
+	 * Asynchronous version of load_chunk (). The returned chunk might not be
+	 * ready yet (see chunk::get_stage ()); players in the world are notified
+	 * through player::chunk_ready () once it is.
+	 */
+	chunk*
+	world::request_chunk (int x, int z)
+	{
+		chunk *ch = this->get_chunk (x, z);
+		if (ch && ch->get_stage () == CS_READY)
+			return ch;
+		
+		std::lock_guard<std::mutex> guard {this->gen_lock};
+		return this->gen_request (x, z, CS_READY);
+	}
+	
+	/* 
+	 * Writes the chunk at the given coordinates to disk if it is ready and
+	 * has been modified.
+	 */
+	void
+	world::save_chunk (int x, int z)
+	{
+		this->save_chunks ({ chunk_pos (x, z) });
+	}	
+	/* 
+	 * Saves the chunk at the specified coordinates and removes it from
+	 * memory. Returns false if the chunk is still needed, i.e. it is close to
+	 * a player, or it (or a chunk around it) is still being generated.
+	 * Partially generated chunks are dropped without being saved.
+	 */
+	bool
+	world::unload_chunk (int x, int z)
+	{
+		bool seen = false;
+		this->players->all (
+			[x, z, &seen] (player *pl)
+				{
+					chunk_pos cpos = pl->get_pos ();
+					if ((utils::iabs (cpos.x - x) <= player::chunk_radius ()) &&
+							(utils::iabs (cpos.z - z) <= player::chunk_radius ()))
+						seen = true;
+				});
+		if (seen)
+			return false;
+		
+		this->save_chunk (x, z);
+		
+		std::unique_lock<std::mutex> guard {this->gen_lock};
+		chunk *ch = this->get_chunk (x, z);
+		if (!ch || ch == this->edge_chunk)
+			return true;
+		if (ch->get_stage () == CS_READY && ch->modified)
+			return false;
+		
+		// checked again under the lock, in case a player has moved close to the
+		// chunk in the meantime (players are placed in the entity grid as soon
+		// as they join the world).
+		{
+			std::vector<entity *> ents;
+			this->entities.query_radius (chunk_pos (x, z), player::chunk_radius (),
+				ents);
+			if (!ents.empty () || ch->has_entities ())
+				return false;
+		}
+		
+		// stages running (or yet to run) on this chunk or the chunks around it
+		// might need it. Neighbours that have simply stopped at an earlier stage
+		// do not: should they move on later, this chunk is loaded back in (or
+		// generated again, if it was not complete) like any other.
+		for (int nx = x - 1; nx <= x + 1; ++nx)
+			for (int nz = z - 1; nz <= z + 1; ++nz)
+				if (this->gen_pending (nx, nz))
+					return false;
+		
+		this->gen_states.erase (chunk_key (x, z));
+		{
+			std::lock_guard<std::mutex> chunk_guard {this->chunk_lock};
+			this->chunks.erase (chunk_key (x, z));
+			
+			// other threads might still hold a pointer to the chunk (obtained
+			// through get_chunk (), load_chunk (), etc...), so it is only freed
+			// later on, by reclaim_chunks ().
+			this->retired.emplace_back (ch, std::chrono::steady_clock::now ());
+		}
+		guard.unlock ();
+		
+		this->reclaim_chunks ();
+		return true;
+	}
+	
+	/* 
+	 * Frees unloaded chunks that have outlived the grace period and are not
+	 * pinned.
+	 */
+	void
+	world::reclaim_chunks ()
+	{
+		const static std::chrono::seconds grace_period (5);
 		
-		ch = new chunk ();
+		std::vector<chunk *> dead;
+		{
+			std::lock_guard<std::mutex> guard {this->chunk_lock};
+			if (this->retired.empty ())
+				return;
+			
+			auto now = std::chrono::steady_clock::now ();
+			auto itr = this->retired.begin ();
+			while (itr != this->retired.end ())
+				{
+					if ((now - itr->second >= grace_period) && !itr->first->pinned ())
+						{
+							dead.push_back (itr->first);
+							itr = this->retired.erase (itr);
+						}
+					else
+						++ itr;
+				}
+		}
 		
-		// try to load from disk
-		this->prov->open (*this);
-		if (this->prov->load (*this, ch, x, z))
+		for (chunk *ch : dead)
+			delete ch;
+	}
+	
+	
+	
+//----
+	/* 
+	 * Generation pipeline.
+	 * 
+	 * Every chunk has a target stage it has been requested to reach. Whenever a
+	 * chunk's dependencies for its next stage are met (the eight chunks around
+	 * it have completed the stage before, and none of them is busy), the chunk
+	 * is put on the job queue, and a pool task is spawned to run it. Threads
+	 * that block on a chunk run queued jobs themselves while they wait, so
+	 * progress is made even when the pool is saturated.
+	 * 
+	 * Stages only ever write to their own chunk. Since neighbouring chunks
+	 * never run stages at the same time, a stage can safely read from the
+	 * chunks around it. This is what lets the lighting stage take light
+	 * coming in from neighbouring chunks into account: each chunk pulls in
+	 * the light that reaches it, instead of pushing its own light outwards.
+	 */
+	
+	/* 
+	 * Makes sure the chunk at the given coordinates exists, and that it will
+	 * eventually reach (at least) stage @{target}.
+	 */
+	chunk*
+	world::gen_request (int x, int z, int target)
+	{
+		chunk *ch = this->get_chunk (x, z);
+		if (!ch)
 			{
-				this->prov->close ();
+				ch = new chunk ();
 				this->put_chunk (x, z, ch);
-				ch->recalc_heightmap ();
-				ch->relight ();
-				return ch;
 			}
+		if (ch->get_stage () >= target)
+			return ch;
+		
+		chunk_gen_state& st = this->gen_states[chunk_key (x, z)];
+		if (st.target >= target)
+			return ch;
 		
-		this->prov->close ();
-		this->put_chunk (x, z, ch);
-		this->gen->generate (*this, ch, x, z);
-		ch->recalc_heightmap ();
-		ch->relight (false);
+		st.target = target;
+		this->gen_try_advance (x, z);
 		return ch;
 	}
 	
+	/* 
+	 * Queues the chunk's next stage if all of its dependencies have been met.
+	 */
+	void
+	world::gen_try_advance (int x, int z)
+	{
+		unsigned long long key = chunk_key (x, z);
+		auto itr = this->gen_states.find (key);
+		if (itr == this->gen_states.end ())
+			return;
+		
+		chunk *ch = this->get_chunk (x, z);
+		int next = ch->get_stage () + 1;
+		if (itr->second.busy || next > itr->second.target)
+			return;
+		
+		if (next > CS_TERRAIN)
+			{
+				bool ok = true;
+				for (int nx = x - 1; nx <= x + 1; ++nx)
+					for (int nz = z - 1; nz <= z + 1; ++nz)
+						{
+							if (nx == x && nz == z)
+								continue;
+							
+							chunk *nch = this->gen_request (nx, nz, next - 1);
+							if (nch->get_stage () < (next - 1))
+								ok = false;
+							else
+								{
+									auto nitr = this->gen_states.find (chunk_key (nx, nz));
+									if (nitr != this->gen_states.end () && nitr->second.busy)
+										ok = false;
+								}
+						}
+				if (!ok)
+					return;
+				
+				// the requests above might have rehashed the map.
+				itr = this->gen_states.find (key);
+				if (itr->second.busy)
+					return;
+			}
+		
+		itr->second.busy = true;
+		this->gen_jobs.push_back (key);
+		this->gen_cv.notify_all ();
+		
+		if (this->pool)
+			this->gen_enqueue ([this] ()
+				{
+					std::unique_lock<std::mutex> guard {this->gen_lock};
+					this->gen_run_job (guard);
+				});
+	}
+	
+	/* 
+	 * Returns true if a stage is being run on the chunk at the given
+	 * coordinates, or is yet to be run on it.
+	 */
+	bool
+	world::gen_pending (int x, int z)
+	{
+		auto itr = this->gen_states.find (chunk_key (x, z));
+		if (itr == this->gen_states.end ())
+			return false;
+		if (itr->second.busy)
+			return true;
+		
+		chunk *ch = this->get_chunk (x, z);
+		return ch && ch->get_stage () < itr->second.target;
+	}
+	
+	/* 
+	 * Loads the chunk at the given coordinates from the world's provider.
+	 * Returns false if it has never been saved, or could not be read (in
+	 * which case it is left empty, to be generated again).
+	 */
+	bool
+	world::gen_load (chunk *ch, int x, int z)
+	{
+		if (!this->prov)
+			return false;
+		
+		try
+			{
+				if (this->prov->concurrent_loads ())
+					return this->prov->load (*this, ch, x, z);
+				
+				std::lock_guard<std::mutex> prov_guard {this->prov_lock};
+				this->prov->open (*this);
+				bool loaded = this->prov->load (*this, ch, x, z);
+				this->prov->close ();
+				return loaded;
+			}
+		catch (const std::exception& ex)
+			{
+				std::ostringstream ss;
+				ss << "failed to load chunk (" << x << ", " << z << "): " << ex.what ()
+					 << " (generating it again)";
+				this->report_error (ss.str ());
+				
+				// throw away whatever was read before the error.
+				chunk empty;
+				ch->copy_from (empty);
+				return false;
+			}
+	}
+	
+	/* 
+	 * Spreads light, level by level, out of every block in @{light} (a
+	 * 48x48-block area, @{top} blocks tall) into the blocks around it. Each step
+	 * costs one level, or the opacity of the block entered if that is higher.
+	 */
+	static void
+	spread_light (unsigned char *light, const unsigned char *opacity, int top)
+	{
+		std::vector<int> levels[16];
+		for (int i = 0; i < (48 * 48 * top); ++i)
+			if (light[i] > 1)
+				levels[light[i]].push_back (i);
+		
+		// steps only ever lower the level, so every block is spread from at most
+		// once, after its final value is known.
+		for (int l = 15; l > 1; --l)
+			for (int i : levels[l])
+				{
+					if (light[i] != l)
+						continue;
+					
+					int x = i % 48, z = (i / 48) % 48, y = i / (48 * 48);
+					int adj[6];
+					int adj_count = 0;
+					if (x > 0)  adj[adj_count++] = i - 1;
+					if (x < 47) adj[adj_count++] = i + 1;
+					if (z > 0)  adj[adj_count++] = i - 48;
+					if (z < 47) adj[adj_count++] = i + 48;
+					if (y > 0)  adj[adj_count++] = i - (48 * 48);
+					if (y < (top - 1)) adj[adj_count++] = i + (48 * 48);
+					
+					for (int j = 0; j < adj_count; ++j)
+						{
+							int n = adj[j];
+							int nl = l - ((opacity[n] > 1) ? opacity[n] : 1);
+							if (nl > light[n])
+								{
+									light[n] = nl;
+									if (nl > 1)
+										levels[nl].push_back (n);
+								}
+						}
+				}
+	}
+	
+	/* 
+	 * Computes the sky and block light of chunk @{ch} (at @{cx}, @{cz}) from
+	 * the blocks in the 3x3 area of chunks around it, so that light crossing
+	 * chunk borders is accounted for. Light never travels further than 15
+	 * blocks, so the result is the same as if the whole world were lit at
+	 * once. Only @{ch} itself is written to.
+	 */
+	static void
+	light_chunk (world *wr, chunk *ch, int cx, int cz)
+	{
+		const int area = 48 * 48;
+		std::vector<unsigned char> opacity (area * 256), sky (area * 256),
+			blk (area * 256);
+		std::vector<unsigned char> ch_opacity (65536), ch_luminance (65536);
+		
+		int top = 0;
+		for (int nx = -1; nx <= 1; ++nx)
+			for (int nz = -1; nz <= 1; ++nz)
+				{
+					// the chunks around a chunk being generated are always there, but
+					// anything missing would simply be taken as air.
+					chunk *nch = (nx == 0 && nz == 0) ? ch : wr->get_chunk (cx + nx, cz + nz);
+					if (!nch)
+						continue;
+					nch->export_light_info (ch_opacity.data (), ch_luminance.data ());
+					
+					// only the part below the chunk's highest non-air block is copied
+					// over, the rest of the area is already air.
+					int ch_top = 256;
+					for (; ch_top > 0; -- ch_top)
+						{
+							int start = (ch_top - 1) << 8;
+							if (std::count (&ch_opacity[start], &ch_opacity[start] + 256, 0) != 256 ||
+									std::count (&ch_luminance[start], &ch_luminance[start] + 256, 0) != 256)
+								break;
+						}
+					if (ch_top > top)
+						top = ch_top;
+					
+					int ox = (nx + 1) * 16, oz = (nz + 1) * 16;
+					for (int y = 0; y < ch_top; ++y)
+						for (int z = 0; z < 16; ++z)
+							for (int x = 0; x < 16; ++x)
+								{
+									int i = (y << 8) | (z << 4) | x;
+									int r = (y * area) + ((oz + z) * 48) + (ox + x);
+									opacity[r] = ch_opacity[i];
+									blk[r] = ch_luminance[i];
+								}
+				}
+		
+		// everything above the highest non-air block is open sky, and needs no
+		// spreading. the columns below it are lit from the top down first.
+		for (int c = 0; c < area; ++c)
+			{
+				int curr = 15;
+				for (int y = top - 1; y >= 0; --y)
+					{
+						int r = (y * area) + c;
+						curr -= opacity[r];
+						if (curr < 0)
+							curr = 0;
+						sky[r] = curr;
+					}
+			}
+		
+		spread_light (sky.data (), opacity.data (), top);
+		spread_light (blk.data (), opacity.data (), top);
+		
+		std::vector<unsigned char> ch_blight (65536, 0), ch_slight (65536, 15);
+		for (int y = 0; y < top; ++y)
+			for (int z = 0; z < 16; ++z)
+				for (int x = 0; x < 16; ++x)
+					{
+						int i = (y << 8) | (z << 4) | x;
+						int r = (y * area) + ((16 + z) * 48) + (16 + x);
+						ch_blight[i] = blk[r];
+						ch_slight[i] = sky[r];
+					}
+		ch->import_light (ch_blight.data (), ch_slight.data ());
+	}
+	
+	/* 
+	 * Runs stage @{next} on the given chunk, without holding the generation
+	 * lock. Loaded chunks skip straight to CS_READY, in which case @{next} is
+	 * updated accordingly.
+	 */
+	void
+	world::gen_run_stage (chunk *ch, int x, int z, int& next, bool& relight)
+	{
+		switch (next)
+			{
+			case CS_TERRAIN:
+				if (this->gen_load (ch, x, z))
+					{
+						// saved chunks are complete already, lighting included (relighting
+						// them would also throw away the blob they were loaded with).
+						ch->recalc_heightmap ();
+						ch->modified = false;
+						next = CS_READY;
+					}
+				else
+					{
+						this->gen->generate (*this, ch, x, z);
+						relight = !this->gen->prelit ();
+					}
+				break;
+			
+			case CS_DECORATED:
+				if (this->gen->decorate (*this, ch, x, z))
+					relight = true;
+				break;
+			
+			case CS_LIT:
+				if (relight)
+					{
+						ch->recalc_heightmap ();
+						light_chunk (this, ch, x, z);
+					}
+				break;
+			}
+	}
+	
+	/* 
+	 * Runs a single queued stage (temporarily releasing the lock while doing
+	 * so). Returns false if there was nothing to run.
+	 */
+	bool
+	world::gen_run_job (std::unique_lock<std::mutex>& guard)
+	{
+		if (this->gen_jobs.empty ())
+			return false;
+		
+		unsigned long long key = this->gen_jobs.front ();
+		this->gen_jobs.pop_front ();
+		
+		int x, z;
+		chunk_coords (key, &x, &z);
+		chunk *ch = this->get_chunk (x, z);
+		int next = ch->get_stage () + 1;
+		bool relight = this->gen_states[key].relight;
+		
+		guard.unlock ();
+		try
+			{
+				this->gen_run_stage (ch, x, z, next, relight);
+			}
+		catch (const std::exception& ex)
+			{
+				// the chunk moves on as it is, so that nothing waiting on it (or on
+				// the chunks around it) is left hanging.
+				std::ostringstream ss;
+				ss << "failed to generate chunk (" << x << ", " << z << "): " << ex.what ();
+				this->report_error (ss.str ());
+			}
+		guard.lock ();
+		
+		ch->set_stage ((chunk_stage)next);
+		if (next == CS_READY)
+			this->gen_states.erase (key);
+		else
+			{
+				chunk_gen_state& st = this->gen_states[key];
+				st.busy = false;
+				st.relight = relight;
+			}
+		
+		// this chunk, and any of the chunks around it might be able to move on
+		// now.
+		for (int nx = x - 1; nx <= x + 1; ++nx)
+			for (int nz = z - 1; nz <= z + 1; ++nz)
+				this->gen_try_advance (nx, nz);
+		
+		this->gen_cv.notify_all ();
+		if (next == CS_READY)
+			{
+				this->notify_ready (x, z, ch);
+				if (ch->modified && !ch->save_queued.exchange (true))
+					this->saver->mark_dirty (x, z);
+			}
+		return true;
+	}
+	
+	/* 
+	 * Blocks until the chunk at the given coordinates is ready, running
+	 * queued stages on the calling thread in the meantime.
+	 */
+	void
+	world::gen_wait (int x, int z, std::unique_lock<std::mutex>& guard)
+	{
+		chunk *ch = this->get_chunk (x, z);
+		while (ch->get_stage () != CS_READY)
+			{
+				if (!this->gen_run_job (guard))
+					this->gen_cv.wait (guard);
+			}
+	}
+	
+	
+	
+	/* 
+	 * Runs @{f} on the thread pool, keeping track of it so that the world is
+	 * not destroyed while it is still pending.
+	 */
+	void
+	world::gen_enqueue (std::function<void ()>&& f)
+	{
+		++ this->gen_tasks;
+		this->pool->enqueue (
+			[this, f] (void *)
+				{
+					try
+						{
+							f ();
+						}
+					catch (const std::exception& ex)
+						{
+							this->report_error (std::string ("background task failed: ")
+								+ ex.what ());
+						}
+					
+					std::lock_guard<std::mutex> guard {this->gen_lock};
+					if (-- this->gen_tasks == 0)
+						this->gen_cv.notify_all ();
+				});
+	}
+	
+	/* 
+	 * Lets players in this world know that a chunk they might be waiting for
+	 * has become ready.
+	 */
+	void
+	world::notify_ready (int x, int z, chunk *ch)
+	{
+		// done on the pool, so that players are never locked by a thread that
+		// is running stages on their behalf.
+		if (!this->pool)
+			return;
+		
+		// the chunk might be unloaded before the task gets to run.
+		ch->pin ();
+		this->gen_enqueue ([this, x, z, ch] ()
+			{
+				world *wr = this;
+				this->players->all (
+					[wr, x, z, ch] (player *pl)
+						{
+							pl->chunk_ready (wr, x, z, ch);
+						});
+				ch->unpin ();
+			});
+	}
+	
 	
 	
 //----
+	
+	/* 
+	 * Queues the chunk at the given coordinates to be saved if it has
+	 * changed since version @{old_version} and is not queued already.
+	 */
+	void
+	world::mark_dirty (int x, int z, chunk *ch, unsigned int old_version)
+	{
+		if (ch == this->edge_chunk || ch->get_version () == old_version)
+			return;
+		
+		// checked after the write, so that if the saver has taken the chunk in
+		// the meantime, it is queued again.
+		if (!ch->save_queued.exchange (true))
+			this->saver->mark_dirty (x, z);
+	}
+	
+	
+	
 	/* 
 	 * Block interaction: 
 	 */
@@ -580,8 +1535,11 @@ namespace hCraft {
 	void
 	world::set_id (int x, int y, int z, unsigned short id)
 	{
-		chunk *ch = this->load_chunk (utils::div (x, 16), utils::div (z, 16));
+		int cx = utils::div (x, 16), cz = utils::div (z, 16);
+		chunk *ch = this->load_chunk (cx, cz);
+		unsigned int old_version = ch->get_version ();
 		ch->set_id (utils::mod (x, 16), y, utils::mod (z, 16), id);
+		this->mark_dirty (cx, cz, ch, old_version);
 	}
 	
 	unsigned short
@@ -597,8 +1555,11 @@ namespace hCraft {
 	void
 	world::set_meta (int x, int y, int z, unsigned char val)
 	{
-		chunk *ch = this->load_chunk (utils::div (x, 16), utils::div (z, 16));
+		int cx = utils::div (x, 16), cz = utils::div (z, 16);
+		chunk *ch = this->load_chunk (cx, cz);
+		unsigned int old_version = ch->get_version ();
 		ch->set_meta (utils::mod (x, 16), y, utils::mod (z, 16), val);
+		this->mark_dirty (cx, cz, ch, old_version);
 	}
 	
 	unsigned char
@@ -614,8 +1575,11 @@ namespace hCraft {
 	void
 	world::set_block_light (int x, int y, int z, unsigned char val)
 	{
-		chunk *ch = this->load_chunk (utils::div (x, 16), utils::div (z, 16));
+		int cx = utils::div (x, 16), cz = utils::div (z, 16);
+		chunk *ch = this->load_chunk (cx, cz);
+		unsigned int old_version = ch->get_version ();
 		ch->set_block_light (utils::mod (x, 16), y, utils::mod (z, 16), val);
+		this->mark_dirty (cx, cz, ch, old_version);
 	}
 	
 	unsigned char
@@ -631,8 +1595,11 @@ namespace hCraft {
 	void
 	world::set_sky_light (int x, int y, int z, unsigned char val)
 	{
-		chunk *ch = this->load_chunk (utils::div (x, 16), utils::div (z, 16));
+		int cx = utils::div (x, 16), cz = utils::div (z, 16);
+		chunk *ch = this->load_chunk (cx, cz);
+		unsigned int old_version = ch->get_version ();
 		ch->set_sky_light (utils::mod (x, 16), y, utils::mod (z, 16), val);
+		this->mark_dirty (cx, cz, ch, old_version);
 	}
 	
 	unsigned char
@@ -648,8 +1615,11 @@ namespace hCraft {
 	void
 	world::set_id_and_meta (int x, int y, int z, unsigned short id, unsigned char meta)
 	{
-		chunk *ch = this->load_chunk (utils::div (x, 16), utils::div (z, 16));
+		int cx = utils::div (x, 16), cz = utils::div (z, 16);
+		chunk *ch = this->load_chunk (cx, cz);
+		unsigned int old_version = ch->get_version ();
 		ch->set_id_and_meta (utils::mod (x, 16), y, utils::mod (z, 16), id, meta);
+		this->mark_dirty (cx, cz, ch, old_version);
 	}
 	
 	
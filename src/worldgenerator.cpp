@@ -23,6 +23,7 @@
 
 // generators:
 #include "flatgrass.hpp"
+#include "terrain.hpp"
 
 
 namespace hCraft {
@@ -52,6 +53,10 @@ namespace hCraft {
 	create_flatgrass (long seed)
 		{ return new flatgrass_world_generator (seed); }
 	
+	static world_generator*
+	create_terrain (long seed)
+		{ return new terrain_world_generator (seed); }
+	
 	
 	/* 
 	 * Finds and instantiates a new world generator from the given name.
@@ -61,6 +66,7 @@ namespace hCraft {
 	{
 		static std::unordered_map<std::string, world_generator* (*) (long)> generators {
 				{ "flatgrass", create_flatgrass },
+				{ "terrain", create_terrain },
 			};
 		
 		auto itr = generators.find (name);
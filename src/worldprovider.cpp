@@ -24,14 +24,34 @@
 #include <sys/stat.h>
 
 #include "hwprovider.hpp"
+#include "anvilprovider.hpp"
 
 
 namespace hCraft {
 	
+	/* 
+	 * Saves only the specified chunk.
+	 * Same as calling encode () and then write ().
+	 */
+	void
+	world_provider::save (world& wr, chunk *ch, int x, int z)
+	{
+		unsigned int size;
+		unsigned char *data = this->encode (ch, x, z, &size);
+		this->write (wr, x, z, data, size);
+		delete[] data;
+	}
+	
+	
+	
 	static world_provider*
 	create_hw_provider (const char *path, const char *world_name)
 		{ return new hw_provider (path, world_name); }
 	
+	static world_provider*
+	create_anvil_provider (const char *path, const char *world_name)
+		{ return new anvil_provider (path, world_name); }
+	
 	/* 
 	 * Returns a new instance of the world provider named @{name}.
 	 * @{path} specifies the directory to which the world should be exported to\
@@ -43,6 +63,7 @@ namespace hCraft {
 	{
 		static std::unordered_map<std::string, world_provider* (*) (const char *, const char *)> creators {
 			{ "hw", create_hw_provider },
+			{ "anvil", create_anvil_provider },
 		};
 		
 		auto itr = creators.find (name);
@@ -65,6 +86,7 @@ namespace hCraft {
 		if (!populated)
 			{
 				provs.emplace_back (new hw_provider_naming ());
+				provs.emplace_back (new anvil_provider_naming ());
 				populated = true;
 			}
 		